@@ -1171,6 +1171,7 @@ typedef struct xen_sysctl_cputopo xc_cputopo_t;
 typedef struct xen_sysctl_numainfo xc_numainfo_t;
 typedef struct xen_sysctl_meminfo xc_meminfo_t;
 typedef struct xen_sysctl_pcitopoinfo xc_pcitopoinfo_t;
+typedef struct xen_sysctl_scrub_status xc_scrub_status_t;
 
 typedef uint32_t xc_cpu_to_node_t;
 typedef uint32_t xc_cpu_to_socket_t;
@@ -1188,6 +1189,14 @@ int xc_numainfo(xc_interface *xch, unsigned *max_nodes,
 int xc_pcitopoinfo(xc_interface *xch, unsigned num_devs,
                    physdev_pci_device_t *devs, uint32_t *nodes);
 
+/*
+ * Query the progress of scrubbing freed memory.  status->num_nodes is the
+ * number of entries in node_dirty_pages on input (node_dirty_pages may be
+ * NULL), and the number of nodes Xen has counts for on output.
+ */
+int xc_scrub_status(xc_interface *xch, xc_scrub_status_t *status,
+                    uint64_t *node_dirty_pages);
+
 int xc_sched_id(xc_interface *xch,
                 int *sched_id);
 
@@ -2013,6 +2022,22 @@ int xc_mem_paging_prep(xc_interface *xch, uint32_t domain_id, uint64_t gfn);
 int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                        uint64_t gfn, void *buffer);
 
+/*
+ * Batched variants of nominate, evict and load, for nr gfns.  The loaded
+ * contents are the nr consecutive pages at buffer.  Return -1 with errno set
+ * if the operation as a whole failed, or 0 with the result for each gfn
+ * (0 or -errno) stored in errs.
+ */
+int xc_mem_paging_nominate_batch(xc_interface *xch, uint32_t domain_id,
+                                 const uint64_t *gfns, unsigned int nr,
+                                 int *errs);
+int xc_mem_paging_evict_batch(xc_interface *xch, uint32_t domain_id,
+                              const uint64_t *gfns, unsigned int nr,
+                              int *errs);
+int xc_mem_paging_load_batch(xc_interface *xch, uint32_t domain_id,
+                             const uint64_t *gfns, unsigned int nr,
+                             const void *buffer, int *errs);
+
 /** 
  * Access tracking operations.
  * Supported only on Intel EPT 64 bit processors.
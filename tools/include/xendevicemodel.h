@@ -51,6 +51,22 @@ int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id);
 
+/**
+ * This function instantiates an IOREQ Server, as
+ * xendevicemodel_create_ioreq_server() does, with optional capabilities.
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm handle_bufioreq how should the IOREQ Server handle buffered
+ *                       requests (HVM_IOREQSRV_BUFIOREQ_*)?
+ * @parm flags XEN_DMOP_IOREQ_SERVER_* capabilities of the emulator.
+ * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_create_ioreq_server_flags(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    unsigned int flags, ioservid_t *id);
+
 /**
  * This function retrieves the necessary information to allow an
  * emulator to use an IOREQ Server.
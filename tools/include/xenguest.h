@@ -26,6 +26,21 @@
 
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
+/*
+ * Send memory as COMPRESSED_PAGE_DATA records, optionally delta encoding pages
+ * sent again against their previous contents.  The stream can then only be
+ * restored by a libxenguest from Xen 4.17 or newer.
+ */
+#define XCFLAGS_COMPRESS        (1 << 2)
+#define XCFLAGS_COMPRESS_DELTA  (1 << 3)
+/*
+ * Number of threads to use for sending the memory of a domain in
+ * xc_domain_save().  0 (the default) and 1 mean the calling thread does it.
+ */
+#define XCFLAGS_THREADS_SHIFT 8
+#define XCFLAGS_THREADS_MASK  (0xffU << XCFLAGS_THREADS_SHIFT)
+#define XCFLAGS_THREADS(n)    (((n) << XCFLAGS_THREADS_SHIFT) & \
+                               XCFLAGS_THREADS_MASK)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -467,6 +482,19 @@ struct save_callbacks {
 #define XGS_POLICY_CONTINUE_PRECOPY 0  /* Remain in the precopy phase. */
 #define XGS_POLICY_STOP_AND_COPY    1  /* Immediately suspend and transmit the
                                         * remaining dirty pages. */
+#define XGS_POLICY_POSTCOPY         2  /* Immediately suspend and transmit the
+                                        * remaining dirty pages after the
+                                        * guest has been resumed on the
+                                        * receiving side.  HVM only, and
+                                        * requires recv_fd for page faults to
+                                        * be reported back.  Falls back to
+                                        * STOP_AND_COPY if unavailable.  Once
+                                        * the guest may have been resumed on
+                                        * the receiving side, a failure is
+                                        * reported as XGS_RC_POSTCOPY_FAILED
+                                        * and the guest must not be resumed
+                                        * on this side: its memory is split
+                                        * between both. */
     precopy_policy_t precopy_policy;
 
     /*
@@ -526,10 +554,13 @@ typedef enum {
  * @param flags XCFLAGS_xxx
  * @param stream_type XC_STREAM_PLAIN if the far end of the stream
  *        doesn't use checkpointing
- * @param recv_fd Only used for XC_STREAM_COLO.  Contains backchannel from
- *        the destination side.
- * @return 0 on success, -1 on failure
+ * @param recv_fd Only used for XC_STREAM_COLO and post-copy migration.
+ *        Contains backchannel from the destination side.
+ * @return 0 on success, -1 on failure, XGS_RC_POSTCOPY_FAILED on failure of
+ *         a post-copy migration after the guest may have been resumed on the
+ *         receiving side, in which case it must not be resumed on this side
  */
+#define XGS_RC_POSTCOPY_FAILED (-2)
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
                    xc_stream_type_t stream_type, int recv_fd);
@@ -551,7 +582,8 @@ struct restore_callbacks {
     int (*suspend)(void *data);
 
     /*
-     * Called after the secondary vm is ready to resume.
+     * Called after the secondary vm is ready to resume, or for a post-copy
+     * migration once the remaining memory is to be fetched on demand.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
      */
@@ -605,8 +637,9 @@ struct restore_callbacks {
  *        checkpointing
  * @param callbacks non-NULL to receive a callback to restore toolstack
  *        specific data
- * @param send_back_fd Only used for XC_STREAM_COLO.  Contains backchannel to
- *        the source side.
+ * @param send_back_fd Only used for XC_STREAM_COLO and post-copy migration.
+ *        Contains backchannel to the source side.  Post-copy migration
+ *        also requires the postcopy and restore_results callbacks.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -167,6 +167,35 @@ bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
 			const char *path, struct xs_permissions *perms,
 			unsigned int num_perms);
 
+/* One operation of a batch, see xs_batch(). */
+struct xs_batch_op {
+	/* XS_READ, XS_WRITE, XS_MKDIR, XS_RM or XS_SET_PERMS. */
+	enum xsd_sockmsg_type type;
+	const char *path;
+	/* Data to write for XS_WRITE. */
+	const void *data;
+	unsigned int len;
+	/* Permissions for XS_SET_PERMS. */
+	struct xs_permissions *perms;
+	unsigned int num_perms;
+
+	/* Filled in by xs_batch(): 0 or errno value of the operation. */
+	int err;
+	/* Result of XS_READ, nul terminated: call free() on it after use. */
+	void *value;
+	unsigned int value_len;
+};
+
+/* Perform multiple operations with as few requests as possible.
+ * The operations are done in the given order, but not atomically unless
+ * done in a transaction. The result of each operation is returned in the
+ * err, value and value_len fields of its element of ops.
+ * Returns false on failure, in which case the results of the operations
+ * are undefined (some operations might have been performed).
+ */
+bool xs_batch(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_batch_op *ops, unsigned int num_ops);
+
 /* Watch a node for changes (poll on fd to detect, or call read_watch()).
  * When the node (or any child) changes, fd will become readable.
  * Token is returned when watch is read, to allow matching.
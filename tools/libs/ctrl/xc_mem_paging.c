@@ -55,6 +55,47 @@ static int xc_mem_paging_memop(xc_interface *xch, uint32_t domain_id,
     return rc;
 }
 
+static int xc_mem_paging_batch_memop(xc_interface *xch, uint32_t domain_id,
+                                     unsigned int op, const uint64_t *gfns,
+                                     unsigned int nr, const void *buffer,
+                                     int *errs)
+{
+    xen_mem_paging_op_t mpo;
+    DECLARE_HYPERCALL_BOUNCE_IN(gfns, nr * sizeof(*gfns));
+    DECLARE_HYPERCALL_BOUNCE_IN(buffer, nr * XC_PAGE_SIZE);
+    DECLARE_HYPERCALL_BOUNCE(errs, nr * sizeof(*errs),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    int rc = -1;
+
+    memset(&mpo, 0, sizeof(mpo));
+
+    mpo.op      = op;
+    mpo.domain  = domain_id;
+    mpo.nr      = nr;
+
+    if ( xc_hypercall_bounce_pre(xch, gfns) ||
+         xc_hypercall_bounce_pre(xch, errs) ||
+         (buffer && xc_hypercall_bounce_pre(xch, buffer)) )
+    {
+        PERROR("Could not bounce memory for XENMEM_paging_op %u", op);
+        goto out;
+    }
+
+    set_xen_guest_handle(mpo.gfn_list, gfns);
+    set_xen_guest_handle(mpo.errs, errs);
+    if ( buffer )
+        set_xen_guest_handle(mpo.buffer, buffer);
+
+    rc = xc_memory_op(xch, XENMEM_paging_op, &mpo, sizeof(mpo));
+
+ out:
+    xc_hypercall_bounce_post(xch, buffer);
+    xc_hypercall_bounce_post(xch, errs);
+    xc_hypercall_bounce_post(xch, gfns);
+
+    return rc;
+}
+
 int xc_mem_paging_enable(xc_interface *xch, uint32_t domain_id,
                          uint32_t *port)
 {
@@ -119,6 +160,38 @@ int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                                gfn, buffer);
 }
 
+int xc_mem_paging_nominate_batch(xc_interface *xch, uint32_t domain_id,
+                                 const uint64_t *gfns, unsigned int nr,
+                                 int *errs)
+{
+    return xc_mem_paging_batch_memop(xch, domain_id,
+                                     XENMEM_paging_op_nominate_batch,
+                                     gfns, nr, NULL, errs);
+}
+
+int xc_mem_paging_evict_batch(xc_interface *xch, uint32_t domain_id,
+                              const uint64_t *gfns, unsigned int nr,
+                              int *errs)
+{
+    return xc_mem_paging_batch_memop(xch, domain_id,
+                                     XENMEM_paging_op_evict_batch,
+                                     gfns, nr, NULL, errs);
+}
+
+int xc_mem_paging_load_batch(xc_interface *xch, uint32_t domain_id,
+                             const uint64_t *gfns, unsigned int nr,
+                             const void *buffer, int *errs)
+{
+    errno = EINVAL;
+
+    if ( !buffer )
+        return -1;
+
+    return xc_mem_paging_batch_memop(xch, domain_id,
+                                     XENMEM_paging_op_prep_batch,
+                                     gfns, nr, buffer, errs);
+}
+
 
 /*
  * Local variables:
@@ -287,6 +287,35 @@ out:
     return ret;
 }
 
+int xc_scrub_status(xc_interface *xch, xc_scrub_status_t *status,
+                    uint64_t *node_dirty_pages)
+{
+    int ret;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(node_dirty_pages,
+                             status->num_nodes * sizeof(*node_dirty_pages),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( (ret = xc_hypercall_bounce_pre(xch, node_dirty_pages)) )
+        goto out;
+
+    sysctl.u.scrub_status.num_nodes = status->num_nodes;
+    set_xen_guest_handle(sysctl.u.scrub_status.node_dirty_pages,
+                         node_dirty_pages);
+
+    sysctl.cmd = XEN_SYSCTL_scrub_status;
+
+    if ( (ret = do_sysctl(xch, &sysctl)) != 0 )
+        goto out;
+
+    *status = sysctl.u.scrub_status;
+
+out:
+    xc_hypercall_bounce_post(xch, node_dirty_pages);
+
+    return ret;
+}
+
 int xc_pcitopoinfo(xc_interface *xch, unsigned num_devs,
                    physdev_pci_device_t *devs,
                    uint32_t *nodes)
@@ -165,9 +165,9 @@ static int xendevicemodel_op(
     return ret;
 }
 
-int xendevicemodel_create_ioreq_server(
+int xendevicemodel_create_ioreq_server_flags(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
-    ioservid_t *id)
+    unsigned int flags, ioservid_t *id)
 {
     struct xen_dm_op op;
     struct xen_dm_op_create_ioreq_server *data;
@@ -179,6 +179,12 @@ int xendevicemodel_create_ioreq_server(
     data = &op.u.create_ioreq_server;
 
     data->handle_bufioreq = handle_bufioreq;
+    data->flags = flags;
+
+    if (data->flags != flags) {
+        errno = EINVAL;
+        return -1;
+    }
 
     rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
     if (rc)
@@ -189,6 +195,14 @@ int xendevicemodel_create_ioreq_server(
     return 0;
 }
 
+int xendevicemodel_create_ioreq_server(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    ioservid_t *id)
+{
+    return xendevicemodel_create_ioreq_server_flags(dmod, domid,
+                                                    handle_bufioreq, 0, id);
+}
+
 int xendevicemodel_get_ioreq_server_info(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id,
     xen_pfn_t *ioreq_gfn, xen_pfn_t *bufioreq_gfn,
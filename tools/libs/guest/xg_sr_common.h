@@ -246,6 +246,25 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /* Threads for sending memory, see xg_sr_save.c. */
+            unsigned int nr_threads;
+            struct xc_sr_save_workers *workers;
+
+            /* Send pages as COMPRESSED_PAGE_DATA records. */
+            bool compress;
+            /* Delta encode pages against their last sent contents. */
+            bool compress_delta;
+            struct xc_sr_page_cache *page_cache;
+
+            /*
+             * Post-copy migration: the remaining memory is sent after the
+             * guest has been resumed on the receiving side.
+             */
+            bool postcopy;
+            unsigned long nr_postcopy_pfns;
+            /* The guest may have been resumed on the receiving side. */
+            bool postcopy_transition;
         } save;
 
         struct /* Restore data. */
@@ -270,6 +289,9 @@ struct xc_sr_context
             /* Whether a STATIC_DATA_END record has been seen/inferred. */
             bool seen_static_data_end;
 
+            /* Post-copy migration state, see xg_sr_restore.c. */
+            struct xc_sr_restore_postcopy *postcopy;
+
 /*
  * With Remus/COLO, we buffer the records sent by the primary at checkpoint,
  * in case the primary will fail, we can recover from the last
@@ -540,6 +562,23 @@ static inline bool page_type_has_stream_data(uint32_t type)
     }
 }
 
+/*
+ * Encode a page for a COMPRESSED_PAGE_DATA record, as the difference to prev
+ * if it is non-NULL, or compressed stand-alone.  cpage must have room for
+ * PAGE_SIZE bytes of data.  Returns the number of bytes used in the record.
+ */
+size_t encode_page(const void *page, const void *prev,
+                   struct xc_sr_rec_compressed_page *cpage);
+
+/*
+ * Decode a page from the first len bytes of data, which are the remainder of
+ * a COMPRESSED_PAGE_DATA record.  prev are the current contents of the page,
+ * which delta encoded pages are based on, or NULL if there are none.  Returns
+ * the number of bytes consumed, or 0 on error.
+ */
+size_t decode_page(struct xc_sr_context *ctx, const void *data, size_t len,
+                   const void *prev, void *page);
+
 #endif
 /*
  * Local variables:
@@ -0,0 +1,362 @@
+/*
+ * Page encodings for COMPRESSED_PAGE_DATA records.
+ *
+ * Only the LZ4 decompressor is available in the tree, so this file contains a
+ * minimal LZ4 block compressor producing output which can be decoded by it.
+ * It is tuned for speed rather than ratio: a single hash table probe per
+ * position, as pages sent during migration are either compressible very well
+ * (mostly zeroes, or repeated patterns) or not at all.
+ *
+ * XBZRLE encodes a page as the difference to the contents sent previously,
+ * as a sequence of (unchanged run, changed run, changed bytes) triples, with
+ * the run lengths encoded as ULEB128 numbers.  The trailing unchanged run is
+ * implicit.
+ */
+
+#include "xg_sr_common.h"
+
+#include <xen-tools/libs.h>
+
+#include "../../xen/include/xen/lz4.h"
+
+#define LZ4_MINMATCH      4
+#define LZ4_LASTLITERALS  5
+#define LZ4_MFLIMIT       12
+#define LZ4_ML_BITS       4
+#define LZ4_ML_MASK       ((1U << LZ4_ML_BITS) - 1)
+#define LZ4_RUN_MASK      ((1U << (8 - LZ4_ML_BITS)) - 1)
+#define LZ4_HASH_LOG      12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Emit a length extension for values at or above a nibble's mask. */
+static uint8_t *lz4_put_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+    {
+        if ( op >= oend )
+            return NULL;
+        *op++ = 255;
+    }
+
+    if ( op >= oend )
+        return NULL;
+    *op++ = len;
+
+    return op;
+}
+
+/*
+ * Emit a sequence of literals, followed by a match unless match_len is 0.
+ * Returns NULL if the output doesn't fit.
+ */
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *oend,
+                                 const uint8_t *lit, size_t lit_len,
+                                 unsigned int offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ4_MINMATCH : 0;
+
+    if ( op > oend )
+        return NULL;
+
+    *token = (min(lit_len, (size_t)LZ4_RUN_MASK) << LZ4_ML_BITS) |
+             min(ml, (size_t)LZ4_ML_MASK);
+
+    if ( lit_len >= LZ4_RUN_MASK &&
+         !(op = lz4_put_length(op, oend, lit_len - LZ4_RUN_MASK)) )
+        return NULL;
+
+    if ( op + lit_len > oend )
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if ( !match_len )
+        return op;
+
+    if ( op + 2 > oend )
+        return NULL;
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    if ( ml >= LZ4_ML_MASK &&
+         !(op = lz4_put_length(op, oend, ml - LZ4_ML_MASK)) )
+        return NULL;
+
+    return op;
+}
+
+/*
+ * Compress one page into dst, which is dst_len bytes long.  Returns the
+ * compressed size, or 0 if it doesn't fit.
+ */
+static size_t lz4_compress_page(const uint8_t *src, uint8_t *dst,
+                                size_t dst_len)
+{
+    uint16_t table[1U << LZ4_HASH_LOG];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *const iend = src + PAGE_SIZE;
+    const uint8_t *const mflimit = iend - LZ4_MFLIMIT;
+    const uint8_t *const matchlimit = iend - LZ4_LASTLITERALS;
+    uint8_t *op = dst, *const oend = dst + dst_len;
+
+    memset(table, 0, sizeof(table));
+
+    /* Position 0 is in the table implicitly, so start matching at 1. */
+    for ( ip++; ip < mflimit; )
+    {
+        uint32_t v = read32(ip);
+        unsigned int h = lz4_hash(v);
+        const uint8_t *ref = src + table[h];
+        const uint8_t *start = ip;
+        unsigned int offset = ip - ref;
+
+        table[h] = ip - src;
+
+        if ( read32(ref) != v )
+        {
+            ip++;
+            continue;
+        }
+
+        /* Extend the match backwards, then forwards. */
+        while ( start > anchor && ref > src && start[-1] == ref[-1] )
+        {
+            start--;
+            ref--;
+        }
+
+        for ( ip += LZ4_MINMATCH, ref = ip - offset;
+              ip + sizeof(uint64_t) <= matchlimit &&
+              !memcmp(ip, ref, sizeof(uint64_t));
+              ip += sizeof(uint64_t), ref += sizeof(uint64_t) )
+            ;
+        for ( ; ip < matchlimit && *ip == *ref; ip++, ref++ )
+            ;
+
+        op = lz4_put_sequence(op, oend, anchor, start - anchor, offset,
+                              ip - start);
+        if ( !op )
+            return 0;
+
+        anchor = ip;
+    }
+
+    op = lz4_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+
+    return op ? op - dst : 0;
+}
+
+static uint8_t *put_uleb128(uint8_t *op, const uint8_t *oend, size_t v)
+{
+    do {
+        if ( op >= oend )
+            return NULL;
+        *op++ = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while ( v );
+
+    return op;
+}
+
+static const uint8_t *get_uleb128(const uint8_t *ip, const uint8_t *iend,
+                                  size_t *v)
+{
+    unsigned int shift;
+
+    for ( *v = 0, shift = 0; ip < iend && shift < 28; shift += 7 )
+    {
+        *v |= (size_t)(*ip & 0x7f) << shift;
+        if ( !(*ip++ & 0x80) )
+            return ip;
+    }
+
+    return NULL;
+}
+
+/*
+ * Encode the difference between page and prev into dst, which is dst_len
+ * bytes long.  Returns the encoded size, or 0 if it doesn't fit.  An
+ * unchanged page is encoded as a single unchanged run.
+ */
+static size_t xbzrle_encode_page(const uint8_t *page, const uint8_t *prev,
+                                 uint8_t *dst, size_t dst_len)
+{
+    uint8_t *op = dst, *const oend = dst + dst_len;
+    size_t i = 0, skip, len;
+
+    while ( i < PAGE_SIZE )
+    {
+        /* Unchanged run, compared a word at a time where possible. */
+        for ( skip = i; i < PAGE_SIZE && page[i] == prev[i]; )
+        {
+            if ( !(i & 7) && i + 8 <= PAGE_SIZE &&
+                 !memcmp(&page[i], &prev[i], 8) )
+                i += 8;
+            else
+                i++;
+        }
+
+        if ( i == PAGE_SIZE )
+            break;
+
+        skip = i - skip;
+
+        /*
+         * Changed run.  Isolated unchanged bytes are cheaper to include than
+         * to start a new triple for.
+         */
+        for ( len = i; i < PAGE_SIZE; i++ )
+            if ( page[i] == prev[i] &&
+                 (i + 1 == PAGE_SIZE || page[i + 1] == prev[i + 1]) )
+                break;
+
+        len = i - len;
+
+        if ( !(op = put_uleb128(op, oend, skip)) ||
+             !(op = put_uleb128(op, oend, len)) ||
+             op + len > oend )
+            return 0;
+
+        memcpy(op, &page[i - len], len);
+        op += len;
+    }
+
+    /* Make sure an unchanged page is distinguishable from an empty one. */
+    if ( op == dst && !(op = put_uleb128(op, oend, PAGE_SIZE)) )
+        return 0;
+
+    return op - dst;
+}
+
+static int xbzrle_decode_page(const uint8_t *src, size_t src_len,
+                              uint8_t *page)
+{
+    const uint8_t *ip = src, *const iend = src + src_len;
+    size_t i = 0, skip, len;
+
+    while ( ip < iend )
+    {
+        if ( !(ip = get_uleb128(ip, iend, &skip)) )
+            return -1;
+
+        if ( skip > PAGE_SIZE - i )
+            return -1;
+        i += skip;
+
+        if ( i == PAGE_SIZE && ip == iend )
+            break;
+
+        if ( !(ip = get_uleb128(ip, iend, &len)) ||
+             len > PAGE_SIZE - i || len > iend - ip )
+            return -1;
+
+        memcpy(&page[i], ip, len);
+        ip += len;
+        i += len;
+    }
+
+    return 0;
+}
+
+size_t encode_page(const void *page, const void *prev,
+                   struct xc_sr_rec_compressed_page *cpage)
+{
+    size_t len = 0;
+
+    if ( prev )
+    {
+        len = xbzrle_encode_page(page, prev, cpage->data, PAGE_SIZE / 2);
+        cpage->encoding = COMPRESSED_PAGE_XBZRLE;
+    }
+
+    if ( !len )
+    {
+        len = lz4_compress_page(page, cpage->data, PAGE_SIZE - PAGE_SIZE / 8);
+        cpage->encoding = COMPRESSED_PAGE_LZ4;
+    }
+
+    if ( !len )
+    {
+        memcpy(cpage->data, page, PAGE_SIZE);
+        len = PAGE_SIZE;
+        cpage->encoding = COMPRESSED_PAGE_RAW;
+    }
+
+    cpage->_res1 = 0;
+    cpage->length = len;
+
+    return sizeof(*cpage) + len;
+}
+
+size_t decode_page(struct xc_sr_context *ctx, const void *data, size_t len,
+                   const void *prev, void *page)
+{
+    xc_interface *xch = ctx->xch;
+    const struct xc_sr_rec_compressed_page *cpage = data;
+    size_t page_len = PAGE_SIZE;
+
+    if ( len < sizeof(*cpage) || cpage->length > len - sizeof(*cpage) )
+    {
+        ERROR("Compressed page data truncated");
+        return 0;
+    }
+
+    switch ( cpage->encoding )
+    {
+    case COMPRESSED_PAGE_RAW:
+        if ( cpage->length != PAGE_SIZE )
+            goto bad;
+        memcpy(page, cpage->data, PAGE_SIZE);
+        break;
+
+    case COMPRESSED_PAGE_LZ4:
+        if ( lz4_decompress_unknownoutputsize(cpage->data, cpage->length,
+                                              page, &page_len) ||
+             page_len != PAGE_SIZE )
+            goto bad;
+        break;
+
+    case COMPRESSED_PAGE_XBZRLE:
+        if ( !prev )
+            goto bad;
+        memcpy(page, prev, PAGE_SIZE);
+        if ( xbzrle_decode_page(cpage->data, cpage->length, page) )
+            goto bad;
+        break;
+
+    default:
+        ERROR("Unknown page encoding %#x", cpage->encoding);
+        return 0;
+    }
+
+    return sizeof(*cpage) + cpage->length;
+
+ bad:
+    ERROR("Invalid page data for encoding %#x, length %u",
+          cpage->encoding, cpage->length);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,6 +1,10 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_sr_common.h"
 
@@ -198,21 +202,25 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  For a COMPRESSED_PAGE_DATA record, the block of
+ * page data is data_len bytes of encoded pages.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+                             xen_pfn_t *pfns, uint32_t *types, void *page_data,
+                             size_t data_len, bool compressed)
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
     int *map_errs = malloc(count * sizeof(*map_errs));
+    void *decoded = compressed ? malloc(PAGE_SIZE) : NULL;
     int rc;
-    void *mapping = NULL, *guest_page = NULL;
+    void *mapping = NULL, *guest_page = NULL, *data;
+    size_t used;
     unsigned int i, /* i indexes the pfns from the record. */
         j,          /* j indexes the subset of pfns we decide to map. */
         nr_pages = 0;
 
-    if ( !mfns || !map_errs )
+    if ( !mfns || !map_errs || (compressed && !decoded) )
     {
         rc = -1;
         ERROR("Failed to allocate %zu bytes to process page data",
@@ -263,8 +271,30 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
             goto err;
         }
 
+        if ( compressed )
+        {
+            /* Delta encoded pages are based on the current contents. */
+            used = decode_page(ctx, page_data, data_len, guest_page, decoded);
+            if ( !used )
+            {
+                rc = -1;
+                ERROR("Failed to decode pfn %#"PRIpfn" (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+                goto err;
+            }
+
+            data = decoded;
+            page_data += used;
+            data_len -= used;
+        }
+        else
+        {
+            data = page_data;
+            page_data += PAGE_SIZE;
+        }
+
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        rc = ctx->restore.ops.localise_page(ctx, types[i], data);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -275,19 +305,26 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, data, PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
         else
         {
             /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            memcpy(guest_page, data, PAGE_SIZE);
         }
 
         ++j;
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+    }
+
+    if ( compressed && data_len )
+    {
+        rc = -1;
+        ERROR("COMPRESSED_PAGE_DATA record has %zu bytes of trailing data",
+              data_len);
+        goto err;
     }
 
  done:
@@ -297,6 +334,7 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
     if ( mapping )
         xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
 
+    free(decoded);
     free(map_errs);
     free(mfns);
 
@@ -304,13 +342,693 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Post-copy migration.
+ *
+ * After POSTCOPY_BEGIN, the pfns listed in POSTCOPY_PFNS records are evicted
+ * using mem_paging, and the guest is resumed at POSTCOPY_TRANSITION.  From
+ * then on, the remaining records are PAGE_DATA/COMPRESSED_PAGE_DATA and END.
+ * Guest accesses to pfns which haven't arrived yet are reported by Xen on
+ * the paging ring.  These pfns are sent to the source side in POSTCOPY_FAULT
+ * records on the back channel, so it can send them next, and the faulting
+ * vcpus are resumed once the contents have been loaded.
+ */
+struct xc_sr_restore_postcopy
+{
+    /* Pfns listed in POSTCOPY_PFNS records, whose contents are not here. */
+    unsigned long *outstanding;
+    unsigned long nr_outstanding;
+    /* Outstanding pfns reported to the source side. */
+    unsigned long *requested;
+
+    /* Requests from Xen waiting for the contents of their pfn. */
+    vm_event_request_t *pending;
+    unsigned int nr_pending, max_pending;
+
+    /* POSTCOPY_FAULT record being assembled. */
+    uint64_t *faults;
+    unsigned int nr_faults, max_faults;
+
+    xen_pfn_t ring_pfn;
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    xenevtchn_handle *xce;
+    evtchn_port_t port;
+    bool paging_enabled;
+
+    /* Whether the guest has been resumed. */
+    bool transitioned;
+};
+
+static int postcopy_send_faults(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_FAULT,
+        .length = pc->nr_faults * sizeof(*pc->faults),
+    };
+    struct iovec iov[] = {
+        { &rec.type, sizeof(rec.type) },
+        { &rec.length, sizeof(rec.length) },
+        { pc->faults, rec.length },
+    };
+
+    if ( !pc->nr_faults )
+        return 0;
+
+    pc->nr_faults = 0;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write post-copy faults to back channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void postcopy_put_response(struct xc_sr_context *ctx,
+                                  const vm_event_request_t *req)
+{
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    vm_event_response_t rsp = {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = req->reason,
+        .u.mem_paging.gfn = req->u.mem_paging.gfn,
+    };
+    RING_IDX rsp_prod = pc->back_ring.rsp_prod_pvt;
+
+    memcpy(RING_GET_RESPONSE(&pc->back_ring, rsp_prod), &rsp, sizeof(rsp));
+    pc->back_ring.rsp_prod_pvt = rsp_prod + 1;
+    RING_PUSH_RESPONSES(&pc->back_ring);
+}
+
+/*
+ * Consume the requests on the paging ring.  Requests for pfns which are still
+ * outstanding are kept until the contents have arrived.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_request_t req, *pending;
+    unsigned int nr_responses = 0;
+    xen_pfn_t pfn;
+    int rc;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION ||
+             req.reason != VM_EVENT_REASON_MEM_PAGING )
+        {
+            ERROR("Unexpected vm_event request: version %#x, reason %u",
+                  req.version, req.reason);
+            return -1;
+        }
+
+        pfn = req.u.mem_paging.gfn;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("Paging request for pfn %#"PRIpfn" outside domain maximum",
+                  pfn);
+            return -1;
+        }
+
+        if ( test_bit(pfn, pc->outstanding) &&
+             !(req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE) )
+        {
+            if ( pc->nr_pending == pc->max_pending )
+            {
+                unsigned int max = pc->max_pending ? 2 * pc->max_pending : 32;
+
+                pending = realloc(pc->pending, max * sizeof(*pending));
+                if ( !pending )
+                {
+                    ERROR("Unable to allocate memory for paging requests");
+                    return -1;
+                }
+
+                pc->pending = pending;
+                pc->max_pending = max;
+            }
+
+            pc->pending[pc->nr_pending++] = req;
+
+            if ( test_and_set_bit(pfn, pc->requested) )
+                continue;
+
+            pc->faults[pc->nr_faults++] = pfn;
+            if ( pc->nr_faults == pc->max_faults &&
+                 (rc = postcopy_send_faults(ctx)) )
+                return rc;
+
+            continue;
+        }
+
+        /* The guest has released the page, so its contents aren't needed. */
+        if ( test_and_clear_bit(pfn, pc->outstanding) )
+            --pc->nr_outstanding;
+
+        postcopy_put_response(ctx, &req);
+        nr_responses++;
+    }
+
+    rc = postcopy_send_faults(ctx);
+    if ( rc )
+        return rc;
+
+    if ( nr_responses && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the stream to become readable, servicing the paging ring in the
+ * meantime.
+ */
+static int postcopy_wait_for_stream(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct pollfd pfd[] = {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+    };
+    xenevtchn_port_or_error_t port;
+    int rc;
+
+    for ( ; ; )
+    {
+        if ( poll(pfd, ARRAY_SIZE(pfd), -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll stream and paging event channel");
+            return -1;
+        }
+
+        if ( pfd[1].revents & POLLIN )
+        {
+            port = xenevtchn_pending(pc->xce);
+            if ( port < 0 )
+            {
+                PERROR("Failed to get pending paging event");
+                return -1;
+            }
+
+            if ( xenevtchn_unmask(pc->xce, port) )
+            {
+                PERROR("Failed to unmask paging event channel");
+                return -1;
+            }
+
+            rc = postcopy_handle_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        /* Errors and EOF are reported by read_record(). */
+        if ( pfd[0].revents )
+            return 0;
+    }
+}
+
+/*
+ * Load the contents of a pfn, if it is still outstanding, and queue responses
+ * for the requests waiting for it.  Returns the number of responses queued,
+ * or -1 on error.
+ */
+static int postcopy_load_page(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                              void *data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned int i;
+    int nr_responses = 0;
+
+    if ( !test_and_clear_bit(pfn, pc->outstanding) )
+        return 0;
+
+    --pc->nr_outstanding;
+
+    if ( xc_mem_paging_load(xch, ctx->domid, pfn, data) )
+    {
+        PERROR("Failed to load pfn %#"PRIpfn, pfn);
+        return -1;
+    }
+
+    for ( i = 0; i < pc->nr_pending; )
+    {
+        if ( pc->pending[i].u.mem_paging.gfn != pfn )
+        {
+            i++;
+            continue;
+        }
+
+        postcopy_put_response(ctx, &pc->pending[i]);
+        pc->pending[i] = pc->pending[--pc->nr_pending];
+        nr_responses++;
+    }
+
+    return nr_responses;
+}
+
+/*
+ * Load the contents of outstanding pfns, and resume the vcpus waiting for
+ * them.  Pages which are no longer outstanding are skipped.
+ */
+static int process_postcopy_page_data(struct xc_sr_context *ctx,
+                                      unsigned int count, xen_pfn_t *pfns,
+                                      uint32_t *types, void *page_data,
+                                      size_t data_len, bool compressed)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    void *page = malloc(PAGE_SIZE), *data;
+    unsigned int i, nr_responses = 0;
+    size_t used;
+    int rc = -1;
+
+    if ( !page )
+    {
+        ERROR("Unable to allocate memory for post-copy page");
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        if ( compressed )
+        {
+            /* No previous contents to delta encode against. */
+            used = decode_page(ctx, page_data, data_len, NULL, page);
+            if ( !used )
+            {
+                ERROR("Failed to decode pfn %#"PRIpfn, pfns[i]);
+                goto err;
+            }
+
+            data = page;
+            page_data += used;
+            data_len -= used;
+        }
+        else
+        {
+            data = page_data;
+            page_data += PAGE_SIZE;
+        }
+
+        if ( !test_bit(pfns[i], pc->outstanding) )
+            continue;
+
+        rc = ctx->restore.ops.localise_page(ctx, types[i], data);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn, pfns[i]);
+            goto err;
+        }
+
+        rc = postcopy_load_page(ctx, pfns[i], data);
+        if ( rc < 0 )
+            goto err;
+
+        nr_responses += rc;
+        rc = -1;
+    }
+
+    if ( compressed && data_len )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record has %zu bytes of trailing data",
+              data_len);
+        goto err;
+    }
+
+    if ( nr_responses && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(page);
+
+    return rc;
+}
+
+/*
+ * Set up mem_paging for the domain, in the same way as xenpaging does.
+ */
+static int handle_postcopy_begin(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_begin *begin = rec->data;
+    struct xc_sr_restore_postcopy *pc;
+    xen_pfn_t ring_pfn;
+    uint32_t port;
+    int rc;
+
+    if ( ctx->restore.postcopy )
+    {
+        ERROR("Multiple POSTCOPY_BEGIN records found");
+        return -1;
+    }
+
+    if ( !ctx->dominfo.hvm || ctx->stream_type != XC_STREAM_PLAIN ||
+         ctx->restore.send_back_fd < 0 ||
+         !ctx->restore.callbacks->postcopy ||
+         !ctx->restore.callbacks->restore_results )
+    {
+        ERROR("Post-copy migration not possible for this stream");
+        return -1;
+    }
+
+    if ( rec->length != sizeof(*begin) )
+    {
+        ERROR("POSTCOPY_BEGIN record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*begin));
+        return -1;
+    }
+
+    if ( !ctx->restore.ops.pfn_is_valid(ctx, begin->paging_ring_pfn) )
+    {
+        ERROR("Paging ring pfn %#"PRIx64" outside domain maximum",
+              begin->paging_ring_pfn);
+        return -1;
+    }
+
+    pc = calloc(1, sizeof(*pc));
+    if ( !pc )
+    {
+        ERROR("Unable to allocate memory for post-copy state");
+        return -1;
+    }
+    ctx->restore.postcopy = pc;
+
+    pc->outstanding = bitmap_alloc(ctx->restore.p2m_size);
+    pc->requested = bitmap_alloc(ctx->restore.p2m_size);
+    if ( !pc->outstanding || !pc->requested )
+    {
+        ERROR("Unable to allocate memory for post-copy bitmaps");
+        return -1;
+    }
+
+    pc->ring_pfn = ring_pfn = begin->paging_ring_pfn;
+
+    rc = xc_hvm_param_set(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          ring_pfn);
+    if ( rc )
+    {
+        PERROR("Failed to set paging ring pfn");
+        return rc;
+    }
+
+    pc->ring_page = xc_map_foreign_pages(xch, ctx->domid,
+                                         PROT_READ | PROT_WRITE,
+                                         &ring_pfn, 1);
+    if ( !pc->ring_page )
+    {
+        rc = xc_domain_populate_physmap_exact(xch, ctx->domid, 1, 0, 0,
+                                              &ring_pfn);
+        if ( rc )
+        {
+            PERROR("Failed to populate paging ring pfn");
+            return rc;
+        }
+
+        pc->ring_page = xc_map_foreign_pages(xch, ctx->domid,
+                                             PROT_READ | PROT_WRITE,
+                                             &ring_pfn, 1);
+        if ( !pc->ring_page )
+        {
+            PERROR("Failed to map paging ring");
+            return -1;
+        }
+    }
+
+    rc = xc_mem_paging_enable(xch, ctx->domid, &port);
+    if ( rc )
+    {
+        PERROR("Failed to enable paging");
+        return rc;
+    }
+    pc->paging_enabled = true;
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(pc->xce, ctx->domid, port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return rc;
+    }
+    pc->port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   XC_PAGE_SIZE);
+
+    pc->max_faults = RING_SIZE(&pc->back_ring);
+    pc->faults = malloc(pc->max_faults * sizeof(*pc->faults));
+    if ( !pc->faults )
+    {
+        ERROR("Unable to allocate memory for post-copy faults");
+        return -1;
+    }
+
+    rc = xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0,
+                                              &ring_pfn);
+    if ( rc )
+    {
+        PERROR("Failed to remove paging ring from physmap");
+        return rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Evict the pfns whose contents will be sent after the guest is resumed.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    uint64_t *pfns = rec->data;
+    unsigned int i, count = rec->length / sizeof(*pfns);
+    xen_pfn_t *batch = NULL;
+    int rc = -1;
+
+    if ( !pc || pc->transitioned )
+    {
+        ERROR("POSTCOPY_PFNS record outside of post-copy setup");
+        return -1;
+    }
+
+    if ( rec->length % sizeof(*pfns) )
+    {
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        return -1;
+    }
+
+    if ( count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in POSTCOPY_PFNS record");
+        return -1;
+    }
+
+    batch = malloc(count * sizeof(*batch));
+    if ( !batch )
+    {
+        ERROR("Unable to allocate memory for %u pfns", count);
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIx64" (index %u) outside domain maximum",
+                  pfns[i], i);
+            goto err;
+        }
+
+        batch[i] = pfns[i];
+    }
+
+    /* Only populated pfns can be evicted. */
+    rc = populate_pfns(ctx, count, batch, NULL);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for post-copy");
+        goto err;
+    }
+
+    rc = -1;
+    for ( i = 0; i < count; ++i )
+    {
+        if ( batch[i] == pc->ring_pfn || test_bit(batch[i], pc->outstanding) )
+            continue;
+
+        if ( xc_mem_paging_nominate(xch, ctx->domid, batch[i]) ||
+             xc_mem_paging_evict(xch, ctx->domid, batch[i]) )
+        {
+            PERROR("Failed to evict pfn %#"PRIpfn, batch[i]);
+            goto err;
+        }
+
+        set_bit(batch[i], pc->outstanding);
+        ++pc->nr_outstanding;
+    }
+
+    rc = 0;
+
+ err:
+    free(batch);
+
+    return rc;
+}
+
+/*
+ * Complete the restore of everything but the outstanding memory, and resume
+ * the guest.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( !pc || pc->transitioned )
+    {
+        ERROR("Unexpected POSTCOPY_TRANSITION record");
+        return -1;
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                            ctx->restore.console_gfn,
+                                            ctx->restore.callbacks->data);
+
+    IPRINTF("Resuming guest with %lu pages outstanding", pc->nr_outstanding);
+
+    /* Returns 1 on success, like for COLO. */
+    if ( ctx->restore.callbacks->postcopy(ctx->restore.callbacks->data) != 1 )
+    {
+        ERROR("Failed to resume guest for post-copy");
+        return -1;
+    }
+
+    pc->transitioned = true;
+
+    return 0;
+}
+
+/*
+ * Called at the END record.  Beyond this point, failures leave the guest
+ * without parts of its memory, and it has to be destroyed.
+ */
+static int postcopy_complete(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( !pc->transitioned )
+    {
+        ERROR("No POSTCOPY_TRANSITION record seen");
+        return -1;
+    }
+
+    rc = postcopy_handle_requests(ctx);
+    if ( rc )
+        return rc;
+
+    if ( pc->nr_outstanding )
+    {
+        ERROR("%lu pages still outstanding at end of stream",
+              pc->nr_outstanding);
+        return -1;
+    }
+
+    rc = xc_mem_paging_disable(xch, ctx->domid);
+    if ( rc )
+    {
+        PERROR("Failed to disable paging");
+        return rc;
+    }
+    pc->paging_enabled = false;
+
+    return 0;
+}
+
+static void postcopy_cleanup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    if ( pc->paging_enabled && xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    if ( pc->xce )
+    {
+        if ( pc->port )
+            xenevtchn_unbind(pc->xce, pc->port);
+        xenevtchn_close(pc->xce);
+    }
+
+    if ( pc->ring_page )
+        munmap(pc->ring_page, XC_PAGE_SIZE);
+
+    free(pc->faults);
+    free(pc->pending);
+    free(pc->requested);
+    free(pc->outstanding);
+    free(pc);
+    ctx->restore.postcopy = NULL;
+}
+
+/*
+ * Validate a PAGE_DATA or COMPRESSED_PAGE_DATA record from the stream, and
+ * pass the results to process_page_data() to actually perform the legwork.
+ * Records are self-contained, so they are fine to arrive in any order.  The
+ * encoded pages of a COMPRESSED_PAGE_DATA record are validated while
+ * decoding them.
  */
 static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
+    bool compressed = rec->type == REC_TYPE_COMPRESSED_PAGE_DATA;
     unsigned int i, pages_of_data = 0;
     int rc = -1;
 
@@ -397,7 +1115,8 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         types[i] = type;
     }
 
-    if ( rec->length != (sizeof(*pages) +
+    if ( !compressed &&
+         rec->length != (sizeof(*pages) +
                          (sizeof(uint64_t) * pages->count) +
                          (PAGE_SIZE * pages_of_data)) )
     {
@@ -407,8 +1126,17 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    if ( ctx->restore.postcopy && ctx->restore.postcopy->transitioned )
+        rc = process_postcopy_page_data(ctx, pages->count, pfns, types,
+                                        &pages->pfn[pages->count],
+                                        rec->length - sizeof(*pages) -
+                                        (sizeof(uint64_t) * pages->count),
+                                        compressed);
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types,
+                               &pages->pfn[pages->count],
+                               rec->length - sizeof(*pages) -
+                               (sizeof(uint64_t) * pages->count), compressed);
  err:
     free(types);
     free(pfns);
@@ -416,6 +1144,154 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     return rc;
 }
 
+/*
+ * Zero the pfns listed in a ZERO_PAGES record.  Pages freshly allocated by
+ * Xen are scrubbed, so only pfns which were populated already need clearing.
+ */
+static int handle_zero_pages(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    uint64_t *rec_pfns = rec->data;
+    unsigned int i, nr_mapped = 0, nr_responses = 0;
+    unsigned int count = rec->length / sizeof(*rec_pfns);
+    xen_pfn_t *pfns = NULL, *mfns = NULL;
+    uint32_t *types = NULL;
+    int *map_errs = NULL;
+    void *mapping = NULL, *page = NULL;
+    static const uint8_t zero_page[PAGE_SIZE];
+    int rc = -1;
+
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        return -1;
+    }
+
+    if ( rec->length % sizeof(*rec_pfns) || !count )
+    {
+        ERROR("ZERO_PAGES record wrong size: length %u", rec->length);
+        return -1;
+    }
+
+    pfns = malloc(count * sizeof(*pfns));
+    types = malloc(count * sizeof(*types));
+    mfns = malloc(count * sizeof(*mfns));
+    map_errs = malloc(count * sizeof(*map_errs));
+    if ( !pfns || !types || !mfns || !map_errs )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, rec_pfns[i]) )
+        {
+            ERROR("pfn %#"PRIx64" (index %u) outside domain maximum",
+                  rec_pfns[i], i);
+            goto err;
+        }
+
+        pfns[i] = rec_pfns[i];
+        types[i] = XEN_DOMCTL_PFINFO_NOTAB;
+    }
+
+    if ( pc && pc->transitioned )
+    {
+        page = calloc(1, PAGE_SIZE);
+        if ( !page )
+        {
+            ERROR("Unable to allocate memory for post-copy page");
+            goto err;
+        }
+
+        for ( i = 0; i < count; ++i )
+        {
+            rc = postcopy_load_page(ctx, pfns[i], page);
+            if ( rc < 0 )
+                goto err;
+            nr_responses += rc;
+        }
+
+        rc = -1;
+        if ( nr_responses && xenevtchn_notify(pc->xce, pc->port) )
+        {
+            PERROR("Failed to notify paging event channel");
+            goto err;
+        }
+
+        rc = 0;
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfn_is_populated(ctx, pfns[i]) )
+            mfns[nr_mapped++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+    }
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u zero pages", count);
+        goto err;
+    }
+    rc = -1;
+
+    for ( i = 0; i < count; ++i )
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+    if ( nr_mapped == 0 )
+    {
+        rc = 0;
+        goto err;
+    }
+
+    mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE,
+                                   nr_mapped, mfns, map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u mfns for zero pages", nr_mapped);
+        goto err;
+    }
+
+    for ( i = 0; i < nr_mapped; ++i )
+    {
+        if ( map_errs[i] )
+        {
+            ERROR("Mapping mfn %#"PRIpfn" for zeroing failed with %d",
+                  mfns[i], map_errs[i]);
+            goto err;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            /* Verify mode - compare against a zeroed page. */
+            if ( memcmp(mapping + i * PAGE_SIZE, zero_page, PAGE_SIZE) )
+                ERROR("verify mfn %#"PRIpfn" failed (zero page)", mfns[i]);
+        }
+        else
+            memset(mapping + i * PAGE_SIZE, 0, PAGE_SIZE);
+    }
+
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_mapped);
+
+    free(page);
+    free(map_errs);
+    free(mfns);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
 /*
  * Send checkpoint dirty pfn list to primary.
  */
@@ -667,9 +1543,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         break;
 
     case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_ZERO_PAGES:
+        rc = handle_zero_pages(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -683,6 +1564,18 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_static_data_end(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_BEGIN:
+        rc = handle_postcopy_begin(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
@@ -759,6 +1652,8 @@ static void cleanup(struct xc_sr_context *ctx)
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
 
+    postcopy_cleanup(ctx);
+
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 }
@@ -780,6 +1675,13 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( ctx->restore.postcopy && ctx->restore.postcopy->transitioned )
+        {
+            rc = postcopy_wait_for_stream(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -821,6 +1723,17 @@ static int restore(struct xc_sr_context *ctx)
 
     } while ( rec.type != REC_TYPE_END );
 
+    if ( ctx->restore.postcopy )
+    {
+        /* The guest is running already, see handle_postcopy_transition(). */
+        rc = postcopy_complete(ctx);
+        if ( rc )
+            goto err;
+
+        IPRINTF("Post-copy restore successful");
+        goto done;
+    }
+
  remus_failover:
     if ( ctx->stream_type == XC_STREAM_COLO )
     {
@@ -1,8 +1,231 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "xg_sr_common.h"
 
+/*
+ * Optional worker threads for sending memory, used if more than one thread is
+ * requested via XCFLAGS_THREADS().
+ *
+ * Batches of pfns are filled by the main thread as usual, and are then queued
+ * for the workers.  A worker maps (and normalises) the pages of a batch and
+ * writes the PAGE_DATA record, so records of one iteration can end up in the
+ * stream in any order.  As every pfn is contained in at most one batch of an
+ * iteration this doesn't matter for the restore side.  The main thread waits
+ * for all batches to be written at the end of each iteration, so the order
+ * with respect to all other records is kept.
+ */
+struct xc_sr_save_batch
+{
+    struct xc_sr_save_batch *next;
+    unsigned int nr_pfns;
+    xen_pfn_t pfns[MAX_BATCH_SIZE];
+};
+
+struct xc_sr_save_workers
+{
+    struct xc_sr_context *ctx;
+
+    /* Protects all fields below, and the deferred pages of ctx. */
+    pthread_mutex_t lock;
+    /* Signalled when a batch has been queued, or the workers should stop. */
+    pthread_cond_t work;
+    /* Signalled when a worker has finished a batch. */
+    pthread_cond_t done;
+    /* Serialises writing records into the stream. */
+    pthread_mutex_t stream_lock;
+
+    /* Batch being filled by the main thread. */
+    struct xc_sr_save_batch *current;
+    /* Batches waiting for a worker, in order. */
+    struct xc_sr_save_batch *queue, **queue_tail;
+    /* Unused batches. */
+    struct xc_sr_save_batch *free;
+    /* Number of batches queued or being written. */
+    unsigned int pending;
+    bool stop;
+
+    /* Result of the first failing batch. */
+    int rc, error;
+
+    struct xc_sr_save_batch *batches;
+    unsigned int nr_threads;
+    pthread_t threads[];
+};
+
+/*
+ * Cache of the contents last sent for NOTAB pages, used for sending them as
+ * a difference (COMPRESSED_PAGE_XBZRLE) in later iterations.  It is direct
+ * mapped by pfn and has room for at most PAGE_CACHE_SIZE bytes of pages.
+ *
+ * Pages which are not sent in an iteration keep their contents on the
+ * receiving side, so only pages sent as something different than NOTAB (i.e.
+ * localised by the restore code) need invalidating.  A worker thread finding
+ * a slot busy waits for it: sending the page without updating the slot would
+ * leave a stale copy to encode the next delta of the page against.
+ */
+#define PAGE_CACHE_SIZE (64UL << 20)
+
+struct xc_sr_page_cache
+{
+    unsigned long nr_slots;
+    xen_pfn_t *pfns;
+    bool *busy;
+    void *pages;
+};
+
+/*
+ * Mark a pfn as deferred, it will be sent again in the final iteration.
+ */
+static void defer_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_save_workers *w = ctx->save.workers;
+
+    if ( w )
+        pthread_mutex_lock(&w->lock);
+
+    set_bit(pfn, ctx->save.deferred_pages);
+    ++ctx->save.nr_deferred_pages;
+
+    if ( w )
+        pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Encode a page for a COMPRESSED_PAGE_DATA record into buf, against its
+ * previously sent contents if possible.  Returns the number of bytes used.
+ *
+ * The guest may still be modifying the page, so a page going into the cache
+ * is copied once and both encoded and cached from that copy.  Otherwise the
+ * cache could end up different from what the receiver decoded, breaking the
+ * next delta of the page.
+ */
+static size_t compress_page(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                            xen_pfn_t type, const void *page, void *buf)
+{
+    struct xc_sr_page_cache *cache = ctx->save.page_cache;
+    unsigned long slot;
+    void *prev = NULL;
+    uint8_t copy[PAGE_SIZE];
+    size_t len;
+
+    if ( !cache )
+        return encode_page(page, NULL, buf);
+
+    slot = pfn % cache->nr_slots;
+    while ( __atomic_test_and_set(&cache->busy[slot], __ATOMIC_ACQUIRE) )
+        ;
+
+    if ( cache->pfns[slot] == pfn )
+        prev = cache->pages + slot * PAGE_SIZE;
+
+    if ( type != XEN_DOMCTL_PFINFO_NOTAB )
+    {
+        if ( prev )
+            cache->pfns[slot] = INVALID_PFN;
+        len = encode_page(page, NULL, buf);
+    }
+    else
+    {
+        memcpy(copy, page, PAGE_SIZE);
+        len = encode_page(copy, prev, buf);
+        memcpy(cache->pages + slot * PAGE_SIZE, copy, PAGE_SIZE);
+        cache->pfns[slot] = pfn;
+    }
+
+    __atomic_clear(&cache->busy[slot], __ATOMIC_RELEASE);
+
+    return len;
+}
+
+/*
+ * Record a page sent in a ZERO_PAGES record as the previously sent contents.
+ */
+static void cache_zero_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_page_cache *cache = ctx->save.page_cache;
+    unsigned long slot;
+
+    if ( !cache )
+        return;
+
+    slot = pfn % cache->nr_slots;
+    while ( __atomic_test_and_set(&cache->busy[slot], __ATOMIC_ACQUIRE) )
+        ;
+
+    memset(cache->pages + slot * PAGE_SIZE, 0, PAGE_SIZE);
+    cache->pfns[slot] = pfn;
+
+    __atomic_clear(&cache->busy[slot], __ATOMIC_RELEASE);
+}
+
+static int alloc_page_cache(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_page_cache *cache;
+    unsigned long i;
+
+    cache = calloc(1, sizeof(*cache));
+    if ( !cache )
+        goto err;
+    ctx->save.page_cache = cache;
+
+    cache->nr_slots = min(ctx->save.p2m_size, PAGE_CACHE_SIZE / PAGE_SIZE);
+    cache->pfns = malloc(cache->nr_slots * sizeof(*cache->pfns));
+    cache->busy = calloc(cache->nr_slots, sizeof(*cache->busy));
+    cache->pages = malloc(cache->nr_slots * PAGE_SIZE);
+    if ( !cache->pfns || !cache->busy || !cache->pages )
+        goto err;
+
+    for ( i = 0; i < cache->nr_slots; i++ )
+        cache->pfns[i] = INVALID_PFN;
+
+    return 0;
+
+ err:
+    ERROR("Unable to allocate memory for page cache");
+    errno = ENOMEM;
+    return -1;
+}
+
+static void free_page_cache(struct xc_sr_context *ctx)
+{
+    struct xc_sr_page_cache *cache = ctx->save.page_cache;
+
+    if ( !cache )
+        return;
+
+    free(cache->pages);
+    free(cache->busy);
+    free(cache->pfns);
+    free(cache);
+    ctx->save.page_cache = NULL;
+}
+
+/*
+ * Check a page for being all zeroes.  Words are combined in blocks, which the
+ * compiler can vectorise, and most non-zero pages fail in the first block.
+ */
+static bool page_is_zero(const void *page)
+{
+    const unsigned long *p = page;
+    unsigned long acc;
+    unsigned int i, j;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+    {
+        for ( acc = 0, j = 0; j < 8; j++ )
+            acc |= p[i + j];
+
+        if ( acc )
+            return false;
+    }
+
+    return true;
+}
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -76,31 +299,42 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 
 /*
  * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * is constructed in ctx->save.batch_pfns, or was queued for a worker thread.
  *
  * This function:
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * - construct and writes a ZERO_PAGES record for the regular pages which
+ *   are all zeroes.
+ * - construct and writes a PAGE_DATA record into the stream, or a
+ *   COMPRESSED_PAGE_DATA record if requested, for the remaining pfns.
  */
-static int write_batch(struct xc_sr_context *ctx)
+static int write_batch(struct xc_sr_context *ctx, const xen_pfn_t *batch_pfns,
+                       unsigned int nr_pfns)
 {
     xc_interface *xch = ctx->xch;
+    struct xc_sr_save_workers *w = ctx->save.workers;
     xen_pfn_t *mfns = NULL, *types = NULL;
     void *guest_mapping = NULL;
     void **guest_data = NULL;
     void **local_pages = NULL;
     int *errors = NULL, rc = -1;
     unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned int nr_pfns = ctx->save.nr_batch_pfns;
     void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
+    uint64_t *rec_pfns = NULL, *zero_pfns = NULL;
+    unsigned int nr_rec_pfns = 0, nr_zero_pfns = 0;
+    void *cdata = NULL;
+    size_t cdata_len = 0;
+    static const uint8_t zeroes[1U << REC_ALIGN_ORDER];
     struct iovec *iov = NULL; int iovcnt = 0;
     struct xc_sr_rec_page_data_header hdr = { 0 };
     struct xc_sr_record rec = {
         .type = REC_TYPE_PAGE_DATA,
     };
+    struct xc_sr_record zero_rec = {
+        .type = REC_TYPE_ZERO_PAGES,
+    };
 
     assert(nr_pfns != 0);
 
@@ -115,7 +349,7 @@ static int write_batch(struct xc_sr_context *ctx)
     /* Pointers to locally allocated pages.  Need freeing. */
     local_pages = calloc(nr_pfns, sizeof(*local_pages));
     /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    iov = malloc((nr_pfns + 8) * sizeof(*iov));
 
     if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
     {
@@ -126,15 +360,11 @@ static int write_batch(struct xc_sr_context *ctx)
 
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch_pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            defer_page(ctx, batch_pfns[i]);
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -178,7 +408,7 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch_pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
@@ -192,8 +422,7 @@ static int write_batch(struct xc_sr_context *ctx)
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_page(ctx, batch_pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -209,37 +438,118 @@ static int write_batch(struct xc_sr_context *ctx)
     }
 
     rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    zero_pfns = malloc(nr_pfns * sizeof(*zero_pfns));
+    if ( !rec_pfns || !zero_pfns )
     {
         ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
+              2 * nr_pfns * sizeof(*rec_pfns));
         goto err;
     }
 
-    hdr.count = nr_pfns;
+    /*
+     * Regular pages which are all zeroes are listed in a ZERO_PAGES record
+     * rather than sent.  Page tables need their type, even if empty.
+     */
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( guest_data[i] && types[i] == XEN_DOMCTL_PFINFO_NOTAB &&
+             page_is_zero(guest_data[i]) )
+        {
+            cache_zero_page(ctx, batch_pfns[i]);
+            zero_pfns[nr_zero_pfns++] = batch_pfns[i];
+            guest_data[i] = NULL;
+            --nr_pages;
+        }
+        else
+            rec_pfns[nr_rec_pfns++] =
+                ((uint64_t)(types[i]) << 32) | batch_pfns[i];
+    }
+
+    if ( ctx->save.compress && nr_pages )
+    {
+        cdata = malloc(nr_pages *
+                       (sizeof(struct xc_sr_rec_compressed_page) + PAGE_SIZE));
+        if ( !cdata )
+        {
+            ERROR("Unable to allocate memory for compressing %u pages",
+                  nr_pages);
+            goto err;
+        }
+
+        for ( i = 0; i < nr_pfns; ++i )
+        {
+            if ( guest_data[i] )
+                cdata_len += compress_page(ctx, batch_pfns[i], types[i],
+                                           guest_data[i], cdata + cdata_len);
+        }
+    }
+
+    hdr.count = nr_rec_pfns;
 
     rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    rec.length += nr_rec_pfns * sizeof(*rec_pfns);
+    if ( ctx->save.compress )
+    {
+        rec.type = REC_TYPE_COMPRESSED_PAGE_DATA;
+        rec.length += cdata_len;
+    }
+    else
+        rec.length += nr_pages * PAGE_SIZE;
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+    if ( nr_zero_pfns )
+    {
+        zero_rec.length = nr_zero_pfns * sizeof(*zero_pfns);
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+        iov[iovcnt].iov_base = &zero_rec.type;
+        iov[iovcnt].iov_len = sizeof(zero_rec.type);
+        iovcnt++;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+        iov[iovcnt].iov_base = &zero_rec.length;
+        iov[iovcnt].iov_len = sizeof(zero_rec.length);
+        iovcnt++;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+        iov[iovcnt].iov_base = zero_pfns;
+        iov[iovcnt].iov_len = zero_rec.length;
+        iovcnt++;
+    }
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    /* Nothing left for a PAGE_DATA record? */
+    if ( !nr_rec_pfns )
+        goto write;
 
-    iovcnt = 4;
+    iov[iovcnt].iov_base = &rec.type;
+    iov[iovcnt].iov_len = sizeof(rec.type);
+    iovcnt++;
 
-    if ( nr_pages )
+    iov[iovcnt].iov_base = &rec.length;
+    iov[iovcnt].iov_len = sizeof(rec.length);
+    iovcnt++;
+
+    iov[iovcnt].iov_base = &hdr;
+    iov[iovcnt].iov_len = sizeof(hdr);
+    iovcnt++;
+
+    iov[iovcnt].iov_base = rec_pfns;
+    iov[iovcnt].iov_len = nr_rec_pfns * sizeof(*rec_pfns);
+    iovcnt++;
+
+    if ( cdata_len )
+    {
+        iov[iovcnt].iov_base = cdata;
+        iov[iovcnt].iov_len = cdata_len;
+        iovcnt++;
+
+        if ( rec.length & ((1U << REC_ALIGN_ORDER) - 1) )
+        {
+            iov[iovcnt].iov_base = (void *)zeroes;
+            iov[iovcnt].iov_len = (1U << REC_ALIGN_ORDER) -
+                (rec.length & ((1U << REC_ALIGN_ORDER) - 1));
+            iovcnt++;
+        }
+
+        nr_pages = 0;
+    }
+    else if ( nr_pages )
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
@@ -253,17 +563,25 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+ write:
+    if ( w )
+        pthread_mutex_lock(&w->stream_lock);
+    rc = writev_exact(ctx->fd, iov, iovcnt);
+    if ( w )
+        pthread_mutex_unlock(&w->stream_lock);
+    if ( rc )
     {
         PERROR("Failed to write page data to stream");
+        rc = -1;
         goto err;
     }
 
     /* Sanity check we have sent all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
 
  err:
+    free(cdata);
+    free(zero_pfns);
     free(rec_pfns);
     if ( guest_mapping )
         xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
@@ -279,6 +597,209 @@ static int write_batch(struct xc_sr_context *ctx)
     return rc;
 }
 
+static void *save_worker(void *data)
+{
+    struct xc_sr_save_workers *w = data;
+    struct xc_sr_save_batch *batch;
+    bool skip;
+    int rc;
+
+    pthread_mutex_lock(&w->lock);
+
+    for ( ; ; )
+    {
+        while ( !w->queue && !w->stop )
+            pthread_cond_wait(&w->work, &w->lock);
+
+        if ( w->stop )
+            break;
+
+        batch = w->queue;
+        w->queue = batch->next;
+        if ( !w->queue )
+            w->queue_tail = &w->queue;
+
+        /* Don't write anything after another batch has failed. */
+        skip = w->rc;
+
+        pthread_mutex_unlock(&w->lock);
+
+        rc = skip ? 0 : write_batch(w->ctx, batch->pfns, batch->nr_pfns);
+
+        pthread_mutex_lock(&w->lock);
+
+        if ( rc && !w->rc )
+        {
+            w->rc = rc;
+            w->error = errno;
+        }
+
+        batch->next = w->free;
+        w->free = batch;
+        --w->pending;
+        pthread_cond_broadcast(&w->done);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static void stop_workers(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_workers *w = ctx->save.workers;
+    unsigned int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    for ( i = 0; i < w->nr_threads; i++ )
+        pthread_join(w->threads[i], NULL);
+
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->stream_lock);
+    pthread_mutex_destroy(&w->lock);
+
+    free(w->batches);
+    free(w);
+
+    ctx->save.workers = NULL;
+    ctx->save.batch_pfns = NULL;
+}
+
+static int start_workers(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_workers *w;
+    unsigned int i, nr_threads = ctx->save.nr_threads;
+    /* Allow for all workers being busy while the next batches are filled. */
+    unsigned int nr_batches = 2 * nr_threads + 1;
+    int rc;
+
+    w = calloc(1, sizeof(*w) + nr_threads * sizeof(*w->threads));
+    if ( !w )
+    {
+        ERROR("Unable to allocate memory for %u worker threads", nr_threads);
+        return -1;
+    }
+
+    w->batches = malloc(nr_batches * sizeof(*w->batches));
+    if ( !w->batches )
+    {
+        ERROR("Unable to allocate memory for %u batches", nr_batches);
+        free(w);
+        return -1;
+    }
+
+    w->ctx = ctx;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->stream_lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->queue_tail = &w->queue;
+
+    w->current = &w->batches[0];
+    for ( i = 1; i < nr_batches; i++ )
+    {
+        w->batches[i].next = w->free;
+        w->free = &w->batches[i];
+    }
+
+    ctx->save.workers = w;
+    ctx->save.batch_pfns = w->current->pfns;
+
+    for ( ; w->nr_threads < nr_threads; w->nr_threads++ )
+    {
+        rc = pthread_create(&w->threads[w->nr_threads], NULL, save_worker, w);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create worker thread");
+            stop_workers(ctx);
+            return -1;
+        }
+    }
+
+    DPRINTF("Using %u threads for sending memory", nr_threads);
+
+    return 0;
+}
+
+/*
+ * Hand the current batch to the worker threads and switch to an unused one,
+ * waiting for one to become available if necessary.
+ */
+static int queue_batch(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_workers *w = ctx->save.workers;
+    struct xc_sr_save_batch *batch = w->current;
+    int rc;
+
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    batch->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+
+    *w->queue_tail = batch;
+    w->queue_tail = &batch->next;
+    ++w->pending;
+    pthread_cond_signal(&w->work);
+
+    while ( !w->free && !w->rc )
+        pthread_cond_wait(&w->done, &w->lock);
+
+    rc = w->rc;
+    if ( !rc )
+    {
+        w->current = w->free;
+        w->free = w->current->next;
+    }
+    else
+        errno = w->error;
+
+    pthread_mutex_unlock(&w->lock);
+
+    if ( rc )
+    {
+        PERROR("Failed to write batch of pages");
+        return rc;
+    }
+
+    ctx->save.batch_pfns = w->current->pfns;
+    ctx->save.nr_batch_pfns = 0;
+
+    return 0;
+}
+
+/*
+ * Wait for the worker threads to have written all queued batches.
+ */
+static int wait_for_workers(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_workers *w = ctx->save.workers;
+    int rc;
+
+    if ( !w )
+        return 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    while ( w->pending )
+        pthread_cond_wait(&w->done, &w->lock);
+
+    rc = w->rc;
+    if ( rc )
+        errno = w->error;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
 /*
  * Flush a batch of pfns into the stream.
  */
@@ -289,10 +810,14 @@ static int flush_batch(struct xc_sr_context *ctx)
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.workers )
+        return queue_batch(ctx);
+
+    rc = write_batch(ctx, ctx->save.batch_pfns, ctx->save.nr_batch_pfns);
 
     if ( !rc )
     {
+        ctx->save.nr_batch_pfns = 0;
         VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
                                     MAX_BATCH_SIZE *
                                     sizeof(*ctx->save.batch_pfns));
@@ -393,6 +918,11 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    /* All pages of this iteration need to be in the stream now. */
+    rc = wait_for_workers(ctx);
+    if ( rc )
+        return rc;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -573,6 +1103,19 @@ static int send_memory_live(struct xc_sr_context *ctx)
         goto out;
     }
 
+    if ( policy_decision == XGS_POLICY_POSTCOPY )
+    {
+        /*
+         * Faults on the receiving side are handled using mem_paging, which
+         * needs HAP, and reported back via the back channel.
+         */
+        if ( ctx->dominfo.hvm && ctx->dominfo.hap &&
+             ctx->stream_type == XC_STREAM_PLAIN && ctx->save.recv_fd >= 0 )
+            ctx->save.postcopy = true;
+        else
+            DPRINTF("Post-copy not possible, using stop-and-copy");
+    }
+
  out:
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
@@ -694,6 +1237,261 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Send a POSTCOPY_PFNS record for pfns whose contents are to be sent after
+ * the guest has been resumed on the receiving side.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx, uint64_t *pfns,
+                               unsigned int nr_pfns)
+{
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = nr_pfns * sizeof(*pfns),
+        .data = pfns,
+    };
+
+    return write_record(ctx, &rec);
+}
+
+/*
+ * Suspend the domain and, instead of sending the dirty memory, announce it in
+ * POSTCOPY_PFNS records.  This is the last iteration of a post-copy live
+ * migration.  Pfns without any data are dealt with right away in PAGE_DATA
+ * records, and cleared from the dirty bitmap.  The bitmap is left containing
+ * the pfns still to be sent by send_postcopy_memory().
+ */
+static int suspend_and_send_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    struct xc_sr_rec_postcopy_begin begin = { 0 };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_BEGIN,
+        .length = sizeof(begin),
+        .data = &begin,
+    };
+    xen_pfn_t *batch = NULL, *types = NULL, *nodata = NULL, p;
+    uint64_t *pfns = NULL, value;
+    unsigned int i, nr_batch = 0, nr_nodata, nr_pfns;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        goto out;
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        rc = -1;
+        goto out;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    rc = xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN, &value);
+    if ( rc )
+    {
+        PERROR("Unable to get paging ring pfn");
+        goto out;
+    }
+    begin.paging_ring_pfn = value;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        goto out;
+
+    rc = -1;
+    batch = malloc(MAX_BATCH_SIZE * sizeof(*batch));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    nodata = malloc(MAX_BATCH_SIZE * sizeof(*nodata));
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    if ( !batch || !types || !nodata || !pfns )
+    {
+        ERROR("Unable to allocate memory for post-copy pfns");
+        goto out;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; )
+    {
+        if ( test_bit(p, dirty_bitmap) )
+            batch[nr_batch++] = p;
+
+        if ( ++p < ctx->save.p2m_size && nr_batch < MAX_BATCH_SIZE )
+            continue;
+        if ( !nr_batch )
+            break;
+
+        for ( i = 0; i < nr_batch; ++i )
+            types[i] = ctx->save.ops.pfn_to_gfn(ctx, batch[i]);
+
+        if ( xc_get_pfn_type_batch(xch, ctx->domid, nr_batch, types) )
+        {
+            PERROR("Failed to get types for pfn batch");
+            goto out;
+        }
+
+        for ( i = 0, nr_nodata = 0, nr_pfns = 0; i < nr_batch; ++i )
+        {
+            if ( page_type_has_stream_data(types[i]) )
+                pfns[nr_pfns++] = batch[i];
+            else
+            {
+                clear_bit(batch[i], dirty_bitmap);
+                nodata[nr_nodata++] = batch[i];
+            }
+        }
+
+        if ( nr_nodata && write_batch(ctx, nodata, nr_nodata) )
+            goto out;
+
+        if ( nr_pfns && write_postcopy_pfns(ctx, pfns, nr_pfns) )
+            goto out;
+
+        ctx->save.nr_postcopy_pfns += nr_pfns;
+        nr_batch = 0;
+    }
+
+    DPRINTF("%lu pages left for post-copy", ctx->save.nr_postcopy_pfns);
+    rc = 0;
+
+ out:
+    free(pfns);
+    free(nodata);
+    free(types);
+    free(batch);
+    return rc;
+}
+
+/*
+ * Add pfns the guest faulted on at the receiving side to the batch, taking
+ * them out of the set still to be sent.
+ */
+static int handle_postcopy_faults(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    struct xc_sr_record rec;
+    uint64_t *pfns;
+    unsigned int i;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    while ( (rc = poll(&pfd, 1, 0)) > 0 )
+    {
+        rc = read_record(ctx, ctx->save.recv_fd, &rec);
+        if ( rc )
+            return rc;
+
+        if ( rec.type != REC_TYPE_POSTCOPY_FAULT ||
+             rec.length % sizeof(*pfns) )
+        {
+            ERROR("Unexpected record %#x (%s), length %u on back channel",
+                  rec.type, rec_type_to_str(rec.type), rec.length);
+            free(rec.data);
+            return -1;
+        }
+
+        for ( i = 0, pfns = rec.data; i < rec.length / sizeof(*pfns); ++i )
+        {
+            if ( pfns[i] >= ctx->save.p2m_size ||
+                 !test_and_clear_bit(pfns[i], dirty_bitmap) )
+                continue;
+
+            --ctx->save.nr_postcopy_pfns;
+            rc = add_to_batch(ctx, pfns[i]);
+            if ( rc )
+                break;
+        }
+
+        free(rec.data);
+        if ( rc )
+            return rc;
+    }
+
+    if ( rc < 0 && errno != EINTR )
+    {
+        PERROR("Failed to poll back channel");
+        return -1;
+    }
+
+    return flush_batch(ctx);
+}
+
+/*
+ * Send the memory announced in POSTCOPY_PFNS records, while the guest runs on
+ * the receiving side.  Pages are sent in small batches in pfn order, but pages
+ * the guest is waiting for are sent first.
+ */
+#define POSTCOPY_BATCH_SIZE 64
+
+static int send_postcopy_memory(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    xen_pfn_t p = 0;
+    unsigned int n;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    /*
+     * Even if writing the record fails, the receiving side may have got it,
+     * and resumed the guest.
+     */
+    ctx->save.postcopy_transition = true;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    /* The receiving side has discarded the contents of these pages. */
+    free_page_cache(ctx);
+
+    xc_set_progress_prefix(xch, "Post-copy frames");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = handle_postcopy_faults(ctx);
+        if ( rc )
+            goto out;
+
+        for ( n = 0; p < ctx->save.p2m_size && n < POSTCOPY_BATCH_SIZE; ++p )
+        {
+            if ( !test_and_clear_bit(p, dirty_bitmap) )
+                continue;
+
+            --ctx->save.nr_postcopy_pfns;
+            ++n;
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                goto out;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+    rc = wait_for_workers(ctx);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -744,11 +1542,15 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    rc = suspend_and_send_dirty(ctx);
+    if ( ctx->save.postcopy )
+        rc = suspend_and_send_postcopy_pfns(ctx);
+    else
+        rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
 
-    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN )
+    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN &&
+         !ctx->save.postcopy )
     {
         rc = verify_frames(ctx);
         if ( rc )
@@ -803,8 +1605,22 @@ static int setup(struct xc_sr_context *ctx)
 
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
         xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
-    ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
-                                  sizeof(*ctx->save.batch_pfns));
+    if ( ctx->save.nr_threads > 1 )
+    {
+        rc = start_workers(ctx);
+        if ( rc )
+            goto err;
+    }
+    else
+        ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
+                                      sizeof(*ctx->save.batch_pfns));
+
+    if ( ctx->save.compress_delta )
+    {
+        rc = alloc_page_cache(ctx);
+        if ( rc )
+            goto err;
+    }
     ctx->save.deferred_pages = bitmap_alloc(ctx->save.p2m_size);
 
     if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
@@ -832,11 +1648,15 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
 
+    if ( ctx->save.workers )
+        stop_workers(ctx);
+
     if ( ctx->save.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free_page_cache(ctx);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -905,6 +1725,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_memory(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
             /*
@@ -968,6 +1795,12 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     saved_rc = rc;
     PERROR("Save failed");
 
+    if ( ctx->save.postcopy_transition )
+    {
+        ERROR("Post-copy migration failed, guest must not be resumed");
+        saved_rc = XGS_RC_POSTCOPY_FAILED;
+    }
+
  done:
     cleanup(ctx);
 
@@ -994,6 +1827,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.nr_threads = (flags & XCFLAGS_THREADS_MASK) >>
+                          XCFLAGS_THREADS_SHIFT;
+    ctx.save.compress = !!(flags & (XCFLAGS_COMPRESS |
+                                    XCFLAGS_COMPRESS_DELTA));
+    /*
+     * Delta encoding relies on the receiving side not changing the guest
+     * memory between iterations, which isn't true for a COLO secondary, and
+     * gains nothing for a single pass.
+     */
+    ctx.save.compress_delta = (flags & XCFLAGS_COMPRESS_DELTA) &&
+                              ctx.save.live &&
+                              stream_type == XC_STREAM_PLAIN;
     ctx.save.recv_fd = recv_fd;
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
@@ -76,6 +76,12 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000013U
+#define REC_TYPE_POSTCOPY_BEGIN             0x00000014U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000015U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000016U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000017U
+#define REC_TYPE_ZERO_PAGES                 0x00000018U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +96,28 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/*
+ * COMPRESSED_PAGE_DATA - same header as PAGE_DATA, followed by one of these
+ * (not individually aligned) for every page with stream data.
+ */
+struct xc_sr_rec_compressed_page
+{
+    uint16_t encoding;
+    uint16_t _res1;
+    uint32_t length;
+    uint8_t data[0];
+};
+
+#define COMPRESSED_PAGE_RAW     0x0000U
+#define COMPRESSED_PAGE_LZ4     0x0001U
+#define COMPRESSED_PAGE_XBZRLE  0x0002U
+
+/* POSTCOPY_BEGIN */
+struct xc_sr_rec_postcopy_begin
+{
+    uint64_t paging_ring_pfn;
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
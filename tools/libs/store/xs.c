@@ -795,6 +795,198 @@ unwind:
 	return false;
 }
 
+/* Append the sub-request for op to buf, returns its size or 0 if no space. */
+static unsigned int batch_pack_op(char *buf, unsigned int space,
+				  const struct xs_batch_op *op)
+{
+	struct xsd_sockmsg msg = { .type = op->type };
+	char perm[MAX_STRLEN(unsigned int)+1];
+	unsigned int i, len, off = sizeof(msg);
+
+#define BATCH_ADD(data, size) do {					\
+		len = (size);						\
+		if (off + len > space)					\
+			return 0;					\
+		memcpy(buf + off, (data), len);				\
+		off += len;						\
+	} while (0)
+
+	if (off > space)
+		return 0;
+
+	BATCH_ADD(op->path, strlen(op->path) + 1);
+	if (op->type == XS_WRITE)
+		BATCH_ADD(op->data, op->len);
+	if (op->type == XS_SET_PERMS) {
+		for (i = 0; i < op->num_perms; i++) {
+			if (!xs_perm_to_string(&op->perms[i], perm,
+					       sizeof(perm)))
+				return 0;
+			BATCH_ADD(perm, strlen(perm) + 1);
+		}
+	}
+
+#undef BATCH_ADD
+
+	msg.len = off - sizeof(msg);
+	memcpy(buf, &msg, sizeof(msg));
+
+	return off;
+}
+
+/* Perform a single operation of a batch on its own. */
+static void batch_single_op(struct xs_handle *h, xs_transaction_t t,
+			    struct xs_batch_op *op)
+{
+	bool ok = false;
+
+	switch (op->type) {
+	case XS_READ:
+		op->value = xs_read(h, t, op->path, &op->value_len);
+		ok = op->value;
+		break;
+	case XS_WRITE:
+		ok = xs_write(h, t, op->path, op->data, op->len);
+		break;
+	case XS_MKDIR:
+		ok = xs_mkdir(h, t, op->path);
+		break;
+	case XS_RM:
+		ok = xs_rm(h, t, op->path);
+		break;
+	case XS_SET_PERMS:
+		ok = xs_set_permissions(h, t, op->path, op->perms,
+					op->num_perms);
+		break;
+	default:
+		errno = EINVAL;
+		break;
+	}
+
+	op->err = ok ? 0 : errno;
+}
+
+/* Store the result of an operation from its sub-reply. */
+static bool batch_set_result(struct xs_handle *h, xs_transaction_t t,
+			     struct xs_batch_op *op,
+			     const struct xsd_sockmsg *msg, const char *body)
+{
+	if (msg->type == XS_ERROR) {
+		if (!msg->len || body[msg->len - 1])
+			return false;
+		op->err = get_error(body);
+		/* A value too large for a batch can still be read alone. */
+		if (op->type == XS_READ && op->err == E2BIG)
+			batch_single_op(h, t, op);
+		return true;
+	}
+
+	if (msg->type != op->type)
+		return false;
+
+	if (op->type == XS_READ) {
+		op->value = malloc(msg->len + 1);
+		if (!op->value) {
+			op->err = ENOMEM;
+			return true;
+		}
+		memcpy(op->value, body, msg->len);
+		((char *)op->value)[msg->len] = '\0';
+		op->value_len = msg->len;
+	}
+
+	return true;
+}
+
+bool xs_batch(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_batch_op *ops, unsigned int num_ops)
+{
+	struct xsd_sockmsg msg;
+	struct iovec iovec;
+	char *buf, *reply;
+	unsigned int i, done, size, len, off;
+
+	for (i = 0; i < num_ops; i++) {
+		switch (ops[i].type) {
+		case XS_READ:
+		case XS_WRITE:
+		case XS_MKDIR:
+		case XS_RM:
+		case XS_SET_PERMS:
+			break;
+		default:
+			errno = EINVAL;
+			return false;
+		}
+		ops[i].err = 0;
+		ops[i].value = NULL;
+		ops[i].value_len = 0;
+	}
+
+	buf = malloc(XENSTORE_PAYLOAD_MAX);
+	if (!buf)
+		return false;
+
+	for (done = 0; done < num_ops; done = i) {
+		len = 0;
+		for (i = done; i < num_ops; i++) {
+			size = batch_pack_op(buf + len,
+					     XENSTORE_PAYLOAD_MAX - len, &ops[i]);
+			if (!size)
+				break;
+			len += size;
+		}
+
+		/* Operation too large for a batch. */
+		if (i == done) {
+			batch_single_op(h, t, &ops[i]);
+			i++;
+			continue;
+		}
+
+		iovec.iov_base = buf;
+		iovec.iov_len = len;
+		reply = xs_talkv(h, t, XS_BATCH, &iovec, 1, &len);
+		if (!reply) {
+			/* Older xenstored without XS_BATCH support. */
+			if (errno != ENOSYS && errno != EINVAL)
+				goto fail;
+			for (i = done; i < num_ops; i++)
+				batch_single_op(h, t, &ops[i]);
+			break;
+		}
+
+		for (i = done, off = 0; i < num_ops; i++) {
+			if (len - off < sizeof(msg))
+				break;
+			memcpy(&msg, reply + off, sizeof(msg));
+			off += sizeof(msg);
+			if (msg.len > len - off ||
+			    !batch_set_result(h, t, &ops[i], &msg,
+					      reply + off)) {
+				free(reply);
+				errno = EIO;
+				goto fail;
+			}
+			off += msg.len;
+		}
+		free(reply);
+
+		/* No progress at all would loop forever. */
+		if (i == done) {
+			errno = EIO;
+			goto fail;
+		}
+	}
+
+	free(buf);
+	return true;
+
+fail:
+	free_no_errno(buf);
+	return false;
+}
+
 /* Always return false a functionality has been removed in Xen 4.9 */
 bool xs_restrict(struct xs_handle *h, unsigned domid)
 {
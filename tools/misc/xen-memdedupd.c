@@ -0,0 +1,710 @@
+/*
+ * xen-memdedupd: merge identical pages of guests using memory sharing.
+ *
+ * Guest memory is scanned through read-only foreign mappings, and each page
+ * is hashed.  As done by Linux' KSM, only pages whose hash hasn't changed
+ * since the previous pass are considered for merging, so that pages being
+ * written to aren't nominated just to be unshared again:
+ *  - the stable table holds pages which have been shared, keyed by hash.  A
+ *    candidate with the same hash is shared with the page found there;
+ *  - the unstable table holds the other candidates seen during the current
+ *    pass.  Two candidates with the same hash are shared with each other,
+ *    and the result moves to the stable table.  The unstable table is emptied
+ *    at the start of every pass.
+ *
+ * A hash match is confirmed by comparing the contents of both pages after
+ * nominating them.  Nominated pages are read-only to their guests, and a
+ * write to one unshares it and invalidates its handle, so the sharing
+ * operation fails rather than merging pages which have diverged since.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+#include <xen-tools/libs.h>
+
+/* Built from the hypervisor's copy, see the Makefile. */
+#include "../../xen/include/xen/xxhash.h"
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
+/* Pages mapped at once while scanning. */
+#define SCAN_BATCH 256
+
+struct page_ref {
+    uint64_t hash;
+    uint64_t handle;        /* Sharing handle, stable table only. */
+    xen_pfn_t gfn;
+    domid_t domid;          /* DOMID_INVALID if the slot is free. */
+};
+
+/* Open addressing hash table of pages, keyed by the hash of their contents. */
+struct page_table {
+    struct page_ref *slots;
+    unsigned long size;     /* Power of two. */
+    unsigned long nr;
+};
+
+struct dom {
+    struct dom *next;
+    domid_t domid;
+    bool seen;              /* Still exists, reset at the start of a pass. */
+    xen_pfn_t nr_gfns;
+    uint64_t *hashes;       /* Hash of each page in the previous pass. */
+    unsigned long *shared;  /* Pages shared by us, and unchanged since. */
+};
+
+static struct {
+    unsigned long passes;
+    unsigned long scanned;
+    unsigned long volatile_pages;
+    unsigned long merged;
+    unsigned long collisions;
+    unsigned long failed;
+} stats;
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+static struct page_table stable, unstable;
+static struct dom *doms;
+
+static unsigned long scan_rate = 25000;
+static unsigned int interval = 60;
+static bool all_doms, verbose;
+
+static volatile sig_atomic_t stop, dump;
+
+static void handle_signal(int sig)
+{
+    if ( sig == SIGUSR1 )
+        dump = 1;
+    else
+        stop = 1;
+}
+
+static uint64_t page_hash(const void *page)
+{
+    uint64_t hash = xxh64(page, XC_PAGE_SIZE, 0);
+
+    /* 0 means "not known" in struct dom's hashes. */
+    return hash ?: 1;
+}
+
+static bool bitmap_test(const unsigned long *map, xen_pfn_t bit)
+{
+    return map[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG));
+}
+
+static void bitmap_assign(unsigned long *map, xen_pfn_t bit, bool val)
+{
+    if ( val )
+        map[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+    else
+        map[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+static struct page_ref *table_find(const struct page_table *t, uint64_t hash)
+{
+    unsigned long i;
+
+    if ( !t->size )
+        return NULL;
+
+    for ( i = hash & (t->size - 1); t->slots[i].domid != DOMID_INVALID;
+          i = (i + 1) & (t->size - 1) )
+        if ( t->slots[i].hash == hash )
+            return &t->slots[i];
+
+    return NULL;
+}
+
+static int table_resize(struct page_table *t, unsigned long size)
+{
+    struct page_table new = { .size = size };
+    unsigned long i;
+
+    new.slots = malloc(size * sizeof(*new.slots));
+    if ( !new.slots )
+        return -1;
+
+    for ( i = 0; i < size; i++ )
+        new.slots[i].domid = DOMID_INVALID;
+
+    for ( i = 0; i < t->size; i++ )
+    {
+        const struct page_ref *ref = &t->slots[i];
+        unsigned long j;
+
+        if ( ref->domid == DOMID_INVALID )
+            continue;
+
+        for ( j = ref->hash & (size - 1); new.slots[j].domid != DOMID_INVALID;
+              j = (j + 1) & (size - 1) )
+            ;
+        new.slots[j] = *ref;
+        new.nr++;
+    }
+
+    free(t->slots);
+    *t = new;
+
+    return 0;
+}
+
+/* Add a page, unless one with the same hash is present already. */
+static struct page_ref *table_add(struct page_table *t, uint64_t hash,
+                                  domid_t domid, xen_pfn_t gfn,
+                                  uint64_t handle)
+{
+    struct page_ref *ref;
+    unsigned long i;
+
+    if ( (t->nr + 1) * 4 > t->size * 3 &&
+         table_resize(t, t->size ? t->size * 2 : 1024) )
+        return NULL;
+
+    for ( i = hash & (t->size - 1); t->slots[i].domid != DOMID_INVALID;
+          i = (i + 1) & (t->size - 1) )
+        if ( t->slots[i].hash == hash )
+            return &t->slots[i];
+
+    ref = &t->slots[i];
+    ref->hash = hash;
+    ref->handle = handle;
+    ref->gfn = gfn;
+    ref->domid = domid;
+    t->nr++;
+
+    return ref;
+}
+
+static void table_del(struct page_table *t, struct page_ref *ref)
+{
+    unsigned long i = ref - t->slots, j, home;
+
+    /* Move later entries of the cluster back, so that lookups find them. */
+    for ( j = (i + 1) & (t->size - 1); t->slots[j].domid != DOMID_INVALID;
+          j = (j + 1) & (t->size - 1) )
+    {
+        home = t->slots[j].hash & (t->size - 1);
+        if ( ((j - home) & (t->size - 1)) >= ((j - i) & (t->size - 1)) )
+        {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+
+    t->slots[i].domid = DOMID_INVALID;
+    t->nr--;
+}
+
+static void table_clear(struct page_table *t)
+{
+    unsigned long i;
+
+    for ( i = 0; i < t->size; i++ )
+        t->slots[i].domid = DOMID_INVALID;
+    t->nr = 0;
+}
+
+static struct dom *find_dom(domid_t domid)
+{
+    struct dom *d;
+
+    for ( d = doms; d; d = d->next )
+        if ( d->domid == domid )
+            return d;
+
+    return NULL;
+}
+
+static void mark_shared(domid_t domid, xen_pfn_t gfn)
+{
+    struct dom *d = find_dom(domid);
+
+    if ( d && gfn < d->nr_gfns )
+        bitmap_assign(d->shared, gfn, true);
+}
+
+/* Compare the contents of two guest pages. */
+static bool same_contents(domid_t d1, xen_pfn_t gfn1,
+                          domid_t d2, xen_pfn_t gfn2)
+{
+    void *p1, *p2;
+    bool same = false;
+
+    p1 = xenforeignmemory_map(fmem, d1, PROT_READ, 1, &gfn1, NULL);
+    if ( !p1 )
+        return false;
+
+    p2 = xenforeignmemory_map(fmem, d2, PROT_READ, 1, &gfn2, NULL);
+    if ( p2 )
+    {
+        same = !memcmp(p1, p2, XC_PAGE_SIZE);
+        xenforeignmemory_unmap(fmem, p2, 1);
+    }
+
+    xenforeignmemory_unmap(fmem, p1, 1);
+
+    return same;
+}
+
+/*
+ * Share a candidate page with the (nominated) page src refers to.  Returns 0
+ * on success, -1 with errno set otherwise.  errno is EEXIST if the contents
+ * differ.
+ */
+static int share_with(const struct page_ref *src, domid_t domid,
+                      xen_pfn_t gfn)
+{
+    uint64_t handle;
+
+    if ( xc_memshr_nominate_gfn(xch, domid, gfn, &handle) )
+        return -1;
+
+    /* Both are the same shared page already. */
+    if ( handle == src->handle )
+        return 0;
+
+    if ( !same_contents(src->domid, src->gfn, domid, gfn) )
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    return xc_memshr_share_gfns(xch, src->domid, src->gfn, src->handle,
+                                domid, gfn, handle);
+}
+
+static void merge_page(struct dom *d, xen_pfn_t gfn, uint64_t hash)
+{
+    struct page_ref *ref = table_find(&stable, hash);
+    struct page_ref src;
+
+    if ( ref )
+    {
+        if ( !share_with(ref, d->domid, gfn) )
+        {
+            bitmap_assign(d->shared, gfn, true);
+            stats.merged++;
+            return;
+        }
+
+        if ( errno == EEXIST )
+        {
+            stats.collisions++;
+            return;
+        }
+
+        /* The stable page was written to, or went away. */
+        if ( errno != -XENMEM_SHARING_OP_S_HANDLE_INVALID &&
+             errno != ESRCH && errno != EINVAL )
+        {
+            stats.failed++;
+            return;
+        }
+
+        table_del(&stable, ref);
+    }
+
+    ref = table_find(&unstable, hash);
+    if ( !ref || (ref->domid == d->domid && ref->gfn == gfn) )
+    {
+        table_add(&unstable, hash, d->domid, gfn, 0);
+        return;
+    }
+
+    src = *ref;
+    table_del(&unstable, ref);
+
+    if ( xc_memshr_nominate_gfn(xch, src.domid, src.gfn, &src.handle) )
+    {
+        /* The other candidate isn't sharable any more, replace it. */
+        table_add(&unstable, hash, d->domid, gfn, 0);
+        return;
+    }
+
+    if ( share_with(&src, d->domid, gfn) )
+    {
+        if ( errno == EEXIST )
+            stats.collisions++;
+        else
+            stats.failed++;
+        return;
+    }
+
+    mark_shared(src.domid, src.gfn);
+    bitmap_assign(d->shared, gfn, true);
+    stats.merged++;
+
+    table_add(&stable, hash, src.domid, src.gfn, src.handle);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep as needed not to scan more than scan_rate pages per second. */
+static void throttle(uint64_t start, unsigned long scanned)
+{
+    uint64_t due = start + scanned * 1000000000ULL / scan_rate;
+    uint64_t now = now_ns();
+    struct timespec ts;
+
+    if ( !scan_rate || now >= due )
+        return;
+
+    ts.tv_sec = (due - now) / 1000000000ULL;
+    ts.tv_nsec = (due - now) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+}
+
+static int dom_resize(struct dom *d, xen_pfn_t nr_gfns)
+{
+    size_t old_words = (d->nr_gfns + BITS_PER_LONG - 1) / BITS_PER_LONG;
+    size_t words = (nr_gfns + BITS_PER_LONG - 1) / BITS_PER_LONG;
+    uint64_t *hashes;
+    unsigned long *shared;
+
+    if ( nr_gfns <= d->nr_gfns )
+        return 0;
+
+    hashes = realloc(d->hashes, nr_gfns * sizeof(*hashes));
+    if ( !hashes )
+        return -1;
+    d->hashes = hashes;
+
+    shared = realloc(d->shared, words * sizeof(*shared));
+    if ( !shared )
+        return -1;
+    d->shared = shared;
+
+    memset(&hashes[d->nr_gfns], 0, (nr_gfns - d->nr_gfns) * sizeof(*hashes));
+    memset(&shared[old_words], 0, (words - old_words) * sizeof(*shared));
+    if ( d->nr_gfns % BITS_PER_LONG )
+        shared[old_words - 1] &= (1UL << (d->nr_gfns % BITS_PER_LONG)) - 1;
+    d->nr_gfns = nr_gfns;
+
+    return 0;
+}
+
+static void scan_dom(struct dom *d, uint64_t start, unsigned long *scanned)
+{
+    xen_pfn_t gfns[SCAN_BATCH], cand_gfn[SCAN_BATCH], max_gfn, gfn;
+    uint64_t cand_hash[SCAN_BATCH];
+    int errs[SCAN_BATCH];
+    unsigned int i, n, nr_cand;
+
+    if ( xc_domain_maximum_gpfn(xch, d->domid, &max_gfn) )
+        return;
+
+    if ( dom_resize(d, max_gfn + 1) )
+    {
+        fprintf(stderr, "d%u: out of memory for %"PRI_xen_pfn" pages\n",
+                d->domid, max_gfn + 1);
+        return;
+    }
+
+    for ( gfn = 0; gfn <= max_gfn && !stop; gfn += n )
+    {
+        const uint8_t *map;
+
+        n = min_t(xen_pfn_t, SCAN_BATCH, max_gfn + 1 - gfn);
+        for ( i = 0; i < n; i++ )
+            gfns[i] = gfn + i;
+
+        map = xenforeignmemory_map(fmem, d->domid, PROT_READ, n, gfns, errs);
+        if ( !map )
+        {
+            if ( errno == ESRCH )
+                return;
+            continue;
+        }
+
+        for ( i = nr_cand = 0; i < n; i++ )
+        {
+            uint64_t hash, prev = d->hashes[gfn + i];
+
+            if ( errs[i] )
+            {
+                d->hashes[gfn + i] = 0;
+                continue;
+            }
+
+            hash = page_hash(map + i * XC_PAGE_SIZE);
+            d->hashes[gfn + i] = hash;
+            stats.scanned++;
+
+            if ( hash != prev )
+            {
+                bitmap_assign(d->shared, gfn + i, false);
+                stats.volatile_pages++;
+                continue;
+            }
+
+            if ( bitmap_test(d->shared, gfn + i) )
+                continue;
+
+            cand_gfn[nr_cand] = gfn + i;
+            cand_hash[nr_cand++] = hash;
+        }
+
+        /* Pages can't be nominated while mapped. */
+        xenforeignmemory_unmap(fmem, (void *)map, n);
+
+        for ( i = 0; i < nr_cand; i++ )
+            merge_page(d, cand_gfn[i], cand_hash[i]);
+
+        *scanned += n;
+        throttle(start, *scanned);
+    }
+}
+
+static void free_dom(struct dom *d)
+{
+    free(d->hashes);
+    free(d->shared);
+    free(d);
+}
+
+/* Pick up new domains, and forget about the ones which have gone away. */
+static void update_doms(void)
+{
+    static xc_domaininfo_t info[256];
+    struct dom *d, **pd;
+    unsigned long i;
+    uint32_t next = 1;
+    int nr, j;
+
+    for ( d = doms; d; d = d->next )
+        d->seen = !all_doms;
+
+    while ( all_doms &&
+            (nr = xc_domain_getinfolist(xch, next, ARRAY_SIZE(info),
+                                        info)) > 0 )
+    {
+        for ( j = 0; j < nr; j++ )
+        {
+            domid_t domid = info[j].domain;
+
+            next = domid + 1;
+
+            if ( !(info[j].flags & XEN_DOMINF_hvm_guest) ||
+                 (info[j].flags & XEN_DOMINF_dying) )
+                continue;
+
+            d = find_dom(domid);
+            if ( !d )
+            {
+                if ( xc_memshr_control(xch, domid, 1) )
+                    continue;
+
+                d = calloc(1, sizeof(*d));
+                if ( !d )
+                    continue;
+
+                d->domid = domid;
+                d->next = doms;
+                doms = d;
+            }
+
+            d->seen = true;
+        }
+    }
+
+    for ( pd = &doms; (d = *pd); )
+    {
+        if ( d->seen )
+        {
+            pd = &d->next;
+            continue;
+        }
+
+        /* Drop stable pages of the domain, they can't be shared with. */
+        for ( i = 0; i < stable.size; )
+            if ( stable.slots[i].domid == d->domid )
+                table_del(&stable, &stable.slots[i]);
+            else
+                i++;
+
+        *pd = d->next;
+        free_dom(d);
+    }
+}
+
+static void print_stats(void)
+{
+    printf("passes %lu scanned %lu volatile %lu merged %lu collisions %lu "
+           "failed %lu stable %lu shared-frames %ld freed-pages %ld\n",
+           stats.passes, stats.scanned, stats.volatile_pages, stats.merged,
+           stats.collisions, stats.failed, stable.nr,
+           xc_sharing_used_frames(xch), xc_sharing_freed_pages(xch));
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] {-a | <domid>...}\n"
+           "Merge identical pages of HVM guests using memory sharing.\n\n"
+           "  -a         scan all HVM guests\n"
+           "  -r <rate>  scan at most <rate> pages per second (default %lu,\n"
+           "             0 for no limit)\n"
+           "  -i <secs>  wait <secs> seconds between passes (default %u)\n"
+           "  -n <nr>    exit after <nr> passes\n"
+           "  -v         print statistics after every pass\n\n"
+           "Statistics are printed on SIGUSR1, and on exit.\n",
+           prog, scan_rate, interval);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = handle_signal };
+    unsigned long max_passes = 0;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "ar:i:n:vh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'a':
+            all_doms = true;
+            break;
+        case 'r':
+            scan_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            max_passes = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    if ( all_doms == (optind < argc) )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !xch || !fmem )
+    {
+        perror("Failed to open Xen interfaces");
+        goto out;
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        domid_t domid = strtoul(argv[optind], NULL, 0);
+        struct dom *d;
+
+        if ( find_dom(domid) )
+            continue;
+
+        if ( xc_memshr_control(xch, domid, 1) )
+        {
+            fprintf(stderr, "Failed to enable sharing for d%u: %s\n",
+                    domid, strerror(errno));
+            goto out;
+        }
+
+        d = calloc(1, sizeof(*d));
+        if ( !d )
+            goto out;
+
+        d->domid = domid;
+        d->next = doms;
+        doms = d;
+    }
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    while ( !stop )
+    {
+        uint64_t start = now_ns();
+        unsigned long scanned = 0;
+        unsigned int remaining;
+        struct dom *d;
+
+        update_doms();
+        table_clear(&unstable);
+
+        for ( d = doms; d && !stop; d = d->next )
+            scan_dom(d, start, &scanned);
+
+        stats.passes++;
+        if ( verbose || dump )
+        {
+            dump = 0;
+            print_stats();
+        }
+
+        if ( max_passes && stats.passes >= max_passes )
+            break;
+
+        for ( remaining = interval; remaining && !stop; )
+        {
+            remaining = sleep(remaining);
+            if ( dump )
+            {
+                dump = 0;
+                print_stats();
+            }
+        }
+    }
+
+    print_stats();
+    rc = 0;
+
+ out:
+    while ( doms )
+    {
+        struct dom *d = doms;
+
+        doms = d->next;
+        free_dom(d);
+    }
+    free(stable.slots);
+    free(unstable.slots);
+    if ( fmem )
+        xenforeignmemory_close(fmem);
+    if ( xch )
+        xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -96,6 +96,9 @@ int main(int argc, char *argv[])
         case LOCKPROF_TYPE_PERDOM:
             sprintf(name, "domain %d lock %s", data[j].idx, data[j].name);
             break;
+        case LOCKPROF_TYPE_RUNQ:
+            sprintf(name, "runqueue %d lock %s", data[j].idx, data[j].name);
+            break;
         default:
             sprintf(name, "unknown type(%d) %d lock %s", data[j].type,
                     data[j].idx, data[j].name);
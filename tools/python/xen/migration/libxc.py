@@ -59,6 +59,12 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_compressed_page_data       = 0x00000013
+REC_TYPE_postcopy_begin             = 0x00000014
+REC_TYPE_postcopy_pfns              = 0x00000015
+REC_TYPE_postcopy_transition        = 0x00000016
+REC_TYPE_postcopy_fault             = 0x00000017
+REC_TYPE_zero_pages                 = 0x00000018
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -80,6 +86,12 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_postcopy_begin             : "Postcopy begin",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_fault             : "Postcopy fault",
+    REC_TYPE_zero_pages                 : "Zero pages",
 }
 
 # page_data
@@ -113,6 +125,21 @@ X86_PV_VCPU_HDR_FORMAT    = "II"
 # x86_tsc_info
 X86_TSC_INFO_FORMAT       = "IIQII"
 
+# compressed_page_data, following the page_data header for each page
+COMPRESSED_PAGE_FORMAT       = "HHI"
+COMPRESSED_PAGE_RAW          = 0x0000
+COMPRESSED_PAGE_LZ4          = 0x0001
+COMPRESSED_PAGE_XBZRLE       = 0x0002
+
+compressed_page_encoding_to_str = {
+    COMPRESSED_PAGE_RAW    : "raw",
+    COMPRESSED_PAGE_LZ4    : "LZ4",
+    COMPRESSED_PAGE_XBZRLE : "XBZRLE",
+}
+
+# postcopy_begin
+POSTCOPY_BEGIN_FORMAT     = "Q"
+
 # hvm_params
 HVM_PARAMS_ENTRY_FORMAT   = "QQ"
 HVM_PARAMS_FORMAT         = "II"
@@ -218,7 +245,7 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_compressed_page_data):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together" %
@@ -252,8 +279,9 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
-        """ Page Data record """
+    def verify_page_data_header(self, content):
+        """ Header and pfns of a (Compressed) Page Data record.  Returns the
+        size of both, and the number of pages with data """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
         if len(content) <= minsz:
@@ -289,10 +317,54 @@ class VerifyLibxc(VerifyBase):
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
 
+        return minsz + pfnsz, nr_pages
+
+
+    def verify_record_page_data(self, content):
+        """ Page Data record """
+        hdrsz, nr_pages = self.verify_page_data_header(content)
+
         pagesz = nr_pages * 4096
-        if len(content) != minsz + pfnsz + pagesz:
-            raise RecordError("Expected %u + %u + %u, got %u" %
-                              (minsz, pfnsz, pagesz, len(content)))
+        if len(content) != hdrsz + pagesz:
+            raise RecordError("Expected %u + %u, got %u" %
+                              (hdrsz, pagesz, len(content)))
+
+
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        offset, nr_pages = self.verify_page_data_header(content)
+        encsz = calcsize(COMPRESSED_PAGE_FORMAT)
+
+        for idx in range(nr_pages):
+
+            if len(content) - offset < encsz:
+                raise RecordError("Compressed page %d truncated" % (idx, ))
+
+            encoding, res1, length = unpack(COMPRESSED_PAGE_FORMAT,
+                                            content[offset:offset + encsz])
+            offset += encsz
+
+            if encoding not in compressed_page_encoding_to_str:
+                raise RecordError("Unknown encoding 0x%04x for page %d" %
+                                  (encoding, idx))
+
+            if res1 != 0:
+                raise RecordError("Reserved bits set in page %d: 0x%04x" %
+                                  (idx, res1))
+
+            if encoding == COMPRESSED_PAGE_RAW and length != 4096:
+                raise RecordError("Raw page %d has length %u" %
+                                  (idx, length))
+
+            if length > 4096 or len(content) - offset < length:
+                raise RecordError("Invalid length %u for page %d" %
+                                  (length, idx))
+
+            offset += length
+
+        if offset != len(content):
+            raise RecordError("Expected %u bytes of page data, got %u" %
+                              (offset, len(content)))
 
 
     def verify_record_x86_pv_info(self, content):
@@ -477,6 +549,54 @@ class VerifyLibxc(VerifyBase):
                               (contentsz, sz))
 
 
+    def verify_record_postcopy_begin(self, content):
+        """ postcopy begin record """
+
+        sz = calcsize(POSTCOPY_BEGIN_FORMAT)
+
+        if len(content) != sz:
+            raise RecordError("Length should be %u bytes" % (sz, ))
+
+        ring_pfn, = unpack(POSTCOPY_BEGIN_FORMAT, content)
+        self.info("  Paging ring pfn 0x%x" % (ring_pfn, ))
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ postcopy pfns record """
+
+        if len(content) % 8 != 0:
+            raise RecordError("Length expected to be a multiple of 8, not %d" %
+                              (len(content), ))
+
+        self.info("  %d pfns" % (len(content) // 8, ))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_fault(self, content):
+        """ postcopy fault record """
+        raise RecordError("Found postcopy fault record in stream")
+
+
+    def verify_record_zero_pages(self, content):
+        """ zero pages record """
+
+        if len(content) == 0 or len(content) % 8 != 0:
+            raise RecordError("Length expected to be a non-zero multiple of 8,"
+                              " not %d" % (len(content), ))
+
+        for idx, pfn in enumerate(unpack("=%dQ" % (len(content) // 8),
+                                         content)):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid pfn 0x%x (index %d)" % (pfn, idx))
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -526,4 +646,19 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+
+    REC_TYPE_postcopy_begin:
+        VerifyLibxc.verify_record_postcopy_begin,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
+
+    REC_TYPE_zero_pages:
+        VerifyLibxc.verify_record_zero_pages,
     }
@@ -0,0 +1,492 @@
+/*
+ * Benchmark for the credit2 runqueue.
+ *
+ * A sequence of runqueue insertions and picks, either taken from a xentrace
+ * file containing TRC_CSCHED2_* records or generated randomly, is replayed
+ * against the sorted list credit2 used to use and against the red-black tree
+ * it uses now (built from xen/common/sched/credit2-runq.h).  The time taken
+ * by each operation, i.e. the time the runqueue lock would be held for it,
+ * is reported for both, as well as the time for one insertion plus one pick,
+ * i.e. for a unit going through the runqueue once.
+ *
+ * Picking from the tree is slower than from the list, as removing a node
+ * from the tree and finding the next one costs more than removing a list
+ * element.  Insertions into the list get slower with the runqueue length, so
+ * with the generated operations the tree only wins with more than about 128
+ * runnable units per runqueue, and is up to a quarter slower below that.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emul.h"
+
+#include <public/trace.h>
+
+/* As in xen/common/sched/credit2.c, part of the trace format. */
+#define TRC_CSCHED2_RUNQ_POS         TRC_SCHED_CLASS_EVT(CSCHED2, 2)
+#define TRC_CSCHED2_CREDIT_BURN      TRC_SCHED_CLASS_EVT(CSCHED2, 3)
+#define TRC_CSCHED2_CREDIT_RESET     TRC_SCHED_CLASS_EVT(CSCHED2, 7)
+#define TRC_CSCHED2_TICKLE_NEW       TRC_SCHED_CLASS_EVT(CSCHED2, 13)
+#define TRC_CSCHED2_RUNQ_CANDIDATE   TRC_SCHED_CLASS_EVT(CSCHED2, 20)
+
+#define CSCHED2_CREDIT_INIT  10500000 /* MILLISECS(10) + CSCHED2_MIN_TIMER */
+
+#define MAX_UNITS  4096
+#define HASH_SIZE  (2 * MAX_UNITS)
+
+struct unit {
+    struct list_head list_elem;
+    struct csched2_unit svc; /* svc.credit is the credit it's queued with. */
+    unsigned int key;
+    int cur_credit;          /* Last credit seen in the trace. */
+    bool queued;
+};
+
+enum op_type {
+    OP_INSERT,
+    OP_PICK,
+};
+
+struct op {
+    enum op_type type;
+    unsigned int unit;
+    int credit;
+};
+
+static struct unit units[MAX_UNITS];
+static unsigned int nr_units;
+
+static struct op *ops;
+static unsigned long nr_ops, max_ops;
+
+struct runq_ops {
+    const char *name;
+    void (*init)(void);
+    unsigned int (*insert)(struct unit *u);
+    unsigned int (*pick)(struct unit *u);
+};
+
+/* The old runqueue: a list sorted by decreasing credit. */
+static struct list_head runq_list;
+
+static void list_runq_init(void)
+{
+    INIT_LIST_HEAD(&runq_list);
+}
+
+static unsigned int list_runq_insert(struct unit *u)
+{
+    struct list_head *iter;
+    unsigned int steps = 0;
+
+    list_for_each ( iter, &runq_list )
+    {
+        struct unit *u2 = list_entry(iter, struct unit, list_elem);
+
+        if ( u->svc.credit > u2->svc.credit )
+            break;
+        steps++;
+    }
+
+    list_add_tail(&u->list_elem, iter);
+
+    return steps;
+}
+
+static unsigned int list_runq_pick(struct unit *u)
+{
+    struct list_head *iter;
+    unsigned int steps = 0;
+
+    /* Scan from the head, as runq_candidate() does. */
+    list_for_each ( iter, &runq_list )
+    {
+        if ( iter == &u->list_elem )
+            break;
+        steps++;
+    }
+
+    list_del(&u->list_elem);
+
+    return steps;
+}
+
+/* The new runqueue: the credit2 code itself. */
+static struct csched2_runqueue_data rqd;
+
+static void tree_runq_init(void)
+{
+    runq_init(&rqd);
+}
+
+static unsigned int tree_runq_insert(struct unit *u)
+{
+    runq_add(&rqd, &u->svc);
+
+    return 0;
+}
+
+static unsigned int tree_runq_pick(struct unit *u)
+{
+    const struct csched2_unit *svc;
+    unsigned int steps = 0;
+
+    /* Scan from the first unit, as runq_candidate() does. */
+    for ( svc = runq_first(&rqd); svc != &u->svc; svc = runq_next(svc) )
+        steps++;
+
+    runq_del(&rqd, &u->svc);
+
+    return steps;
+}
+
+static const struct runq_ops runqs[] = {
+    { "sorted list", list_runq_init, list_runq_insert, list_runq_pick },
+    { "rbtree",      tree_runq_init, tree_runq_insert, tree_runq_pick },
+};
+
+static void add_op(enum op_type type, unsigned int unit, int credit)
+{
+    if ( nr_ops == max_ops )
+    {
+        max_ops = max_ops ? 2 * max_ops : 65536;
+        ops = realloc(ops, max_ops * sizeof(*ops));
+        if ( !ops )
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    ops[nr_ops].type = type;
+    ops[nr_ops].unit = unit;
+    ops[nr_ops].credit = credit;
+    nr_ops++;
+}
+
+/*
+ * Build the operations from a trace.  There's nothing in the CSCHED2 records
+ * identifying the runqueue, so all of them are replayed on a single one,
+ * which is the worst case for the runqueue length.
+ */
+static unsigned int unit_hash[HASH_SIZE];
+
+static struct unit *find_unit(uint32_t key)
+{
+    unsigned int h = (key * 2654435761U) % HASH_SIZE;
+
+    for ( ; unit_hash[h]; h = (h + 1) % HASH_SIZE )
+        if ( units[unit_hash[h] - 1].key == key )
+            return &units[unit_hash[h] - 1];
+
+    if ( nr_units == MAX_UNITS )
+    {
+        fprintf(stderr, "Too many units in the trace\n");
+        exit(1);
+    }
+
+    units[nr_units].key = key;
+    unit_hash[h] = ++nr_units;
+
+    return &units[nr_units - 1];
+}
+
+static void read_trace(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    uint32_t hdr, data[9];
+    unsigned int i;
+
+    if ( !f )
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+
+    while ( fread(&hdr, sizeof(hdr), 1, f) == 1 )
+    {
+        unsigned int event = hdr & 0x0fffffff;
+        unsigned int extra = (hdr >> 28) & 7;
+        struct unit *u;
+        uint32_t tsc[2];
+
+        if ( (hdr & (1U << 31)) && fread(tsc, sizeof(tsc), 1, f) != 1 )
+            break;
+        if ( extra && fread(data, sizeof(*data), extra, f) != extra )
+            break;
+
+        switch ( event )
+        {
+        case TRC_CSCHED2_CREDIT_BURN:
+        case TRC_CSCHED2_CREDIT_RESET:
+        case TRC_CSCHED2_TICKLE_NEW:
+            if ( extra < 3 )
+                continue;
+            u = find_unit(data[0]);
+            /* The credit is the last field of TICKLE_NEW and CREDIT_RESET. */
+            u->cur_credit = event == TRC_CSCHED2_CREDIT_BURN ? data[1]
+                                                             : data[2];
+            break;
+
+        case TRC_CSCHED2_RUNQ_POS:
+            if ( extra < 2 )
+                continue;
+            u = find_unit(data[0]);
+            if ( !u->queued )
+            {
+                add_op(OP_INSERT, u - units, u->cur_credit);
+                u->queued = true;
+            }
+            break;
+
+        case TRC_CSCHED2_RUNQ_CANDIDATE:
+            if ( extra < 3 )
+                continue;
+            u = find_unit(data[0]);
+            u->cur_credit = data[2];
+            if ( u->queued )
+            {
+                add_op(OP_PICK, u - units, 0);
+                u->queued = false;
+            }
+            break;
+        }
+    }
+
+    fclose(f);
+
+    for ( i = 0; i < nr_units; i++ )
+        units[i].queued = false;
+
+    printf("Trace %s: %u units, %lu operations\n", name, nr_units, nr_ops);
+}
+
+/*
+ * Generate operations resembling a busy runqueue: the unit picked is usually
+ * the first one, sometimes one a few positions further down (as happens when
+ * the first ones can't run on the pCPU), and it is reinserted with less
+ * credit after having run.  Credits are reset when the one picked runs out.
+ */
+static void generate_ops(unsigned int nr, unsigned long count)
+{
+    unsigned int *runq = malloc(nr * sizeof(*runq));
+    unsigned int len = 0, i;
+
+    if ( !runq || nr > MAX_UNITS )
+    {
+        fprintf(stderr, "Cannot generate operations for %u units\n", nr);
+        exit(1);
+    }
+
+    nr_units = nr;
+    srandom(0);
+
+    /* Shadow runqueue, to know which unit is at which position. */
+    for ( i = 0; i < nr; i++ )
+    {
+        unsigned int j;
+
+        units[i].cur_credit = CSCHED2_CREDIT_INIT - random() % 1000000;
+        for ( j = len; j && units[runq[j - 1]].cur_credit < units[i].cur_credit;
+              j-- )
+            runq[j] = runq[j - 1];
+        runq[j] = i;
+        len++;
+        add_op(OP_INSERT, i, units[i].cur_credit);
+    }
+
+    while ( nr_ops < count )
+    {
+        unsigned int pos = random() % 8 ? 0 : random() % len;
+        unsigned int u = runq[pos], j;
+
+        add_op(OP_PICK, u, 0);
+        memmove(&runq[pos], &runq[pos + 1], (--len - pos) * sizeof(*runq));
+
+        units[u].cur_credit -= random() % 2000000;
+        if ( units[u].cur_credit <= 0 )
+            for ( i = 0; i < nr; i++ )
+                units[i].cur_credit = min(units[i].cur_credit +
+                                          CSCHED2_CREDIT_INIT,
+                                          CSCHED2_CREDIT_INIT);
+
+        for ( j = 0; j < len && units[runq[j]].cur_credit >= units[u].cur_credit;
+              j++ )
+            ;
+        memmove(&runq[j + 1], &runq[j], (len++ - j) * sizeof(*runq));
+        runq[j] = u;
+        add_op(OP_INSERT, u, units[u].cur_credit);
+    }
+
+    free(runq);
+
+    printf("Generated: %u units, %lu operations\n", nr_units, nr_ops);
+}
+
+struct op_stats {
+    unsigned long count;
+    unsigned long long total_ns, max_ns, steps;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replay(const struct runq_ops *runq, struct op_stats stats[2])
+{
+    unsigned long i;
+
+    for ( i = 0; i < nr_units; i++ )
+        units[i].queued = false;
+
+    memset(stats, 0, 2 * sizeof(*stats));
+    runq->init();
+
+    for ( i = 0; i < nr_ops; i++ )
+    {
+        const struct op *op = &ops[i];
+        struct unit *u = &units[op->unit];
+        struct op_stats *s = &stats[op->type];
+        unsigned long long start, t;
+
+        start = now_ns();
+
+        if ( op->type == OP_INSERT )
+        {
+            ASSERT(!u->queued);
+            u->svc.credit = op->credit;
+            s->steps += runq->insert(u);
+        }
+        else
+        {
+            ASSERT(u->queued);
+            s->steps += runq->pick(u);
+        }
+
+        t = now_ns() - start;
+
+        u->queued = op->type == OP_INSERT;
+        s->count++;
+        s->total_ns += t;
+        if ( t > s->max_ns )
+            s->max_ns = t;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-t trace] [-n units] [-o operations]\n"
+            "  -t  replay the TRC_CSCHED2_* records of a xentrace file\n"
+            "  -n  number of units for generated operations (default 256)\n"
+            "  -o  number of generated operations (default 1000000)\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const op_names[] = { "insert", "pick" };
+    const char *trace = NULL;
+    unsigned int nr = 256, i, j;
+    unsigned long count = 1000000;
+    struct op_stats stats[ARRAY_SIZE(runqs)][2];
+    int c;
+
+    while ( (c = getopt(argc, argv, "t:n:o:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 't':
+            trace = optarg;
+            break;
+        case 'n':
+            nr = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( trace )
+        read_trace(trace);
+    else if ( nr )
+        generate_ops(nr, count);
+
+    if ( !nr_ops )
+    {
+        fprintf(stderr, "No runqueue operations to replay\n");
+        return 1;
+    }
+
+    printf("%-12s %-7s %10s %10s %10s %12s\n",
+           "runqueue", "op", "count", "mean ns", "max ns", "scan steps");
+
+    for ( i = 0; i < ARRAY_SIZE(runqs); i++ )
+    {
+        unsigned long long mean[2];
+
+        replay(&runqs[i], stats[i]);
+
+        for ( j = 0; j < 2; j++ )
+        {
+            mean[j] = stats[i][j].count
+                      ? stats[i][j].total_ns / stats[i][j].count : 0;
+            printf("%-12s %-7s %10lu %10llu %10llu %12llu\n",
+                   runqs[i].name, op_names[j], stats[i][j].count,
+                   mean[j], stats[i][j].max_ns, stats[i][j].steps);
+        }
+
+        /* A unit going through the runqueue once. */
+        printf("%-12s %-7s %10s %10llu\n", runqs[i].name, "both", "",
+               mean[OP_INSERT] + mean[OP_PICK]);
+    }
+
+    /*
+     * Both runqueues must have picked the units at the same positions,
+     * otherwise the ordering isn't the same.
+     */
+    for ( i = 1; i < ARRAY_SIZE(runqs); i++ )
+        if ( stats[i][OP_PICK].steps != stats[0][OP_PICK].steps )
+        {
+            fprintf(stderr, "%s and %s runqueues are ordered differently\n",
+                    runqs[0].name, runqs[i].name);
+            return 1;
+        }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
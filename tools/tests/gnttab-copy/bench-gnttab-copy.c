@@ -0,0 +1,286 @@
+/*
+ * Compare the cost of copying between granted pages with GNTTABOP_copy
+ * (one operation per segment) and with GNTTABOP_copy_segs (up to
+ * GNTTAB_COPY_SEGS_MAX segments per operation), for a range of segment
+ * sizes.
+ *
+ * The pages copied between are granted by the calling domain to itself,
+ * so this has to be run in dom0 (or with -d giving the caller's domid).
+ * Every run copies all source pages to the destination pages, split into
+ * segments of the given size.  By default the segments of a page are
+ * issued in order, which allows Xen to merge them for GNTTABOP_copy_segs;
+ * with -r they are issued in reverse order, so only the saving from
+ * acquiring grants once per operation remains.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xencall.h>
+#include <xengnttab.h>
+
+#include <xen/xen.h>
+#include <xen/grant_table.h>
+
+#define PAGE_SIZE 4096
+
+static xencall_handle *xcall;
+static unsigned int nr_pages = 64;
+static uint32_t *src_refs, *dest_refs;
+static bool reverse;
+
+static unsigned int seg_index(unsigned int i, unsigned int per_page)
+{
+    unsigned int page = i / per_page, seg = i % per_page;
+
+    return page * per_page + (reverse ? per_page - 1 - seg : seg);
+}
+
+static gnttab_copy_t *setup_copy(unsigned int seg_size, unsigned int nr)
+{
+    unsigned int per_page = PAGE_SIZE / seg_size, i;
+    gnttab_copy_t *ops = xencall_alloc_buffer(xcall, nr * sizeof(*ops));
+
+    if ( !ops )
+        err(1, "xencall_alloc_buffer");
+
+    for ( i = 0; i < nr; i++ )
+    {
+        unsigned int n = seg_index(i, per_page);
+        unsigned int offs = (n % per_page) * seg_size;
+
+        memset(&ops[i], 0, sizeof(ops[i]));
+        ops[i].source.u.ref = src_refs[n / per_page];
+        ops[i].source.domid = DOMID_SELF;
+        ops[i].source.offset = offs;
+        ops[i].dest.u.ref = dest_refs[n / per_page];
+        ops[i].dest.domid = DOMID_SELF;
+        ops[i].dest.offset = offs;
+        ops[i].len = seg_size;
+        ops[i].flags = GNTCOPY_source_gref | GNTCOPY_dest_gref;
+    }
+
+    return ops;
+}
+
+static gnttab_copy_segs_t *setup_copy_segs(unsigned int seg_size,
+                                           unsigned int nr,
+                                           gnttab_copy_seg_t **psegs,
+                                           unsigned int *nr_ops)
+{
+    unsigned int per_page = PAGE_SIZE / seg_size, i;
+    unsigned int nr_descs = (nr + GNTTAB_COPY_SEGS_MAX - 1) /
+                            GNTTAB_COPY_SEGS_MAX;
+    gnttab_copy_seg_t *segs = xencall_alloc_buffer(xcall,
+                                                   nr * sizeof(*segs));
+    gnttab_copy_segs_t *ops = xencall_alloc_buffer(xcall,
+                                                   nr_descs * sizeof(*ops));
+
+    if ( !segs || !ops )
+        err(1, "xencall_alloc_buffer");
+
+    for ( i = 0; i < nr; i++ )
+    {
+        unsigned int n = seg_index(i, per_page);
+        unsigned int offs = (n % per_page) * seg_size;
+
+        memset(&segs[i], 0, sizeof(segs[i]));
+        segs[i].source = src_refs[n / per_page];
+        segs[i].dest = dest_refs[n / per_page];
+        segs[i].source_offset = offs;
+        segs[i].dest_offset = offs;
+        segs[i].len = seg_size;
+    }
+
+    for ( i = 0; i < nr_descs; i++ )
+    {
+        memset(&ops[i], 0, sizeof(ops[i]));
+        ops[i].source_domid = DOMID_SELF;
+        ops[i].dest_domid = DOMID_SELF;
+        ops[i].flags = GNTCOPY_source_gref | GNTCOPY_dest_gref;
+        ops[i].nr_segs = (i + 1 < nr_descs) ? GNTTAB_COPY_SEGS_MAX
+                         : nr - i * GNTTAB_COPY_SEGS_MAX;
+        set_xen_guest_handle(ops[i].segs, &segs[i * GNTTAB_COPY_SEGS_MAX]);
+    }
+
+    *psegs = segs;
+    *nr_ops = nr_descs;
+
+    return ops;
+}
+
+static void grant_table_op(unsigned int cmd, void *ops, unsigned int nr)
+{
+    if ( xencall3(xcall, __HYPERVISOR_grant_table_op,
+                  cmd, (unsigned long)ops, nr) )
+        err(1, "grant table op %u", cmd);
+}
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Returns the time per run, in seconds. */
+static double run_copy(unsigned int seg_size, unsigned int iters)
+{
+    unsigned int nr = nr_pages * (PAGE_SIZE / seg_size), i;
+    gnttab_copy_t *ops = setup_copy(seg_size, nr);
+    struct timespec t0, t1;
+
+    grant_table_op(GNTTABOP_copy, ops, nr);
+    for ( i = 0; i < nr; i++ )
+        if ( ops[i].status != GNTST_okay )
+            errx(1, "GNTTABOP_copy segment %u: status %d", i, ops[i].status);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0; i < iters; i++ )
+        grant_table_op(GNTTABOP_copy, ops, nr);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    xencall_free_buffer(xcall, ops);
+
+    return elapsed(&t0, &t1) / iters;
+}
+
+static double run_copy_segs(unsigned int seg_size, unsigned int iters)
+{
+    unsigned int nr = nr_pages * (PAGE_SIZE / seg_size), nr_ops, i;
+    gnttab_copy_seg_t *segs;
+    gnttab_copy_segs_t *ops = setup_copy_segs(seg_size, nr, &segs, &nr_ops);
+    struct timespec t0, t1;
+
+    grant_table_op(GNTTABOP_copy_segs, ops, nr_ops);
+    for ( i = 0; i < nr_ops; i++ )
+        if ( ops[i].status != GNTST_okay )
+            errx(1, "GNTTABOP_copy_segs operation %u: status %d",
+                 i, ops[i].status);
+    for ( i = 0; i < nr; i++ )
+        if ( segs[i].status != GNTST_okay )
+            errx(1, "GNTTABOP_copy_segs segment %u: status %d",
+                 i, segs[i].status);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0; i < iters; i++ )
+        grant_table_op(GNTTABOP_copy_segs, ops, nr_ops);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    xencall_free_buffer(xcall, ops);
+    xencall_free_buffer(xcall, segs);
+
+    return elapsed(&t0, &t1) / iters;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r] [-d domid] [-p pages] [-i iterations]\n"
+            "  -r  issue the segments of each page in reverse order\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = { 64, 256, 512, 1024, 2048, 4096 };
+    unsigned int iters = 1000, domid = 0, i;
+    xengntshr_handle *xgs;
+    unsigned char *src, *dest;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "rd:p:i:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            reverse = true;
+            break;
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            iters = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( !nr_pages || !iters )
+        usage(argv[0]);
+
+    xcall = xencall_open(NULL, 0);
+    if ( !xcall )
+        err(1, "xencall_open");
+
+    xgs = xengntshr_open(NULL, 0);
+    if ( !xgs )
+        err(1, "xengntshr_open");
+
+    src_refs = calloc(nr_pages, sizeof(*src_refs));
+    dest_refs = calloc(nr_pages, sizeof(*dest_refs));
+    if ( !src_refs || !dest_refs )
+        err(1, "calloc");
+
+    src = xengntshr_share_pages(xgs, domid, nr_pages, src_refs, 0);
+    dest = xengntshr_share_pages(xgs, domid, nr_pages, dest_refs, 1);
+    if ( !src || !dest )
+        err(1, "xengntshr_share_pages");
+
+    for ( i = 0; i < nr_pages * PAGE_SIZE; i++ )
+        src[i] = i * 7 + i / PAGE_SIZE;
+
+    printf("Copying %u pages, %s segment order, %u runs each\n",
+           nr_pages, reverse ? "reverse" : "forward", iters);
+    printf("%8s %10s %12s %12s %12s %8s\n", "seg size", "segments",
+           "copy MB/s", "segs MB/s", "segs ns/seg", "speedup");
+
+    for ( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ )
+    {
+        unsigned int nr = nr_pages * (PAGE_SIZE / sizes[i]);
+        double bytes = (double)nr_pages * PAGE_SIZE;
+        double t_copy, t_segs;
+
+        memset(dest, 0, nr_pages * PAGE_SIZE);
+        t_copy = run_copy(sizes[i], iters);
+        if ( memcmp(src, dest, nr_pages * PAGE_SIZE) )
+            errx(1, "GNTTABOP_copy: data mismatch");
+
+        memset(dest, 0, nr_pages * PAGE_SIZE);
+        t_segs = run_copy_segs(sizes[i], iters);
+        if ( memcmp(src, dest, nr_pages * PAGE_SIZE) )
+            errx(1, "GNTTABOP_copy_segs: data mismatch");
+
+        printf("%8u %10u %12.1f %12.1f %12.1f %8.2f\n",
+               sizes[i], nr, bytes / t_copy / 1e6, bytes / t_segs / 1e6,
+               t_segs * 1e9 / nr, t_copy / t_segs);
+    }
+
+    xengntshr_unshare(xgs, dest, nr_pages);
+    xengntshr_unshare(xgs, src, nr_pages);
+    free(dest_refs);
+    free(src_refs);
+    xengntshr_close(xgs);
+    xencall_close(xcall);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,85 @@
+/*
+ * Userspace environment for the batched ioreq ring tests.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_IOREQ_BATCH_
+#define _TEST_IOREQ_BATCH_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE 4096
+
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb()  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#include "ioreq.h"
+
+#define IOREQ_STATUS_HANDLED     0
+#define IOREQ_STATUS_UNHANDLED   1
+
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock(l) pthread_mutex_lock(l)
+#define spin_unlock(l) pthread_mutex_unlock(l)
+
+typedef unsigned int evtchn_port_t;
+
+/* The emulator's end of the event channel. */
+struct domain {
+    sem_t evtchn;
+    unsigned int notifications;
+};
+
+struct vcpu {
+    struct domain *domain;
+};
+
+extern struct vcpu *current;
+
+void notify_via_xen_event_channel(struct domain *d, evtchn_port_t port);
+
+struct ioreq_page {
+    void *va;
+};
+
+struct ioreq_server {
+    spinlock_t bufioreq_lock;
+    evtchn_port_t bufioreq_evtchn;
+    struct ioreq_page batchioreq;
+};
+
+bool ioreq_can_post(const ioreq_t *p);
+int ioreq_send_batched(struct ioreq_server *s, const ioreq_t *p);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
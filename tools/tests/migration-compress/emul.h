@@ -0,0 +1,82 @@
+/*
+ * Userspace environment for the migration stream page encoding tests.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_MIGRATION_COMPRESS_
+#define _TEST_MIGRATION_COMPRESS_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE 4096
+
+#define min(x, y) ({                    \
+        const typeof(x) tx = (x);       \
+        const typeof(y) ty = (y);       \
+                                        \
+        (void) (&tx == &ty);            \
+        tx < ty ? tx : ty;              \
+})
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* As for libxenguest, see xg_dom_decompress_lz4.c. */
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+
+static inline uint_fast16_t le16_to_cpup(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+#include "../../../xen/include/xen/lz4.h"
+
+#include "xg_sr_stream_format.h"
+
+typedef struct {
+    unsigned int errors;
+} xc_interface;
+
+struct xc_sr_context {
+    xc_interface *xch;
+};
+
+/* Errors are expected for invalid records only, so just count them. */
+#define ERROR(msg, args...) (xch->errors++)
+
+size_t encode_page(const void *page, const void *prev,
+                   struct xc_sr_rec_compressed_page *cpage);
+size_t decode_page(struct xc_sr_context *ctx, const void *data, size_t len,
+                   const void *prev, void *page);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,284 @@
+/*
+ * Unit tests for the page encodings of COMPRESSED_PAGE_DATA records.
+ *
+ * Pages of different kinds are encoded stand-alone (LZ4 or raw) and as the
+ * difference to a previous version of the page (XBZRLE), and are checked to
+ * decode to the original contents again.  Invalid records must be rejected.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include "emul.h"
+
+#define EXPECT(cond, fmt, ...) do {                                     \
+    if ( !(cond) )                                                      \
+    {                                                                   \
+        fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__,         \
+                ##__VA_ARGS__);                                         \
+        abort();                                                        \
+    }                                                                   \
+} while ( 0 )
+
+static xc_interface xch;
+static struct xc_sr_context ctx = { .xch = &xch };
+
+static union {
+    struct xc_sr_rec_compressed_page cpage;
+    uint8_t buf[sizeof(struct xc_sr_rec_compressed_page) + PAGE_SIZE];
+} rec;
+
+static uint8_t page[PAGE_SIZE], prev[PAGE_SIZE], out[PAGE_SIZE];
+
+static void fill_random(uint8_t *p, size_t len)
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+        p[i] = random();
+}
+
+/*
+ * Encode page (against prev if with_prev is set), decode it again and check
+ * the result.  Returns the encoding used.
+ */
+static unsigned int round_trip(const char *what, bool with_prev)
+{
+    const void *base = with_prev ? prev : NULL;
+    size_t len, used;
+
+    len = encode_page(page, base, &rec.cpage);
+    EXPECT(len == sizeof(rec.cpage) + rec.cpage.length,
+           "%s: length %zu for data length %u", what, len, rec.cpage.length);
+    EXPECT(rec.cpage.length <= PAGE_SIZE, "%s: data length %u",
+           what, rec.cpage.length);
+
+    /* The receiving side has the previous contents in the page already. */
+    if ( with_prev )
+        memcpy(out, prev, PAGE_SIZE);
+    else
+        memset(out, 0xa5, PAGE_SIZE);
+
+    used = decode_page(&ctx, rec.buf, len, base, out);
+    EXPECT(used == len, "%s: decoded %zu of %zu bytes", what, used, len);
+    EXPECT(!memcmp(page, out, PAGE_SIZE), "%s: contents differ (encoding %u)",
+           what, rec.cpage.encoding);
+
+    /* Trailing data of the record must not be consumed. */
+    used = decode_page(&ctx, rec.buf, len + 1, base, out);
+    EXPECT(used == len, "%s: decoded %zu of %zu bytes with trailing data",
+           what, used, len);
+
+    return rec.cpage.encoding;
+}
+
+static void check_expected(const char *what, bool with_prev,
+                           unsigned int encoding)
+{
+    unsigned int enc = round_trip(what, with_prev);
+
+    EXPECT(enc == encoding, "%s: encoding %u instead of %u",
+           what, enc, encoding);
+}
+
+static void check_pages(void)
+{
+    unsigned int i;
+
+    memset(page, 0, PAGE_SIZE);
+    check_expected("zero page", false, COMPRESSED_PAGE_LZ4);
+    EXPECT(rec.cpage.length < 64, "zero page: LZ4 length %u",
+           rec.cpage.length);
+
+    for ( i = 0; i < PAGE_SIZE; i++ )
+        page[i] = i % 13;
+    check_expected("pattern page", false, COMPRESSED_PAGE_LZ4);
+
+    /* Text-like contents with repetitions at varying distances. */
+    for ( i = 0; i < PAGE_SIZE; i++ )
+        page[i] = "abcdefgh xen page "[(i * 7 + i / 64) % 18];
+    check_expected("text page", false, COMPRESSED_PAGE_LZ4);
+
+    /* Long literal runs, followed by long matches. */
+    fill_random(page, PAGE_SIZE / 2);
+    memcpy(page + PAGE_SIZE / 2, page, PAGE_SIZE / 2);
+    check_expected("half random page", false, COMPRESSED_PAGE_LZ4);
+
+    fill_random(page, PAGE_SIZE);
+    check_expected("random page", false, COMPRESSED_PAGE_RAW);
+
+    /* A match running up to the end of the page. */
+    memset(page, 0x11, PAGE_SIZE);
+    fill_random(page, 16);
+    check_expected("match at end", false, COMPRESSED_PAGE_LZ4);
+}
+
+static void check_deltas(void)
+{
+    unsigned int i;
+
+    fill_random(prev, PAGE_SIZE);
+
+    memcpy(page, prev, PAGE_SIZE);
+    check_expected("unchanged page", true, COMPRESSED_PAGE_XBZRLE);
+    EXPECT(rec.cpage.length && rec.cpage.length < 4,
+           "unchanged page: XBZRLE length %u", rec.cpage.length);
+
+    page[0] ^= 1;
+    page[PAGE_SIZE - 1] ^= 1;
+    check_expected("first and last byte", true, COMPRESSED_PAGE_XBZRLE);
+
+    /* Isolated unchanged bytes within a changed run. */
+    memcpy(page, prev, PAGE_SIZE);
+    for ( i = 100; i < 200; i++ )
+        if ( i % 2 )
+            page[i] ^= 0xff;
+    check_expected("alternating bytes", true, COMPRESSED_PAGE_XBZRLE);
+
+    /* Runs of more than 127 bytes need multi-byte lengths. */
+    memcpy(page, prev, PAGE_SIZE);
+    for ( i = 1000; i < 1300; i++ )
+        page[i] ^= 0x80;
+    check_expected("long run", true, COMPRESSED_PAGE_XBZRLE);
+
+    /* Too many changes: use LZ4 or raw data instead. */
+    fill_random(page, PAGE_SIZE);
+    check_expected("changed page", true, COMPRESSED_PAGE_RAW);
+    memset(page, 0, PAGE_SIZE);
+    check_expected("cleared page", true, COMPRESSED_PAGE_LZ4);
+}
+
+static void fuzz(unsigned int iterations)
+{
+    unsigned int i, n, j, off, len;
+    char what[32];
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        snprintf(what, sizeof(what), "iteration %u", i);
+
+        if ( random() % 2 )
+            fill_random(prev, PAGE_SIZE);
+        else
+            for ( j = 0; j < PAGE_SIZE; j++ )
+                prev[j] = (random() % 8) ? 0 : random();
+
+        /* Modify a random number of runs of random length. */
+        memcpy(page, prev, PAGE_SIZE);
+        for ( n = random() % 64; n; n-- )
+        {
+            off = random() % PAGE_SIZE;
+            len = min(1 + (unsigned int)(random() % 256), PAGE_SIZE - off);
+            if ( random() % 2 )
+                memset(page + off, random(), len);
+            else
+                fill_random(page + off, len);
+        }
+
+        round_trip(what, false);
+        round_trip(what, true);
+    }
+}
+
+static void check_invalid(void)
+{
+    size_t len;
+
+    memset(page, 0, PAGE_SIZE);
+    len = encode_page(page, NULL, &rec.cpage);
+
+    EXPECT(!decode_page(&ctx, rec.buf, sizeof(rec.cpage) - 1, NULL, out),
+           "truncated header accepted");
+    EXPECT(!decode_page(&ctx, rec.buf, len - 1, NULL, out),
+           "truncated data accepted");
+
+    rec.cpage.length--;
+    EXPECT(!decode_page(&ctx, rec.buf, len, NULL, out),
+           "short LZ4 data accepted");
+
+    len = encode_page(page, page, &rec.cpage);
+    EXPECT(rec.cpage.encoding == COMPRESSED_PAGE_XBZRLE, "no XBZRLE encoding");
+    EXPECT(!decode_page(&ctx, rec.buf, len, NULL, out),
+           "XBZRLE without previous contents accepted");
+
+    /* A run going beyond the end of the page. */
+    rec.cpage.length = 3;
+    rec.cpage.data[0] = 0x81;
+    rec.cpage.data[1] = 0x40;
+    rec.cpage.data[2] = 0x01;
+    EXPECT(!decode_page(&ctx, rec.buf, sizeof(rec.cpage) + 3, prev, out),
+           "XBZRLE run beyond the page accepted");
+
+    rec.cpage.encoding = COMPRESSED_PAGE_RAW;
+    rec.cpage.length = PAGE_SIZE - 1;
+    EXPECT(!decode_page(&ctx, rec.buf, sizeof(rec.buf), NULL, out),
+           "short raw page accepted");
+
+    rec.cpage.encoding = 0xffff;
+    EXPECT(!decode_page(&ctx, rec.buf, sizeof(rec.buf), NULL, out),
+           "unknown encoding accepted");
+
+    EXPECT(xch.errors == 7, "%u errors reported instead of 7", xch.errors);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i <iterations>] [-s <seed>]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int iterations = 10000, seed = 1;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "i:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    printf("Testing page encodings with %u iterations, seed %u\n",
+           iterations, seed);
+
+    srandom(seed);
+
+    check_pages();
+    check_deltas();
+    fuzz(iterations);
+    EXPECT(!xch.errors, "%u errors reported", xch.errors);
+
+    check_invalid();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
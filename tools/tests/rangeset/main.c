@@ -0,0 +1,399 @@
+/*
+ * Unit tests for the rangeset code.
+ *
+ * The rangeset operations are checked against a trivial reference
+ * implementation, using random operations on ranges both at the low and at
+ * the high end of the number space.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "emul.h"
+
+#define NR_VALUES   256
+#define MAX_RANGES  (2 * NR_VALUES)
+
+/* Reference: sorted array of disjoint, non-adjacent ranges. */
+struct ref_range {
+    unsigned long s, e;
+};
+
+static struct ref_range ref[MAX_RANGES];
+static unsigned int nr_ref;
+
+static struct ref_range out[MAX_RANGES];
+static unsigned int nr_out;
+
+#define EXPECT(cond, fmt, ...) do {                                     \
+    if ( !(cond) )                                                      \
+    {                                                                   \
+        fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__,         \
+                ##__VA_ARGS__);                                         \
+        abort();                                                        \
+    }                                                                   \
+} while ( 0 )
+
+static void ref_add(unsigned long s, unsigned long e)
+{
+    struct ref_range new[MAX_RANGES];
+    unsigned int i, n = 0;
+    bool done = false;
+
+    for ( i = 0; i < nr_ref; i++ )
+    {
+        /* Merge overlapping and adjacent ranges into [s,e]. */
+        if ( (ref[i].e == ~0UL || ref[i].e + 1 >= s) &&
+             (e == ~0UL || e + 1 >= ref[i].s) )
+        {
+            s = min(s, ref[i].s);
+            e = max(e, ref[i].e);
+            continue;
+        }
+        if ( !done && ref[i].s > e )
+        {
+            new[n++] = (struct ref_range){ s, e };
+            done = true;
+        }
+        new[n++] = ref[i];
+    }
+    if ( !done )
+        new[n++] = (struct ref_range){ s, e };
+
+    assert(n <= MAX_RANGES);
+    memcpy(ref, new, n * sizeof(*ref));
+    nr_ref = n;
+}
+
+static void ref_remove(unsigned long s, unsigned long e)
+{
+    struct ref_range new[MAX_RANGES + 1];
+    unsigned int i, n = 0;
+
+    for ( i = 0; i < nr_ref; i++ )
+    {
+        if ( ref[i].e < s || ref[i].s > e )
+        {
+            new[n++] = ref[i];
+            continue;
+        }
+        if ( ref[i].s < s )
+            new[n++] = (struct ref_range){ ref[i].s, s - 1 };
+        if ( ref[i].e > e )
+            new[n++] = (struct ref_range){ e + 1, ref[i].e };
+    }
+
+    assert(n <= MAX_RANGES);
+    memcpy(ref, new, n * sizeof(*ref));
+    nr_ref = n;
+}
+
+static bool ref_contains(unsigned long s, unsigned long e)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_ref; i++ )
+        if ( ref[i].s <= s && e <= ref[i].e )
+            return true;
+
+    return false;
+}
+
+static bool ref_overlaps(unsigned long s, unsigned long e)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_ref; i++ )
+        if ( ref[i].s <= e && s <= ref[i].e )
+            return true;
+
+    return false;
+}
+
+static int ref_claim(unsigned long size, unsigned long *s)
+{
+    unsigned long start = 0;
+    unsigned int i;
+
+    for ( i = 0; i < nr_ref; i++ )
+    {
+        if ( ref[i].s - start >= size )
+            goto found;
+        if ( ref[i].e == ~0UL )
+            return -ENOSPC;
+        start = ref[i].e + 1;
+    }
+    if ( (~0UL - start) + 1 < size )
+        return -ENOSPC;
+
+ found:
+    ref_add(start, start + size - 1);
+    *s = start;
+
+    return 0;
+}
+
+/* Collect the reported ranges, merging adjacent ones. */
+static int cf_check collect(unsigned long s, unsigned long e, void *data)
+{
+    EXPECT(s <= e, "reported range %lx-%lx", s, e);
+    if ( nr_out )
+    {
+        EXPECT(out[nr_out - 1].e < s, "range %lx-%lx not after %lx-%lx",
+               s, e, out[nr_out - 1].s, out[nr_out - 1].e);
+        if ( out[nr_out - 1].e + 1 == s )
+        {
+            out[nr_out - 1].e = e;
+            return 0;
+        }
+    }
+    EXPECT(nr_out < MAX_RANGES, "too many ranges");
+    out[nr_out++] = (struct ref_range){ s, e };
+
+    return 0;
+}
+
+static void check_all(struct rangeset *r)
+{
+    unsigned int i;
+
+    nr_out = 0;
+    EXPECT(!rangeset_report_ranges(r, 0, ~0UL, collect, NULL),
+           "report failed");
+    EXPECT(nr_out == nr_ref, "%u ranges instead of %u", nr_out, nr_ref);
+    for ( i = 0; i < nr_ref; i++ )
+        EXPECT(out[i].s == ref[i].s && out[i].e == ref[i].e,
+               "range %u: %lx-%lx instead of %lx-%lx", i,
+               out[i].s, out[i].e, ref[i].s, ref[i].e);
+    EXPECT(rangeset_is_empty(r) == !nr_ref, "wrong emptiness");
+}
+
+/* Check reporting a sub-range against the reference. */
+static void check_report(struct rangeset *r, unsigned long s, unsigned long e)
+{
+    unsigned int i, n = 0;
+
+    nr_out = 0;
+    EXPECT(!rangeset_report_ranges(r, s, e, collect, NULL), "report failed");
+    for ( i = 0; i < nr_ref; i++ )
+    {
+        if ( ref[i].e < s || ref[i].s > e )
+            continue;
+        EXPECT(n < nr_out && out[n].s == max(ref[i].s, s) &&
+               out[n].e == min(ref[i].e, e),
+               "report %lx-%lx: wrong range %u", s, e, n);
+        n++;
+    }
+    EXPECT(n == nr_out, "report %lx-%lx: %u ranges instead of %u",
+           s, e, nr_out, n);
+}
+
+/* Values at the low end and at the high end of the number space. */
+static unsigned long rnd_value(void)
+{
+    unsigned long v = random() % NR_VALUES;
+
+    return (v < NR_VALUES / 2) ? v : ~0UL - (v - NR_VALUES / 2);
+}
+
+static void rnd_range(unsigned long *s, unsigned long *e)
+{
+    unsigned long a = rnd_value(), b;
+
+    /* Mostly small ranges, sometimes spanning both ends. */
+    b = (random() % 8) ? a + random() % 8 : rnd_value();
+    if ( b < a )
+    {
+        *s = b;
+        *e = a;
+    }
+    else
+    {
+        *s = a;
+        *e = b;
+    }
+}
+
+static void fuzz(struct rangeset *r, unsigned int iterations)
+{
+    unsigned long s, e, rs, ss, size;
+    unsigned int i;
+    int rc, ref_rc;
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        rnd_range(&s, &e);
+
+        switch ( random() % 8 )
+        {
+        case 0: case 1: case 2:
+            EXPECT(!rangeset_add_range(r, s, e), "add %lx-%lx", s, e);
+            ref_add(s, e);
+            break;
+
+        case 3: case 4:
+            EXPECT(!rangeset_remove_range(r, s, e), "remove %lx-%lx", s, e);
+            ref_remove(s, e);
+            break;
+
+        case 5:
+            EXPECT(rangeset_contains_range(r, s, e) == ref_contains(s, e),
+                   "contains %lx-%lx", s, e);
+            EXPECT(rangeset_overlaps_range(r, s, e) == ref_overlaps(s, e),
+                   "overlaps %lx-%lx", s, e);
+            break;
+
+        case 6:
+            size = 1 + random() % 4;
+            rs = ss = 0;
+            rc = rangeset_claim_range(r, size, &rs);
+            ref_rc = ref_claim(size, &ss);
+            EXPECT(rc == ref_rc && rs == ss, "claim %lu: %d/%lx instead of %d/%lx",
+                   size, rc, rs, ref_rc, ss);
+            break;
+
+        case 7:
+            check_report(r, s, e);
+            break;
+        }
+
+        check_all(r);
+    }
+}
+
+static int cf_check consume(unsigned long s, unsigned long e, void *data,
+                            unsigned long *c)
+{
+    unsigned long *left = data;
+
+    /* Consume ranges partially in order to test restarting. */
+    *c = min(e - s, *left - 1) + 1;
+    *left -= *c;
+
+    return *left ? 0 : -ERESTART;
+}
+
+/* Operations not covered by fuzz(), done on the current state. */
+static void check_misc(struct rangeset *r)
+{
+    struct rangeset *r2 = rangeset_new(NULL, "test2", 0);
+    unsigned long budget, left, todo, n;
+    unsigned int i;
+    int rc;
+
+    EXPECT(r2, "rangeset_new failed");
+
+    /* Merging into an empty rangeset copies it. */
+    EXPECT(!rangeset_merge(r2, r), "merge failed");
+    check_all(r2);
+
+    /* Swap with an empty set and back. */
+    rangeset_destroy(r2);
+    r2 = rangeset_new(NULL, "test2", 0);
+    EXPECT(r2, "rangeset_new failed");
+    rangeset_swap(r, r2);
+    EXPECT(rangeset_is_empty(r), "swapped set not empty");
+    check_all(r2);
+    rangeset_swap(r, r2);
+    check_all(r);
+
+    /* Consume everything, a few numbers or big chunks at a time. */
+    do {
+        budget = (random() % 2) ? 3 : ~0UL / 4;
+        left = budget;
+        rc = rangeset_consume_ranges(r, consume, &left);
+        EXPECT(!rc || rc == -ERESTART, "consume failed: %d", rc);
+        for ( todo = budget - left; todo; todo -= n )
+        {
+            n = min(ref[0].e - ref[0].s, todo - 1) + 1;
+            ref_remove(ref[0].s, ref[0].s + n - 1);
+        }
+        check_all(r);
+    } while ( rc );
+
+    /* A limit makes allocations fail, without modifying the set. */
+    rangeset_limit(r2, 2);
+    for ( i = 0; i < 4; i++ )
+    {
+        rc = rangeset_add_singleton(r2, i * 2);
+        EXPECT(rc == (i < 2 ? 0 : -ENOMEM), "add %u to limited set: %d",
+               i * 2, rc);
+    }
+    EXPECT(!rangeset_add_singleton(r2, 1), "add 1 to limited set");
+    EXPECT(!rangeset_add_singleton(r2, 3), "add 3 to limited set");
+    EXPECT(rangeset_contains_range(r2, 0, 3), "limited set not merged");
+
+    rangeset_destroy(r2);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i <iterations>] [-s <seed>]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct domain d = { .domain_id = 1 };
+    struct rangeset *r;
+    unsigned int iterations = 100000, seed = 1, i;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "i:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    printf("Testing rangesets with %u iterations, seed %u\n",
+           iterations, seed);
+
+    rangeset_domain_initialise(&d);
+
+    for ( i = 0; i < 4; i++ )
+    {
+        srandom(seed + i);
+        nr_ref = 0;
+
+        r = rangeset_new(&d, "test", RANGESETF_prettyprint_hex);
+        EXPECT(r, "rangeset_new failed");
+
+        fuzz(r, iterations / 4);
+        check_misc(r);
+    }
+
+    rangeset_domain_destroy(&d);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -26,6 +26,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define container_of(ptr, type, member) ({                      \
         typeof(((type *)0)->member) *mptr = (ptr);              \
@@ -36,6 +38,7 @@
 #define smp_wmb()
 #define prefetch(x) __builtin_prefetch(x)
 #define ASSERT(x) assert(x)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 #define __must_check __attribute__((__warn_unused_result__))
 
 #include "list.h"
@@ -80,7 +83,10 @@ typedef union {
     };
 } pci_sbdf_t;
 
+#define PCI_CFG_SPACE_EXP_SIZE 4096
+
 #define CONFIG_HAS_VPCI
+#define cf_check
 #include "vpci.h"
 
 #define __hwdom_init
@@ -89,9 +95,10 @@ typedef union {
 
 #define xzalloc(type) ((type *)calloc(1, sizeof(type)))
 #define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xzalloc_array(type, num) ((type *)calloc(num, sizeof(type)))
 #define xfree(p) free(p)
 
-#define pci_get_pdev_by_domain(...) &test_pdev
+#define pci_get_pdev(...) &test_pdev
 #define pci_get_ro_map(...) NULL
 
 #define test_bit(...) false
@@ -104,8 +111,6 @@ typedef union {
 #define pci_conf_write16(...)
 #define pci_conf_write32(...)
 
-#define PCI_CFG_SPACE_EXP_SIZE 4096
-
 #define BUG() assert(0)
 #define ASSERT_UNREACHABLE() assert(0)
 
@@ -141,6 +141,80 @@ void multiwrite4_check(unsigned int reg)
     multiread4_check(reg, val);
 }
 
+/*
+ * Benchmark of the register dispatch: populate the config space like a device
+ * with a full set of capabilities would, and time accesses of all sizes to
+ * random offsets in it.
+ */
+#define BENCH_SPAN 0x200
+
+static uint32_t bench_store[BENCH_SPAN / 4];
+static uint16_t bench_store16[2];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_report(const char *what, unsigned long nr, uint64_t ns)
+{
+    printf("%-6s %10lu accesses in %8.3f ms: %12.0f accesses/s\n",
+           what, nr, ns / 1e6, nr * 1e9 / (ns ?: 1));
+}
+
+static int bench(unsigned long nr)
+{
+    static unsigned int offs[4096], sizes[4096];
+    uint32_t seed = 1, sum = 0;
+    unsigned long i;
+    uint64_t t;
+
+    /* Standard header, with a couple of 16bit registers. */
+    for ( i = 0; i < 0x40; i += 4 )
+    {
+        if ( i == 4 )
+        {
+            VPCI_ADD_REG(vpci_read16, vpci_write16, i, 2, bench_store16[0]);
+            VPCI_ADD_REG(vpci_read16, vpci_write16, i + 2, 2,
+                         bench_store16[1]);
+        }
+        else
+            VPCI_ADD_REG(vpci_read32, vpci_write32, i, 4, bench_store[i / 4]);
+    }
+
+    /* Capabilities: every other dword, leaving gaps to pass through. */
+    for ( ; i < BENCH_SPAN; i += 8 )
+        VPCI_ADD_REG(vpci_read32, vpci_write32, i, 4, bench_store[i / 4]);
+
+    for ( i = 0; i < ARRAY_SIZE(offs); i++ )
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        sizes[i] = 1u << (seed % 3);
+        offs[i] = (seed >> 8) % BENCH_SPAN & ~(sizes[i] - 1);
+    }
+
+    t = now_ns();
+    for ( i = 0; i < nr; i++ )
+        sum += vpci_read((pci_sbdf_t){ .sbdf = 0 }, offs[i % ARRAY_SIZE(offs)],
+                         sizes[i % ARRAY_SIZE(offs)]);
+    bench_report("read", nr, now_ns() - t);
+
+    t = now_ns();
+    for ( i = 0; i < nr; i++ )
+        vpci_write((pci_sbdf_t){ .sbdf = 0 }, offs[i % ARRAY_SIZE(offs)],
+                   sizes[i % ARRAY_SIZE(offs)], i);
+    bench_report("write", nr, now_ns() - t);
+
+    /* Keep the reads from being optimized out. */
+    return sum == 1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -160,6 +234,9 @@ main(int argc, char **argv)
     INIT_LIST_HEAD(&vpci.handlers);
     spin_lock_init(&vpci.lock);
 
+    if ( argc > 1 && !strcmp(argv[1], "-b") )
+        return bench(argc > 2 ? strtoul(argv[2], NULL, 0) : 10000000);
+
     VPCI_ADD_REG(vpci_read32, vpci_write32, 0, 4, r0);
     VPCI_READ_CHECK(0, 4, r0);
     VPCI_WRITE_CHECK(0, 4, 0xbcbcbcbc);
@@ -289,8 +366,20 @@ main(int argc, char **argv)
 
     /* Finally try to remove a couple of registers. */
     VPCI_REMOVE_REG(28, 1);
+    VPCI_READ_CHECK(28, 4, 0xffacffff);
     VPCI_REMOVE_REG(24, 4);
+    VPCI_READ_CHECK(24, 4, 0xffffffff);
     VPCI_REMOVE_REG(12, 2);
+    VPCI_READ_CHECK(12, 4, 0xffffffff);
+
+    /* Handlers further into the config space. */
+    VPCI_ADD_REG(vpci_read32, vpci_write32, 0x100, 4, r24);
+    VPCI_ADD_REG(vpci_read8, vpci_write8, 0xfff, 1, r28);
+    VPCI_WRITE_CHECK(0x100, 4, 0x12345678);
+    VPCI_WRITE_CHECK(0xfff, 1, 0x9a);
+    VPCI_READ_CHECK(0xffc, 4, 0x9affffff);
+    VPCI_REMOVE_REG(0x100, 4);
+    VPCI_READ_CHECK(0x100, 4, 0xffffffff);
 
     VPCI_REMOVE_INVALID_REG(20, 1);
     VPCI_REMOVE_INVALID_REG(16, 2);
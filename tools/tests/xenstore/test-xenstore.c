@@ -37,6 +37,8 @@
 #define WRITE_BUFFERS_N    10
 #define WRITE_BUFFERS_SIZE 4000
 #define MAX_TA_LOOPS       100
+#define WATCH_PER_DOMAIN   4
+#define WATCH_WRITES       100
 
 struct test {
     char *name;
@@ -48,6 +50,7 @@ struct test {
 };
 
 static struct xs_handle *xsh;
+static struct xs_handle *watch_xsh;
 static char *path;
 static char *paths[WRITE_BUFFERS_N];
 static char write_buffers[WRITE_BUFFERS_N][WRITE_BUFFERS_SIZE];
@@ -405,6 +408,221 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static bool ta5_written;
+
+static int test_ta5_init(uintptr_t par)
+{
+    if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ||
+         !xs_write(xsh, XBT_NULL, paths[1], write_buffers[1], 1) )
+        return errno;
+    return 0;
+}
+
+/*
+ * Failing writes in a transaction, e.g. due to the node size quota, must
+ * leave the nodes untouched. paths[0] is read before the write, paths[1]
+ * is only written. A privileged connection isn't subject to the quota, so
+ * the writes might succeed, which is fine, too.
+ */
+static int test_ta5(uintptr_t par)
+{
+    xs_transaction_t t;
+    char *buf;
+    unsigned int len;
+    int ret;
+
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+        return errno;
+    buf = xs_read(xsh, t, paths[0], &len);
+    if ( !buf )
+        goto out;
+    free(buf);
+    ta5_written = xs_write(xsh, t, paths[0], write_buffers[2],
+                           WRITE_BUFFERS_SIZE);
+    if ( !ta5_written && errno != ENOSPC )
+        goto out;
+    if ( xs_write(xsh, t, paths[1], write_buffers[2], WRITE_BUFFERS_SIZE) !=
+         ta5_written )
+    {
+        errno = ENOENT;
+        goto out;
+    }
+    if ( !ta5_written )
+    {
+        buf = xs_read(xsh, t, paths[1], &len);
+        if ( !buf )
+            goto out;
+        errno = (len == 1 && buf[0] == 'b') ? 0 : ENOENT;
+        free(buf);
+        if ( errno )
+            goto out;
+    }
+    if ( !xs_transaction_end(xsh, t, false) )
+        return errno;
+    return 0;
+
+ out:
+    ret = errno;
+    xs_transaction_end(xsh, t, true);
+    return ret;
+}
+
+static int test_ta5_deinit(uintptr_t par)
+{
+    unsigned int i;
+    int ret;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        if ( ta5_written )
+            ret = verify_node(paths[i], write_buffers[2], WRITE_BUFFERS_SIZE);
+        else
+            ret = verify_node(paths[i], write_buffers[i], 1);
+        if ( ret )
+            return ret;
+    }
+    if ( ta5_written )
+        return 0;
+
+    /* Overwrite the node again, dropping the data base's record. */
+    if ( !xs_write(xsh, XBT_NULL, paths[0], "c", 1) )
+        return errno;
+    return verify_node(paths[0], "c", 1);
+}
+
+#define test_ta4_init ret0
+
+/* Big transaction as done by toolstacks when setting up a guest. */
+static int test_ta4(uintptr_t par)
+{
+    xs_transaction_t t;
+    char node[64];
+    unsigned int i;
+    int l;
+
+    for ( l = 0; l < MAX_TA_LOOPS; l++ )
+    {
+        t = xs_transaction_start(xsh);
+        if ( t == XBT_NULL )
+            return errno;
+        for ( i = 0; i < par; i++ )
+        {
+            snprintf(node, sizeof(node), "%s/device/%u/state", path, i);
+            if ( !xs_write(xsh, t, node, "1", 1) )
+            {
+                xs_transaction_end(xsh, t, true);
+                return errno;
+            }
+        }
+        if ( xs_transaction_end(xsh, t, false) )
+            return 0;
+        if ( errno != EAGAIN )
+            return errno;
+    }
+
+    ta_loops++;
+    return 0;
+}
+
+static int test_ta4_deinit(uintptr_t par)
+{
+    return xs_rm(xsh, XBT_NULL, path) ? 0 : errno;
+}
+
+#define test_batch_init ret0
+
+/* Same as "ta big" without transaction, but using batches (and read back). */
+static int test_batch(uintptr_t par)
+{
+    struct xs_batch_op ops[2 * par];
+    char nodes[par][64];
+    unsigned int i;
+    int ret = 0;
+
+    for ( i = 0; i < par; i++ )
+    {
+        snprintf(nodes[i], sizeof(nodes[i]), "%s/device/%u/state", path, i);
+        ops[i] = (struct xs_batch_op){ .type = XS_WRITE, .path = nodes[i],
+                                       .data = nodes[i], .len = i % 64 };
+        ops[par + i] = (struct xs_batch_op){ .type = XS_READ,
+                                             .path = nodes[i] };
+    }
+
+    if ( !xs_batch(xsh, XBT_NULL, ops, 2 * par) )
+        return errno;
+
+    for ( i = 0; i < 2 * par; i++ )
+    {
+        if ( ops[i].err )
+            ret = ops[i].err;
+        else if ( ops[i].type == XS_READ &&
+                  (ops[i].value_len != (i - par) % 64 ||
+                   memcmp(ops[i].value, nodes[i - par], ops[i].value_len)) )
+            ret = EIO;
+        free(ops[i].value);
+    }
+
+    return ret;
+}
+
+#define test_batch_deinit test_ta4_deinit
+
+static const char *watch_nodes[WATCH_PER_DOMAIN] = {
+    "backend", "device/vif", "device/vbd", "control"
+};
+
+/*
+ * Synthetic store of <par> domains with WATCH_PER_DOMAIN watches each, set
+ * up via a separate connection in order to not disturb the timed writes.
+ */
+static int test_watch_init(uintptr_t par)
+{
+    char node[64];
+    unsigned int dom, w;
+
+    watch_xsh = xs_open(0);
+    if ( !watch_xsh )
+        return errno;
+
+    for ( dom = 0; dom < par; dom++ )
+        for ( w = 0; w < WATCH_PER_DOMAIN; w++ )
+        {
+            snprintf(node, sizeof(node), "%s/%u/%s", path, dom,
+                     watch_nodes[w]);
+            if ( !xs_write(xsh, XBT_NULL, node, "", 0) )
+                return errno;
+            if ( !xs_watch(watch_xsh, node, "bench") )
+                return errno;
+        }
+
+    return 0;
+}
+
+static int test_watch(uintptr_t par)
+{
+    char node[64];
+    unsigned int i;
+
+    for ( i = 0; i < WATCH_WRITES; i++ )
+    {
+        snprintf(node, sizeof(node), "%s/%u/backend/state", path,
+                 (unsigned int)(i % par));
+        if ( !xs_write(xsh, XBT_NULL, node, "4", 1) )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    xs_close(watch_xsh);
+    watch_xsh = NULL;
+
+    return 0;
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -419,6 +637,10 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("ta fail", test_ta5, 0, "Transaction with failing writes"),
+TEST("ta big", test_ta4, 500, "Transaction writing 500 nodes"),
+TEST("batch 500", test_batch, 500, "Batches writing and reading 500 nodes"),
+TEST("watch 1000", test_watch, 1000, "Writes with 1000 watched domains"),
 };
 
 static void cleanup(void)
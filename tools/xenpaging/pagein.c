@@ -49,6 +49,28 @@ static void *page_in(void *arg)
     pthread_exit(NULL);
 }
 
+/* Add a gfn to the queue, returns -1 if it is full */
+int page_in_queue(unsigned long gfn)
+{
+    int i, rc = -1;
+
+    if (!page_in_possible)
+        return rc;
+
+    pthread_mutex_lock(&page_in_mutex);
+    for (i = 0; i < XENPAGING_PAGEIN_QUEUE_SIZE; i++)
+    {
+        if (page_in_args.pagein_queue[i])
+            continue;
+        page_in_args.pagein_queue[i] = gfn;
+        rc = 0;
+        break;
+    }
+    pthread_mutex_unlock(&page_in_mutex);
+
+    return rc;
+}
+
 void page_in_trigger(void)
 {
     if (!page_in_possible)
@@ -28,7 +28,10 @@
 
 
 int policy_init(struct xenpaging *paging);
+void policy_teardown(struct xenpaging *paging);
+void policy_sample(struct xenpaging *paging);
 unsigned long policy_choose_victim(struct xenpaging *paging);
+void policy_notify_accessed(unsigned long gfn);
 void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
 void policy_notify_paged_in_nomru(unsigned long gfn);
@@ -19,6 +19,8 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include "policy.h"
 
@@ -35,6 +37,66 @@ static unsigned int unconsumed_cleared;
 static unsigned long current_gfn;
 static unsigned long max_pages;
 
+/*
+ * Access history of each gfn, one bit per sample period, with the most
+ * recent period in the top bit.  A gfn counts as referenced in a period if
+ * it had to be paged in for a guest access or, if enabled, the guest wrote
+ * to it according to the log-dirty bitmap.  Log-dirty doesn't see reads, so
+ * pages which are only read become hot once they get paged back in.  It is
+ * off by default, as the domain can't be live migrated while it is on.
+ */
+static uint8_t *history;
+static unsigned long *referenced;
+static struct timespec last_sample;
+/* Highest lru2_key() accepted for a victim until the next sample. */
+static unsigned int cold_limit;
+
+static int logdirty;
+static unsigned int dirty_nr_pages;
+static xc_hypercall_buffer_t dirty_hbuf;
+
+static void enable_logdirty(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap, &dirty_hbuf);
+
+    dirty_nr_pages = (bitmap_size(max_pages) + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    dirty_bitmap = xc_hypercall_buffer_alloc_pages(xch, dirty_bitmap,
+                                                   dirty_nr_pages);
+    if ( !dirty_bitmap )
+    {
+        ERROR("Unable to allocate log-dirty bitmap");
+        return;
+    }
+
+    if ( xc_shadow_control(xch, paging->vm_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                           NULL, 0) < 0 )
+    {
+        PERROR("Failed to enable log-dirty, only using page-ins as accesses");
+        xc_hypercall_buffer_free_pages(xch, dirty_bitmap, dirty_nr_pages);
+        return;
+    }
+
+    NOTICE("Log-dirty mode enabled for domain %u, it can't be live migrated "
+           "until xenpaging exits", paging->vm_event.domain_id);
+    logdirty = 1;
+}
+
+/*
+ * LRU-2 orders pages by the time of their second most recent reference, so
+ * that a page touched once recently still goes before one which is used
+ * repeatedly.  Drop the most recent reference from the history: the larger
+ * the remainder, the hotter the page.
+ */
+static unsigned int lru2_key(uint8_t h)
+{
+    if ( !h )
+        return 0;
+
+    return h & ~(1U << (31 - __builtin_clz(h)));
+}
+
 
 int policy_init(struct xenpaging *paging)
 {
@@ -65,6 +127,19 @@ int policy_init(struct xenpaging *paging)
     for ( i = 0; i < mru_size; i++ )
         mru[i] = INVALID_MFN;
 
+    /* Allocate access history */
+    history = calloc(max_pages, sizeof(*history));
+    referenced = bitmap_alloc(max_pages);
+    if ( !history || !referenced )
+        goto out;
+
+    if ( paging->policy_sample_ms > 0 )
+    {
+        if ( paging->policy_logdirty )
+            enable_logdirty(paging);
+        clock_gettime(CLOCK_MONOTONIC, &last_sample);
+    }
+
     /* Don't page out page 0 */
     set_bit(0, bitmap);
 
@@ -76,10 +151,75 @@ int policy_init(struct xenpaging *paging)
     return rc;
 }
 
+void policy_teardown(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap, &dirty_hbuf);
+
+    if ( !logdirty )
+        return;
+
+    if ( xc_shadow_control(xch, paging->vm_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_OFF, NULL, 0) < 0 )
+        PERROR("Failed to disable log-dirty");
+    else
+        NOTICE("Log-dirty mode disabled for domain %u",
+               paging->vm_event.domain_id);
+
+    xc_hypercall_buffer_free_pages(xch, dirty_bitmap, dirty_nr_pages);
+    logdirty = 0;
+}
+
+/* Age the access history once per sample period */
+void policy_sample(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap, &dirty_hbuf);
+    struct timespec now;
+    unsigned long gfn;
+    long elapsed;
+    int i;
+
+    if ( paging->policy_sample_ms <= 0 )
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - last_sample.tv_sec) * 1000 +
+              (now.tv_nsec - last_sample.tv_nsec) / 1000000;
+    if ( elapsed < paging->policy_sample_ms )
+        return;
+    last_sample = now;
+
+    if ( logdirty )
+    {
+        if ( xc_logdirty_control(xch, paging->vm_event.domain_id,
+                                 XEN_DOMCTL_SHADOW_OP_CLEAN,
+                                 HYPERCALL_BUFFER(dirty_bitmap), max_pages,
+                                 0, NULL) < 0 )
+            PERROR("Failed to retrieve log-dirty bitmap");
+        else
+            for ( i = 0; i < bitmap_size(max_pages); i++ )
+                ((uint8_t *)referenced)[i] |= ((uint8_t *)dirty_bitmap)[i];
+    }
+
+    for ( gfn = 0; gfn < max_pages; gfn++ )
+        history[gfn] = (history[gfn] >> 1) |
+                       (test_bit(gfn, referenced) << 7);
+
+    bitmap_clear(referenced, max_pages);
+    cold_limit = 0;
+}
+
+/*
+ * Sweep the gfns like a clock hand, taking the first one which is cold
+ * enough.  If there is none, settle for the coldest one seen, and accept
+ * pages as warm as that one until the history changes.
+ */
 unsigned long policy_choose_victim(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    unsigned long i;
+    unsigned long i, coldest = INVALID_MFN;
+    unsigned int key, coldest_key = UINT_MAX;
 
     /* One iteration over all possible gfns */
     for ( i = 0; i < max_pages; i++ )
@@ -111,11 +251,25 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
             continue;
 
         /* gfn found */
-        break;
+        key = lru2_key(history[current_gfn]);
+        if ( key <= cold_limit )
+            break;
+
+        if ( key < coldest_key )
+        {
+            coldest = current_gfn;
+            coldest_key = key;
+        }
     }
 
+    /* Nothing cold enough, use the coldest gfn */
+    if ( i >= max_pages && coldest != INVALID_MFN )
+    {
+        current_gfn = coldest;
+        cold_limit = coldest_key;
+    }
     /* Could not nominate any gfn */
-    if ( i >= max_pages )
+    else if ( i >= max_pages )
     {
         /* No more pages, wait in poll */
         paging->use_poll_timeout = 1;
@@ -136,6 +290,11 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
     return current_gfn;
 }
 
+void policy_notify_accessed(unsigned long gfn)
+{
+    set_bit(gfn, referenced);
+}
+
 void policy_notify_paged_out(unsigned long gfn)
 {
     set_bit(gfn, bitmap);
@@ -37,6 +37,10 @@
 
 /* Defines number of mfns a guest should use at a time, in KiB */
 #define WATCH_TARGETPAGES "memory/target-tot_pages"
+/* Period of access sampling for the paging policy, in ms */
+#define DEFAULT_SAMPLE_MS 1000
+/* Size of the aligned block of gfns paged in with a faulting gfn */
+#define DEFAULT_PREFETCH 8
 static char *watch_target_tot_pages;
 static char *dom_path;
 static char watch_token[16];
@@ -178,17 +182,17 @@ static int xenpaging_get_tot_pages(struct xenpaging *paging)
     return domain_info.tot_pages;
 }
 
-static void *init_page(void)
+static void *init_pages(unsigned int nr)
 {
     void *buffer;
 
     /* Allocated page memory */
-    errno = posix_memalign(&buffer, XC_PAGE_SIZE, XC_PAGE_SIZE);
+    errno = posix_memalign(&buffer, XC_PAGE_SIZE, nr * XC_PAGE_SIZE);
     if ( errno != 0 )
         return NULL;
 
     /* Lock buffer in memory so it can't be paged out */
-    if ( mlock(buffer, XC_PAGE_SIZE) < 0 )
+    if ( mlock(buffer, nr * XC_PAGE_SIZE) < 0 )
     {
         free(buffer);
         buffer = NULL;
@@ -208,6 +212,9 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -s <ms>        --sample=<ms>            access sampling period, 0 to disable (default %d).\n", DEFAULT_SAMPLE_MS);
+    printf(" -l             --logdirty               also sample writes via log-dirty mode (prevents live migration).\n");
+    printf(" -p <num>       --prefetch=<num>         pages to prefetch around a page-in, 0 to disable (default %d).\n", DEFAULT_PREFETCH);
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -215,16 +222,22 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvld:f:m:r:s:p:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"sample", 1, NULL, 's'},
+        {"logdirty", 0, NULL, 'l'},
+        {"prefetch", 1, NULL, 'p'},
         { }
     };
 
+    paging->policy_sample_ms = DEFAULT_SAMPLE_MS;
+    paging->prefetch = DEFAULT_PREFETCH;
+
     while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1)
     {
         switch(ch) {
@@ -242,6 +255,15 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 's':
+            paging->policy_sample_ms = atoi(optarg);
+            break;
+        case 'l':
+            paging->policy_logdirty = 1;
+            break;
+        case 'p':
+            paging->prefetch = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -464,7 +486,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    paging->paging_buffer = init_page();
+    paging->paging_buffer = init_pages(XENPAGING_BATCH_SIZE);
     if ( !paging->paging_buffer )
     {
         PERROR("Creating page aligned load buffer");
@@ -487,12 +509,16 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         if ( paging->xs_handle )
             xs_close(paging->xs_handle);
         if ( xch )
+        {
+            policy_teardown(paging);
             xc_interface_close(xch);
+        }
         if ( paging->logger )
             xtl_logger_destroy(paging->logger);
         if ( paging->paging_buffer )
         {
-            munlock(paging->paging_buffer, XC_PAGE_SIZE);
+            munlock(paging->paging_buffer,
+                    XENPAGING_BATCH_SIZE * XC_PAGE_SIZE);
             free(paging->paging_buffer);
         }
 
@@ -521,6 +547,9 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xs_unwatch(paging->xs_handle, watch_target_tot_pages, "");
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
+    /* Stop access sampling */
+    policy_teardown(paging);
+
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
     munmap(paging->vm_event.ring_page, XC_PAGE_SIZE);
@@ -589,85 +618,188 @@ static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Find a slot in the paging file which is not in use, or return -1 */
+static int get_free_slot(struct xenpaging *paging)
+{
+    static int next_slot;
+    int i, slot;
+
+    /* Reuse known free slots */
+    if ( paging->stack_count > 0 )
+        return paging->free_slot_stack[--paging->stack_count];
+
+    /* Scan all slots for remainders */
+    for ( i = 0; i < paging->max_pages; i++ )
+    {
+        slot = next_slot;
+        if ( ++next_slot >= paging->max_pages )
+            next_slot = 0;
+
+        if ( !paging->slot_to_gfn[slot] )
+            return slot;
+    }
+
+    return -1;
+}
+
+static void put_free_slot(struct xenpaging *paging, int slot)
+{
+    paging->slot_to_gfn[slot] = 0;
+    paging->free_slot_stack[paging->stack_count++] = slot;
+}
+
+/* Nominate a batch of gfns, and drop the unpageable ones from the list
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of nominated gfns otherwise
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int xenpaging_nominate_pages(struct xenpaging *paging, uint64_t *gfns,
+                                    int num)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
-    struct xen_domctl domctl;
-
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    int errs[XENPAGING_BATCH_SIZE];
+    int i, nr = 0;
+
+    if ( xc_mem_paging_nominate_batch(xch, paging->vm_event.domain_id,
+                                      gfns, num, errs) < 0 )
+    {
+        PERROR("Error nominating pages");
+        return -1;
+    }
+
+    for ( i = 0; i < num; i++ )
     {
         /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
+        if ( errs[i] == -EBUSY )
+            continue;
+
+        if ( errs[i] )
+        {
+            errno = -errs[i];
+            PERROR("Error nominating page %"PRIx64, gfns[i]);
+            return -1;
+        }
+
+        gfns[nr++] = gfns[i];
     }
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    return nr;
+}
+
+/* Evict a batch of nominated gfns, writing them to free slots
+ * Returns < 0 on fatal error
+ * Returns the number of evicted gfns otherwise
+ */
+static int xenpaging_evict_pages(struct xenpaging *paging, uint64_t *gfns,
+                                 int num)
+{
+    xc_interface *xch = paging->xc_handle;
+    xen_pfn_t victims[XENPAGING_BATCH_SIZE];
+    int errs[XENPAGING_BATCH_SIZE], slots[XENPAGING_BATCH_SIZE];
+    char *pages;
+    int i, nr = 0, rc = 0;
+
+    /* Map pages */
+    for ( i = 0; i < num; i++ )
+        victims[i] = gfns[i];
+    pages = xc_map_foreign_bulk(xch, paging->vm_event.domain_id, PROT_READ,
+                                victims, errs, num);
+    if ( pages == NULL )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        PERROR("Error mapping %d pages", num);
+        return -1;
     }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
+    /* Copy pages */
+    for ( i = 0; i < num; i++ )
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, XC_PAGE_SIZE);
-        ret = -1;
-        goto out;
+        if ( errs[i] )
+        {
+            errno = -errs[i];
+            PERROR("Error mapping page %"PRIx64, gfns[i]);
+            break;
+        }
+
+        slots[i] = get_free_slot(paging);
+        if ( slots[i] < 0 )
+        {
+            ERROR("No free slot for page %"PRIx64, gfns[i]);
+            break;
+        }
+
+        if ( write_page(paging->fd, pages + i * XC_PAGE_SIZE, slots[i]) < 0 )
+        {
+            PERROR("Error copying page %"PRIx64, gfns[i]);
+            put_free_slot(paging, slots[i]);
+            break;
+        }
+
+        /* Reserve the slot */
+        paging->slot_to_gfn[slots[i]] = gfns[i];
     }
 
-    /* Release page */
-    munmap(page, XC_PAGE_SIZE);
+    /* Release pages */
+    munmap(pages, num * XC_PAGE_SIZE);
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    if ( i < num )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
-        {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
+        while ( i-- )
+            put_free_slot(paging, slots[i]);
+        return -1;
     }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+    /* Tell Xen to evict pages */
+    if ( xc_mem_paging_evict_batch(xch, paging->vm_event.domain_id,
+                                   gfns, num, errs) < 0 )
+    {
+        PERROR("Error evicting pages");
+        for ( i = 0; i < num; i++ )
+            put_free_slot(paging, slots[i]);
+        return -1;
+    }
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+    /*
+     * Go through all results even after a fatal error, as the pages after
+     * it may have been evicted and their slots must be kept.
+     */
+    for ( i = 0; i < num; i++ )
+    {
+        if ( errs[i] )
+        {
+            put_free_slot(paging, slots[i]);
+
+            /* A gfn in use is indicated by EBUSY */
+            if ( errs[i] == -EBUSY )
+            {
+                DPRINTF("Nominated page %"PRIx64" busy", gfns[i]);
+                continue;
+            }
+
+            errno = -errs[i];
+            PERROR("Error evicting page %"PRIx64, gfns[i]);
+            rc = -1;
+            continue;
+        }
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        DPRINTF("evict_page > gfn %"PRIx64" pageslot %d\n", gfns[i], slots[i]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfns[i]);
 
-    ret = 0;
+        /* Update index */
+        paging->gfn_to_slot[gfns[i]] = slots[i];
 
- out:
-    return ret;
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+
+        if ( test_and_set_bit(gfns[i], paging->bitmap) )
+            ERROR("Page %"PRIx64" has been evicted before", gfns[i]);
+
+        nr++;
+    }
+
+    return rc < 0 ? rc : nr;
 }
 
-static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
+static void xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
 {
     /* Put the page info on the ring */
     put_response(&paging->vm_event, rsp);
@@ -687,50 +819,60 @@ static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *
        /* Record number of resumed pages */
        paging->num_paged_out--;
     }
-
-    /* Tell Xen page is ready */
-    return xenevtchn_notify(paging->vm_event.xce_handle, paging->vm_event.port);
 }
 
-static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, int i)
+/* Load a batch of gfns from the paging buffer, which holds their contents
+ * Returns < 0 on fatal error
+ */
+static int xenpaging_populate_pages(struct xenpaging *paging, uint64_t *gfns,
+                                    int num)
 {
     xc_interface *xch = paging->xc_handle;
-    int ret;
+    int errs[XENPAGING_BATCH_SIZE];
     unsigned char oom = 0;
+    int i, nr;
 
-    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
-
-    /* Read page */
-    ret = read_page(paging->fd, paging->paging_buffer, i);
-    if ( ret != 0 )
+    while ( num && !interrupted )
     {
-        PERROR("Error reading page");
-        goto out;
-    }
+        /* Tell Xen to allocate pages for the domain */
+        if ( xc_mem_paging_load_batch(xch, paging->vm_event.domain_id,
+                                      gfns, num, paging->paging_buffer,
+                                      errs) < 0 )
+        {
+            PERROR("Error loading %d pages during page-in", num);
+            return -1;
+        }
 
-    do
-    {
-        /* Tell Xen to allocate a page for the domain */
-        ret = xc_mem_paging_load(xch, paging->vm_event.domain_id, gfn, paging->paging_buffer);
-        if ( ret < 0 )
+        /* Keep the pages which need to be retried, with their contents */
+        for ( i = nr = 0; i < num; i++ )
         {
-            if ( errno == ENOMEM )
-            {
-                if ( oom++ == 0 )
-                    DPRINTF("ENOMEM while preparing gfn %lx\n", gfn);
-                sleep(1);
+            if ( !errs[i] )
                 continue;
+
+            if ( errs[i] != -ENOMEM )
+            {
+                errno = -errs[i];
+                PERROR("Error loading %"PRIx64" during page-in", gfns[i]);
+                return -1;
             }
-            PERROR("Error loading %lx during page-in", gfn);
-            ret = -1;
-            break;
+
+            if ( oom++ == 0 )
+                DPRINTF("ENOMEM while preparing gfn %"PRIx64"\n", gfns[i]);
+
+            gfns[nr] = gfns[i];
+            if ( nr != i )
+                memcpy(paging->paging_buffer + nr * XC_PAGE_SIZE,
+                       paging->paging_buffer + i * XC_PAGE_SIZE,
+                       XC_PAGE_SIZE);
+            nr++;
         }
-    }
-    while ( ret && !interrupted );
 
+        num = nr;
+        if ( num )
+            sleep(1);
+    }
 
- out:
-    return ret;
+    return num ? -1 : 0;
 }
 
 /* Trigger a page-in for a batch of pages */
@@ -754,22 +896,55 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
+/* Trigger a page-in of the paged-out neighbours of a gfn accessed by the guest */
+static void prefetch_pages(struct xenpaging *paging, unsigned long gfn)
+{
+    unsigned long start, end, i;
+    int num = 0;
+
+    start = gfn - gfn % paging->prefetch;
+    end = start + paging->prefetch;
+    if ( end > paging->max_pages )
+        end = paging->max_pages;
+
+    for ( i = start; i < end; i++ )
+    {
+        if ( i == gfn || !test_bit(i, paging->bitmap) )
+            continue;
+        if ( page_in_queue(i) )
+            break;
+        num++;
+    }
+
+    if ( num )
+        page_in_trigger();
+}
+
+/* Evict a batch of pages and write them to a free slot in the paging file
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
+ * Returns 0 if no gfn can be evicted
+ * Returns > 0 on successful evict
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int evict_pages(struct xenpaging *paging, int num_pages)
 {
     xc_interface *xch = paging->xc_handle;
+    uint64_t gfns[XENPAGING_BATCH_SIZE];
     unsigned long gfn;
     static int num_paged_out;
-    int ret;
+    int rc, nr, num = 0;
 
-    do
+    while ( num < num_pages && !interrupted )
     {
-        gfn = policy_choose_victim(paging);
-        if ( gfn == INVALID_MFN )
+        /* Choose victims */
+        for ( nr = 0; nr < XENPAGING_BATCH_SIZE && num + nr < num_pages; nr++ )
+        {
+            gfn = policy_choose_victim(paging);
+            if ( gfn == INVALID_MFN )
+                break;
+            gfns[nr] = gfn;
+        }
+
+        if ( !nr )
         {
             /* If the number did not change after last flush command then
              * the command did not reach qemu yet, or qemu still processes
@@ -782,81 +957,166 @@ static int evict_victim(struct xenpaging *paging, int slot)
                 xenpaging_mem_paging_flush_ioemu_cache(paging);
                 num_paged_out = paging->num_paged_out;
             }
-            ret = ENOSPC;
-            goto out;
+            break;
         }
 
-        if ( interrupted )
-        {
-            ret = EINTR;
-            goto out;
-        }
+        rc = xenpaging_nominate_pages(paging, gfns, nr);
+        if ( rc > 0 )
+            rc = xenpaging_evict_pages(paging, gfns, rc);
+        if ( rc < 0 )
+            return -1;
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
+        num += rc;
     }
-    while ( ret );
-
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
 
- out:
-    return ret;
+    return num;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
+/* Handle the requests on the ring in batches, loading the paged-out gfns
+ * with a single hypercall and resuming the vcpus with a single notification
  * Returns < 0 on fatal error
- * Returns 0 if no gfn can be evicted
- * Returns > 0 on successful evict
  */
-static int evict_pages(struct xenpaging *paging, int num_pages)
+static int xenpaging_handle_requests(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    vm_event_request_t reqs[XENPAGING_BATCH_SIZE], *req;
+    vm_event_response_t rsp;
+    uint64_t gfns[XENPAGING_BATCH_SIZE];
+    int paged[XENPAGING_BATCH_SIZE];
+    int i, num, nr, slot, resumed = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&paging->vm_event.back_ring) )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        for ( num = nr = 0;
+              num < XENPAGING_BATCH_SIZE &&
+              RING_HAS_UNCONSUMED_REQUESTS(&paging->vm_event.back_ring);
+              num++ )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            req = &reqs[num];
+            get_request(&paging->vm_event, req);
+
+            if ( req->u.mem_paging.gfn > paging->max_pages )
+            {
+                ERROR("Requested gfn %"PRIx64" higher than max_pages %x\n",
+                      req->u.mem_paging.gfn, paging->max_pages);
+                return -1;
+            }
+
+            /* Check if the page has already been paged in */
+            paged[num] = test_and_clear_bit(req->u.mem_paging.gfn,
+                                            paging->bitmap);
+            if ( !paged[num] )
+                continue;
+
+            /* Find where in the paging file to read from */
+            slot = paging->gfn_to_slot[req->u.mem_paging.gfn];
+
+            /* Sanity check */
+            if ( paging->slot_to_gfn[slot] != req->u.mem_paging.gfn )
+            {
+                ERROR("Expected gfn %"PRIx64" in slot %d, but found gfn %lx\n",
+                      req->u.mem_paging.gfn, slot, paging->slot_to_gfn[slot]);
+                return -1;
+            }
+
+            if ( req->u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+            {
+                DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n",
+                        req->u.mem_paging.gfn, slot);
+                /* Notify policy of page being dropped */
+                policy_notify_dropped(req->u.mem_paging.gfn);
+                continue;
+            }
+
+            DPRINTF("populate_page < gfn %"PRIx64" pageslot %d\n",
+                    req->u.mem_paging.gfn, slot);
+
+            /* Read page */
+            if ( read_page(paging->fd,
+                           paging->paging_buffer + nr * XC_PAGE_SIZE,
+                           slot) != 0 )
+            {
+                PERROR("Error reading page");
+                return -1;
+            }
+
+            gfns[nr++] = req->u.mem_paging.gfn;
         }
-        num++;
-    }
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
-    {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        /* Populate the pages */
+        if ( xenpaging_populate_pages(paging, gfns, nr) < 0 )
+        {
+            ERROR("Error populating %d pages", nr);
+            return -1;
+        }
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        for ( i = 0; i < num; i++ )
         {
-            num = rc < 0 ? -1 : num;
-            break;
+            req = &reqs[i];
+
+            /* Prepare the response */
+            rsp.u.mem_paging.gfn = req->u.mem_paging.gfn;
+            rsp.vcpu_id = req->vcpu_id;
+            rsp.flags = req->flags;
+
+            if ( paged[i] )
+            {
+                /* Only requests from the guest itself pause a vcpu */
+                if ( !(req->u.mem_paging.flags & MEM_PAGING_DROP_PAGE) &&
+                     (req->flags & VM_EVENT_FLAG_VCPU_PAUSED) )
+                {
+                    policy_notify_accessed(req->u.mem_paging.gfn);
+                    if ( paging->prefetch > 1 && !interrupted )
+                        prefetch_pages(paging, req->u.mem_paging.gfn);
+                }
+
+                xenpaging_resume_page(paging, &rsp, 1);
+                resumed++;
+
+                /* Clear this pagefile slot, and record it as free */
+                put_free_slot(paging,
+                              paging->gfn_to_slot[req->u.mem_paging.gfn]);
+            }
+            else
+            {
+                DPRINTF("page %s populated (domain = %d; vcpu = %d;"
+                        " gfn = %"PRIx64"; paused = %d; evict_fail = %d)\n",
+                        req->u.mem_paging.flags & MEM_PAGING_EVICT_FAIL ? "not" : "already",
+                        paging->vm_event.domain_id, req->vcpu_id, req->u.mem_paging.gfn,
+                        !!(req->flags & VM_EVENT_FLAG_VCPU_PAUSED) ,
+                        !!(req->u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) );
+
+                if ( req->flags & VM_EVENT_FLAG_VCPU_PAUSED )
+                    policy_notify_accessed(req->u.mem_paging.gfn);
+
+                /* Tell Xen to resume the vcpu */
+                if (( req->flags & VM_EVENT_FLAG_VCPU_PAUSED ) ||
+                    ( req->u.mem_paging.flags & MEM_PAGING_EVICT_FAIL ))
+                {
+                    xenpaging_resume_page(paging, &rsp, 0);
+                    resumed++;
+                }
+            }
         }
+    }
 
-        num++;
+    /* Tell Xen the pages are ready */
+    if ( resumed &&
+         xenevtchn_notify(paging->vm_event.xce_handle,
+                          paging->vm_event.port) < 0 )
+    {
+        PERROR("Error resuming %d pages", resumed);
+        return -1;
     }
-    return num;
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
     struct sigaction act;
     struct xenpaging *paging;
-    vm_event_request_t req;
-    vm_event_response_t rsp;
     int num, prev_num = 0;
-    int slot;
     int tot_pages;
     int rc;
     xc_interface *xch;
@@ -900,94 +1160,11 @@ int main(int argc, char *argv[])
             DPRINTF("Got event from Xen\n");
         }
 
-        while ( RING_HAS_UNCONSUMED_REQUESTS(&paging->vm_event.back_ring) )
-        {
-            /* Indicate possible error */
-            rc = 1;
-
-            get_request(&paging->vm_event, &req);
-
-            if ( req.u.mem_paging.gfn > paging->max_pages )
-            {
-                ERROR("Requested gfn %"PRIx64" higher than max_pages %x\n",
-                      req.u.mem_paging.gfn, paging->max_pages);
-                goto out;
-            }
-
-            /* Check if the page has already been paged in */
-            if ( test_and_clear_bit(req.u.mem_paging.gfn, paging->bitmap) )
-            {
-                /* Find where in the paging file to read from */
-                slot = paging->gfn_to_slot[req.u.mem_paging.gfn];
-
-                /* Sanity check */
-                if ( paging->slot_to_gfn[slot] != req.u.mem_paging.gfn )
-                {
-                    ERROR("Expected gfn %"PRIx64" in slot %d, but found gfn %lx\n",
-                          req.u.mem_paging.gfn, slot, paging->slot_to_gfn[slot]);
-                    goto out;
-                }
-
-                if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
-                {
-                    DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n",
-                            req.u.mem_paging.gfn, slot);
-                    /* Notify policy of page being dropped */
-                    policy_notify_dropped(req.u.mem_paging.gfn);
-                }
-                else
-                {
-                    /* Populate the page */
-                    if ( xenpaging_populate_page(paging, req.u.mem_paging.gfn, slot) < 0 )
-                    {
-                        ERROR("Error populating page %"PRIx64"", req.u.mem_paging.gfn);
-                        goto out;
-                    }
-                }
-
-                /* Prepare the response */
-                rsp.u.mem_paging.gfn = req.u.mem_paging.gfn;
-                rsp.vcpu_id = req.vcpu_id;
-                rsp.flags = req.flags;
-
-                if ( xenpaging_resume_page(paging, &rsp, 1) < 0 )
-                {
-                    PERROR("Error resuming page %"PRIx64"", req.u.mem_paging.gfn);
-                    goto out;
-                }
-
-                /* Clear this pagefile slot */
-                paging->slot_to_gfn[slot] = 0;
-
-                /* Record this free slot */
-                paging->free_slot_stack[paging->stack_count++] = slot;
-            }
-            else
-            {
-                DPRINTF("page %s populated (domain = %d; vcpu = %d;"
-                        " gfn = %"PRIx64"; paused = %d; evict_fail = %d)\n",
-                        req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL ? "not" : "already",
-                        paging->vm_event.domain_id, req.vcpu_id, req.u.mem_paging.gfn,
-                        !!(req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ,
-                        !!(req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) );
-
-                /* Tell Xen to resume the vcpu */
-                if (( req.flags & VM_EVENT_FLAG_VCPU_PAUSED ) ||
-                    ( req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL ))
-                {
-                    /* Prepare the response */
-                    rsp.u.mem_paging.gfn = req.u.mem_paging.gfn;
-                    rsp.vcpu_id = req.vcpu_id;
-                    rsp.flags = req.flags;
+        /* Indicate possible error */
+        rc = 1;
 
-                    if ( xenpaging_resume_page(paging, &rsp, 0) < 0 )
-                    {
-                        PERROR("Error resuming page %"PRIx64"", req.u.mem_paging.gfn);
-                        goto out;
-                    }
-                }
-            }
-        }
+        if ( xenpaging_handle_requests(paging) < 0 )
+            goto out;
 
         /* If interrupted, write all pages back into the guest */
         if ( interrupted == SIGTERM || interrupted == SIGINT )
@@ -1010,6 +1187,9 @@ int main(int argc, char *argv[])
         /* Indicate possible error */
         rc = 1;
 
+        /* Update the access history used to choose victims */
+        policy_sample(paging);
+
         /* Check if the target has been reached already */
         tot_pages = xenpaging_get_tot_pages(paging);
         if ( tot_pages < 0 )
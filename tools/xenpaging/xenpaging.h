@@ -38,6 +38,8 @@
 #include <xen/vm_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+/* Pages nominated, evicted or loaded with one hypercall */
+#define XENPAGING_BATCH_SIZE 64
 
 struct vm_event {
     domid_t domain_id;
@@ -67,6 +69,9 @@ struct xenpaging {
     int num_paged_out;
     int target_tot_pages;
     int policy_mru_size;
+    int policy_sample_ms;
+    int policy_logdirty;
+    int prefetch;
     int use_poll_timeout;
     int debug;
     int stack_count;
@@ -76,6 +81,8 @@ struct xenpaging {
 
 #define DPRINTF(msg, args...) xtl_log(paging->logger, XTL_DETAIL, 0,      \
                                       "paging", msg, ## args)
+#define NOTICE(msg, args...)  xtl_log(paging->logger, XTL_NOTICE, 0,      \
+                                      "paging", msg, ## args)
 #define ERROR(msg, args...)   xtl_log(paging->logger, XTL_ERROR, -1,      \
                                       "paging", msg, ## args)
 #define PERROR(msg, args...)  xtl_log(paging->logger, XTL_ERROR, -1,      \
@@ -83,6 +90,7 @@ struct xenpaging {
                                       errno, strerror(errno))
 
 extern void create_page_in_thread(struct xenpaging *paging);
+extern int page_in_queue(unsigned long gfn);
 extern void page_in_trigger(void);
 
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
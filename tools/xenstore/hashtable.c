@@ -211,6 +211,31 @@ hashtable_search(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+void * /* returns value previously associated with key */
+hashtable_replace(struct hashtable *h, void *k, void *v)
+{
+    struct entry *e;
+    unsigned int hashvalue, index;
+    void *old;
+
+    hashvalue = hash(h,k);
+    index = indexFor(h->tablelength,hashvalue);
+    e = h->table[index];
+    while (NULL != e)
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
+        {
+            old = e->v;
+            e->v = v;
+            return old;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_remove(struct hashtable *h, void *k)
@@ -245,6 +270,28 @@ hashtable_remove(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*func)(void *k, void *v, void *arg), void *arg)
+{
+    unsigned int i;
+    struct entry *e, *next;
+    int ret;
+
+    for (i = 0; i < h->tablelength; i++)
+    {
+        /* Fetch next entry first, func() may remove the current one. */
+        for (e = h->table[i]; e != NULL; e = next)
+        {
+            next = e->next;
+            ret = func(e->k, e->v, arg);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
 /*****************************************************************************/
 /* destroy */
 void
@@ -54,6 +54,20 @@ hashtable_insert(struct hashtable *h, void *k, void *v);
 void *
 hashtable_search(struct hashtable *h, void *k);
 
+/*****************************************************************************
+ * hashtable_replace
+   
+ * @name        hashtable_replace
+ * @param   h   the hashtable to search
+ * @param   k   the key to search for  - does not claim ownership
+ * @param   v   the new value - does not claim ownership
+ * @return      the value previously associated with the key, or NULL if none
+ *              found (no new entry is inserted in this case)
+ */
+
+void *
+hashtable_replace(struct hashtable *h, void *k, void *v);
+
 /*****************************************************************************
  * hashtable_remove
    
@@ -76,6 +90,21 @@ hashtable_remove(struct hashtable *h, void *k);
 unsigned int
 hashtable_count(struct hashtable *h);
 
+/*****************************************************************************
+ * hashtable_iterate
+
+ * @name        hashtable_iterate
+ * @param   h   the hashtable
+ * @param   func function to call for each entry, it may remove the entry
+ *               passed to it (but no other entries)
+ * @param   arg user supplied parameter for func
+ * @return      0 if successful, or the first non-zero value returned by func
+ *              (iteration is stopped in this case)
+ */
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*func)(void *k, void *v, void *arg), void *arg);
+
 /*****************************************************************************
  * hashtable_destroy
    
@@ -9,7 +9,7 @@
 
 #include "xenstore_lib.h"
 
-/* Header of the node record in tdb. */
+/* Header of the node record in the data base. */
 struct xs_tdb_record_hdr {
 	uint64_t generation;
 	uint32_t num_perms;
@@ -52,7 +52,6 @@
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
-#include "tdb.h"
 
 #ifndef NO_SOCKETS
 #if defined(HAVE_SYSTEMD)
@@ -64,6 +63,11 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#if defined(__linux__) && !defined(NO_SOCKETS)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
 static int xce_pollfd_idx = -1;
 static struct pollfd *fds;
@@ -71,6 +75,26 @@ static unsigned int current_array_size;
 static unsigned int nr_fds;
 static unsigned int delayed_requests;
 
+/*
+ * Connections which need to be looked at in the next main loop iteration,
+ * e.g. because their event channel fired or output has been queued for them.
+ * All other connections are left alone.
+ */
+static LIST_HEAD(ready_conns);
+
+/* Some connections have been stalled due to a pending live-update. */
+static bool have_stalled_conns;
+
+#ifdef USE_EPOLL
+/*
+ * Socket connections are registered with an epoll instance, which in turn
+ * is polled together with the other file descriptors. This avoids having to
+ * add all socket connections to the pollfd array in each loop iteration.
+ */
+static int epoll_fd = -1;
+static int epoll_pollfd_idx = -1;
+#endif
+
 static int sock = -1;
 
 int orig_argc;
@@ -83,7 +107,15 @@ static bool recovery = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
+
+/*
+ * All nodes are kept in a hashtable indexed by the node name. The records
+ * are talloc()-ed children of db_ctx. read_node() doesn't copy the record,
+ * but takes a reference to it, so a node stays valid even if its record is
+ * replaced or deleted in the data base. Transactions rely on this, too.
+ */
+static struct hashtable *nodes;
+static void *db_ctx;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
@@ -328,6 +360,7 @@ static int destroy_conn(void *_conn)
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
@@ -355,6 +388,49 @@ static bool conn_can_write(struct connection *conn)
 	return !conn->is_ignored && conn->funcs->can_write(conn);
 }
 
+void conn_set_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_conns);
+}
+
+/* Check whether a domain connection needs to be looked at again. */
+static void domain_conn_recheck(struct connection *conn)
+{
+	if (conn_can_read(conn) ||
+	    (conn_can_write(conn) && !list_empty(&conn->out_list)))
+		conn_set_ready(conn);
+}
+
+/* Update the events a socket connection is waiting for. */
+static void socket_set_events(struct connection *conn)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev = { .data.ptr = conn };
+
+	if (conn->fd < 0)
+		return;
+
+	ev.events = EPOLLIN | EPOLLPRI;
+	if (!list_empty(&conn->out_list))
+		ev.events |= EPOLLOUT;
+
+	if (ev.events == conn->poll_events)
+		return;
+
+	if (epoll_ctl(epoll_fd, conn->poll_events ? EPOLL_CTL_MOD
+						  : EPOLL_CTL_ADD,
+		      conn->fd, &ev)) {
+		syslog(LOG_ERR, "epoll_ctl failed for fd %d: %m\n", conn->fd);
+		/* We'd never look at the connection again, so drop it. */
+		ignore_connection(conn, XENSTORE_ERROR_COMM);
+		return;
+	}
+
+	conn->poll_events = ev.events;
+#endif
+}
+
 /* This function returns index inside the array if succeed, -1 if fail */
 static int set_fd(int fd, short events)
 {
@@ -411,39 +487,155 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
 					POLLIN|POLLPRI);
 
-	wrl_gettime_now(&now);
-	wrl_log_periodic(now);
-
+#ifdef USE_EPOLL
+	epoll_pollfd_idx = set_fd(epoll_fd, POLLIN);
+#elif !defined(NO_SOCKETS)
 	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			wrl_check_timeout(conn->domain, now, ptimeout);
-			if (conn_can_read(conn) ||
-			    (conn_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
+		if (!conn->domain) {
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
 			conn->pollfd_idx = set_fd(conn->fd, events);
-			/*
-			 * For stalled connection, we want to process the
-			 * pending command as soon as live-update has aborted.
-			 */
-			if (conn->is_stalled && !lu_is_pending())
-				*ptimeout = 0;
 		}
 	}
-}
+#endif
+
+	wrl_gettime_now(&now);
+	wrl_log_periodic(now);
+	wrl_check_timeouts(now, ptimeout);
 
-void set_tdb_key(const char *name, TDB_DATA *key)
-{
 	/*
-	 * Dropping const is fine here, as the key will never be modified
-	 * by TDB.
+	 * For stalled connections, we want to process the pending command
+	 * as soon as live-update has finished or was aborted.
 	 */
-	key->dptr = (char *)name;
-	key->dsize = strlen(name);
+	if (have_stalled_conns && !lu_is_pending()) {
+		list_for_each_entry(conn, &connections, list)
+			if (conn->is_stalled)
+				conn_set_ready(conn);
+		have_stalled_conns = false;
+	}
+
+	if (!list_empty(&ready_conns))
+		*ptimeout = 0;
+}
+
+/* Put all socket connections with pending events on the ready list. */
+static void handle_socket_events(void)
+{
+#ifdef USE_EPOLL
+	struct connection *conn;
+	struct epoll_event events[64];
+	int i, n;
+
+	if (epoll_pollfd_idx == -1)
+		return;
+	if (fds[epoll_pollfd_idx].revents & ~POLLIN)
+		barf_perror("epoll fd poll failed");
+	epoll_pollfd_idx = -1;
+
+	n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 0);
+	if (n < 0 && errno != EINTR)
+		barf_perror("epoll_wait failed");
+
+	/* Any events not fetched now will be reported in the next round. */
+	for (i = 0; i < n; i++) {
+		conn = events[i].data.ptr;
+		conn->poll_revents = events[i].events;
+		conn_set_ready(conn);
+	}
+#elif !defined(NO_SOCKETS)
+	struct connection *conn;
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->pollfd_idx == -1)
+			continue;
+		conn->poll_revents = fds[conn->pollfd_idx].revents;
+		conn->pollfd_idx = -1;
+		if (conn->poll_revents)
+			conn_set_ready(conn);
+	}
+#endif
+}
+
+#ifdef USE_EPOLL
+static void init_epoll(void)
+{
+	struct connection *conn, *next;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll instance");
+
+	/* Register socket connections restored by live-update. */
+	list_for_each_entry_safe(conn, next, &connections, list)
+		if (!conn->domain)
+			socket_set_events(conn);
+}
+#endif
+
+static size_t db_record_size(const struct xs_tdb_record_hdr *hdr)
+{
+	return sizeof(*hdr) + hdr->num_perms * sizeof(hdr->perms[0]) +
+	       hdr->datalen + hdr->childlen;
+}
+
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size)
+{
+	const struct xs_tdb_record_hdr *hdr;
+
+	hdr = hashtable_search(nodes, (void *)db_name);
+	if (!hdr) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if (size)
+		*size = db_record_size(hdr);
+
+	return hdr;
+}
+
+int db_write(struct connection *conn, const char *db_name, void *data,
+	     size_t size)
+{
+	void *old;
+	char *key;
+
+	talloc_steal(db_ctx, data);
+
+	old = hashtable_replace(nodes, (void *)db_name, data);
+	if (old) {
+		/* Frees the record unless a node still refers to it. */
+		talloc_unlink(db_ctx, old);
+		return 0;
+	}
+
+	key = strdup(db_name);
+	if (!key || !hashtable_insert(nodes, key, data)) {
+		free(key);
+		talloc_unlink(db_ctx, data);
+		corrupt(conn, "Write of %s failed", db_name);
+		errno = ENOMEM;
+		return errno;
+	}
+
+	return 0;
+}
+
+int db_delete(struct connection *conn, const char *db_name)
+{
+	void *old;
+
+	/* Frees the key, too. */
+	old = hashtable_remove(nodes, (void *)db_name);
+	if (!old) {
+		errno = ENOENT;
+		return errno;
+	}
+
+	talloc_unlink(db_ctx, old);
+
+	return 0;
 }
 
 /*
@@ -453,7 +645,6 @@ void set_tdb_key(const char *name, TDB_DATA *key)
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name)
 {
-	TDB_DATA key, data;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
 
@@ -469,29 +660,31 @@ struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 
-	if (transaction_prepend(conn, name, &key))
-		return NULL;
+	/*
+	 * Dropping const is fine here, the only in-place modification of
+	 * a node read is done by domain_adjust_node_perms(), which would
+	 * result in the same record on each read anyway.
+	 */
+	hdr = (struct xs_tdb_record_hdr *)transaction_fetch(conn, name);
 
-	data = tdb_fetch(tdb_ctx, key);
+	if (hdr == NULL) {
+		node->generation = NO_GENERATION;
+		access_node(conn, node, NODE_ACCESS_READ);
+		talloc_free(node);
+		errno = ENOENT;
+		return NULL;
+	}
 
-	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
-			node->generation = NO_GENERATION;
-			access_node(conn, node, NODE_ACCESS_READ, NULL);
-			errno = ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+	/* Keep the record around as long as the node is referencing it. */
+	if (!talloc_reference(node, hdr)) {
 		talloc_free(node);
+		errno = ENOMEM;
 		return NULL;
 	}
 
 	node->parent = NULL;
-	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	hdr = (void *)data.dptr;
 	node->generation = hdr->generation;
 	node->perms.num = hdr->num_perms;
 	node->datalen = hdr->datalen;
@@ -509,38 +702,39 @@ struct node *read_node(struct connection *conn, const void *ctx,
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
-	access_node(conn, node, NODE_ACCESS_READ, NULL);
+	access_node(conn, node, NODE_ACCESS_READ);
 
 	return node;
 }
 
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
+int write_node_raw(struct connection *conn, struct node *node,
 		   bool no_quota_check)
 {
-	TDB_DATA data;
+	void *data;
+	size_t size;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
 
 	if (domain_adjust_node_perms(node))
 		return errno;
 
-	data.dsize = sizeof(*hdr)
+	size = sizeof(*hdr)
 		+ node->perms.num * sizeof(node->perms.p[0])
 		+ node->datalen + node->childlen;
 
 	if (!no_quota_check && domain_is_unprivileged(conn) &&
-	    data.dsize >= quota_max_entry_size) {
+	    size >= quota_max_entry_size) {
 		errno = ENOSPC;
 		return errno;
 	}
 
-	data.dptr = talloc_size(node, data.dsize);
-	if (!data.dptr) {
+	data = talloc_size(node, size);
+	if (!data) {
 		errno = ENOMEM;
 		return errno;
 	}
 
-	hdr = (void *)data.dptr;
+	hdr = data;
 	hdr->generation = node->generation;
 	hdr->num_perms = node->perms.num;
 	hdr->datalen = node->datalen;
@@ -553,24 +747,16 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key->dptr);
-		errno = EIO;
-		return errno;
-	}
-	return 0;
+	return transaction_write(conn, node->name, data, size);
 }
 
 static int write_node(struct connection *conn, struct node *node,
 		      bool no_quota_check)
 {
-	TDB_DATA key;
-
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+	if (access_node(conn, node, NODE_ACCESS_WRITE))
 		return errno;
 
-	return write_node_raw(conn, &key, node, no_quota_check);
+	return write_node_raw(conn, node, no_quota_check);
 }
 
 unsigned int perm_for_conn(struct connection *conn,
@@ -811,6 +997,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_set_ready(conn);
 
 	return;
 }
@@ -998,12 +1185,11 @@ static int do_read(struct connection *conn, struct buffered_data *in)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
-
-	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+	if (access_node(conn, node, NODE_ACCESS_DELETE))
 		return;
 
-	if (tdb_delete(tdb_ctx, key) != 0) {
+	/* In a transaction access_node() has dropped the node already. */
+	if ((!conn || !conn->transaction) && db_delete(conn, node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -1087,13 +1273,11 @@ nomem:
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	set_tdb_key(node->name, &key);
-	tdb_delete(tdb_ctx, key);
+	db_delete(NULL, node->name);
 
 	domain_entry_dec(talloc_parent(node), node);
 
@@ -1119,7 +1303,7 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 	 * node will be already existing and won't have i->parent set.
 	 * New nodes are subject to quota handling.
 	 * Initially set a destructor for all new nodes removing them from
-	 * TDB again and undoing quota accounting for the case of an error
+	 * the data base again and undoing quota accounting for the case of an error
 	 * during the write loop.
 	 */
 	for (i = node; i; i = i->parent) {
@@ -1217,8 +1401,17 @@ static void remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
 	size_t childlen = strlen(node->children + offset);
+	char *children;
 
-	memdel(node->children, offset, childlen + 1, node->childlen);
+	/* node->children might point to the data base record: copy it. */
+	children = talloc_memdup(node, node->children, node->childlen);
+	if (!children) {
+		corrupt(conn, "Can't update parent node '%s'", node->name);
+		return;
+	}
+
+	memdel(children, offset, childlen + 1, node->childlen);
+	node->children = children;
 	node->childlen -= childlen + 1;
 	if (write_node(conn, node, true))
 		corrupt(conn, "Can't update parent node '%s'", node->name);
@@ -1416,6 +1609,95 @@ static int do_set_perms(struct connection *conn, struct buffered_data *in)
 	return 0;
 }
 
+/* Operations allowed in a BATCH request. */
+static int (*const batch_funcs[XS_TYPE_COUNT])(struct connection *conn,
+					       struct buffered_data *in) = {
+	[XS_READ]      = do_read,
+	[XS_WRITE]     = do_write,
+	[XS_MKDIR]     = do_mkdir,
+	[XS_RM]        = do_rm,
+	[XS_SET_PERMS] = do_set_perms,
+};
+
+/*
+ * Space to be left in the reply of a BATCH request before performing a
+ * modifying operation: its reply is either "OK" or an error string.
+ */
+#define BATCH_REPLY_RESERVE	(sizeof(struct xsd_sockmsg) + 16)
+
+static int do_batch(struct connection *conn, struct buffered_data *in)
+{
+	struct xsd_sockmsg hdr;
+	struct buffered_data *sub;
+	char *reply;
+	unsigned int off, rlen = 0;
+	int ret;
+
+	/* Don't do anything if the request isn't valid as a whole. */
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr))
+			return EINVAL;
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    hdr.type >= XS_TYPE_COUNT || !batch_funcs[hdr.type])
+			return EINVAL;
+	}
+
+	reply = talloc_array(in, char, XENSTORE_PAYLOAD_MAX);
+	if (!reply)
+		return ENOMEM;
+
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+
+		/* Reads have no side effects, so they can be dropped below. */
+		if (hdr.type != XS_READ &&
+		    XENSTORE_PAYLOAD_MAX - rlen < BATCH_REPLY_RESERVE)
+			break;
+
+		sub = talloc_zero(in, struct buffered_data);
+		if (!sub)
+			return ENOMEM;
+		sub->hdr.msg = hdr;
+		sub->hdr.msg.tx_id = in->hdr.msg.tx_id;
+		sub->buffer = in->buffer + off + sizeof(hdr);
+		sub->used = hdr.len;
+
+		/* The reply of the operation will reuse the sub-request. */
+		conn->in = sub;
+		ret = batch_funcs[hdr.type](conn, sub);
+		if (ret)
+			send_error(conn, ret);
+		assert(conn->in == NULL);
+		list_del(&sub->list);
+
+		if (rlen + sizeof(hdr) + sub->hdr.msg.len > XENSTORE_PAYLOAD_MAX) {
+			if (rlen)
+				break;
+			/* The READ reply can't be sent at all. */
+			conn->in = sub;
+			send_error(conn, E2BIG);
+			list_del(&sub->list);
+		}
+
+		hdr = sub->hdr.msg;
+		hdr.req_id = 0;
+		hdr.tx_id = 0;
+		memcpy(reply + rlen, &hdr, sizeof(hdr));
+		memcpy(reply + rlen + sizeof(hdr), sub->buffer, hdr.len);
+		rlen += sizeof(hdr) + hdr.len;
+
+		/* Restore the length of the sub-request for advancing. */
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		talloc_free(sub);
+	}
+
+	conn->in = in;
+	send_reply(conn, XS_BATCH, reply, rlen);
+
+	return 0;
+}
+
 static struct {
 	const char *str;
 	int (*func)(struct connection *conn, struct buffered_data *in);
@@ -1453,6 +1735,7 @@ static struct {
 	    { "SET_TARGET",    do_set_target,   XS_FLAG_PRIV },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
 	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_BATCH]             = { "BATCH",             do_batch },
 };
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -1552,6 +1835,7 @@ static void consider_message(struct connection *conn)
 				  conn, false) != 0) {
 			trace("Stalling connection %p\n", conn);
 			conn->is_stalled = true;
+			have_stalled_conns = true;
 		}
 		return;
 	}
@@ -1654,8 +1938,11 @@ struct connection *new_connection(const struct interface_funcs *funcs)
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
 	INIT_LIST_HEAD(&new->delayed);
+	INIT_LIST_HEAD(&new->ready_list);
 
 	list_add_tail(&new->list, &connections);
+	/* Look at it at least once, there might be pending data already. */
+	conn_set_ready(new);
 	talloc_set_destructor(new, destroy_conn);
 	trace_create(new, "connection");
 	return new;
@@ -1717,15 +2004,12 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static bool socket_can_process(struct connection *conn, int mask)
 {
-	if (conn->pollfd_idx == -1)
-		return false;
-
-	if (fds[conn->pollfd_idx].revents & ~(POLLIN | POLLOUT)) {
+	if (conn->poll_revents & ~(POLLIN | POLLOUT)) {
 		talloc_free(conn);
 		return false;
 	}
 
-	return (fds[conn->pollfd_idx].revents & mask);
+	return (conn->poll_revents & mask);
 }
 
 static bool socket_can_write(struct connection *conn)
@@ -1755,15 +2039,14 @@ static void accept_connection(int sock)
 		return;
 
 	conn = new_connection(&socket_funcs);
-	if (conn)
+	if (conn) {
 		conn->fd = fd;
-	else
+		socket_set_events(conn);
+	} else
 		close(fd);
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1786,43 +2069,15 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
-{
-	va_list ap;
-	char *s;
-
-	va_start(ap, fmt);
-	s = talloc_vasprintf(NULL, fmt, ap);
-	va_end(ap);
-
-	if (s) {
-		trace("TDB: %s\n", s);
-		syslog(LOG_ERR, "TDB: %s",  s);
-		if (verbose)
-			xprintf("TDB: %s", s);
-		talloc_free(s);
-	} else {
-		trace("talloc failure during logging\n");
-		syslog(LOG_ERR, "talloc failure during logging\n");
-	}
-}
-
 static void setup_structure(bool live_update)
 {
-	char *tdbname;
-
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		unlink(tdbname);
+	db_ctx = talloc_named_const(talloc_autofree_context(), 0, "database");
+	if (!db_ctx)
+		barf_perror("Could not allocate data base context");
 
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags,
-			      O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+	nodes = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!nodes)
+		barf_perror("Could not create data base");
 
 	if (live_update)
 		manual_node("/", NULL);
@@ -1835,7 +2090,7 @@ static void setup_structure(bool live_update)
 	check_store();
 }
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1848,7 +2103,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1985,32 +2240,16 @@ static int check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(void *k, void *v, void *arg)
 {
-	struct hashtable *reachable = private;
-	char *slash;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	struct hashtable *reachable = arg;
 
-	if (!name) {
-		log("clean_store: ENOMEM");
-		return 1;
+	if (!hashtable_search(reachable, k)) {
+		log("clean_store: '%s' is orphaned!", (char *)k);
+		if (recovery)
+			db_delete(NULL, k);
 	}
 
-	if (name[0] != '/') {
-		slash = strchr(name, '/');
-		if (slash)
-			*slash = 0;
-	}
-	if (!hashtable_search(reachable, name)) {
-		log("clean_store: '%s' is orphaned!", name);
-		if (recovery) {
-			tdb_delete(tdb, key);
-		}
-	}
-
-	talloc_free(name);
-
 	return 0;
 }
 
@@ -2021,7 +2260,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	hashtable_iterate(nodes, clean_store_, reachable);
 }
 
 
@@ -2041,8 +2280,7 @@ void check_store(void)
 	}
 
 	log("Checking store ...");
-	if (!check_store_(root, reachable) &&
-	    !check_transactions(reachable))
+	if (!check_store_(root, reachable))
 		clean_store(reachable);
 	log("Checking store complete.");
 
@@ -2136,7 +2374,7 @@ static void usage(void)
 "  -M, --path-max <chars>  limit the allowed Xenstore node path length,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -I, --internal-db       ignored, database is always kept in memory\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
 
@@ -2217,7 +2455,7 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			/* Data base is always in memory. */
 			break;
 		case 'V':
 			verbose = true;
@@ -2315,6 +2553,10 @@ int main(int argc, char *argv[])
 		lu_read_state();
 #endif
 
+#ifdef USE_EPOLL
+	init_epoll();
+#endif
+
 	/* Get ready to listen to the tools. */
 	initialize_fds(&sock_pollfd_idx, &timeout);
 
@@ -2327,7 +2569,8 @@ int main(int argc, char *argv[])
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
+		struct connection *conn;
+		LIST_HEAD(ready);
 
 		if (poll(fds, nr_fds, timeout) < 0) {
 			if (errno == EINTR)
@@ -2371,7 +2614,18 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		list_for_each_entry_safe(conn, next, &connections, list) {
+		handle_socket_events();
+
+		/*
+		 * Connections becoming ready while processing the current
+		 * ones will be handled in the next iteration. Connections
+		 * being freed are removed from either list by destroy_conn().
+		 */
+		list_splice_init(&ready_conns, &ready);
+		while ((conn = list_top(&ready, struct connection,
+					ready_list))) {
+			list_del_init(&conn->ready_list);
+
 			talloc_increase_ref_count(conn);
 
 			if (conn_can_read(conn))
@@ -2386,7 +2640,11 @@ int main(int argc, char *argv[])
 			if (talloc_free(conn) == 0)
 				continue;
 
-			conn->pollfd_idx = -1;
+			conn->poll_revents = 0;
+			if (conn->domain)
+				domain_conn_recheck(conn);
+			else
+				socket_set_events(conn);
 		}
 
 		if (delayed_requests) {
@@ -2550,23 +2808,17 @@ static const char *dump_state_node_tree(FILE *fp, char *path,
 	unsigned int pathlen, childlen, p = 0;
 	struct xs_state_record_header head;
 	struct xs_state_node sn;
-	TDB_DATA key, data;
 	const struct xs_tdb_record_hdr *hdr;
 	const char *child;
 	const char *ret;
 
 	pathlen = strlen(path) + 1;
 
-	set_tdb_key(path, &key);
-	data = tdb_fetch(tdb_ctx, key);
-	if (data.dptr == NULL)
+	/* Not modified while dumping the state: no need to copy the node. */
+	hdr = db_fetch(path, NULL);
+	if (hdr == NULL)
 		return "Error reading node";
 
-	/* Clean up in case of failure. */
-	talloc_steal(path, data.dptr);
-
-	hdr = (void *)data.dptr;
-
 	head.type = XS_STATE_TYPE_NODE;
 	head.length = sizeof(sn);
 	sn.conn_id = 0;
@@ -2623,8 +2875,6 @@ static const char *dump_state_node_tree(FILE *fp, char *path,
 		child += childlen;
 	}
 
-	talloc_free(data.dptr);
-
 	return NULL;
 }
 
@@ -2749,7 +2999,6 @@ void read_state_node(const void *ctx, const void *state)
 {
 	const struct xs_state_node *sn = state;
 	struct node *node, *parent;
-	TDB_DATA key;
 	char *name, *parentname;
 	unsigned int i;
 	struct connection conn = { .id = priv_domid };
@@ -2806,12 +3055,10 @@ void read_state_node(const void *ctx, const void *state)
 	if (add_child(node, parent, name))
 		barf("allocation error restoring node");
 
-	set_tdb_key(parentname, &key);
-	if (write_node_raw(NULL, &key, parent, true))
+	if (write_node_raw(NULL, parent, true))
 		barf("write parent error restoring node");
 
-	set_tdb_key(name, &key);
-	if (write_node_raw(NULL, &key, node, true))
+	if (write_node_raw(NULL, node, true))
 		barf("write node error restoring node");
 	domain_entry_inc(&conn, node);
 
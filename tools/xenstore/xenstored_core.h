@@ -32,7 +32,6 @@
 #include "xenstore_lib.h"
 #include "xenstore_state.h"
 #include "list.h"
-#include "tdb.h"
 #include "hashtable.h"
 
 #ifndef O_CLOEXEC
@@ -103,6 +102,12 @@ struct connection
 	int fd;
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
+	/* Events waited for and events reported for the file descriptor. */
+	unsigned int poll_events;
+	unsigned int poll_revents;
+
+	/* Entry in the list of connections needing attention. */
+	struct list_head ready_list;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -140,6 +145,10 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Cached watch permission check result of the last fire_watches(). */
+	unsigned int watch_perm_gen;
+	bool watch_perm_ok;
+
 	/* Methods for communicating over this connection. */
 	const struct interface_funcs *funcs;
 
@@ -196,11 +205,11 @@ char *canonicalize(struct connection *conn, const void *ctx, const char *node);
 unsigned int perm_for_conn(struct connection *conn,
 			   const struct node_perms *perms);
 
-/* Write a node to the tdb data base. */
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
+/* Write a node to the data base. */
+int write_node_raw(struct connection *conn, struct node *node,
 		   bool no_quota_check);
 
-/* Get a node from the tdb data base. */
+/* Get a node from the data base. */
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name);
 
@@ -233,7 +242,6 @@ extern char **orig_argv;
 extern char *tracefile;
 extern int tracefd;
 
-extern TDB_CONTEXT *tdb_ctx;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -264,9 +272,24 @@ extern const struct interface_funcs socket_funcs;
 #endif
 extern xengnttab_handle **xgt_handle;
 
+/* Have the connection looked at in the next main loop iteration. */
+void conn_set_ready(struct connection *conn);
+
 int remember_string(struct hashtable *hash, const char *str);
 
-void set_tdb_key(const char *name, TDB_DATA *key);
+/* Hash table helpers for nul-terminated string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
+/*
+ * Data base access. Records are owned by the data base and must not be
+ * modified by the caller of db_fetch(). db_write() takes ownership of the
+ * talloc()-ed record passed to it.
+ */
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size);
+int db_write(struct connection *conn, const char *db_name, void *data,
+	     size_t size);
+int db_delete(struct connection *conn, const char *db_name);
 
 const char *dump_state_global(FILE *fp);
 const char *dump_state_buffered_data(FILE *fp, const struct connection *c,
@@ -82,10 +82,20 @@ struct domain
 	wrl_creditt wrl_credit; /* [ -wrl_config_writecost, +_dburst ] */
 	struct wrl_timestampt wrl_timestamp;
 	bool wrl_delay_logged;
+
+	/* Entry in wrl_blocked_domains while wrl_credit is negative. */
+	struct list_head wrl_list;
 };
 
 static LIST_HEAD(domains);
 
+/* Domains waiting for their write rate limit credit to become positive. */
+static LIST_HEAD(wrl_blocked_domains);
+
+/* Domains indexed by the local port of their event channel. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -208,11 +218,43 @@ static void unmap_interface(void *interface)
 	xengnttab_unmap(*xgt_handle, interface, 1);
 }
 
+static bool domain_set_port(struct domain *domain, evtchn_port_t port)
+{
+	struct domain **new;
+	unsigned int size;
+
+	if (domain->port && domain->port < nr_port_domains)
+		port_domains[domain->port] = NULL;
+	domain->port = port;
+
+	if (!port)
+		return true;
+
+	if (port >= nr_port_domains) {
+		size = max(port + 1, 2 * nr_port_domains);
+		new = talloc_realloc(talloc_autofree_context(), port_domains,
+				     struct domain *, size);
+		if (!new) {
+			domain->port = 0;
+			return false;
+		}
+		memset(new + nr_port_domains, 0,
+		       (size - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = size;
+	}
+
+	port_domains[port] = domain;
+
+	return true;
+}
+
 static int destroy_domain(void *_domain)
 {
 	struct domain *domain = _domain;
 
 	list_del(&domain->list);
+	list_del(&domain->wrl_list);
 
 	if (!domain->introduced)
 		return 0;
@@ -220,6 +262,7 @@ static int destroy_domain(void *_domain)
 	if (domain->port) {
 		if (xenevtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
+		domain_set_port(domain, 0);
 	}
 
 	if (domain->interface) {
@@ -285,16 +328,21 @@ void check_domains(void)
 		fire_watches(NULL, NULL, "@releaseDomain", NULL, true, NULL);
 }
 
-/* We scan all domains rather than use the information given here. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xenevtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
 	if (port == virq_port)
 		check_domains();
+	else if (port < nr_port_domains) {
+		domain = port_domains[port];
+		if (domain && domain->conn)
+			conn_set_ready(domain->conn);
+	}
 
 	if (xenevtchn_unmask(xce_handle, port) == -1)
 		barf_perror("Failed to write to event fd");
@@ -340,6 +388,8 @@ static struct domain *alloc_domain(const void *context, unsigned int domid)
 	domain->domid = domid;
 	domain->generation = generation;
 	domain->introduced = false;
+	domain->port = 0;
+	INIT_LIST_HEAD(&domain->wrl_list);
 
 	talloc_set_destructor(domain, destroy_domain);
 
@@ -360,7 +410,7 @@ static int new_domain(struct domain *domain, int port, bool restore)
 {
 	int rc;
 
-	domain->port = 0;
+	domain_set_port(domain, 0);
 	domain->shutdown = false;
 	domain->path = talloc_domain_path(domain, domain->domid);
 	if (!domain->path) {
@@ -370,15 +420,19 @@ static int new_domain(struct domain *domain, int port, bool restore)
 
 	wrl_domain_new(domain);
 
-	if (restore)
-		domain->port = port;
-	else {
+	if (!restore) {
 		/* Tell kernel we're interested in this event. */
 		rc = xenevtchn_bind_interdomain(xce_handle, domain->domid,
 						port);
 		if (rc == -1)
 			return errno;
-		domain->port = rc;
+		port = rc;
+	}
+	if (!domain_set_port(domain, port)) {
+		if (!restore)
+			xenevtchn_unbind(xce_handle, port);
+		errno = ENOMEM;
+		return errno;
 	}
 
 	domain->introduced = true;
@@ -507,7 +561,13 @@ static struct domain *introduce_domain(const void *ctx,
 		if (domain->port)
 			xenevtchn_unbind(xce_handle, domain->port);
 		rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
-		domain->port = (rc == -1) ? 0 : rc;
+		if (rc != -1 && !domain_set_port(domain, rc)) {
+			xenevtchn_unbind(xce_handle, rc);
+			rc = -1;
+		}
+		if (rc == -1)
+			domain_set_port(domain, 0);
+		conn_set_ready(domain->conn);
 	}
 
 	return domain;
@@ -1107,9 +1167,9 @@ void wrl_credit_update(struct domain *domain, struct wrl_timestampt now)
 	      (long)surplus);
 }
 
-void wrl_check_timeout(struct domain *domain,
-		       struct wrl_timestampt now,
-		       int *ptimeout)
+static void wrl_check_timeout(struct domain *domain,
+			      struct wrl_timestampt now,
+			      int *ptimeout)
 {
 	uint64_t num, denom;
 	int wakeup;
@@ -1142,6 +1202,21 @@ void wrl_check_timeout(struct domain *domain,
 	      wakeup);
 }
 
+void wrl_check_timeouts(struct wrl_timestampt now, int *ptimeout)
+{
+	struct domain *domain, *tmp;
+
+	list_for_each_entry_safe(domain, tmp, &wrl_blocked_domains, wrl_list) {
+		wrl_check_timeout(domain, now, ptimeout);
+		if (domain->wrl_credit >= 0) {
+			/* Process requests held back by the rate limit. */
+			list_del_init(&domain->wrl_list);
+			if (domain->conn)
+				conn_set_ready(domain->conn);
+		}
+	}
+}
+
 #define WRL_LOG(now, ...) \
 	(syslog(LOG_WARNING, "write rate limit: " __VA_ARGS__))
 
@@ -1162,6 +1237,8 @@ void wrl_apply_debit_actual(struct domain *domain)
 	      (long)domain->wrl_credit, (long)wrl_reserve);
 
 	if (domain->wrl_credit < 0) {
+		if (list_empty(&domain->wrl_list))
+			list_add_tail(&domain->wrl_list, &wrl_blocked_domains);
 		if (!domain->wrl_delay_logged) {
 			domain->wrl_delay_logged = true;
 			WRL_LOG(now, "domain %ld is affected\n",
@@ -91,9 +91,7 @@ void wrl_gettime_now(struct wrl_timestampt *now_ts);
 void wrl_domain_new(struct domain *domain);
 void wrl_domain_destroy(struct domain *domain);
 void wrl_credit_update(struct domain *domain, struct wrl_timestampt now);
-void wrl_check_timeout(struct domain *domain,
-                       struct wrl_timestampt now,
-                       int *ptimeout);
+void wrl_check_timeouts(struct wrl_timestampt now, int *ptimeout);
 void wrl_log_periodic(struct wrl_timestampt now);
 void wrl_apply_debit_direct(struct connection *conn);
 void wrl_apply_debit_trans_commit(struct connection *conn);
@@ -34,13 +34,14 @@
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
 #include "xenstore_lib.h"
+#include "hashtable.h"
 #include "utils.h"
 
 /*
  * Some notes regarding detection and handling of transaction conflicts:
  *
  * Basic source of reference is the 'generation' count. Each writing access
- * (either normal write or in a transaction) to the tdb data base will set
+ * (either normal write or in a transaction) to the data base will set
  * the node specific generation count to the global generation count.
  * For being able to identify a transaction the transaction specific generation
  * count is initialized with the global generation count when starting the
@@ -106,6 +107,15 @@
  *    TA2: write node A:   g(2:A) = 6, G = 7
  *    End TA1: g(1:A) == g(A) => okay, B = 1:B, g(B) = 7, G = 8
  *    End TA2: g(2:B) != g(B) => EAGAIN
+ *
+ * Nodes are never copied for a transaction. Records in the data base are
+ * immutable and reference counted, so the first access of a node in a
+ * transaction just takes a reference of the current record. Subsequent
+ * accesses of the node in the transaction will see this record, even if the
+ * node has been modified or deleted in the global data base meanwhile. A
+ * node written in the transaction gets a new record, which is kept in the
+ * transaction. When the transaction is committed, these records are moved
+ * to the data base without any copying.
  */
 
 struct accessed_node
@@ -122,14 +132,19 @@ struct accessed_node
 	/* Original node permissions. */
 	struct node_perms perms;
 
+	/*
+	 * Node record as seen by the transaction, NULL if there is no node.
+	 * Either a reference to the record read from the data base, or the
+	 * record written in the transaction.
+	 */
+	struct xs_tdb_record_hdr *record;
+	size_t size;
+
 	/* Generation count checking required? */
 	bool check_gen;
 
 	/* Modified? */
 	bool modified;
-
-	/* Transaction node in data base? */
-	bool ta_node;
 };
 
 struct changed_domain
@@ -158,6 +173,9 @@ struct transaction
 	/* List of accessed nodes. */
 	struct list_head accessed;
 
+	/* Accessed nodes indexed by their name. */
+	struct hashtable *accessed_hash;
+
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
 
@@ -171,42 +189,66 @@ uint64_t generation;
 static struct accessed_node *find_accessed_node(struct transaction *trans,
 						const char *name)
 {
-	struct accessed_node *i;
+	return hashtable_search(trans->accessed_hash, (void *)name);
+}
+
+static int add_accessed_node(struct transaction *trans,
+			     struct accessed_node *i)
+{
+	char *key = strdup(i->node);
 
-	list_for_each_entry(i, &trans->accessed, list)
-		if (streq(i->node, name))
-			return i;
+	if (!key || !hashtable_insert(trans->accessed_hash, key, i)) {
+		free(key);
+		return ENOMEM;
+	}
 
-	return NULL;
+	list_add_tail(&i->list, &trans->accessed);
+
+	return 0;
 }
 
-static char *transaction_get_node_name(void *ctx, struct transaction *trans,
-				       const char *name)
+/*
+ * Get the record of a node as seen by the connection. In a transaction
+ * nodes accessed before are taken from the transaction.
+ */
+const struct xs_tdb_record_hdr *transaction_fetch(struct connection *conn,
+						  const char *name)
 {
-	return talloc_asprintf(ctx, "%"PRIu64"/%s", trans->generation, name);
+	struct accessed_node *i;
+
+	if (conn && conn->transaction) {
+		i = find_accessed_node(conn->transaction, name);
+		if (i) {
+			if (!i->record)
+				errno = ENOENT;
+			return i->record;
+		}
+	}
+
+	return db_fetch(name, NULL);
 }
 
 /*
- * Prepend the transaction to name if node has been modified in the current
- * transaction.
+ * Write the record of a node, which is taken over. In a transaction the
+ * record is kept in the transaction until it is committed.
  */
-int transaction_prepend(struct connection *conn, const char *name,
-			TDB_DATA *key)
+int transaction_write(struct connection *conn, const char *name, void *data,
+		      size_t size)
 {
-	char *tdb_name;
+	struct accessed_node *i;
 
-	if (!conn || !conn->transaction ||
-	    !find_accessed_node(conn->transaction, name)) {
-		set_tdb_key(name, key);
-		return 0;
-	}
+	if (!conn || !conn->transaction)
+		return db_write(conn, name, data, size);
 
-	tdb_name = transaction_get_node_name(conn->transaction,
-					     conn->transaction, name);
-	if (!tdb_name)
-		return errno;
+	/* access_node() has been called for this node before. */
+	i = find_accessed_node(conn->transaction, name);
+	assert(i);
 
-	set_tdb_key(tdb_name, key);
+	if (i->record)
+		talloc_unlink(i, i->record);
+	i->record = talloc_steal(i, data);
+	i->size = size;
+	i->modified = true;
 
 	return 0;
 }
@@ -218,20 +260,18 @@ int transaction_prepend(struct connection *conn, const char *name,
  * node->generation).
  *
  * Accesses in a transaction will be added to the list of accessed nodes
- * if not already done. Read type accesses will copy the node to the
- * transaction specific data base part, write type accesses go there
- * anyway.
- *
- * If not NULL, key will be supplied with name and length of name of the node
- * to be accessed in the data base.
+ * if not already done, taking a reference of the node's record in the data
+ * base. Write type accesses will replace the record via transaction_write(),
+ * delete type accesses drop the record. Only a successful write or a delete
+ * marks the node as modified, so a record still shared with the data base is
+ * never written back (e.g. when writing the new record failed).
  */
 int access_node(struct connection *conn, struct node *node,
-		enum node_access_type type, TDB_DATA *key)
+		enum node_access_type type)
 {
 	struct accessed_node *i = NULL;
 	struct transaction *trans;
-	TDB_DATA local_key;
-	const char *trans_name = NULL;
+	const struct xs_tdb_record_hdr *hdr;
 	int ret;
 	bool introduce = false;
 
@@ -243,17 +283,11 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (!conn || !conn->transaction) {
 		/* They're changing the global database. */
-		if (key)
-			set_tdb_key(node->name, key);
 		return 0;
 	}
 
 	trans = conn->transaction;
 
-	trans_name = transaction_get_node_name(node, trans, node->name);
-	if (!trans_name)
-		goto nomem;
-
 	i = find_accessed_node(trans, node->name);
 	if (!i) {
 		i = talloc_zero(trans, struct accessed_node);
@@ -273,50 +307,48 @@ int access_node(struct connection *conn, struct node *node,
 		}
 
 		introduce = true;
-		i->ta_node = false;
 
 		/*
-		 * Additional transaction-specific node for read type. We only
-		 * have to verify read nodes if we didn't write them.
-		 *
-		 * The node is created and written to DB here to distinguish
-		 * from the write types.
+		 * Keep the record of the node, so the transaction will see
+		 * the same node contents on further accesses, even if writing
+		 * the node fails. We only have to verify read nodes if we
+		 * didn't write them.
 		 */
 		if (type == NODE_ACCESS_READ) {
 			i->generation = node->generation;
 			i->check_gen = true;
-			if (node->generation != NO_GENERATION) {
-				set_tdb_key(trans_name, &local_key);
-				ret = write_node_raw(conn, &local_key, node, true);
-				if (ret)
-					goto err;
-				i->ta_node = true;
-			}
 		}
-		list_add_tail(&i->list, &trans->accessed);
+		hdr = db_fetch(node->name, &i->size);
+		if (hdr) {
+			i->record = talloc_reference(i, hdr);
+			if (!i->record)
+				goto nomem;
+		} else if (type == NODE_ACCESS_READ &&
+			   node->generation != NO_GENERATION)
+			goto nomem;
+
+		ret = add_accessed_node(trans, i);
+		if (ret)
+			goto err;
 	}
 
-	if (type != NODE_ACCESS_READ)
+	if (type == NODE_ACCESS_DELETE) {
 		i->modified = true;
+		if (i->record) {
+			talloc_unlink(i, i->record);
+			i->record = NULL;
+		}
+	}
 
 	if (introduce && type == NODE_ACCESS_DELETE)
 		/* Nothing to delete. */
 		return -1;
 
-	if (key) {
-		set_tdb_key(trans_name, key);
-		if (type == NODE_ACCESS_WRITE)
-			i->ta_node = true;
-		if (type == NODE_ACCESS_DELETE)
-			i->ta_node = false;
-	}
-
 	return 0;
 
 nomem:
 	ret = ENOMEM;
 err:
-	talloc_free((void *)trans_name);
 	talloc_free(i);
 	trans->fail = true;
 	errno = ret;
@@ -326,73 +358,46 @@ err:
 /*
  * Finalize transaction:
  * Walk through accessed nodes and check generation against global data.
- * If all entries match, read the transaction entries and write them without
- * transaction prepended. Delete all transaction specific nodes in the data
- * base.
+ * If all entries match, move the records of the modified nodes to the data
+ * base and delete the nodes deleted in the transaction.
  */
 static int finalize_transaction(struct connection *conn,
 				struct transaction *trans)
 {
 	struct accessed_node *i;
-	TDB_DATA key, ta_key, data;
-	struct xs_tdb_record_hdr *hdr;
+	const struct xs_tdb_record_hdr *hdr;
 	uint64_t gen;
-	char *trans_name;
 	int ret;
 
 	list_for_each_entry(i, &trans->accessed, list) {
 		if (!i->check_gen)
 			continue;
 
-		set_tdb_key(i->node, &key);
-		data = tdb_fetch(tdb_ctx, key);
-		hdr = (void *)data.dptr;
-		if (!data.dptr) {
-			if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-				return EIO;
-			gen = NO_GENERATION;
-		} else
-			gen = hdr->generation;
-		talloc_free(data.dptr);
+		hdr = db_fetch(i->node, NULL);
+		gen = hdr ? hdr->generation : NO_GENERATION;
 		if (i->generation != gen)
 			return EAGAIN;
 	}
 
-	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		trans_name = transaction_get_node_name(i, trans, i->node);
-		if (!trans_name)
-			/* We are doomed: the transaction is only partial. */
-			goto err;
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
 
-		set_tdb_key(trans_name, &ta_key);
-
-		if (i->modified) {
-			set_tdb_key(i->node, &key);
-			if (i->ta_node) {
-				data = tdb_fetch(tdb_ctx, ta_key);
-				if (!data.dptr)
-					goto err;
-				hdr = (void *)data.dptr;
-				hdr->generation = ++generation;
-				ret = tdb_store(tdb_ctx, key, data,
-						TDB_REPLACE);
-				talloc_free(data.dptr);
-				if (ret)
-					goto err;
-				fire_watches(conn, trans, i->node, NULL, false,
-					     i->perms.p ? &i->perms : NULL);
-			} else {
-				fire_watches(conn, trans, i->node, NULL, false,
-					     i->perms.p ? &i->perms : NULL);
-				if (tdb_delete(tdb_ctx, key))
-					goto err;
-			}
+		if (i->record) {
+			/* Modified records are owned by the transaction. */
+			i->record->generation = ++generation;
+			ret = db_write(conn, i->node, i->record, i->size);
+			i->record = NULL;
+			if (ret)
+				goto err;
+			fire_watches(conn, trans, i->node, NULL, false,
+				     i->perms.p ? &i->perms : NULL);
+		} else {
+			fire_watches(conn, trans, i->node, NULL, false,
+				     i->perms.p ? &i->perms : NULL);
+			/* Nodes created in the transaction aren't there. */
+			db_delete(conn, i->node);
 		}
-
-		if (i->ta_node && tdb_delete(tdb_ctx, ta_key))
-			goto err;
-		list_del(&i->list);
-		talloc_free(i);
 	}
 
 	return 0;
@@ -405,24 +410,12 @@ err:
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
-	struct accessed_node *i;
-	char *trans_name;
-	TDB_DATA key;
 
 	wrl_ntransactions--;
 	trace_destroy(trans, "transaction");
-	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		if (i->ta_node) {
-			trans_name = transaction_get_node_name(i, trans,
-							       i->node);
-			if (trans_name) {
-				set_tdb_key(trans_name, &key);
-				tdb_delete(tdb_ctx, key);
-			}
-		}
-		list_del(&i->list);
-		talloc_free(i);
-	}
+
+	/* The accessed nodes are freed together with the transaction. */
+	hashtable_destroy(trans->accessed_hash, 0);
 
 	return 0;
 }
@@ -458,6 +451,13 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	if (!trans)
 		return ENOMEM;
 
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		talloc_free(trans);
+		return ENOMEM;
+	}
+
 	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changed_domains);
 	trans->fail = false;
@@ -596,41 +596,6 @@ void conn_delete_all_transactions(struct connection *conn)
 	conn->ta_start_time = 0;
 }
 
-int check_transactions(struct hashtable *hash)
-{
-	struct connection *conn;
-	struct transaction *trans;
-	struct accessed_node *i;
-	char *tname, *tnode;
-
-	list_for_each_entry(conn, &connections, list) {
-		list_for_each_entry(trans, &conn->transaction_list, list) {
-			tname = talloc_asprintf(trans, "%"PRIu64,
-						trans->generation);
-			if (!tname || !remember_string(hash, tname))
-				goto nomem;
-
-			list_for_each_entry(i, &trans->accessed, list) {
-				if (!i->ta_node)
-					continue;
-				tnode = transaction_get_node_name(tname, trans,
-								  i->node);
-				if (!tnode || !remember_string(hash, tnode))
-					goto nomem;
-				talloc_free(tnode);
-			}
-
-			talloc_free(tname);
-		}
-	}
-
-	return 0;
-
-nomem:
-	talloc_free(tname);
-	return ENOMEM;
-}
-
 /*
  * Local variables:
  *  mode: C
@@ -40,13 +40,14 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 
 /* This node was accessed. */
 int access_node(struct connection *conn, struct node *node,
-                enum node_access_type type, TDB_DATA *key);
+                enum node_access_type type);
 
-/* Prepend the transaction to name if appropriate. */
-int transaction_prepend(struct connection *conn, const char *name,
-                        TDB_DATA *key);
+/* Get or set a node record, taking the transaction into account. */
+const struct xs_tdb_record_hdr *transaction_fetch(struct connection *conn,
+                                                  const char *name);
+int transaction_write(struct connection *conn, const char *name, void *data,
+                      size_t size);
 
 void conn_delete_all_transactions(struct connection *conn);
-int check_transactions(struct hashtable *hash);
 
 #endif /* _XENSTORED_TRANSACTION_H */
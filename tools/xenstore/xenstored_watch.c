@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -37,6 +38,12 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (see struct watch_path). */
+	struct list_head path_list;
+
+	/* Connection owning this watch. */
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -47,6 +54,21 @@ struct watch
 	char *node;
 };
 
+/*
+ * All watches registered for one path. The watch_index hashtable maps a
+ * watch path to its struct watch_path, so firing watches for a node needs
+ * only one lookup per path component instead of a scan of all watches.
+ */
+struct watch_path
+{
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
+/* Generation of the current fire_watches() call, see watch_perm_gen. */
+static unsigned int fire_gen;
+
 static bool check_special_event(const char *name)
 {
 	assert(name);
@@ -54,22 +76,56 @@ static bool check_special_event(const char *name)
 	return strstarts(name, "@");
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+static struct watch_path *watch_path_find(const char *path)
 {
-	unsigned int len = strlen(parent);
+	if (!watch_index)
+		return NULL;
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	return hashtable_search(watch_index, (void *)path);
+}
+
+static int watch_index_add(struct watch *watch)
+{
+	struct watch_path *wp;
+	char *key;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return ENOMEM;
+	}
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+	wp = watch_path_find(watch->node);
+	if (!wp) {
+		wp = malloc(sizeof(*wp));
+		key = strdup(watch->node);
+		if (!wp || !key ||
+		    !hashtable_insert(watch_index, key, wp)) {
+			free(wp);
+			free(key);
+			return ENOMEM;
+		}
+		INIT_LIST_HEAD(&wp->watches);
+	}
 
-	return child[len] == '/' || child[len] == '\0';
+	list_add_tail(&watch->path_list, &wp->watches);
+
+	return 0;
+}
+
+static void watch_index_del(struct watch *watch)
+{
+	struct watch_path *wp;
+
+	list_del(&watch->path_list);
+
+	wp = watch_path_find(watch->node);
+	if (wp && list_empty(&wp->watches)) {
+		/* Frees the key, too. */
+		hashtable_remove(watch_index, watch->node);
+		free(wp);
+	}
 }
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
@@ -159,48 +215,100 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 	return perm & XS_PERM_READ;
 }
 
+/*
+ * Queue events for all watches registered for exactly the given path.
+ * The permission check is done only once per connection and fire_watches()
+ * call, its result is cached in the connection.
+ */
+static void fire_watch_path(const void *ctx, const char *path,
+			    const char *name, struct node *node,
+			    struct node_perms *perms)
+{
+	struct watch_path *wp;
+	struct watch *watch;
+	struct connection *i;
+
+	wp = watch_path_find(path);
+	if (!wp)
+		return;
+
+	list_for_each_entry(watch, &wp->watches, path_list) {
+		i = watch->conn;
+
+		if (i->watch_perm_gen != fire_gen) {
+			i->watch_perm_gen = fire_gen;
+			/* introduce/release domain watches */
+			if (check_special_event(name))
+				i->watch_perm_ok = check_perms_special(name, i);
+			else
+				i->watch_perm_ok = watch_permitted(i, ctx, name,
+								   node, perms);
+		}
+
+		if (i->watch_perm_ok)
+			add_event(i, ctx, watch, name);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
  * We need to take the (potential) old permissions of the node into account
  * as a watcher losing permissions to access a node should receive the
  * watch event, too.
+ * Only the watches registered for the node itself and (unless exact is set)
+ * for its ancestors are visited.
  */
 void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  struct node *node, bool exact, struct node_perms *perms)
 {
-	struct connection *i;
-	struct watch *watch;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		/* introduce/release domain watches */
-		if (check_special_event(name)) {
-			if (!check_perms_special(name, i))
-				continue;
-		} else {
-			if (!watch_permitted(i, ctx, name, node, perms))
-				continue;
-		}
+	if (!watch_index || !hashtable_count(watch_index))
+		return;
+
+	/* Skip generation 0, it is the initial value in new connections. */
+	if (!++fire_gen)
+		fire_gen++;
 
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					add_event(i, ctx, watch, name);
-			} else {
-				if (is_child(name, watch->node))
-					add_event(i, ctx, watch, name);
-			}
+	fire_watch_path(ctx, name, name, node, perms);
+
+	if (exact)
+		return;
+
+	/* As for any other node, a watch on "/" matches special events. */
+	if (check_special_event(name)) {
+		fire_watch_path(ctx, "/", name, node, perms);
+		return;
+	}
+
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+
+	while ((slash = strrchr(path, '/')) != NULL) {
+		if (slash == path) {
+			/* "/" matches everything. */
+			if (path[1])
+				fire_watch_path(ctx, "/", name, node, perms);
+			break;
 		}
+		*slash = '\0';
+		fire_watch_path(ctx, path, name, node, perms);
 	}
+
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	watch_index_del(watch);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -249,6 +357,13 @@ static struct watch *add_watch(struct connection *conn, char *path, char *token,
 
 	INIT_LIST_HEAD(&watch->events);
 
+	watch->conn = conn;
+	errno = watch_index_add(watch);
+	if (errno) {
+		talloc_free(watch);
+		return NULL;
+	}
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	talloc_set_destructor(watch, destroy_watch);
@@ -61,8 +61,10 @@ long hvm_grant_table_op(
     case GNTTABOP_set_version:
     case GNTTABOP_get_version:
     case GNTTABOP_copy:
+    case GNTTABOP_copy_segs:
     case GNTTABOP_map_grant_ref:
     case GNTTABOP_unmap_grant_ref:
+    case GNTTABOP_unmap_flush:
     case GNTTABOP_swap_grant_ref:
         break;
 
@@ -22,7 +22,8 @@
 #ifndef __ASM_X86_MEM_PAGING_H__
 #define __ASM_X86_MEM_PAGING_H__
 
-int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg);
+int mem_paging_memop(unsigned long cmd,
+                     XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg);
 
 #ifdef CONFIG_MEM_PAGING
 # define mem_paging_enabled(d) vm_event_check_ring((d)->vm_event_paging)
@@ -21,7 +21,9 @@
 
 
 #include <asm/p2m.h>
+#include <xen/event.h>
 #include <xen/guest_access.h>
+#include <xen/hypercall.h>
 #include <xen/vm_event.h>
 #include <xsm/xsm.h>
 
@@ -275,8 +277,13 @@ static int nominate(struct domain *d, gfn_t gfn)
  * this case eviction can not be done. If the gfn was populated before the pager
  * could evict it, eviction can not be done either. In this case the gfn is
  * still backed by a mfn.
+ *
+ * On success the page is returned in @to_free, and has to be released with
+ * evict_free() once the p2m lock was dropped, i.e. after the TLB flush for
+ * the p2m change.  This allows a caller to evict several gfns under a single
+ * p2m lock, and with a single flush.
  */
-static int evict(struct domain *d, gfn_t gfn)
+static int evict(struct domain *d, gfn_t gfn, struct page_info **to_free)
 {
     struct page_info *page;
     p2m_type_t p2mt;
@@ -316,14 +323,14 @@ static int evict(struct domain *d, gfn_t gfn)
     ret = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
                         p2m_ram_paged, a);
 
-    /* Clear content before returning the page to Xen */
-    scrub_one_page(page);
-
     /* Track number of paged gfns */
     atomic_inc(&d->paged_pages);
 
+    /* Our reference is dropped by evict_free() */
+    *to_free = page;
+    goto out;
+
  out_put:
-    /* Put the page back so it gets freed */
     put_page(page);
 
  out:
@@ -331,6 +338,15 @@ static int evict(struct domain *d, gfn_t gfn)
     return ret;
 }
 
+static void evict_free(struct page_info *page)
+{
+    /* Clear content before returning the page to Xen */
+    scrub_one_page(page);
+
+    /* Put the page back so it gets freed */
+    put_page(page);
+}
+
 /*
  * prepare - Allocate a new page for the guest
  * @d: guest domain
@@ -438,8 +454,85 @@ static int prepare(struct domain *d, gfn_t gfn,
     return ret;
 }
 
-int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
+#define BATCH_CHUNK 32
+
+/*
+ * batch - Perform a nominate, evict or prepare for each gfn of a list
+ * @d: guest domain
+ * @mpo: batched operation
+ * @done: index of the next gfn of the list
+ *
+ * Returns 0 when done, or -ERESTART if preempted with *done updated.
+ *
+ * The p2m lock is held across a chunk of nominate or evict operations, so
+ * that the TLB flushes for the p2m changes are deferred to a single one.
+ * The guest handles are only accessed without the lock held.
+ */
+static int batch(struct domain *d, const xen_mem_paging_op_t *mpo,
+                 unsigned long *done)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    uint64_t gfns[BATCH_CHUNK];
+    struct page_info *pages[BATCH_CHUNK];
+    int errs[BATCH_CHUNK];
+    unsigned int i, n;
+
+    while ( *done < mpo->nr )
+    {
+        n = min_t(unsigned long, mpo->nr - *done, BATCH_CHUNK);
+
+        if ( copy_from_guest_offset(gfns, mpo->gfn_list, *done, n) )
+            return -EFAULT;
+
+        if ( mpo->op == XENMEM_paging_op_prep_batch )
+        {
+            for ( i = 0; i < n; i++ )
+            {
+                XEN_GUEST_HANDLE_64(const_uint8) buffer = mpo->buffer;
+
+                /* Without a buffer, the pages are to be cleared. */
+                if ( !guest_handle_is_null(buffer) )
+                    guest_handle_add_offset(buffer, (*done + i) * PAGE_SIZE);
+                errs[i] = prepare(d, _gfn(gfns[i]), buffer);
+            }
+        }
+        else
+        {
+            p2m_lock(p2m);
+            for ( i = 0; i < n; i++ )
+            {
+                pages[i] = NULL;
+                errs[i] = mpo->op == XENMEM_paging_op_nominate_batch
+                          ? nominate(d, _gfn(gfns[i]))
+                          : evict(d, _gfn(gfns[i]), &pages[i]);
+            }
+            p2m_unlock(p2m);
+
+            for ( i = 0; i < n; i++ )
+                if ( pages[i] )
+                    evict_free(pages[i]);
+        }
+
+        if ( copy_to_guest_offset(mpo->errs, *done, errs, n) )
+            return -EFAULT;
+
+        *done += n;
+
+        if ( *done < mpo->nr && hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
+    return 0;
+}
+
+/*
+ * The progress of a batched operation is kept in the start extent bits of
+ * the memory_op command, as for the common memory_op subops.
+ */
+int mem_paging_memop(unsigned long cmd,
+                     XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
 {
+    unsigned long done = cmd >> MEMOP_EXTENT_SHIFT;
     int rc;
     xen_mem_paging_op_t mpo;
     struct domain *d;
@@ -460,6 +553,11 @@ int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
     if ( unlikely(!vm_event_check_ring(d->vm_event_paging)) )
         goto out;
 
+    rc = -EINVAL;
+    if ( done && (mpo.op < XENMEM_paging_op_nominate_batch ||
+                  done >= mpo.nr) )
+        goto out;
+
     switch( mpo.op )
     {
     case XENMEM_paging_op_nominate:
@@ -467,8 +565,14 @@ int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
         break;
 
     case XENMEM_paging_op_evict:
-        rc = evict(d, _gfn(mpo.gfn));
+    {
+        struct page_info *page = NULL;
+
+        rc = evict(d, _gfn(mpo.gfn), &page);
+        if ( page )
+            evict_free(page);
         break;
+    }
 
     case XENMEM_paging_op_prep:
         rc = prepare(d, _gfn(mpo.gfn), mpo.buffer);
@@ -476,6 +580,20 @@ int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
             copyback = 1;
         break;
 
+    case XENMEM_paging_op_nominate_batch:
+    case XENMEM_paging_op_evict_batch:
+    case XENMEM_paging_op_prep_batch:
+        rc = -EINVAL;
+        if ( mpo.gfn || mpo.nr > (UINT_MAX >> MEMOP_EXTENT_SHIFT) )
+            break;
+
+        rc = batch(d, &mpo, &done);
+        if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(
+                __HYPERVISOR_memory_op, "lh",
+                XENMEM_paging_op | (done << MEMOP_EXTENT_SHIFT), arg);
+        break;
+
     default:
         rc = -ENOSYS;
         break;
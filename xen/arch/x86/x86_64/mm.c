@@ -25,6 +25,7 @@ EMIT_FILE;
 #include <xen/numa.h>
 #include <xen/nodemask.h>
 #include <xen/guest_access.h>
+#include <xen/hypercall.h>
 #include <xen/mem_access.h>
 #include <asm/current.h>
 #include <asm/asm_defns.h>
@@ -927,6 +928,12 @@ long subarch_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
     unsigned int i;
     long rc = 0;
 
+#ifdef CONFIG_MEM_PAGING
+    /* Batched paging ops keep their progress in the upper bits of cmd. */
+    if ( (cmd & MEMOP_CMD_MASK) == XENMEM_paging_op )
+        return mem_paging_memop(cmd, guest_handle_cast(arg, xen_mem_paging_op_t));
+#endif
+
     switch ( cmd )
     {
     case XENMEM_machphys_mfn_list:
@@ -1006,11 +1013,6 @@ long subarch_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
     case XENMEM_get_sharing_shared_pages:
         return mem_sharing_get_nr_shared_mfns();
 
-#ifdef CONFIG_MEM_PAGING
-    case XENMEM_paging_op:
-        return mem_paging_memop(guest_handle_cast(arg, xen_mem_paging_op_t));
-#endif
-
 #ifdef CONFIG_MEM_SHARING
     case XENMEM_sharing_op:
         return mem_sharing_memop(guest_handle_cast(arg, xen_mem_sharing_op_t));
@@ -33,6 +33,11 @@ CHECK_gnttab_unmap_and_replace;
 DEFINE_XEN_GUEST_HANDLE(gnttab_setup_table_compat_t);
 DEFINE_XEN_GUEST_HANDLE(gnttab_transfer_compat_t);
 DEFINE_XEN_GUEST_HANDLE(gnttab_copy_compat_t);
+DEFINE_XEN_GUEST_HANDLE(gnttab_copy_segs_compat_t);
+
+#define xen_gnttab_copy_seg gnttab_copy_seg
+CHECK_gnttab_copy_seg;
+#undef xen_gnttab_copy_seg
 
 #define xen_gnttab_dump_table gnttab_dump_table
 CHECK_gnttab_dump_table;
@@ -56,6 +61,10 @@ CHECK_gnttab_swap_grant_ref;
 CHECK_gnttab_cache_flush;
 #undef xen_gnttab_cache_flush
 
+#define xen_gnttab_unmap_flush gnttab_unmap_flush
+CHECK_gnttab_unmap_flush;
+#undef xen_gnttab_unmap_flush
+
 int compat_grant_table_op(
     unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) cmp_uop, unsigned int count)
 {
@@ -101,6 +110,10 @@ int compat_grant_table_op(
     CASE(copy);
 #endif
 
+#ifndef CHECK_gnttab_copy_segs
+    CASE(copy_segs);
+#endif
+
 #ifndef CHECK_gnttab_dump_table
     CASE(dump_table);
 #endif
@@ -133,12 +146,14 @@ int compat_grant_table_op(
             struct gnttab_setup_table *setup;
             struct gnttab_transfer *xfer;
             struct gnttab_copy *copy;
+            struct gnttab_copy_segs *segs;
             struct gnttab_get_status_frames *get_status;
         } nat;
         union {
             struct compat_gnttab_setup_table setup;
             struct compat_gnttab_transfer xfer;
             struct compat_gnttab_copy copy;
+            struct compat_gnttab_copy_segs segs;
             struct compat_gnttab_get_status_frames get_status;
         } cmp;
 
@@ -271,6 +286,43 @@ int compat_grant_table_op(
             }
             break;
 
+        case GNTTABOP_copy_segs:
+            for ( n = 0; n < COMPAT_ARG_XLAT_SIZE / sizeof(*nat.segs) && i < count && rc == 0; ++i, ++n )
+            {
+                if ( unlikely(__copy_from_guest_offset(&cmp.segs, cmp_uop, i, 1)) )
+                    rc = -EFAULT;
+                else
+                {
+#define XLAT_gnttab_copy_segs_HNDL_segs(_d_, _s_) \
+                    guest_from_compat_handle((_d_)->segs, (_s_)->segs)
+                    XLAT_gnttab_copy_segs(nat.segs + n, &cmp.segs);
+#undef XLAT_gnttab_copy_segs_HNDL_segs
+                }
+            }
+            if ( rc == 0 )
+                rc = gnttab_copy_segs(guest_handle_cast(nat.uop, gnttab_copy_segs_t), n);
+            if ( rc > 0 )
+            {
+                ASSERT(rc <= n);
+                i -= rc;
+                n -= rc;
+            }
+            if ( rc >= 0 )
+            {
+                XEN_GUEST_HANDLE_PARAM(gnttab_copy_segs_compat_t) segs;
+
+                segs = guest_handle_cast(cmp_uop, gnttab_copy_segs_compat_t);
+                guest_handle_add_offset(segs, i);
+                cnt_uop = guest_handle_cast(segs, void);
+                while ( n-- )
+                {
+                    guest_handle_add_offset(segs, -1);
+                    if ( __copy_field_to_guest(segs, nat.segs + n, status) )
+                        rc = -EFAULT;
+                }
+            }
+            break;
+
         case GNTTABOP_get_status_frames: {
             unsigned int max_frame_list_size_in_pages =
                 (COMPAT_ARG_XLAT_SIZE - sizeof(*nat.get_status)) /
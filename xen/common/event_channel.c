@@ -55,6 +55,8 @@
 
 #define consumer_is_xen(e) (!!(e)->xen_consumer)
 
+static DEFINE_PERCPU_RWLOCK_GLOBAL(evtchn_send_rwlock);
+
 /*
  * Lock an event channel exclusively. This is allowed only when the channel is
  * free or unbound either when taking or when releasing the lock, as any
@@ -347,6 +349,28 @@ static void double_evtchn_unlock(struct evtchn *lchn, struct evtchn *rchn)
     evtchn_write_unlock(rchn);
 }
 
+/*
+ * Keep the evtchn_send() fast path out while an interdomain channel pair is
+ * being bound or closed.  Both domains' event_lock must be held already, so
+ * the ordering here is merely for consistency.
+ */
+static void double_evtchn_send_lock(struct domain *d1, struct domain *d2)
+{
+    if ( d1 > d2 )
+        SWAP(d1, d2);
+
+    percpu_write_lock(evtchn_send_rwlock, &d1->evtchn_send_lock);
+    if ( d1 != d2 )
+        percpu_write_lock(evtchn_send_rwlock, &d2->evtchn_send_lock);
+}
+
+static void double_evtchn_send_unlock(struct domain *d1, struct domain *d2)
+{
+    if ( d1 != d2 )
+        percpu_write_unlock(evtchn_send_rwlock, &d2->evtchn_send_lock);
+    percpu_write_unlock(evtchn_send_rwlock, &d1->evtchn_send_lock);
+}
+
 static int evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
 {
     struct evtchn *lchn, *rchn;
@@ -386,6 +410,7 @@ static int evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     if ( rc )
         goto out;
 
+    double_evtchn_send_lock(ld, rd);
     double_evtchn_lock(lchn, rchn);
 
     lchn->u.interdomain.remote_dom  = rd;
@@ -404,6 +429,7 @@ static int evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     evtchn_port_set_pending(ld, lchn->notify_vcpu_id, lchn);
 
     double_evtchn_unlock(lchn, rchn);
+    double_evtchn_send_unlock(ld, rd);
 
     bind->local_port = lport;
 
@@ -708,6 +734,7 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
         BUG_ON(chn2->state != ECS_INTERDOMAIN);
         BUG_ON(chn2->u.interdomain.remote_dom != d1);
 
+        double_evtchn_send_lock(d1, d2);
         double_evtchn_lock(chn1, chn2);
 
         evtchn_free(d1, chn1);
@@ -716,6 +743,7 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
         chn2->u.unbound.remote_domid = d1->domain_id;
 
         double_evtchn_unlock(chn1, chn2);
+        double_evtchn_send_unlock(d1, d2);
 
         goto out;
 
@@ -749,6 +777,30 @@ int evtchn_send(struct domain *ld, unsigned int lport)
     if ( !lchn )
         return -EINVAL;
 
+    /*
+     * Fast path for established guest-to-guest channels: neither end can be
+     * rebound or closed while ld's evtchn_send_lock is held for reading, so
+     * there's no need to take (and bounce the cache line of) the channel
+     * lock, which is shared by all vCPUs notifying through this port.
+     */
+    percpu_read_lock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+    if ( likely(lchn->state == ECS_INTERDOMAIN) && !consumer_is_xen(lchn) )
+    {
+        rd    = lchn->u.interdomain.remote_dom;
+        rport = lchn->u.interdomain.remote_port;
+        rchn  = evtchn_from_port(rd, rport);
+        if ( !consumer_is_xen(rchn) && !xsm_evtchn_send(XSM_HOOK, ld, lchn) )
+        {
+            perfc_incr(evtchn_send_fast);
+            evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+            percpu_read_unlock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+            return 0;
+        }
+    }
+    percpu_read_unlock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+
+    perfc_incr(evtchn_send_slow);
+
     evtchn_read_lock(lchn);
 
     /* Guest cannot send via a Xen-attached event channel. */
@@ -1473,6 +1525,7 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     d->valid_evtchns = EVTCHNS_PER_BUCKET;
 
     rwlock_init(&d->event_lock);
+    percpu_rwlock_resource_init(&d->evtchn_send_lock, evtchn_send_rwlock);
 
     if ( get_free_port(d) != 0 )
     {
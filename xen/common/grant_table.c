@@ -97,6 +97,16 @@ struct grant_table {
      */
     struct radix_tree_root maptrack_tree;
 
+    /*
+     * Unmaps waiting for a TLB flush before they can be completed: until the
+     * end of the unmap hypercall, or if the domain asked for flushes to be
+     * deferred until GNTTABOP_unmap_flush.  All protected by @unmap_lock.
+     */
+    spinlock_t            unmap_lock;
+    bool                  defer_unmap_flush;
+    unsigned int          nr_pending_unmaps;
+    struct gnttab_unmap_common *pending_unmaps;
+
     /* Domain to which this struct grant_table belongs. */
     struct domain *domain;
 };
@@ -269,6 +279,9 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/* Number of unmaps which may be pending when flushes are deferred. */
+#define GNTTAB_UNMAP_PENDING_MAX (8 * GNTTAB_UNMAP_BATCH_SIZE)
+
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
     do {                                        \
@@ -1552,9 +1565,9 @@ unmap_common(
 }
 
 static void
-unmap_common_complete(struct gnttab_unmap_common *op)
+unmap_common_complete(struct domain *ld, struct gnttab_unmap_common *op)
 {
-    struct domain *ld, *rd = op->rd;
+    struct domain *rd = op->rd;
     struct grant_table *rgt;
     struct active_grant_entry *act;
     grant_entry_header_t *sha;
@@ -1567,8 +1580,6 @@ unmap_common_complete(struct gnttab_unmap_common *op)
         return;
     }
 
-    ld = current->domain;
-
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
 
@@ -1626,6 +1637,156 @@ unmap_common_complete(struct gnttab_unmap_common *op)
     rcu_unlock_domain(rd);
 }
 
+/*
+ * Flush the TLBs and complete all pending unmaps.  Returns the number of
+ * unmaps completed.  Called with unmap_lock held.
+ */
+static unsigned int gnttab_unmap_flush_pending(struct grant_table *lgt)
+{
+    struct domain *ld = lgt->domain;
+    unsigned int i, nr = lgt->nr_pending_unmaps;
+
+    if ( !nr )
+        return 0;
+
+    gnttab_flush_tlb(ld);
+    perfc_incr(gnttab_unmap_flush);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct domain *rd = lgt->pending_unmaps[i].rd;
+
+        unmap_common_complete(ld, &lgt->pending_unmaps[i]);
+        put_domain(rd);
+    }
+
+    lgt->nr_pending_unmaps = 0;
+
+    return nr;
+}
+
+/*
+ * Allocate the set of pending unmaps, if not done yet.  It is kept until the
+ * domain is destroyed.
+ */
+static int gnttab_unmap_pending_alloc(struct grant_table *lgt)
+{
+    struct gnttab_unmap_common *pending;
+
+    if ( ACCESS_ONCE(lgt->pending_unmaps) )
+        return 0;
+
+    pending = xmalloc_array(struct gnttab_unmap_common,
+                            GNTTAB_UNMAP_PENDING_MAX);
+    if ( !pending )
+        return -ENOMEM;
+
+    spin_lock(&lgt->unmap_lock);
+
+    if ( !lgt->pending_unmaps )
+    {
+        lgt->pending_unmaps = pending;
+        pending = NULL;
+    }
+
+    spin_unlock(&lgt->unmap_lock);
+
+    xfree(pending);
+
+    return 0;
+}
+
+/*
+ * Add a batch of unmaps needing a flush to the pending ones, flushing those
+ * first if there isn't enough space left.  Returns false if there is no set
+ * of pending unmaps to add them to.
+ */
+static bool gnttab_unmap_defer(struct grant_table *lgt,
+                               const struct gnttab_unmap_common *common,
+                               unsigned int nr)
+{
+    unsigned int i;
+
+    spin_lock(&lgt->unmap_lock);
+
+    if ( !lgt->pending_unmaps )
+    {
+        spin_unlock(&lgt->unmap_lock);
+        return false;
+    }
+
+    if ( lgt->nr_pending_unmaps + nr > GNTTAB_UNMAP_PENDING_MAX )
+        gnttab_unmap_flush_pending(lgt);
+
+    /* This batch shares the flush with the ones already pending. */
+    if ( lgt->nr_pending_unmaps )
+        perfc_incr(gnttab_unmap_flush_avoided);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( !common[i].done )
+            continue;
+
+        /* Keep the granting domain around until the unmap is completed. */
+        get_knownalive_domain(common[i].rd);
+        lgt->pending_unmaps[lgt->nr_pending_unmaps++] = common[i];
+        perfc_incr(gnttab_unmap_deferred);
+    }
+
+    spin_unlock(&lgt->unmap_lock);
+
+    return true;
+}
+
+/*
+ * Finish a batch of unmaps: flush the TLBs if any host mapping was removed,
+ * and complete the unmaps.  A batch needing a flush is left pending instead,
+ * for gnttab_unmap_end() or GNTTABOP_unmap_flush to flush, if possible.
+ */
+static void gnttab_unmap_batch_done(struct gnttab_unmap_common *common,
+                                    unsigned int nr)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *lgt = ld->grant_table;
+    bool need_flush = false;
+    unsigned int i;
+
+    if ( !nr )
+        return;
+
+    if ( !paging_mode_external(ld) )
+    {
+        for ( i = 0; i < nr && !need_flush; i++ )
+            need_flush = common[i].done & GNTMAP_host_map;
+    }
+
+    if ( need_flush && gnttab_unmap_defer(lgt, common, nr) )
+        return;
+
+    if ( need_flush )
+    {
+        gnttab_flush_tlb(ld);
+        perfc_incr(gnttab_unmap_flush);
+    }
+    else if ( !paging_mode_external(ld) )
+        perfc_incr(gnttab_unmap_flush_avoided);
+
+    for ( i = 0; i < nr; i++ )
+        unmap_common_complete(ld, &common[i]);
+}
+
+/*
+ * End of an unmap hypercall, or of the part of it done before preemption:
+ * flush the pending unmaps once, unless the domain defers flushes.
+ */
+static void gnttab_unmap_end(struct grant_table *lgt)
+{
+    spin_lock(&lgt->unmap_lock);
+    if ( !lgt->defer_unmap_flush )
+        gnttab_unmap_flush_pending(lgt);
+    spin_unlock(&lgt->unmap_lock);
+}
+
 static void
 unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
@@ -1653,6 +1814,10 @@ gnttab_unmap_grant_ref(
     int i, c, partial_done, done = 0;
     struct gnttab_unmap_grant_ref op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct grant_table *lgt = current->domain->grant_table;
+
+    /* Without the set of pending unmaps, each batch is flushed by itself. */
+    gnttab_unmap_pending_alloc(lgt);
 
     while ( count != 0 )
     {
@@ -1670,25 +1835,25 @@ gnttab_unmap_grant_ref(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
-
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        gnttab_unmap_batch_done(common, partial_done);
 
         count -= c;
         done += c;
 
         if ( count && hypercall_preempt_check() )
+        {
+            gnttab_unmap_end(lgt);
             return done;
+        }
     }
 
+    gnttab_unmap_end(lgt);
+
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
+    gnttab_unmap_batch_done(common, partial_done);
+    gnttab_unmap_end(lgt);
     return -EFAULT;
 }
 
@@ -1718,6 +1883,10 @@ gnttab_unmap_and_replace(
     int i, c, partial_done, done = 0;
     struct gnttab_unmap_and_replace op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct grant_table *lgt = current->domain->grant_table;
+
+    /* Without the set of pending unmaps, each batch is flushed by itself. */
+    gnttab_unmap_pending_alloc(lgt);
 
     while ( count != 0 )
     {
@@ -1735,25 +1904,25 @@ gnttab_unmap_and_replace(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
-
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        gnttab_unmap_batch_done(common, partial_done);
 
         count -= c;
         done += c;
 
         if ( count && hypercall_preempt_check() )
+        {
+            gnttab_unmap_end(lgt);
             return done;
+        }
     }
 
+    gnttab_unmap_end(lgt);
+
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
+    gnttab_unmap_batch_done(common, partial_done);
+    gnttab_unmap_end(lgt);
     return -EFAULT;
 }
 
@@ -1977,6 +2146,7 @@ int grant_table_init(struct domain *d, int max_grant_frames,
     /* Simple stuff. */
     percpu_rwlock_resource_init(&gt->lock, grant_rwlock);
     spin_lock_init(&gt->maptrack_lock);
+    spin_lock_init(&gt->unmap_lock);
 
     gt->gt_version = 1;
     gt->max_grant_frames = max_grant_frames;
@@ -2954,9 +3124,9 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
     return p->u.gmfn == b->ptr.u.gmfn;
 }
 
-static int gnttab_copy_buf(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           const struct gnttab_copy_buf *src)
+static int gnttab_copy_buf_check(const struct gnttab_copy *op,
+                                 const struct gnttab_copy_buf *dest,
+                                 const struct gnttab_copy_buf *src)
 {
     int rc;
 
@@ -2978,15 +3148,28 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
                  op->dest.offset, dest->ptr.offset,
                  op->len, dest->len);
 
+    rc = GNTST_okay;
+ out:
+    return rc;
+}
+
+static int gnttab_copy_buf(const struct gnttab_copy *op,
+                           struct gnttab_copy_buf *dest,
+                           const struct gnttab_copy_buf *src)
+{
+    int rc = gnttab_copy_buf_check(op, dest, src);
+
+    if ( rc != GNTST_okay )
+        return rc;
+
     /* Make sure the above checks are not bypassed speculatively */
     block_speculation();
 
     memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
            op->len);
     gnttab_mark_dirty(dest->domain, dest->mfn);
-    rc = GNTST_okay;
- out:
-    return rc;
+
+    return GNTST_okay;
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
@@ -3092,6 +3275,347 @@ static long gnttab_copy(
     return rc;
 }
 
+/*
+ * GNTTABOP_copy_segs keeps a few source and destination buffers acquired for
+ * as long as the domains and flags stay the same, so that segments referring
+ * to the same grant (or frame) only acquire it once.  Each buffer holds a
+ * mapping, so don't make this too large.
+ */
+#define GNTTAB_COPY_SEGS_BUFS 4
+
+struct gnttab_copy_segs_bufs {
+    domid_t source_domid;
+    domid_t dest_domid;
+    uint16_t flags;
+    unsigned int next_src;
+    unsigned int next_dest;
+    struct gnttab_copy_buf src[GNTTAB_COPY_SEGS_BUFS];
+    struct gnttab_copy_buf dest[GNTTAB_COPY_SEGS_BUFS];
+};
+
+/* Segments contiguous in both source and destination, copied in one go. */
+struct gnttab_copy_run {
+    const struct gnttab_copy_buf *src;
+    struct gnttab_copy_buf *dest;
+    unsigned int src_off;
+    unsigned int dest_off;
+    unsigned int len;
+};
+
+static void gnttab_copy_run_flush(struct gnttab_copy_run *run)
+{
+    if ( !run->len )
+        return;
+
+    /* Make sure the checks of the segments are not bypassed speculatively */
+    block_speculation();
+
+    memcpy(run->dest->virt + run->dest_off, run->src->virt + run->src_off,
+           run->len);
+    gnttab_mark_dirty(run->dest->domain, run->dest->mfn);
+    run->len = 0;
+}
+
+static void gnttab_copy_run_add(struct gnttab_copy_run *run,
+                                const struct gnttab_copy *op,
+                                const struct gnttab_copy_buf *src,
+                                struct gnttab_copy_buf *dest)
+{
+    /*
+     * Copies within a single page aren't merged, as the segments may then
+     * overlap each other.
+     */
+    if ( run->len && run->src == src && run->dest == dest &&
+         !mfn_eq(src->mfn, dest->mfn) &&
+         run->src_off + run->len == op->source.offset &&
+         run->dest_off + run->len == op->dest.offset )
+    {
+        run->len += op->len;
+        return;
+    }
+
+    gnttab_copy_run_flush(run);
+
+    run->src = src;
+    run->dest = dest;
+    run->src_off = op->source.offset;
+    run->dest_off = op->dest.offset;
+    run->len = op->len;
+}
+
+static void gnttab_copy_segs_release(struct gnttab_copy_segs_bufs *bufs)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_SEGS_BUFS; i++ )
+    {
+        gnttab_copy_release_buf(&bufs->src[i]);
+        gnttab_copy_release_buf(&bufs->dest[i]);
+    }
+}
+
+static void gnttab_copy_segs_unlock(struct gnttab_copy_segs_bufs *bufs)
+{
+    unsigned int i;
+
+    gnttab_copy_segs_release(bufs);
+    gnttab_copy_unlock_domains(&bufs->src[0], &bufs->dest[0]);
+
+    /* The references are held through the first buffers only. */
+    for ( i = 1; i < GNTTAB_COPY_SEGS_BUFS; i++ )
+    {
+        bufs->src[i].domain = NULL;
+        bufs->dest[i].domain = NULL;
+    }
+}
+
+static int gnttab_copy_segs_lock(const struct gnttab_copy_segs *op,
+                                 struct gnttab_copy_segs_bufs *bufs)
+{
+    struct gnttab_copy copy = {
+        .source.domid = op->source_domid,
+        .dest.domid = op->dest_domid,
+        .flags = op->flags,
+    };
+    unsigned int i;
+    int rc;
+
+    if ( bufs->src[0].domain && bufs->dest[0].domain &&
+         op->source_domid == bufs->source_domid &&
+         op->dest_domid == bufs->dest_domid &&
+         op->flags == bufs->flags )
+        return GNTST_okay;
+
+    gnttab_copy_segs_unlock(bufs);
+
+    rc = gnttab_copy_lock_domains(&copy, &bufs->src[0], &bufs->dest[0]);
+    if ( rc < 0 )
+        return rc;
+
+    for ( i = 1; i < GNTTAB_COPY_SEGS_BUFS; i++ )
+    {
+        bufs->src[i].domain = bufs->src[0].domain;
+        bufs->src[i].ptr.domid = op->source_domid;
+        bufs->dest[i].domain = bufs->dest[0].domain;
+        bufs->dest[i].ptr.domid = op->dest_domid;
+    }
+
+    bufs->source_domid = op->source_domid;
+    bufs->dest_domid = op->dest_domid;
+    bufs->flags = op->flags;
+
+    return GNTST_okay;
+}
+
+/*
+ * Find the buffer for a segment's source or destination, acquiring it in
+ * place of the least recently acquired one if needed.
+ */
+static int gnttab_copy_segs_get_buf(const struct gnttab_copy *op,
+                                    const struct gnttab_copy_ptr *ptr,
+                                    unsigned int gref_flag,
+                                    struct gnttab_copy_buf *bufs,
+                                    unsigned int *next,
+                                    struct gnttab_copy_run *run,
+                                    struct gnttab_copy_buf **buf)
+{
+    struct gnttab_copy_buf *b;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < GNTTAB_COPY_SEGS_BUFS; i++ )
+    {
+        if ( gnttab_copy_buf_valid(ptr, &bufs[i], op->flags & gref_flag) )
+        {
+            *buf = &bufs[i];
+            return GNTST_okay;
+        }
+    }
+
+    /* The buffer to be replaced may be part of the pending run. */
+    gnttab_copy_run_flush(run);
+
+    b = &bufs[*next];
+    *next = (*next + 1) % GNTTAB_COPY_SEGS_BUFS;
+
+    gnttab_copy_release_buf(b);
+    rc = gnttab_copy_claim_buf(op, ptr, b, gref_flag);
+    if ( rc != GNTST_okay )
+        gnttab_copy_release_buf(b);
+    else
+        *buf = b;
+
+    return rc;
+}
+
+static bool gnttab_copy_seg_ptr(struct gnttab_copy_ptr *ptr, uint64_t val,
+                                bool is_gref)
+{
+    if ( is_gref )
+    {
+        ptr->u.ref = val;
+        return ptr->u.ref == val;
+    }
+
+    ptr->u.gmfn = val;
+    return ptr->u.gmfn == val;
+}
+
+/*
+ * Returns 0 once all segments of the operation were processed (the status
+ * of the operation itself being stored in op->status), a positive value if
+ * the operation needs to be restarted, or -EFAULT.
+ */
+static long gnttab_copy_segs_one(struct gnttab_copy_segs *op,
+                                 struct gnttab_copy_segs_bufs *bufs)
+{
+    XEN_GUEST_HANDLE(gnttab_copy_seg_t) segs = op->segs;
+    struct gnttab_copy_run run = {};
+    unsigned int i;
+    long rc = 0;
+
+    if ( op->nr_segs > GNTTAB_COPY_SEGS_MAX )
+    {
+        op->status = GNTST_bad_copy_arg;
+        return 0;
+    }
+
+    op->status = gnttab_copy_segs_lock(op, bufs);
+    if ( op->status != GNTST_okay )
+        return 0;
+
+    for ( i = 0; i < op->nr_segs; i++ )
+    {
+        struct gnttab_copy_seg seg;
+        struct gnttab_copy copy = {
+            .source.domid = op->source_domid,
+            .dest.domid = op->dest_domid,
+            .flags = op->flags,
+        };
+        struct gnttab_copy_buf *src, *dest;
+
+        if ( unlikely(copy_from_guest(&seg, segs, 1)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        copy.source.offset = seg.source_offset;
+        copy.dest.offset = seg.dest_offset;
+        copy.len = seg.len;
+
+        if ( !gnttab_copy_seg_ptr(&copy.source, seg.source,
+                                  op->flags & GNTCOPY_source_gref) ||
+             !gnttab_copy_seg_ptr(&copy.dest, seg.dest,
+                                  op->flags & GNTCOPY_dest_gref) )
+            rc = GNTST_bad_copy_arg;
+        else if ( (rc = gnttab_copy_segs_get_buf(&copy, &copy.source,
+                                                 GNTCOPY_source_gref,
+                                                 bufs->src, &bufs->next_src,
+                                                 &run, &src)) == GNTST_okay &&
+                  (rc = gnttab_copy_segs_get_buf(&copy, &copy.dest,
+                                                 GNTCOPY_dest_gref,
+                                                 bufs->dest, &bufs->next_dest,
+                                                 &run, &dest)) == GNTST_okay &&
+                  (rc = gnttab_copy_buf_check(&copy, dest, src)) == GNTST_okay )
+            gnttab_copy_run_add(&run, &copy, src, dest);
+
+        if ( rc > 0 )
+            break;
+
+        seg.status = rc;
+        rc = 0;
+        if ( unlikely(copy_field_to_guest(segs, &seg, status)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(segs, 1);
+    }
+
+    gnttab_copy_run_flush(&run);
+
+    return rc;
+}
+
+/* Like gnttab_copy(), returns "count - i" when needing a continuation. */
+static long gnttab_copy_segs(
+    XEN_GUEST_HANDLE_PARAM(gnttab_copy_segs_t) uop, unsigned int count)
+{
+    unsigned int i;
+    struct gnttab_copy_segs op;
+    struct gnttab_copy_segs_bufs bufs = {};
+    long rc = 0;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( i && hypercall_preempt_check() )
+        {
+            rc = count - i;
+            break;
+        }
+
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        rc = gnttab_copy_segs_one(&op, &bufs);
+        if ( rc > 0 )
+        {
+            rc = count - i;
+            break;
+        }
+        if ( rc < 0 )
+            break;
+
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(uop, 1);
+    }
+
+    gnttab_copy_segs_unlock(&bufs);
+
+    return rc;
+}
+
+static long
+gnttab_unmap_flush(XEN_GUEST_HANDLE_PARAM(gnttab_unmap_flush_t) uop,
+                   unsigned int count)
+{
+    struct grant_table *gt = current->domain->grant_table;
+    gnttab_unmap_flush_t op;
+
+    if ( count != 1 )
+        return -EINVAL;
+
+    if ( copy_from_guest(&op, uop, 1) )
+        return -EFAULT;
+
+    if ( op.flags & ~GNTTAB_UNMAP_FLUSH_defer )
+        return -EINVAL;
+
+    if ( (op.flags & GNTTAB_UNMAP_FLUSH_defer) &&
+         gnttab_unmap_pending_alloc(gt) )
+        return -ENOMEM;
+
+    spin_lock(&gt->unmap_lock);
+
+    op.completed = gnttab_unmap_flush_pending(gt);
+    gt->defer_unmap_flush = op.flags & GNTTAB_UNMAP_FLUSH_defer;
+
+    spin_unlock(&gt->unmap_lock);
+
+    if ( __copy_field_to_guest(uop, &op, completed) )
+        return -EFAULT;
+
+    return 0;
+}
+
 static long
 gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
 {
@@ -3658,6 +4182,22 @@ long do_grant_table_op(
         break;
     }
 
+    case GNTTABOP_copy_segs:
+    {
+        XEN_GUEST_HANDLE_PARAM(gnttab_copy_segs_t) segs =
+            guest_handle_cast(uop, gnttab_copy_segs_t);
+
+        if ( unlikely(!guest_handle_okay(segs, count)) )
+            goto out;
+        rc = gnttab_copy_segs(segs, count);
+        if ( rc > 0 )
+        {
+            guest_handle_add_offset(segs, count - rc);
+            uop = guest_handle_cast(segs, void);
+        }
+        break;
+    }
+
     case GNTTABOP_query_size:
         rc = gnttab_query_size(
             guest_handle_cast(uop, gnttab_query_size_t), count);
@@ -3678,6 +4218,11 @@ long do_grant_table_op(
         rc = gnttab_get_version(guest_handle_cast(uop, gnttab_get_version_t));
         break;
 
+    case GNTTABOP_unmap_flush:
+        rc = gnttab_unmap_flush(guest_handle_cast(uop, gnttab_unmap_flush_t),
+                                count);
+        break;
+
     case GNTTABOP_swap_grant_ref:
     {
         XEN_GUEST_HANDLE_PARAM(gnttab_swap_grant_ref_t) swap =
@@ -3720,7 +4265,7 @@ long do_grant_table_op(
     if ( rc > 0 || (opaque_out != 0 && rc == 0) )
     {
         /* Adjust rc, see gnttab_copy() for why this is needed. */
-        if ( cmd == GNTTABOP_copy )
+        if ( cmd == GNTTABOP_copy || cmd == GNTTABOP_copy_segs )
             rc = count - rc;
         ASSERT(rc < count);
         ASSERT((opaque_out & GNTTABOP_CMD_MASK) == 0);
@@ -3752,6 +4297,12 @@ int gnttab_release_mappings(struct domain *d)
     if ( !gt || !gt->maptrack )
         return 0;
 
+    /* Complete unmaps left pending by the domain first. */
+    spin_lock(&gt->unmap_lock);
+    gnttab_unmap_flush_pending(gt);
+    gt->defer_unmap_flush = false;
+    spin_unlock(&gt->unmap_lock);
+
     for ( handle = gt->maptrack_limit; handle; )
     {
         mfn_t mfn;
@@ -3939,6 +4490,9 @@ grant_table_destroy(
     ASSERT(!t->maptrack_limit);
     vfree(t->maptrack);
 
+    ASSERT(!t->nr_pending_unmaps);
+    xfree(t->pending_unmaps);
+
     for ( i = 0; i < nr_active_grant_frames(t); i++ )
         free_xenheap_page(t->active[i]);
     xfree(t->active);
@@ -4222,6 +4776,9 @@ static void gnttab_usage_print(struct domain *rd)
            rd->domain_id, gt->gt_version,
            nr_grant_frames(gt), gt->max_grant_frames,
            nr_maptrack_frames(gt), gt->max_maptrack_frames);
+    if ( gt->defer_unmap_flush )
+        printk("  deferring unmap flushes, %u unmaps pending\n",
+               gt->nr_pending_unmaps);
 
     nr_ents = nr_grant_entries(gt);
     for ( ref = 0; ref != nr_ents; ref++ )
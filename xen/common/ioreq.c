@@ -24,7 +24,9 @@
 #include <xen/irq.h>
 #include <xen/lib.h>
 #include <xen/paging.h>
+#include <xen/rcupdate.h>
 #include <xen/sched.h>
+#include <xen/sort.h>
 #include <xen/trace.h>
 
 #include <asm/guest_atomics.h>
@@ -258,9 +260,9 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
     return res;
 }
 
-static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
+static int ioreq_server_alloc_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page;
 
     if ( iorp->page )
@@ -306,9 +308,9 @@ static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
     return -ENOMEM;
 }
 
-static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
+static void ioreq_server_free_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page = iorp->page;
 
     if ( !page )
@@ -333,7 +335,8 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
-        if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
+        if ( (s->ioreq.page == page) || (s->bufioreq.page == page) ||
+             (s->batchioreq.page == page) )
         {
             found = true;
             break;
@@ -464,25 +467,53 @@ static void ioreq_server_remove_all_vcpus(struct ioreq_server *s)
     spin_unlock(&s->lock);
 }
 
+/*
+ * The batched ring is only allocated once the emulator acquires it.  Senders
+ * may look at it by then, so it's set up with bufioreq_lock held.
+ */
+static int ioreq_server_alloc_batch_mfn(struct ioreq_server *s)
+{
+    struct ioreq_page *iorp = &s->batchioreq;
+    int rc = 0;
+
+    spin_lock(&s->bufioreq_lock);
+
+    if ( !iorp->page )
+    {
+        rc = ioreq_server_alloc_mfn(s, iorp);
+        if ( !rc )
+            /* Notify for the first request posted. */
+            ((ioreq_batch_page_t *)iorp->va)->event = 1;
+    }
+
+    spin_unlock(&s->bufioreq_lock);
+
+    return rc;
+}
+
 static int ioreq_server_alloc_pages(struct ioreq_server *s)
 {
     int rc;
 
-    rc = ioreq_server_alloc_mfn(s, false);
+    rc = ioreq_server_alloc_mfn(s, &s->ioreq);
 
     if ( !rc && (s->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF) )
-        rc = ioreq_server_alloc_mfn(s, true);
+        rc = ioreq_server_alloc_mfn(s, &s->bufioreq);
 
     if ( rc )
-        ioreq_server_free_mfn(s, false);
+        ioreq_server_free_mfn(s, &s->ioreq);
 
     return rc;
 }
 
 static void ioreq_server_free_pages(struct ioreq_server *s)
 {
-    ioreq_server_free_mfn(s, true);
-    ioreq_server_free_mfn(s, false);
+    spin_lock(&s->bufioreq_lock);
+    ioreq_server_free_mfn(s, &s->batchioreq);
+    spin_unlock(&s->bufioreq_lock);
+
+    ioreq_server_free_mfn(s, &s->bufioreq);
+    ioreq_server_free_mfn(s, &s->ioreq);
 }
 
 static void ioreq_server_free_rangesets(struct ioreq_server *s)
@@ -574,7 +605,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
-                             ioservid_t id)
+                             unsigned int flags, ioservid_t id)
 {
     struct domain *currd = current->domain;
     struct vcpu *v;
@@ -591,12 +622,14 @@ static int ioreq_server_init(struct ioreq_server *s,
 
     s->ioreq.gfn = INVALID_GFN;
     s->bufioreq.gfn = INVALID_GFN;
+    s->batchioreq.gfn = INVALID_GFN;
 
     rc = ioreq_server_alloc_rangesets(s, id);
     if ( rc )
         return rc;
 
     s->bufioreq_handling = bufioreq_handling;
+    s->batch = flags & XEN_DMOP_IOREQ_SERVER_BATCH;
 
     for_each_vcpu ( d, v )
     {
@@ -639,8 +672,266 @@ static void ioreq_server_deinit(struct ioreq_server *s)
     put_domain(s->emulator);
 }
 
+/*
+ * Dispatch index.
+ *
+ * Rather than querying the rangesets of all ioreq servers on every emulated
+ * access, ioreq_server_select() looks the access up in a per-domain index.
+ * For each range type, the ranges of all enabled servers are flattened into
+ * a sorted array of disjoint segments, each referring to the range of the
+ * server which would be selected for accesses within it: the most recently
+ * created one covering it.  The index is rebuilt whenever ranges are mapped
+ * or unmapped, or servers are enabled, disabled or destroyed, and published
+ * via RCU, so that lookups don't need any lock.
+ */
+struct ioreq_segment {
+    unsigned long start, end;
+    unsigned long range_end;   /* End of the server's range covering it. */
+    struct ioreq_server *s;
+};
+
+struct ioreq_index {
+    struct rcu_head rcu;
+    unsigned int nr[NR_IO_RANGE_TYPES];
+    struct ioreq_segment *seg[NR_IO_RANGE_TYPES];
+};
+
+static DEFINE_RCU_READ_LOCK(ioreq_index_rcu);
+
+struct ioreq_range {
+    unsigned long start, end;
+    struct ioreq_server *s;
+};
+
+struct ioreq_collect {
+    struct ioreq_range *ranges;
+    unsigned int nr;
+    struct ioreq_server *s;
+};
+
+static int cf_check ioreq_count_range(unsigned long s, unsigned long e,
+                                      void *arg)
+{
+    (*(unsigned int *)arg)++;
+
+    return 0;
+}
+
+static int cf_check ioreq_collect_range(unsigned long s, unsigned long e,
+                                        void *arg)
+{
+    struct ioreq_collect *c = arg;
+
+    c->ranges[c->nr].start = s;
+    c->ranges[c->nr].end = e;
+    c->ranges[c->nr].s = c->s;
+    c->nr++;
+
+    return 0;
+}
+
+static int cf_check cmp_ulong(const void *a, const void *b)
+{
+    unsigned long l = *(const unsigned long *)a;
+    unsigned long r = *(const unsigned long *)b;
+
+    return l < r ? -1 : l > r;
+}
+
+static void cf_check swap_ulong(void *a, void *b, size_t size)
+{
+    unsigned long tmp = *(unsigned long *)a;
+
+    *(unsigned long *)a = *(unsigned long *)b;
+    *(unsigned long *)b = tmp;
+}
+
+/* Index of the first boundary not below val. */
+static unsigned int find_bound(const unsigned long *bound, unsigned int nr,
+                               unsigned long val)
+{
+    unsigned int lo = 0, hi = nr;
+
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( bound[mid] < val )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void ioreq_index_free(struct ioreq_index *idx)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+        xfree(idx->seg[i]);
+
+    xfree(idx);
+}
+
+static void cf_check ioreq_index_free_rcu(struct rcu_head *head)
+{
+    ioreq_index_free(container_of(head, struct ioreq_index, rcu));
+}
+
+/*
+ * Flatten the ranges of one type.  The elementary intervals between all the
+ * range boundaries are owned by the first range covering them, ranges being
+ * collected in the order ioreq_server_select() checks the servers in, and
+ * then merged into segments.
+ */
+static int ioreq_index_build_type(struct domain *d, struct ioreq_index *idx,
+                                  unsigned int type)
+{
+    struct ioreq_collect c = { .nr = 0 };
+    const struct ioreq_range **owner = NULL;
+    unsigned long *bound = NULL;
+    struct ioreq_segment *seg;
+    struct ioreq_server *s;
+    unsigned int id, i, j, nr = 0, nr_bound = 0, nr_seg = 0;
+    int rc = -ENOMEM;
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+        if ( s->enabled )
+            rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                   ioreq_count_range, &nr);
+
+    if ( !nr )
+        return 0;
+
+    c.ranges = xmalloc_array(struct ioreq_range, nr);
+    bound = xmalloc_array(unsigned long, 2 * nr);
+    owner = xzalloc_array(const struct ioreq_range *, 2 * nr);
+    if ( !c.ranges || !bound || !owner )
+        goto out;
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( !s->enabled )
+            continue;
+
+        c.s = s;
+        rangeset_report_ranges(s->range[type], 0, ~0UL,
+                               ioreq_collect_range, &c);
+    }
+    ASSERT(c.nr == nr);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        bound[nr_bound++] = c.ranges[i].start;
+        if ( c.ranges[i].end != ~0UL )
+            bound[nr_bound++] = c.ranges[i].end + 1;
+    }
+
+    sort(bound, nr_bound, sizeof(*bound), cmp_ulong, swap_ulong);
+
+    for ( i = j = 0; i < nr_bound; i++ )
+        if ( !j || bound[i] != bound[j - 1] )
+            bound[j++] = bound[i];
+    nr_bound = j;
+
+    for ( i = 0; i < nr; i++ )
+        for ( j = find_bound(bound, nr_bound, c.ranges[i].start);
+              j < nr_bound && bound[j] <= c.ranges[i].end; j++ )
+            if ( !owner[j] )
+                owner[j] = &c.ranges[i];
+
+    seg = xmalloc_array(struct ioreq_segment, nr_bound);
+    if ( !seg )
+        goto out;
+
+    for ( i = 0; i < nr_bound; i++ )
+    {
+        unsigned long end = i + 1 < nr_bound ? bound[i + 1] - 1 : ~0UL;
+
+        if ( !owner[i] )
+            continue;
+
+        if ( nr_seg && owner[i - 1] == owner[i] )
+        {
+            seg[nr_seg - 1].end = end;
+            continue;
+        }
+
+        seg[nr_seg].start = bound[i];
+        seg[nr_seg].end = end;
+        seg[nr_seg].range_end = owner[i]->end;
+        seg[nr_seg].s = owner[i]->s;
+        nr_seg++;
+    }
+
+    idx->seg[type] = seg;
+    idx->nr[type] = nr_seg;
+    rc = 0;
+
+ out:
+    xfree(owner);
+    xfree(bound);
+    xfree(c.ranges);
+
+    return rc;
+}
+
+/* To be called with the ioreq server lock held. */
+static void ioreq_index_update(struct domain *d)
+{
+    struct ioreq_index *idx = xzalloc(struct ioreq_index);
+    struct ioreq_index *old = d->ioreq_server.index;
+    unsigned int i;
+
+    for ( i = 0; idx && i < NR_IO_RANGE_TYPES; i++ )
+        if ( ioreq_index_build_type(d, idx, i) )
+        {
+            ioreq_index_free(idx);
+            idx = NULL;
+        }
+
+    /* Without an index, ioreq_server_select() checks all servers. */
+    rcu_assign_pointer(d->ioreq_server.index, idx);
+
+    if ( old )
+        call_rcu(&old->rcu, ioreq_index_free_rcu);
+}
+
+/*
+ * Returns false if the index can't tell which server [start, end] is for,
+ * because it crosses the end of the range of the server covering start.
+ */
+static bool ioreq_index_lookup(const struct ioreq_index *idx,
+                               unsigned int type, unsigned long start,
+                               unsigned long end, struct ioreq_server **sp)
+{
+    const struct ioreq_segment *seg = idx->seg[type];
+    unsigned int lo = 0, hi = idx->nr[type];
+
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( seg[mid].end < start )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( lo == idx->nr[type] || seg[lo].start > start )
+        *sp = NULL;
+    else if ( end <= seg[lo].range_end )
+        *sp = seg[lo].s;
+    else
+        return false;
+
+    return true;
+}
+
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
-                               ioservid_t *id)
+                               unsigned int flags, ioservid_t *id)
 {
     struct ioreq_server *s;
     unsigned int i;
@@ -652,6 +943,11 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
         return -EINVAL;
 
+    /* The batched ring shares the buffered ring's event channel. */
+    if ( (flags & XEN_DMOP_IOREQ_SERVER_BATCH) &&
+         bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_OFF )
+        return -EINVAL;
+
     s = xzalloc(struct ioreq_server);
     if ( !s )
         return -ENOMEM;
@@ -675,7 +971,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, flags, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -728,6 +1024,8 @@ static int ioreq_server_destroy(struct domain *d, ioservid_t id)
     ioreq_server_deinit(s);
     set_ioreq_server(d, id, NULL);
 
+    ioreq_index_update(d);
+
     domain_unpause(d);
 
     xfree(s);
@@ -827,6 +1125,18 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
         rc = 0;
         break;
 
+    case XENMEM_resource_ioreq_server_frame_batch:
+        rc = -ENOENT;
+        if ( !s->batch )
+            goto out;
+
+        rc = ioreq_server_alloc_batch_mfn(s);
+        if ( rc )
+            goto out;
+
+        *mfn = page_to_mfn(s->batchioreq.page);
+        break;
+
     default:
         rc = -EINVAL;
         break;
@@ -883,6 +1193,8 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc )
+        ioreq_index_update(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -935,6 +1247,8 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc )
+        ioreq_index_update(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -1010,6 +1324,8 @@ static int ioreq_server_set_state(struct domain *d, ioservid_t id,
     else
         ioreq_server_disable(s);
 
+    ioreq_index_update(d);
+
     domain_unpause(d);
 
     rc = 0;
@@ -1093,63 +1409,81 @@ void ioreq_server_destroy_all(struct domain *d)
         xfree(s);
     }
 
+    if ( d->ioreq_server.index )
+    {
+        call_rcu(&d->ioreq_server.index->rcu, ioreq_index_free_rcu);
+        d->ioreq_server.index = NULL;
+    }
+
     spin_unlock_recursive(&d->ioreq_server.lock);
 }
 
-struct ioreq_server *ioreq_server_select(struct domain *d,
-                                         ioreq_t *p)
+static struct ioreq_server *ioreq_server_scan(struct domain *d,
+                                             unsigned int type,
+                                             unsigned long start,
+                                             unsigned long end)
 {
     struct ioreq_server *s;
-    uint8_t type;
-    uint64_t addr;
     unsigned int id;
 
-    if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
-        return NULL;
-
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
-        struct rangeset *r;
+        if ( s->enabled &&
+             rangeset_contains_range(s->range[type], start, end) )
+            return s;
+    }
 
-        if ( !s->enabled )
-            continue;
+    return NULL;
+}
 
-        r = s->range[type];
+struct ioreq_server *ioreq_server_select(struct domain *d,
+                                         ioreq_t *p)
+{
+    const struct ioreq_index *idx;
+    struct ioreq_server *s = NULL;
+    uint8_t type;
+    uint64_t addr;
+    unsigned long start, end;
+    bool found;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
+        return NULL;
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    switch ( type )
+    {
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-            break;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    default:
+        return NULL;
+    }
 
-            break;
+    rcu_read_lock(&ioreq_index_rcu);
+    idx = rcu_dereference(d->ioreq_server.index);
+    found = idx && ioreq_index_lookup(idx, type, start, end, &s);
+    rcu_read_unlock(&ioreq_index_rcu);
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+    if ( !found )
+        s = ioreq_server_scan(d, type, start, end);
 
-            break;
-        }
+    if ( s && type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
     }
 
-    return NULL;
+    return s;
 }
 
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
@@ -1245,6 +1579,71 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
     return IOREQ_STATUS_HANDLED;
 }
 
+/*
+ * MMIO writes which don't reference guest memory can be posted to the
+ * batched ring: the vCPU has nothing to wait for, and the emulator consumes
+ * the ring before any later synchronous request, so ordering is preserved.
+ * Port I/O writes are commonly expected to have taken effect by the time the
+ * instruction completes (e.g. to acknowledge an interrupt), so they aren't.
+ */
+static bool ioreq_can_post(const ioreq_t *p)
+{
+    return p->dir == IOREQ_WRITE && !p->data_is_ptr &&
+           p->type == IOREQ_TYPE_COPY;
+}
+
+static int ioreq_send_batched(struct ioreq_server *s, const ioreq_t *p)
+{
+    struct domain *d = current->domain;
+    ioreq_batch_page_t *pg;
+    ioreq_t *slot;
+    uint32_t prod;
+
+    /* Ensure ioreq_batch_page fits in a page */
+    BUILD_BUG_ON(sizeof(ioreq_batch_page_t) > PAGE_SIZE);
+
+    spin_lock(&s->bufioreq_lock);
+
+    pg = s->batchioreq.va;
+
+    /* The emulator hasn't acquired the ring (yet). */
+    if ( !pg )
+    {
+        spin_unlock(&s->bufioreq_lock);
+        return IOREQ_STATUS_UNHANDLED;
+    }
+
+    prod = pg->prod;
+
+    if ( (prod - ACCESS_ONCE(pg->cons)) >= IOREQ_BATCH_SLOT_NUM )
+    {
+        /* The ring is full: send the request through the normal path. */
+        spin_unlock(&s->bufioreq_lock);
+        return IOREQ_STATUS_UNHANDLED;
+    }
+
+    slot = &pg->ring[prod % IOREQ_BATCH_SLOT_NUM];
+    *slot = *p;
+    slot->state = STATE_IOREQ_READY;
+    slot->vp_eport = 0;
+
+    /* Make the ioreq_t visible /before/ prod. */
+    smp_wmb();
+    pg->prod = ++prod;
+
+    /*
+     * Make prod visible /before/ reading event.  The emulator waits for a
+     * notification only once it has consumed everything up to event - 1.
+     */
+    smp_mb();
+    if ( ACCESS_ONCE(pg->event) == prod )
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+
+    spin_unlock(&s->bufioreq_lock);
+
+    return IOREQ_STATUS_HANDLED;
+}
+
 int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
                bool buffered)
 {
@@ -1258,6 +1657,10 @@ int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
     if ( buffered )
         return ioreq_send_buffered(s, proto_p);
 
+    if ( s->batch && ioreq_can_post(proto_p) &&
+         ioreq_send_batched(s, proto_p) == IOREQ_STATUS_HANDLED )
+        return IOREQ_STATUS_HANDLED;
+
     if ( unlikely(!vcpu_start_shutdown_deferral(curr)) )
     {
         vio->suspended = true;
@@ -1348,10 +1751,11 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( (data->flags & ~XEN_DMOP_IOREQ_SERVER_BATCH) ||
+             data->pad[0] || data->pad[1] )
             break;
 
-        rc = ioreq_server_create(d, data->handle_bufioreq,
+        rc = ioreq_server_create(d, data->handle_bufioreq, data->flags,
                                  &data->id);
         break;
     }
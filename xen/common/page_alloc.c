@@ -121,6 +121,7 @@
  */
 
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -465,6 +466,61 @@ static long total_avail_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Per-CPU magazines of small free blocks, to keep the common small
+ * allocations and frees off heap_lock.
+ *
+ * Blocks in a magazine have been taken out of the heap as if allocated: they
+ * are PGC_state_inuse and unowned, and aren't accounted in avail[],
+ * total_avail_pages or node_need_scrub.  Their pages may still carry
+ * PGC_need_scrub, in which case they get scrubbed when handed out, and
+ * u.free.need_tlbflush / tlbflush_timestamp are kept valid for them.  A page
+ * getting offlined while in a magazine is returned to the heap (and hence
+ * offlined for real) instead of being handed out.
+ *
+ * Magazines only hold memory of the local node, above the DMA zone, and are
+ * refilled from and drained to the heap a batch at a time.  Claims are
+ * checked when refilling, so claimed memory never ends up in a magazine, and
+ * freed memory bypasses the magazines while any claim is outstanding.
+ */
+#define PCP_MAX_ORDER 2
+#define PCP_SLOTS     32
+#define pcp_high(order)  (PCP_SLOTS >> (order))
+#define pcp_batch(order) (pcp_high(order) / 2)
+
+struct pcp_magazine {
+    spinlock_t lock;
+    unsigned int nr[PCP_MAX_ORDER + 1];
+    struct page_info *pg[PCP_MAX_ORDER + 1][PCP_SLOTS];
+};
+
+static DEFINE_PER_CPU(struct pcp_magazine, pcp_magazine);
+static bool __read_mostly pcp_enabled;
+static unsigned int __read_mostly pcp_zone_lo;
+
+static bool __initdata opt_page_magazines = true;
+boolean_param("page-magazines", opt_page_magazines);
+
+/* heap_lock contention, as seen by lock_heap(). */
+static DEFINE_PER_CPU(unsigned long, heap_lock_contended);
+static DEFINE_PER_CPU(s_time_t, heap_lock_wait);
+
+static void lock_heap(void)
+{
+    s_time_t start;
+
+    if ( likely(spin_trylock(&heap_lock)) )
+        return;
+
+    start = NOW();
+    spin_lock(&heap_lock);
+    this_cpu(heap_lock_wait) += NOW() - start;
+    this_cpu(heap_lock_contended)++;
+    perfc_incr(heap_lock_contended);
+}
+
+static bool pcp_drain_all(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -508,6 +564,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      * must always take the global heap_lock rather than only in the much
      * rarer case that d->outstanding_pages is non-zero
      */
+    if ( pages )
+        /* Let memory held in per-CPU magazines count as available. */
+        pcp_drain_all();
+
     spin_lock(&d->page_alloc_lock);
     spin_lock(&heap_lock);
 
@@ -919,6 +979,416 @@ static struct page_info *get_free_buddy(unsigned int zone_lo,
     }
 }
 
+/* Reference count must continuously be zero for free pages. */
+static void check_page_free(const struct page_info *pg, unsigned int i)
+{
+    if ( (pg[i].count_info & ~PGC_need_scrub) != PGC_state_free )
+    {
+        printk(XENLOG_ERR
+               "pg[%u] MFN %"PRI_mfn" c=%#lx o=%u v=%#lx t=%#x\n",
+               i, mfn_x(page_to_mfn(pg + i)),
+               pg[i].count_info, pg[i].v.free.order,
+               pg[i].u.free.val, pg[i].tlbflush_timestamp);
+        BUG();
+    }
+}
+
+/*
+ * Split the free buddy @pg, as returned by get_free_buddy(), down to @order,
+ * returning the unused halves to the heap, and take the remaining block out
+ * of the free page accounting.  *first_dirty is set for the block returned.
+ */
+static struct page_info *take_heap_block(struct page_info *pg,
+                                         unsigned int order,
+                                         unsigned int *first_dirty)
+{
+    nodeid_t node = phys_to_nid(page_to_maddr(pg));
+    unsigned int zone = page_to_zone(pg);
+    unsigned int buddy_order = PFN_ORDER(pg);
+    unsigned int dirty = pg->u.free.first_dirty;
+    unsigned long request = 1UL << order;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /* We may have to halve the chunk a number of times. */
+    while ( buddy_order != order )
+    {
+        buddy_order--;
+        page_list_add_scrub(pg, node, zone, buddy_order,
+                            (1U << buddy_order) > dirty ?
+                            dirty : INVALID_DIRTY_IDX);
+        pg += 1U << buddy_order;
+
+        if ( dirty != INVALID_DIRTY_IDX )
+        {
+            /* Adjust first_dirty */
+            if ( dirty >= 1U << buddy_order )
+                dirty -= 1U << buddy_order;
+            else
+                dirty = 0; /* We've moved past original first_dirty */
+        }
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    total_avail_pages -= request;
+    ASSERT(total_avail_pages >= 0);
+
+    *first_dirty = dirty;
+
+    return pg;
+}
+
+static void free_heap_pages_locked(
+    struct page_info *pg, unsigned int order, unsigned int first_dirty,
+    unsigned int dirty_cnt, bool pg_offlined);
+static void mark_page_unowned(struct page_info *pg, mfn_t mfn);
+static void scrub_kick(nodeid_t node);
+
+/* Move up to a batch of blocks from the heap into @mag. */
+static void pcp_refill(struct pcp_magazine *mag, unsigned int order,
+                       nodeid_t node)
+{
+    unsigned int i, first_dirty, dirty_cnt = 0;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&mag->lock));
+
+    lock_heap();
+
+    while ( mag->nr[order] < pcp_batch(order) )
+    {
+        /* Leave claimed memory to the domains holding the claims. */
+        if ( outstanding_claims + (1L << order) > total_avail_pages )
+            break;
+
+        pg = get_free_buddy(pcp_zone_lo, NR_ZONES - 1, order,
+                            MEMF_node(node) | MEMF_exact_node, NULL);
+        if ( !pg )
+            break;
+
+        pg = take_heap_block(pg, order, &first_dirty);
+
+        for ( i = 0; i < (1U << order); i++ )
+        {
+            check_page_free(pg, i);
+            if ( pg[i].count_info & PGC_need_scrub )
+                dirty_cnt++;
+            pg[i].count_info = PGC_state_inuse |
+                               (pg[i].count_info & PGC_need_scrub);
+            /* v.free.order aliases the owner. */
+            page_set_owner(&pg[i], NULL);
+        }
+
+        mag->pg[order][mag->nr[order]++] = pg;
+    }
+
+    node_need_scrub[node] -= dirty_cnt;
+
+    check_low_mem_virq();
+
+    spin_unlock(&heap_lock);
+
+    perfc_incr(pcp_refill);
+}
+
+/*
+ * Return a block taken out of a magazine to the heap.  Needs heap_lock.
+ * Returns whether the block has pages needing scrubbing.
+ */
+static bool pcp_free_block(struct page_info *pg, unsigned int order)
+{
+    unsigned int i, first_dirty = INVALID_DIRTY_IDX, dirty_cnt = 0;
+    bool pg_offlined = false;
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        unsigned long x = pg[i].count_info;
+
+        if ( x & PGC_need_scrub )
+        {
+            if ( first_dirty == INVALID_DIRTY_IDX )
+                first_dirty = i;
+            dirty_cnt++;
+        }
+
+        /* Offlining is serialised by heap_lock, so no need for cmpxchg(). */
+        if ( (x & PGC_state) == PGC_state_offlining )
+        {
+            pg[i].count_info = (x & (PGC_broken | PGC_need_scrub)) |
+                               PGC_state_offlined;
+            pg_offlined = true;
+        }
+        else
+        {
+            ASSERT((x & PGC_state) == PGC_state_inuse);
+            pg[i].count_info = PGC_state_free | (x & PGC_need_scrub);
+        }
+    }
+
+    free_heap_pages_locked(pg, order, first_dirty, dirty_cnt, pg_offlined);
+
+    return dirty_cnt;
+}
+
+/* Return the @nr oldest blocks of @order in @mag to the heap. */
+static void pcp_drain(struct pcp_magazine *mag, unsigned int order,
+                      unsigned int nr)
+{
+    unsigned int i;
+    bool dirty = false;
+
+    ASSERT(spin_is_locked(&mag->lock));
+    ASSERT(nr <= mag->nr[order]);
+
+    lock_heap();
+    for ( i = 0; i < nr; i++ )
+        if ( pcp_free_block(mag->pg[order][i], order) )
+            dirty = true;
+    spin_unlock(&heap_lock);
+
+    /* All blocks of a magazine are from the same node. */
+    if ( dirty )
+        scrub_kick(phys_to_nid(page_to_maddr(mag->pg[order][0])));
+
+    mag->nr[order] -= nr;
+    memmove(&mag->pg[order][0], &mag->pg[order][nr],
+            mag->nr[order] * sizeof(mag->pg[order][0]));
+
+    perfc_incr(pcp_drain);
+}
+
+static bool pcp_drain_cpu(unsigned int cpu)
+{
+    struct pcp_magazine *mag = &per_cpu(pcp_magazine, cpu);
+    unsigned int order;
+    bool drained = false;
+
+    spin_lock(&mag->lock);
+    for ( order = 0; order <= PCP_MAX_ORDER; order++ )
+        if ( mag->nr[order] )
+        {
+            pcp_drain(mag, order, mag->nr[order]);
+            drained = true;
+        }
+    spin_unlock(&mag->lock);
+
+    return drained;
+}
+
+/* Return all magazines' contents to the heap.  Returns whether any. */
+static bool pcp_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    if ( !pcp_enabled )
+        return false;
+
+    for_each_online_cpu ( cpu )
+        if ( pcp_drain_cpu(cpu) )
+            drained = true;
+
+    return drained;
+}
+
+/* Number of pages held in the magazines of @node's CPUs (all if none). */
+static unsigned long pcp_avail_pages(nodeid_t node)
+{
+    unsigned int cpu, order;
+    unsigned long pages = 0;
+
+    if ( !pcp_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct pcp_magazine *mag = &per_cpu(pcp_magazine, cpu);
+
+        if ( node != NUMA_NO_NODE && cpu_to_node(cpu) != node )
+            continue;
+
+        for ( order = 0; order <= PCP_MAX_ORDER; order++ )
+            pages += (unsigned long)read_atomic(&mag->nr[order]) << order;
+    }
+
+    return pages;
+}
+
+/* Whether the local @node is where the heap would allocate from, too. */
+static bool pcp_node_ok(nodeid_t node, unsigned int memflags,
+                        const struct domain *d)
+{
+    nodeid_t req_node = MEMF_get_node(memflags);
+
+    if ( req_node != NUMA_NO_NODE )
+        return req_node == node;
+
+    if ( !d || num_online_nodes() == 1 )
+        return true;
+
+    /* Don't defeat spreading the domain's memory over its nodes. */
+    return nodes_weight(d->node_affinity) == 1 &&
+           nodemask_test(node, &d->node_affinity);
+}
+
+static struct page_info *pcp_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    struct pcp_magazine *mag = &this_cpu(pcp_magazine);
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    struct page_info *pg = NULL;
+    unsigned int i, zone;
+    bool dirty = false;
+
+    if ( !pcp_enabled || order > PCP_MAX_ORDER || zone_hi < pcp_zone_lo ||
+         node >= MAX_NUMNODES || !pcp_node_ok(node, memflags, d) )
+        return NULL;
+
+    spin_lock(&mag->lock);
+
+    if ( !mag->nr[order] )
+        pcp_refill(mag, order, node);
+
+    if ( mag->nr[order] )
+    {
+        pg = mag->pg[order][mag->nr[order] - 1];
+        zone = page_to_zone(pg);
+        if ( zone >= zone_lo && zone <= zone_hi )
+            mag->nr[order]--;
+        else
+            pg = NULL;
+    }
+
+    for ( i = 0; pg && i < (1U << order); i++ )
+    {
+        if ( page_state_is(&pg[i], inuse) )
+            continue;
+
+        /* Offlined while in the magazine: let the heap deal with it. */
+        lock_heap();
+        dirty = pcp_free_block(pg, order);
+        spin_unlock(&heap_lock);
+        pg = NULL;
+    }
+
+    spin_unlock(&mag->lock);
+
+    if ( dirty )
+        scrub_kick(node);
+
+    if ( !pg )
+        return NULL;
+
+    perfc_incr(pcp_alloc);
+
+    if ( d != NULL )
+        d->last_alloc_node = node;
+
+    return pg;
+}
+
+static bool pcp_free(struct page_info *pg, unsigned int order,
+                     bool need_scrub)
+{
+    struct pcp_magazine *mag = &this_cpu(pcp_magazine);
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i;
+
+    if ( !pcp_enabled || order > PCP_MAX_ORDER ||
+         phys_to_nid(mfn_to_maddr(mfn)) != node ||
+         page_to_zone(pg) < pcp_zone_lo ||
+         /* Make freed memory available to claims right away. */
+         read_atomic(&outstanding_claims) )
+        return false;
+
+    for ( i = 0; i < (1U << order); i++ )
+        if ( !page_state_is(&pg[i], inuse) || (pg[i].count_info & PGC_static) )
+            return false;
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        unsigned long x, nx, y = pg[i].count_info;
+
+        /*
+         * Clear everything but the state, which may change under our feet
+         * if the page is being offlined.
+         */
+        do {
+            x = y;
+            nx = (x & (PGC_state | PGC_broken)) |
+                 (need_scrub ? PGC_need_scrub : 0);
+        } while ( (y = cmpxchg(&pg[i].count_info, x, nx)) != x );
+
+        mark_page_unowned(&pg[i], mfn_add(mfn, i));
+
+        if ( need_scrub )
+            poison_one_page(&pg[i]);
+    }
+
+    spin_lock(&mag->lock);
+
+    if ( mag->nr[order] == pcp_high(order) )
+        pcp_drain(mag, order, pcp_batch(order));
+
+    mag->pg[order][mag->nr[order]++] = pg;
+
+    spin_unlock(&mag->lock);
+
+    perfc_incr(pcp_free);
+
+    return true;
+}
+
+static int cf_check cpu_pcp_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&per_cpu(pcp_magazine, cpu).lock);
+        break;
+
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        pcp_drain_cpu(cpu);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_pcp_nfb = {
+    .notifier_call = cpu_pcp_callback,
+};
+
+static int __init cf_check pcp_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    if ( !opt_page_magazines )
+        return 0;
+
+    pcp_zone_lo = dma_bitsize ? bits_to_zone(dma_bitsize) + 1
+                              : MEMZONE_XEN + 1;
+
+    cpu_pcp_callback(&cpu_pcp_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_pcp_nfb);
+
+    pcp_enabled = true;
+
+    return 0;
+}
+presmp_initcall(pcp_init);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
@@ -926,10 +1396,10 @@ static struct page_info *alloc_heap_pages(
     struct domain *d)
 {
     nodeid_t node;
-    unsigned int i, buddy_order, zone, first_dirty;
+    unsigned int i, first_dirty;
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    bool need_tlbflush = false;
+    bool need_tlbflush = false, cached = false, drained = false;
     uint32_t tlbflush_timestamp = 0;
     unsigned int dirty_cnt = 0;
     mfn_t mfn;
@@ -943,7 +1413,29 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
+    pg = pcp_alloc(zone_lo, zone_hi, order, memflags, d);
+    if ( pg )
+    {
+        node = phys_to_nid(page_to_maddr(pg));
+        /* Magazine blocks may be partly dirty: check each page below. */
+        first_dirty = 0;
+        cached = true;
+
+        for ( i = 0; i < (1U << order); i++ )
+        {
+            if ( !(memflags & MEMF_no_tlbflush) )
+                accumulate_tlbflush(&need_tlbflush, &pg[i],
+                                    &tlbflush_timestamp);
+
+            pg[i].u.inuse.type_info = PGT_TYPE_INFO_INITIALIZER;
+            page_set_owner(&pg[i], NULL);
+        }
+
+        goto prepare;
+    }
+
+ retry:
+    lock_heap();
 
     /*
      * Claimed memory is considered unavailable unless the request
@@ -952,10 +1444,7 @@ static struct page_info *alloc_heap_pages(
     if ( (outstanding_claims + request > total_avail_pages) &&
           ((memflags & MEMF_no_refcount) ||
            !d || d->outstanding_pages < request) )
-    {
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+        goto fail;
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
     /* Try getting a dirty buddy if we couldn't get a clean one. */
@@ -963,41 +1452,10 @@ static struct page_info *alloc_heap_pages(
         pg = get_free_buddy(zone_lo, zone_hi, order,
                             memflags | MEMF_no_scrub, d);
     if ( !pg )
-    {
-        /* No suitable memory blocks. Fail the request. */
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+        goto fail;
 
     node = phys_to_nid(page_to_maddr(pg));
-    zone = page_to_zone(pg);
-    buddy_order = PFN_ORDER(pg);
-
-    first_dirty = pg->u.free.first_dirty;
-
-    /* We may have to halve the chunk a number of times. */
-    while ( buddy_order != order )
-    {
-        buddy_order--;
-        page_list_add_scrub(pg, node, zone, buddy_order,
-                            (1U << buddy_order) > first_dirty ?
-                            first_dirty : INVALID_DIRTY_IDX);
-        pg += 1U << buddy_order;
-
-        if ( first_dirty != INVALID_DIRTY_IDX )
-        {
-            /* Adjust first_dirty */
-            if ( first_dirty >= 1U << buddy_order )
-                first_dirty -= 1U << buddy_order;
-            else
-                first_dirty = 0; /* We've moved past original first_dirty */
-        }
-    }
-
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
+    pg = take_heap_block(pg, order, &first_dirty);
 
     check_low_mem_virq();
 
@@ -1006,16 +1464,7 @@ static struct page_info *alloc_heap_pages(
 
     for ( i = 0; i < (1 << order); i++ )
     {
-        /* Reference count must continuously be zero for free pages. */
-        if ( (pg[i].count_info & ~PGC_need_scrub) != PGC_state_free )
-        {
-            printk(XENLOG_ERR
-                   "pg[%u] MFN %"PRI_mfn" c=%#lx o=%u v=%#lx t=%#x\n",
-                   i, mfn_x(page_to_mfn(pg + i)),
-                   pg[i].count_info, pg[i].v.free.order,
-                   pg[i].u.free.val, pg[i].tlbflush_timestamp);
-            BUG();
-        }
+        check_page_free(pg, i);
 
         /* PGC_need_scrub can only be set if first_dirty is valid */
         ASSERT(first_dirty != INVALID_DIRTY_IDX || !(pg[i].count_info & PGC_need_scrub));
@@ -1035,6 +1484,7 @@ static struct page_info *alloc_heap_pages(
 
     spin_unlock(&heap_lock);
 
+ prepare:
     if ( first_dirty != INVALID_DIRTY_IDX ||
          (scrub_debug && !(memflags & MEMF_no_scrub)) )
     {
@@ -1051,9 +1501,10 @@ static struct page_info *alloc_heap_pages(
                 check_one_page(&pg[i]);
         }
 
-        if ( dirty_cnt )
+        /* Dirty pages in magazines aren't accounted in node_need_scrub. */
+        if ( dirty_cnt && !cached )
         {
-            spin_lock(&heap_lock);
+            lock_heap();
             node_need_scrub[node] -= dirty_cnt;
             spin_unlock(&heap_lock);
         }
@@ -1071,6 +1522,21 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(mfn_x(mfn) + i, !(memflags & MEMF_no_icache_flush));
 
     return pg;
+
+ fail:
+    spin_unlock(&heap_lock);
+
+    /*
+     * Small requests failing means memory is tight: the pages sitting in
+     * other CPUs' magazines may make the difference.
+     */
+    if ( order <= PCP_MAX_ORDER && !drained && pcp_drain_all() )
+    {
+        drained = true;
+        goto retry;
+    }
+
+    return NULL;
 }
 
 /* Remove any offlined page in the buddy pointed to by head. */
@@ -1170,10 +1636,30 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
+/*
+ * Background scrubbing is done by idle CPUs, each of them working on its own
+ * buddy.  All CPUs of a node scrub that node's memory in parallel, while a
+ * memory-only node is scrubbed by a single CPU from the closest node at a
+ * time, tracked in node_scrubbing.
+ *
+ * CPUs which went idle without finding any scrub work are recorded in
+ * scrub_wait_cpus, and get woken up once dirty pages are freed to their node.
+ */
 static nodemask_t node_scrubbing;
+static cpumask_t scrub_wait_cpus;
+static atomic_t nr_scrubbers;
+static unsigned long scrubbed_pages; /* Protected by heap_lock. */
+
+static nodeid_t scrub_local_node(unsigned int cpu)
+{
+    nodeid_t node = cpu_to_node(cpu);
+
+    return node == NUMA_NO_NODE ? 0 : node;
+}
 
 /*
- * If get_node is true this will return closest node that needs to be scrubbed,
+ * If get_node is true this will return the local node if it needs to be
+ * scrubbed, or else the closest memory-only node that needs to be scrubbed,
  * with appropriate bit in node_scrubbing set.
  * If get_node is not set, this will return *a* node that needs to be scrubbed.
  * node_scrubbing bitmask will no be updated.
@@ -1181,15 +1667,11 @@ static nodemask_t node_scrubbing;
  */
 static unsigned int node_to_scrub(bool get_node)
 {
-    nodeid_t node = cpu_to_node(smp_processor_id()), local_node;
+    nodeid_t node = scrub_local_node(smp_processor_id()), local_node;
     nodeid_t closest = NUMA_NO_NODE;
     u8 dist, shortest = 0xff;
 
-    if ( node == NUMA_NO_NODE )
-        node = 0;
-
-    if ( node_need_scrub[node] &&
-         (!get_node || !node_test_and_set(node, node_scrubbing)) )
+    if ( node_need_scrub[node] )
         return node;
 
     /*
@@ -1259,19 +1741,68 @@ static void cf_check scrub_continue(void *data)
     }
 }
 
+/*
+ * Find the last dirty buddy on a free list which isn't being scrubbed by
+ * another CPU.  Unscrubbed pages are always at the end of the list.
+ */
+static struct page_info *scrub_claimable(const struct page_list_head *head)
+{
+    struct page_info *pg, *tmp;
+
+    page_list_for_each_safe_reverse ( pg, tmp, head )
+    {
+        if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+            break;
+        if ( pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING )
+            return pg;
+    }
+
+    return NULL;
+}
+
+/* Wake up the CPUs waiting for scrub work which can scrub @node. */
+static void scrub_kick(nodeid_t node)
+{
+    const cpumask_t *mask = &node_to_cpumask(node);
+    unsigned int cpu;
+
+    /* Pairs with the barrier in scrub_free_pages(). */
+    smp_mb();
+
+    if ( cpumask_empty(&scrub_wait_cpus) )
+        return;
+
+    if ( cpumask_empty(mask) )
+        mask = &cpu_online_map;
+
+    for_each_cpu ( cpu, mask )
+        if ( cpu_online(cpu) &&
+             cpumask_test_and_clear_cpu(cpu, &scrub_wait_cpus) )
+            smp_send_event_check_cpu(cpu);
+}
+
 bool scrub_free_pages(void)
 {
     struct page_info *pg;
     unsigned int zone;
     unsigned int cpu = smp_processor_id();
-    bool preempt = false;
+    bool preempt = false, claimed = false;
     nodeid_t node;
     unsigned int cnt = 0;
 
+    /*
+     * Announce that we're looking for work before checking for it, so that
+     * dirty pages freed meanwhile get us woken up by scrub_kick().
+     */
+    if ( !cpumask_test_cpu(cpu, &scrub_wait_cpus) )
+        cpumask_set_cpu(cpu, &scrub_wait_cpus);
+    smp_mb();
+
     node = node_to_scrub(true);
     if ( node == NUMA_NO_NODE )
         return false;
 
+    atomic_inc(&nr_scrubbers);
     spin_lock(&heap_lock);
 
     for ( zone = 0; zone < NR_ZONES; zone++ )
@@ -1279,17 +1810,17 @@ bool scrub_free_pages(void)
         unsigned int order = MAX_ORDER;
 
         do {
-            while ( !page_list_empty(&heap(node, zone, order)) )
+            while ( (pg = scrub_claimable(&heap(node, zone, order))) != NULL )
             {
                 unsigned int i, dirty_cnt;
                 struct scrub_wait_state st;
 
-                /* Unscrubbed pages are always at the end of the list. */
-                pg = page_list_last(&heap(node, zone, order));
-                if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
-                    break;
+                if ( !claimed )
+                {
+                    cpumask_clear_cpu(cpu, &scrub_wait_cpus);
+                    claimed = true;
+                }
 
-                ASSERT(pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING);
                 pg->u.free.scrub_state = BUDDY_SCRUBBING;
 
                 spin_unlock(&heap_lock);
@@ -1324,6 +1855,7 @@ bool scrub_free_pages(void)
 
                         spin_lock(&heap_lock);
                         node_need_scrub[node] -= dirty_cnt;
+                        scrubbed_pages += dirty_cnt;
                         spin_unlock(&heap_lock);
                         goto out_nolock;
                     }
@@ -1356,6 +1888,7 @@ bool scrub_free_pages(void)
                 spin_lock_cb(&heap_lock, scrub_continue, &st);
 
                 node_need_scrub[node] -= dirty_cnt;
+                scrubbed_pages += dirty_cnt;
 
                 if ( st.drop )
                     goto out;
@@ -1380,10 +1913,31 @@ bool scrub_free_pages(void)
     spin_unlock(&heap_lock);
 
  out_nolock:
-    node_clear(node, node_scrubbing);
+    atomic_dec(&nr_scrubbers);
+    if ( node != scrub_local_node(cpu) )
+        node_clear(node, node_scrubbing);
+
+    /*
+     * Don't keep the idle loop spinning when all the dirty buddies are
+     * being scrubbed by other CPUs already.
+     */
+    if ( !claimed )
+        return false;
+
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
+void get_scrub_status(unsigned long *scrubbed, unsigned int *scrubbers)
+{
+    *scrubbed = read_atomic(&scrubbed_pages);
+    *scrubbers = atomic_read(&nr_scrubbers);
+}
+
+unsigned long node_dirty_pages(unsigned int node)
+{
+    return read_atomic(&node_need_scrub[node]);
+}
+
 static bool mark_page_free(struct page_info *pg, mfn_t mfn)
 {
     bool pg_offlined = false;
@@ -1423,6 +1977,13 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
         BUG();
     }
 
+    mark_page_unowned(pg, mfn);
+
+    return pg_offlined;
+}
+
+static void mark_page_unowned(struct page_info *pg, mfn_t mfn)
+{
     /* If a page has no owner it will need no safety TLB flush. */
     pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
     if ( pg->u.free.need_tlbflush )
@@ -1431,45 +1992,26 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
     /* This page is not a guest frame any more. */
     page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
     set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
-
-    return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order, bool need_scrub)
+/*
+ * Put 2^@order pages, already marked free, back into the heap.  @dirty_cnt
+ * of them, starting at @first_dirty, have PGC_need_scrub set.
+ */
+static void free_heap_pages_locked(
+    struct page_info *pg, unsigned int order, unsigned int first_dirty,
+    unsigned int dirty_cnt, bool pg_offlined)
 {
     unsigned long mask;
-    mfn_t mfn = page_to_mfn(pg);
-    unsigned int i, node = phys_to_nid(mfn_to_maddr(mfn));
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
     unsigned int zone = page_to_zone(pg);
-    bool pg_offlined = false;
-
-    ASSERT(order <= MAX_ORDER);
 
-    spin_lock(&heap_lock);
-
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
-            pg_offlined = true;
-
-        if ( need_scrub )
-        {
-            pg[i].count_info |= PGC_need_scrub;
-            poison_one_page(&pg[i]);
-        }
-    }
+    ASSERT(spin_is_locked(&heap_lock));
 
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
-    if ( need_scrub )
-    {
-        node_need_scrub[node] += 1 << order;
-        pg->u.free.first_dirty = 0;
-    }
-    else
-        pg->u.free.first_dirty = INVALID_DIRTY_IDX;
+    node_need_scrub[node] += dirty_cnt;
+    pg->u.free.first_dirty = first_dirty;
 
     /* Merge chunks as far as possible. */
     while ( order < MAX_ORDER )
@@ -1530,8 +2072,42 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i;
+    bool pg_offlined = false;
+
+    ASSERT(order <= MAX_ORDER);
+
+    if ( pcp_free(pg, order, need_scrub) )
+        return;
+
+    lock_heap();
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
+            pg_offlined = true;
+
+        if ( need_scrub )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            poison_one_page(&pg[i]);
+        }
+    }
+
+    free_heap_pages_locked(pg, order, need_scrub ? 0 : INVALID_DIRTY_IDX,
+                           need_scrub ? 1U << order : 0, pg_offlined);
 
     spin_unlock(&heap_lock);
+
+    if ( need_scrub )
+        scrub_kick(phys_to_nid(page_to_maddr(pg)));
 }
 
 
@@ -1640,6 +2216,9 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    /* Allow a page sitting in a per-CPU magazine to be offlined right away. */
+    pcp_drain_all();
+
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -2571,12 +3150,13 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + pcp_avail_pages(NUMA_NO_NODE);
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
 {
-    return avail_heap_pages(MEMZONE_XEN, NR_ZONES -1, nodeid);
+    return avail_heap_pages(MEMZONE_XEN, NR_ZONES -1, nodeid) +
+           pcp_avail_pages(nodeid);
 }
 
 
@@ -2653,11 +3233,159 @@ static void cf_check dump_heap(unsigned char key)
             continue;
         printk("Node %d has %lu unscrubbed pages\n", i, node_need_scrub[i]);
     }
+
+    for_each_online_cpu ( i )
+    {
+        const struct pcp_magazine *mag = &per_cpu(pcp_magazine, i);
+
+        if ( pcp_enabled )
+            printk("CPU%d magazines: order0 %u order1 %u order2 %u\n", i,
+                   mag->nr[0], mag->nr[1], mag->nr[2]);
+        if ( per_cpu(heap_lock_contended, i) )
+            printk("CPU%d heap_lock: %lu contended, %"PRI_stime"ns waited\n",
+                   i, per_cpu(heap_lock_contended, i),
+                   per_cpu(heap_lock_wait, i));
+    }
+}
+
+/*
+ * Heap stress test: every online CPU repeatedly allocates and frees a set of
+ * single pages, reporting the rate achieved and how long it spent waiting
+ * for heap_lock in the process.
+ */
+#define HEAP_STRESS_PAGES  512
+#define HEAP_STRESS_ROUNDS 256
+
+struct heap_stress {
+    struct tasklet tasklet;
+    unsigned long ops;
+    s_time_t time;
+    unsigned long contended;
+    s_time_t wait;
+};
+
+/*
+ * Indexed by CPU, and never freed: the CPUs may go offline while the test
+ * runs, and their tasklets then run elsewhere.
+ */
+static struct heap_stress *heap_stress;
+static cpumask_t heap_stress_cpus;
+static atomic_t heap_stress_running;
+
+static void heap_stress_report(void)
+{
+    unsigned int cpu;
+    unsigned long ops = 0, contended = 0;
+    s_time_t wait = 0;
+
+    printk("Heap stress test: %u x %u single page allocations and frees\n",
+           HEAP_STRESS_ROUNDS, HEAP_STRESS_PAGES);
+
+    for_each_cpu ( cpu, &heap_stress_cpus )
+    {
+        const struct heap_stress *hs = &heap_stress[cpu];
+
+        printk("CPU%u: %lu ops in %"PRI_stime"us (%lu/ms), heap_lock: "
+               "%lu contended, %"PRI_stime"us waited\n",
+               cpu, hs->ops, hs->time / 1000,
+               hs->time ? hs->ops * MILLISECS(1) / hs->time : 0,
+               hs->contended, hs->wait / 1000);
+        ops += hs->ops;
+        contended += hs->contended;
+        wait += hs->wait;
+    }
+
+    printk("Total: %lu ops, heap_lock: %lu contended, %"PRI_stime"us waited\n",
+           ops, contended, wait / 1000);
+}
+
+static void cf_check heap_stress_cpu(void *data)
+{
+    struct heap_stress *hs = data;
+    PAGE_LIST_HEAD(list);
+    struct page_info *pg;
+    unsigned int round, i;
+    unsigned long contended = this_cpu(heap_lock_contended);
+    s_time_t wait = this_cpu(heap_lock_wait), start = NOW();
+
+    hs->ops = 0;
+
+    for ( round = 0; round < HEAP_STRESS_ROUNDS; round++ )
+    {
+        for ( i = 0; i < HEAP_STRESS_PAGES; i++ )
+        {
+            if ( (pg = alloc_domheap_page(NULL, MEMF_no_scrub)) == NULL )
+                break;
+            page_list_add(pg, &list);
+            hs->ops++;
+        }
+
+        while ( (pg = page_list_remove_head(&list)) != NULL )
+        {
+            free_domheap_page(pg);
+            hs->ops++;
+        }
+
+        process_pending_softirqs();
+    }
+
+    hs->time = NOW() - start;
+    hs->contended = this_cpu(heap_lock_contended) - contended;
+    hs->wait = this_cpu(heap_lock_wait) - wait;
+
+    if ( atomic_dec_and_test(&heap_stress_running) )
+        heap_stress_report();
+}
+
+static void cf_check run_heap_stress(unsigned char key)
+{
+    unsigned int cpu;
+
+    if ( atomic_cmpxchg(&heap_stress_running, 0, 1) )
+    {
+        printk("Heap stress test already running\n");
+        return;
+    }
+
+    if ( !heap_stress )
+    {
+        heap_stress = xzalloc_array(struct heap_stress, nr_cpu_ids);
+        if ( !heap_stress )
+        {
+            printk("Heap stress test: out of memory\n");
+            atomic_set(&heap_stress_running, 0);
+            return;
+        }
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+            tasklet_init(&heap_stress[cpu].tasklet, heap_stress_cpu,
+                         &heap_stress[cpu]);
+    }
+
+    /* Tasklets can't be scheduled on CPUs going offline. */
+    if ( !get_cpu_maps() )
+    {
+        printk("Heap stress test: CPUs being brought up or down, try again\n");
+        atomic_set(&heap_stress_running, 0);
+        return;
+    }
+
+    cpumask_copy(&heap_stress_cpus, &cpu_online_map);
+    atomic_set(&heap_stress_running, cpumask_weight(&heap_stress_cpus));
+
+    printk("'%c' pressed -> running heap stress test on %u CPUs\n",
+           key, cpumask_weight(&heap_stress_cpus));
+
+    for_each_cpu ( cpu, &heap_stress_cpus )
+        tasklet_schedule_on_cpu(&heap_stress[cpu].tasklet, cpu);
+
+    put_cpu_maps();
 }
 
 static __init int cf_check register_heap_trigger(void)
 {
     register_keyhandler('H', dump_heap, "dump heap info", 1);
+    register_keyhandler('j', run_heap_stress, "run heap stress test", 0);
     return 0;
 }
 __initcall(register_heap_trigger);
@@ -21,6 +21,7 @@
 #include <xen/init.h>
 #include <xen/radix-tree.h>
 #include <xen/errno.h>
+#include <xen/xmem_cache.h>
 
 struct radix_tree_path {
 	struct radix_tree_node *node;
@@ -52,9 +53,11 @@ struct rcu_node {
 	struct rcu_head rcu_head;
 };
 
+static XMEM_CACHE(rcu_node_cache, "radix_tree_node", struct rcu_node);
+
 static struct radix_tree_node *cf_check rcu_node_alloc(void *arg)
 {
-	struct rcu_node *rcu_node = xmalloc(struct rcu_node);
+	struct rcu_node *rcu_node = xmem_cache_alloc(&rcu_node_cache);
 	return rcu_node ? &rcu_node->node : NULL;
 }
 
@@ -62,7 +65,7 @@ static void cf_check _rcu_node_free(struct rcu_head *head)
 {
 	struct rcu_node *rcu_node =
 		container_of(head, struct rcu_node, rcu_head);
-	xfree(rcu_node);
+	xmem_cache_free(&rcu_node_cache, rcu_node);
 }
 
 static void cf_check rcu_node_free(struct radix_tree_node *node, void *arg)
@@ -948,18 +948,11 @@ void vcpu_sleep_sync(struct vcpu *v)
     sync_vcpu_execstate(v);
 }
 
-void vcpu_wake(struct vcpu *v)
+/* To be called with the scheduler lock of v's unit held. */
+void vcpu_wake_locked(struct vcpu *v)
 {
-    unsigned long flags;
-    spinlock_t *lock;
     struct sched_unit *unit = v->sched_unit;
 
-    TRACE_2D(TRC_SCHED_WAKE, v->domain->domain_id, v->vcpu_id);
-
-    rcu_read_lock(&sched_res_rculock);
-
-    lock = unit_schedule_lock_irqsave(unit, &flags);
-
     if ( likely(vcpu_runnable(v)) )
     {
         if ( v->runstate.state >= RUNSTATE_blocked )
@@ -981,6 +974,27 @@ void vcpu_wake(struct vcpu *v)
         if ( v->runstate.state == RUNSTATE_blocked )
             vcpu_runstate_change(v, RUNSTATE_offline, NOW());
     }
+}
+
+void vcpu_wake(struct vcpu *v)
+{
+    unsigned long flags;
+    spinlock_t *lock;
+    struct sched_unit *unit = v->sched_unit;
+
+    TRACE_2D(TRC_SCHED_WAKE, v->domain->domain_id, v->vcpu_id);
+
+    rcu_read_lock(&sched_res_rculock);
+
+    if ( vcpu_runnable(v) && sched_queue_wake(unit_scheduler(unit), unit) )
+    {
+        rcu_read_unlock(&sched_res_rculock);
+        return;
+    }
+
+    lock = unit_schedule_lock_irqsave(unit, &flags);
+
+    vcpu_wake_locked(v);
 
     unit_schedule_unlock_irqrestore(lock, flags, unit);
 
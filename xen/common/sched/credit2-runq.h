@@ -0,0 +1,109 @@
+/******************************************************************************
+ * Runqueue of the credit2 scheduler.
+ *
+ * The runnable units of a runqueue are kept in a red-black tree ordered by
+ * decreasing credit.  Units with equal credit are kept in the order they were
+ * inserted, i.e. a unit is put after all the ones with at least its credit,
+ * as with a sorted list.  The unit with the most credit is cached, so finding
+ * it takes constant time.
+ *
+ * This is to be included by credit2.c only, after the definitions of struct
+ * csched2_runqueue_data (runq and runq_first fields) and struct csched2_unit
+ * (credit and runq_elem fields).  It is a separate file so that
+ * tools/tests/credit2-runq can use it, too.
+ */
+
+#ifndef __XEN_SCHED_CREDIT2_RUNQ_H__
+#define __XEN_SCHED_CREDIT2_RUNQ_H__
+
+#include <xen/rbtree.h>
+
+static inline void runq_init(struct csched2_runqueue_data *rqd)
+{
+    rqd->runq = RB_ROOT;
+    rqd->runq_first = NULL;
+}
+
+static inline int unit_on_runq(const struct csched2_unit *svc)
+{
+    return !RB_EMPTY_NODE(&svc->runq_elem);
+}
+
+static inline struct csched2_unit * runq_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct csched2_unit, runq_elem);
+}
+
+/* The runnable units of a runqueue, in order of decreasing credit. */
+static inline struct csched2_unit *runq_first(
+    const struct csched2_runqueue_data *rqd)
+{
+    return rqd->runq_first ? runq_elem(rqd->runq_first) : NULL;
+}
+
+static inline struct csched2_unit *runq_next(const struct csched2_unit *svc)
+{
+    struct rb_node *next = rb_next(&svc->runq_elem);
+
+    return next ? runq_elem(next) : NULL;
+}
+
+static inline void runq_add(struct csched2_runqueue_data *rqd,
+                            struct csched2_unit *svc)
+{
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+    bool first = true;
+
+    while ( *link )
+    {
+        parent = *link;
+
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            first = false;
+        }
+    }
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+
+    if ( first )
+        rqd->runq_first = &svc->runq_elem;
+}
+
+static inline void runq_del(struct csched2_runqueue_data *rqd,
+                            struct csched2_unit *svc)
+{
+    if ( rqd->runq_first == &svc->runq_elem )
+        rqd->runq_first = rb_next(&svc->runq_elem);
+
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
+}
+
+/* Position of a unit in its runqueue.  This is linear in the position. */
+static inline unsigned int runq_pos(const struct csched2_unit *svc)
+{
+    const struct rb_node *iter;
+    unsigned int pos = 0;
+
+    for ( iter = rb_prev(&svc->runq_elem); iter; iter = rb_prev(iter) )
+        pos++;
+
+    return pos;
+}
+
+#endif /* __XEN_SCHED_CREDIT2_RUNQ_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -19,6 +19,7 @@
 #include <xen/event.h>
 #include <xen/time.h>
 #include <xen/perfc.h>
+#include <xen/rbtree.h>
 #include <xen/softirq.h>
 #include <asm/div64.h>
 #include <xen/errno.h>
@@ -489,14 +490,24 @@ custom_param("credit2_runqueue", parse_credit2_runqueue);
 static unsigned int __read_mostly opt_max_cpus_runqueue = MAX_CPUS_RUNQ;
 integer_param("sched_credit2_max_cpus_runqueue", opt_max_cpus_runqueue);
 
+/*
+ * Wakeups of a unit coming from a pCPU not in its runqueue can be queued on
+ * the runqueue, without taking its lock, and done by one of its own pCPUs
+ * the next time it goes through the scheduler. See csched2_unit_queue_wake().
+ */
+static bool __read_mostly opt_wake_queue;
+boolean_param("credit2_wake_queue", opt_wake_queue);
+
 /*
  * Per-runqueue data
  */
 struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
+    struct lock_profile_qhead profile_head; /* Lock profiling of lock         */
 
     struct list_head rql;      /* List of runqueues                          */
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Runnable units, ordered by credit          */
+    struct rb_node *runq_first;/* Unit with the highest credit in runq       */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -516,6 +527,10 @@ struct csched2_runqueue_data {
     struct list_head svc;      /* List of all units assigned to the runqueue */
     unsigned int max_weight;   /* Max weight of the units in this runqueue   */
     unsigned int pick_bias;    /* Last picked pcpu. Start from it next time  */
+
+    struct csched2_unit *wakeq;/* Queued wakeups, most recent first         */
+
+    struct rcu_head rcu;       /* For freeing, see csched2_free_pdata()      */
 };
 
 /*
@@ -565,11 +580,14 @@ struct csched2_unit {
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
     struct list_head parked_elem;      /* On the parked_units list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
     int tickled_cpu;                   /* Cpu that will pick us (-1 if none)  */
+
+    struct csched2_unit *wakeq_next;   /* Next in the wakeup queue            */
+    struct csched2_runqueue_data *wakeq_rqd; /* Wakeup queued on (or NULL)    */
 };
 
 /*
@@ -830,15 +848,8 @@ static s_time_t c2t(const struct csched2_runqueue_data *rqd, s_time_t credit,
  * Runqueue related code.
  */
 
-static inline int unit_on_runq(const struct csched2_unit *svc)
-{
-    return !list_empty(&svc->runq_elem);
-}
-
-static inline struct csched2_unit * runq_elem(struct list_head *elem)
-{
-    return list_entry(elem, struct csched2_unit, runq_elem);
-}
+/* Needs struct csched2_runqueue_data and struct csched2_unit. */
+#include "credit2-runq.h"
 
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
 {
@@ -932,7 +943,7 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
     unsigned long flags;
     int rqi = 0;
     unsigned int min_rqs, max_cpus_runq;
-    bool rqi_unused = false;
+    bool rqi_unused = false, rqd_created = false;
 
     /* Prealloc in case we need it - not allowed with interrupts off. */
     rqd_new = xzalloc(struct csched2_runqueue_data);
@@ -1031,6 +1042,7 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
         list_add(&rqd->rql, rqd_ins);
         rqd->pick_bias = cpu;
         rqd->id = rqi;
+        rqd_created = true;
     }
     else
         rqd = rqd_valid;
@@ -1042,6 +1054,20 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
 
     xfree(rqd_new);
 
+    /*
+     * The lock of a new runqueue isn't used until a CPU is activated on it.
+     * Initialize it here, as lock profiling needs to allocate memory.
+     */
+    if ( rqd_created )
+    {
+        /* rqd->id is only unique within the cpupool. */
+        static atomic_t __maybe_unused runq_prof_id = ATOMIC_INIT(0);
+
+        lock_profile_register_struct(LOCKPROF_TYPE_RUNQ, rqd,
+                                     atomic_inc_return(&runq_prof_id) - 1);
+        spin_lock_init_prof(rqd, lock);
+    }
+
     return rqd;
 }
 
@@ -1422,31 +1448,20 @@ update_load(const struct scheduler *ops,
 
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
     ASSERT(!unit_on_runq(svc));
     ASSERT(c2r(cpu) == c2r(sched_unit_master(svc->unit)));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_unit(svc->unit));
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
-    {
-        struct csched2_unit * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
-    }
-    list_add_tail(&svc->runq_elem, iter);
+    runq_add(rqd, svc);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1454,9 +1469,11 @@ static void runq_insert(struct csched2_unit *svc)
             unsigned unit:16, dom:16;
             unsigned pos;
         } d;
+
+        /* Finding the position is linear, so only do so when tracing. */
+        d.pos = runq_pos(svc);
         d.dom = svc->unit->domain->domain_id;
         d.unit = svc->unit->unit_id;
-        d.pos = pos;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1466,7 +1483,7 @@ static void runq_insert(struct csched2_unit *svc)
 static inline void runq_remove(struct csched2_unit *svc)
 {
     ASSERT(unit_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    runq_del(svc->rqd, svc);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_unit *, s_time_t);
@@ -2176,7 +2193,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->unit = unit;
@@ -2285,6 +2302,165 @@ out:
     return;
 }
 
+/*
+ * Remote wakeup queues.
+ *
+ * When a unit is woken up from a pCPU which is not in its runqueue, taking
+ * the runqueue lock just to put the unit in the runqueue and tickle one of
+ * the pCPUs of the runqueue means bouncing the lock (and the runqueue data)
+ * between caches, likely across sockets.  If credit2_wake_queue is enabled,
+ * such a wakeup is instead pushed on a lock-free, multiple producer single
+ * consumer, queue of the runqueue, and one of its pCPUs is poked.  The
+ * wakeups are then done by the first pCPU of the runqueue going through
+ * csched2_schedule() (or by whoever holds the runqueue lock and needs the
+ * queue to be empty), which holds the runqueue lock anyway.
+ *
+ * A unit can only be queued once at a time, which is tracked by wakeq_rqd,
+ * set while the unit is in a queue.  If the unit moves to another runqueue
+ * while its wakeup is queued, the wakeup is moved to the new runqueue's
+ * queue when found.
+ *
+ * Wakers access the runqueue without holding any lock, so runqueues are
+ * freed only after an RCU grace period, with wakers in an RCU read-side
+ * critical section.  A waker may also push its wakeup after the last pCPU
+ * of the runqueue has gone and has drained the queue: whoever of the two
+ * comes last (see rqd->nr_cpus) drains the queue.
+ */
+static DEFINE_RCU_READ_LOCK(csched2_runq_rcu);
+
+/* Returns true if the queue was empty. */
+static bool wakeq_push(struct csched2_runqueue_data *rqd,
+                       struct csched2_unit *svc)
+{
+    struct csched2_unit *head = read_atomic(&rqd->wakeq), *old;
+
+    do {
+        old = head;
+        svc->wakeq_next = old;
+        head = cmpxchg(&rqd->wakeq, old, svc);
+    } while ( head != old );
+
+    return !old;
+}
+
+/*
+ * Queue the wakeup of svc on rqd, and make sure a pCPU of rqd will go
+ * through the scheduler, preferring cpu.
+ */
+static void wakeq_queue(struct csched2_runqueue_data *rqd,
+                        struct csched2_unit *svc, unsigned int cpu)
+{
+    if ( !wakeq_push(rqd, svc) )
+        return;
+
+    if ( !cpumask_test_cpu(cpu, &rqd->active) )
+        cpu = cpumask_first(&rqd->active);
+    if ( cpu < nr_cpu_ids )
+        cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
+}
+
+/* Do the wakeups queued on rqd, whose lock must be held. */
+static void wakeq_drain(struct csched2_runqueue_data *rqd)
+{
+    struct csched2_unit *svc, *next, *list = NULL;
+
+    ASSERT(spin_is_locked(&rqd->lock));
+
+    if ( likely(!read_atomic(&rqd->wakeq)) )
+        return;
+
+    /* Reverse the queue, to do the wakeups in the order they came in. */
+    for ( svc = xchg(&rqd->wakeq, NULL); svc; svc = next )
+    {
+        next = svc->wakeq_next;
+        svc->wakeq_next = list;
+        list = svc;
+    }
+
+    for ( svc = list; svc; svc = next )
+    {
+        struct csched2_runqueue_data *nrqd;
+
+        next = svc->wakeq_next;
+
+        if ( unlikely(svc->rqd != rqd) )
+        {
+            /*
+             * svc->rqd is only NULL while the unit is being moved between
+             * two other runqueues, with both their locks held.
+             */
+            while ( (nrqd = read_atomic(&svc->rqd)) == NULL )
+                cpu_relax();
+
+            SCHED_STAT_CRANK(wake_requeued);
+            write_atomic(&svc->wakeq_rqd, nrqd);
+            wakeq_queue(nrqd, svc, sched_unit_master(svc->unit));
+            continue;
+        }
+
+        /*
+         * From now on, a new wakeup for the unit has to be queued again (or
+         * done directly), but this one is done after it has been requested.
+         */
+        write_atomic(&svc->wakeq_rqd, NULL);
+        smp_mb();
+
+        vcpu_wake_locked(svc->unit->vcpu_list);
+    }
+}
+
+static bool cf_check
+csched2_unit_queue_wake(const struct scheduler *ops, struct sched_unit *unit)
+{
+    struct csched2_unit * const svc = csched2_unit(unit);
+    struct csched2_runqueue_data *rqd;
+    unsigned int cpu = sched_unit_master(unit);
+    unsigned long flags;
+
+    if ( !opt_wake_queue || ops->cpupool->gran != SCHED_GRAN_cpu ||
+         is_idle_unit(unit) )
+        return false;
+
+    rcu_read_lock(&csched2_runq_rcu);
+
+    rqd = read_atomic(&svc->rqd);
+
+    /*
+     * Only single vCPU units are dealt with, and wakeups from a pCPU of the
+     * unit's runqueue take the lock as usual (it's likely in our cache).
+     */
+    if ( !rqd || !cpumask_test_cpu(cpu, &rqd->active) ||
+         get_sched_res(smp_processor_id())->schedule_lock == &rqd->lock )
+    {
+        rcu_read_unlock(&csched2_runq_rcu);
+        return false;
+    }
+
+    /* If the unit's wakeup is already queued, it will cover this one too. */
+    if ( cmpxchg(&svc->wakeq_rqd, NULL, rqd) == NULL )
+    {
+        SCHED_STAT_CRANK(wake_queued);
+        wakeq_queue(rqd, svc, cpu);
+
+        /*
+         * Pairs with the barrier in csched2_deinit_pdata(): if the last pCPU
+         * of the runqueue has gone meanwhile, it may not have seen our
+         * wakeup, so do it ourselves.
+         */
+        smp_mb();
+        if ( unlikely(!read_atomic(&rqd->nr_cpus)) )
+        {
+            spin_lock_irqsave(&rqd->lock, flags);
+            wakeq_drain(rqd);
+            spin_unlock_irqrestore(&rqd->lock, flags);
+        }
+    }
+
+    rcu_read_unlock(&csched2_runq_rcu);
+
+    return true;
+}
+
 static void cf_check
 csched2_unit_yield(const struct scheduler *ops, struct sched_unit *unit)
 {
@@ -3207,7 +3383,7 @@ csched2_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     /* csched2_res_pick() expects the pcpu lock to be held */
     lock = unit_schedule_lock_irq(unit);
@@ -3242,13 +3418,22 @@ static void cf_check
 csched2_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
 {
     struct csched2_unit * const svc = csched2_unit(unit);
+    struct csched2_runqueue_data *rqd;
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     SCHED_STAT_CRANK(unit_remove);
 
+    /* A queued wakeup refers to svc, so it must be done before freeing it. */
+    while ( (rqd = read_atomic(&svc->wakeq_rqd)) != NULL )
+    {
+        spin_lock_irq(&rqd->lock);
+        wakeq_drain(rqd);
+        spin_unlock_irq(&rqd->lock);
+    }
+
     /* Remove from runqueue */
     lock = unit_schedule_lock_irq(unit);
 
@@ -3267,7 +3452,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(cpu);
-    struct list_head *runq = &rqd->runq;
+    struct csched2_unit *swait = runq_first(rqd);
     const struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3305,10 +3490,8 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
+    if ( swait )
     {
-        struct csched2_unit *swait = runq_elem(runq->next);
-
         if ( ! is_idle_unit(swait->unit)
              && swait->credit > 0 )
         {
@@ -3363,7 +3546,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_unit *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter, *temp;
+    struct csched2_unit *svc;
     const struct sched_resource *sr = get_sched_res(cpu);
     struct csched2_unit *snext = NULL;
     struct csched2_private *prv = csched2_priv(sr->scheduler);
@@ -3446,10 +3629,8 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_unit(sched_idle_unit(cpu));
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    for ( svc = runq_first(rqd); svc; svc = runq_next(svc) )
     {
-        struct csched2_unit * svc = list_entry(iter, struct csched2_unit, runq_elem);
-
         if ( unlikely(tb_init_done) )
         {
             struct {
@@ -3579,6 +3760,9 @@ static void cf_check csched2_schedule(
 
     ASSERT(spin_is_locked(get_sched_res(sched_cpu)->schedule_lock));
 
+    /* Units woken up remotely are candidates for running straight away. */
+    wakeq_drain(rqd);
+
     BUG_ON(!is_idle_unit(currunit) && scurr->rqd != rqd);
 
     /* Clear "tickled" bit now that we've been scheduled */
@@ -3690,10 +3874,10 @@ static void cf_check csched2_schedule(
          * returned the first unit in the runqueue, for various reasons
          * (e.g., affinity). Only trigger a reset when it does.
          */
-        if ( list_empty(&rqd->runq) )
+        if ( !runq_first(rqd) )
             top_credit = snext->credit;
         else
-            top_credit = max(snext->credit, runq_elem(rqd->runq.next)->credit);
+            top_credit = max(snext->credit, runq_first(rqd)->credit);
         if ( top_credit <= CSCHED2_CREDIT_RESET )
         {
             reset_credit(sched_cpu, now, snext);
@@ -3869,7 +4053,7 @@ csched2_dump(const struct scheduler *ops)
 
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        struct list_head *iter, *runq = &rqd->runq;
+        const struct csched2_unit *svc;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -3881,15 +4065,10 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( svc = runq_first(rqd); svc; svc = runq_next(svc) )
         {
-            const struct csched2_unit *svc = runq_elem(iter);
-
-            if ( svc )
-            {
-                printk("\t%3d: ", loop++);
-                csched2_dump_unit(prv, svc);
-            }
+            printk("\t%3d: ", loop++);
+            csched2_dump_unit(prv, svc);
         }
         spin_unlock(&rqd->lock);
     }
@@ -3941,8 +4120,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         BUG_ON(!cpumask_empty(&rqd->active));
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
-        INIT_LIST_HEAD(&rqd->runq);
-        spin_lock_init(&rqd->lock);
+        runq_init(rqd);
         prv->active_queues++;
     }
 
@@ -4076,6 +4254,21 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     else if ( rqd->pick_bias == cpu )
         rqd->pick_bias = cpumask_first(&rqd->active);
 
+    /*
+     * The wakeups queued on the runqueue may have been waiting for this cpu
+     * to do them. Let another one do them or, if there's none, move them to
+     * where their units are now.  Wakeups queued after this are done by the
+     * waker (see csched2_unit_queue_wake()).
+     */
+    smp_mb();
+    if ( read_atomic(&rqd->wakeq) )
+    {
+        if ( rqd->nr_cpus )
+            cpu_raise_softirq(cpumask_first(&rqd->active), SCHEDULE_SOFTIRQ);
+        else
+            wakeq_drain(rqd);
+    }
+
     spin_unlock(&rqd->lock);
 
     __cpumask_clear_cpu(cpu, &prv->initialized);
@@ -4085,6 +4278,17 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     return;
 }
 
+static void cf_check csched2_free_rqd(struct rcu_head *head)
+{
+    struct csched2_runqueue_data *rqd =
+        container_of(head, struct csched2_runqueue_data, rcu);
+
+    ASSERT(!read_atomic(&rqd->wakeq));
+
+    lock_profile_deregister_struct(LOCKPROF_TYPE_RUNQ, rqd);
+    xfree(rqd);
+}
+
 static void cf_check
 csched2_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
@@ -4110,7 +4314,10 @@ csched2_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 
     write_unlock_irqrestore(&prv->lock, flags);
 
-    xfree(rqd);
+    /* Wakers may still be looking at the runqueue without holding its lock. */
+    if ( rqd )
+        call_rcu(&rqd->rcu, csched2_free_rqd);
+
     xfree(pcpu);
 }
 
@@ -4212,6 +4419,7 @@ static const struct scheduler sched_credit2_def = {
 
     .sleep          = csched2_unit_sleep,
     .wake           = csched2_unit_wake,
+    .queue_wake     = csched2_unit_queue_wake,
     .yield          = csched2_unit_yield,
 
     .adjust         = csched2_dom_cntl,
@@ -308,6 +308,8 @@ struct scheduler {
                                     struct sched_unit *);
     void         (*wake)           (const struct scheduler *,
                                     struct sched_unit *);
+    bool         (*queue_wake)     (const struct scheduler *,
+                                    struct sched_unit *);
     void         (*yield)          (const struct scheduler *,
                                     struct sched_unit *);
     void         (*context_saved)  (const struct scheduler *,
@@ -435,6 +437,17 @@ static inline void sched_wake(const struct scheduler *s,
         s->wake(s, unit);
 }
 
+/*
+ * Give the scheduler a chance to have the wakeup of unit done later, by a
+ * pCPU of its own, without taking the unit's scheduler lock here.  If true
+ * is returned, the scheduler will call vcpu_wake_locked() for it.
+ */
+static inline bool sched_queue_wake(const struct scheduler *s,
+                                    struct sched_unit *unit)
+{
+    return s->queue_wake && s->queue_wake(s, unit);
+}
+
 static inline void sched_yield(const struct scheduler *s,
                                struct sched_unit *unit)
 {
@@ -593,6 +606,7 @@ affinity_balance_cpumask(const struct sched_unit *unit, int step,
         cpumask_copy(mask, unit->cpu_hard_affinity);
 }
 
+void vcpu_wake_locked(struct vcpu *v);
 void sched_rm_cpu(unsigned int cpu);
 const cpumask_t *sched_get_opt_cpumask(enum sched_gran opt, unsigned int cpu);
 void schedule_dump(struct cpupool *c);
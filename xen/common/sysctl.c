@@ -364,6 +364,36 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_scrub_status:
+    {
+        struct xen_sysctl_scrub_status *ss = &op->u.scrub_status;
+        unsigned int i, num_nodes = last_node(node_online_map) + 1;
+        unsigned long scrubbed;
+
+        get_scrub_status(&scrubbed, &ss->scrubbers);
+        ss->scrubbed_pages = scrubbed;
+        ss->dirty_pages = 0;
+        for ( i = 0; i < num_nodes; i++ )
+            ss->dirty_pages += node_dirty_pages(i);
+
+        if ( !guest_handle_is_null(ss->node_dirty_pages) )
+        {
+            for ( i = 0; i < min(num_nodes, ss->num_nodes); i++ )
+            {
+                uint64_t dirty = node_dirty_pages(i);
+
+                if ( copy_to_guest_offset(ss->node_dirty_pages, i, &dirty, 1) )
+                {
+                    ret = -EFAULT;
+                    break;
+                }
+            }
+        }
+
+        ss->num_nodes = num_nodes;
+    }
+    break;
+
     case XEN_SYSCTL_cputopoinfo:
     {
         unsigned int i, num_cpus;
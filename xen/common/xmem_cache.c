@@ -0,0 +1,489 @@
+/******************************************************************************
+ * xmem_cache.c
+ *
+ * Per-CPU object caches for small fixed-size objects, see xen/xmem_cache.h.
+ *
+ * A slab is a naturally aligned block of xenheap pages starting with a
+ * struct xmem_slab, followed by the objects, so the slab an object belongs
+ * to is found by masking the object's address.  Slabs with free objects are
+ * kept on per-node lists under the cache's lock; slabs with all objects in
+ * use aren't on any list.  An empty slab is freed unless it is the only
+ * partially used one left for its node.
+ *
+ * Every CPU has a magazine of free objects for each of the first
+ * XMEM_CACHE_MAX caches, which it refills from and flushes back to the slabs
+ * of its own node in batches.  Objects belonging to another node's slabs are
+ * returned to their slab directly, so magazines hold node-local memory
+ * unless the local node ran out of it.  Allocations and frees aren't
+ * permitted in interrupt context, so the magazine of the current CPU can be
+ * accessed without locking.
+ */
+
+#include <xen/cpu.h>
+#include <xen/hypfs.h>
+#include <xen/init.h>
+#include <xen/keyhandler.h>
+#include <xen/lib.h>
+#include <xen/mm.h>
+#include <xen/perfc.h>
+#include <xen/percpu.h>
+#include <xen/sched.h>
+#include <xen/xmalloc.h>
+#include <xen/xmem_cache.h>
+
+#define XMEM_CACHE_MAX      16  /* Caches with per-CPU magazines. */
+#define XMEM_CACHE_NO_MAG   (XMEM_CACHE_MAX + 1)
+#define XMEM_MAG_SIZE       15
+#define XMEM_MAG_BATCH      8
+#define XMEM_SLAB_MAX_ORDER 2
+#define XMEM_SLAB_MIN_OBJS  8
+
+struct xmem_slab {
+    struct list_head list;
+    const struct xmem_cache *cache;
+    void *free;                 /* Singly linked list of free objects. */
+    unsigned int inuse;
+    nodeid_t node;
+};
+
+struct xmem_magazine {
+    unsigned int nr;
+    void *obj[XMEM_MAG_SIZE];
+};
+
+static DEFINE_PER_CPU(struct xmem_magazine [XMEM_CACHE_MAX], xmem_magazines);
+
+static DEFINE_SPINLOCK(caches_lock);
+static LIST_HEAD(caches);
+static unsigned int nr_magazines;
+
+static struct xmem_slab *obj_to_slab(const struct xmem_cache *c,
+                                     const void *obj)
+{
+    struct xmem_slab *slab =
+        (void *)((unsigned long)obj & ~((PAGE_SIZE << c->order) - 1));
+
+    ASSERT(slab->cache == c);
+
+    return slab;
+}
+
+static struct xmem_magazine *cache_magazine(const struct xmem_cache *c)
+{
+    return c->id <= XMEM_CACHE_MAX ? &this_cpu(xmem_magazines)[c->id - 1]
+                                   : NULL;
+}
+
+/* Pick the smallest slab holding at least XMEM_SLAB_MIN_OBJS objects. */
+static bool cache_layout(struct xmem_cache *c)
+{
+    c->align = max_t(unsigned int, c->align, sizeof(void *));
+    if ( c->align & (c->align - 1) )
+        return false;
+
+    c->size = ROUNDUP(max_t(unsigned int, c->size, sizeof(void *)), c->align);
+    c->offset = ROUNDUP(sizeof(struct xmem_slab), c->align);
+
+    for ( c->order = 0; ; c->order++ )
+    {
+        if ( c->offset < (PAGE_SIZE << c->order) )
+            c->objs = ((PAGE_SIZE << c->order) - c->offset) / c->size;
+        else
+            c->objs = 0;
+
+        if ( c->objs >= XMEM_SLAB_MIN_OBJS )
+            return true;
+        if ( c->order == XMEM_SLAB_MAX_ORDER )
+            return false;
+    }
+}
+
+#ifdef CONFIG_HYPFS
+struct xmem_cache_hypfs {
+    struct hypfs_entry_dir dir;
+    struct hypfs_entry_leaf size;
+    struct hypfs_entry_leaf slabs;
+    struct hypfs_entry_leaf inuse;
+};
+
+static HYPFS_DIR_INIT(memory_dir, "memory");
+static HYPFS_DIR_INIT(caches_dir, "caches");
+
+static void init_uint_leaf(struct hypfs_entry_leaf *leaf, const char *name,
+                           const unsigned int *val)
+{
+    leaf->e.type = XEN_HYPFS_TYPE_UINT;
+    leaf->e.encoding = XEN_HYPFS_ENC_PLAIN;
+    leaf->e.name = name;
+    leaf->e.size = sizeof(*val);
+    leaf->e.funcs = &hypfs_leaf_ro_funcs;
+    leaf->u.content = val;
+}
+
+static void cache_hypfs_add(const struct xmem_cache *c)
+{
+    struct xmem_cache_hypfs *h = xzalloc(struct xmem_cache_hypfs);
+
+    if ( !h )
+        return;
+
+    h->dir.e.type = XEN_HYPFS_TYPE_DIR;
+    h->dir.e.encoding = XEN_HYPFS_ENC_PLAIN;
+    h->dir.e.name = c->name;
+    h->dir.e.funcs = &hypfs_dir_funcs;
+    INIT_LIST_HEAD(&h->dir.e.list);
+    INIT_LIST_HEAD(&h->dir.dirlist);
+
+    init_uint_leaf(&h->size, "size", &c->size);
+    init_uint_leaf(&h->slabs, "slabs", &c->slabs);
+    init_uint_leaf(&h->inuse, "inuse", &c->inuse);
+
+    if ( hypfs_add_dir(&caches_dir, &h->dir, false) )
+    {
+        printk(XENLOG_WARNING "xmem cache %s: duplicate name\n", c->name);
+        xfree(h);
+        return;
+    }
+
+    hypfs_add_leaf(&h->dir, &h->size, true);
+    hypfs_add_leaf(&h->dir, &h->slabs, true);
+    hypfs_add_leaf(&h->dir, &h->inuse, true);
+}
+#else
+static void cache_hypfs_add(const struct xmem_cache *c) {}
+#endif
+
+/* Finish setting up a cache on first use, and make it visible. */
+static void cache_setup(struct xmem_cache *c)
+{
+    bool added = false;
+    unsigned int i;
+
+    spin_lock(&caches_lock);
+
+    if ( !c->id )
+    {
+        if ( !cache_layout(c) )
+            panic("xmem cache %s: bad object size %u or alignment %u\n",
+                  c->name, c->size, c->align);
+
+        /*
+         * Users only look at the lists with c->lock held, so initialising
+         * them under the lock makes them visible before any such access.
+         */
+        spin_lock(&c->lock);
+        for ( i = 0; i < ARRAY_SIZE(c->partial); i++ )
+            INIT_LIST_HEAD(&c->partial[i]);
+        spin_unlock(&c->lock);
+
+        list_add_tail(&c->list, &caches);
+        c->id = nr_magazines < XMEM_CACHE_MAX ? ++nr_magazines
+                                              : XMEM_CACHE_NO_MAG;
+        added = true;
+    }
+
+    spin_unlock(&caches_lock);
+
+    if ( added )
+        cache_hypfs_add(c);
+}
+
+static struct xmem_slab *slab_new(const struct xmem_cache *c, nodeid_t node)
+{
+    struct xmem_slab *slab = alloc_xenheap_pages(c->order, MEMF_node(node));
+    void **link, *obj;
+    unsigned int i;
+
+    if ( !slab )
+        return NULL;
+
+    ASSERT(!((unsigned long)slab & ((PAGE_SIZE << c->order) - 1)));
+
+    slab->cache = c;
+    slab->inuse = 0;
+    slab->node = phys_to_nid(virt_to_maddr(slab));
+
+    link = &slab->free;
+    for ( i = 0, obj = (void *)slab + c->offset; i < c->objs;
+          i++, obj += c->size )
+    {
+        *link = obj;
+        link = obj;
+    }
+    *link = NULL;
+
+    return slab;
+}
+
+/* Take up to nr objects from the slabs on list.  Called with c->lock held. */
+static unsigned int slab_take(struct xmem_cache *c, struct list_head *list,
+                              void **objs, unsigned int nr)
+{
+    unsigned int i = 0;
+
+    while ( i < nr && !list_empty(list) )
+    {
+        struct xmem_slab *slab = list_first_entry(list, struct xmem_slab,
+                                                  list);
+
+        do {
+            objs[i] = slab->free;
+            slab->free = *(void **)objs[i++];
+            slab->inuse++;
+        } while ( i < nr && slab->free );
+
+        if ( !slab->free )
+            list_del(&slab->list);
+    }
+
+    c->inuse += i;
+
+    return i;
+}
+
+/*
+ * Get up to nr objects, preferably from the local node.  Returns the number
+ * of objects obtained, which is 0 only if no memory is available at all.
+ */
+static unsigned int cache_get(struct xmem_cache *c, void **objs,
+                              unsigned int nr)
+{
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    struct xmem_slab *slab;
+    unsigned int got;
+
+    spin_lock(&c->lock);
+
+    got = slab_take(c, &c->partial[node], objs, nr);
+    if ( got )
+        goto out;
+
+    spin_unlock(&c->lock);
+    slab = slab_new(c, node);
+    spin_lock(&c->lock);
+
+    if ( slab )
+    {
+        list_add(&slab->list, &c->partial[slab->node]);
+        c->slabs++;
+    }
+
+    got = slab_take(c, &c->partial[node], objs, nr);
+
+    /* Fall back to a single object from wherever one can be found. */
+    for ( node = 0; !got && node < ARRAY_SIZE(c->partial); node++ )
+        got = slab_take(c, &c->partial[node], objs, 1);
+
+ out:
+    spin_unlock(&c->lock);
+
+    return got;
+}
+
+/* Return nr objects to their slabs, freeing slabs which became empty. */
+static void cache_put(struct xmem_cache *c, void *const *objs,
+                      unsigned int nr)
+{
+    struct xmem_slab *slab, *tmp;
+    LIST_HEAD(empty);
+    unsigned int i;
+
+    spin_lock(&c->lock);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        slab = obj_to_slab(c, objs[i]);
+
+        ASSERT(slab->inuse);
+        if ( !slab->free )
+            list_add(&slab->list, &c->partial[slab->node]);
+
+        *(void **)objs[i] = slab->free;
+        slab->free = objs[i];
+
+        if ( !--slab->inuse && !list_is_singular(&c->partial[slab->node]) )
+        {
+            list_move(&slab->list, &empty);
+            c->slabs--;
+        }
+    }
+
+    c->inuse -= nr;
+
+    spin_unlock(&c->lock);
+
+    list_for_each_entry_safe ( slab, tmp, &empty, list )
+        free_xenheap_pages(slab, c->order);
+}
+
+struct xmem_cache *xmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align)
+{
+    struct xmem_cache *c = xzalloc(struct xmem_cache);
+
+    if ( !c )
+        return NULL;
+
+    c->name = name;
+    c->size = size;
+    c->align = align;
+    spin_lock_init(&c->lock);
+
+    if ( !size || !cache_layout(c) )
+    {
+        xfree(c);
+        return NULL;
+    }
+
+    cache_setup(c);
+
+    return c;
+}
+
+void *xmem_cache_alloc(struct xmem_cache *c)
+{
+    struct xmem_magazine *mag;
+    void *obj;
+
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( unlikely(!c->id) )
+        cache_setup(c);
+
+    mag = cache_magazine(c);
+    if ( !mag )
+        return cache_get(c, &obj, 1) ? obj : NULL;
+
+    if ( !mag->nr )
+    {
+        perfc_incr(xmem_cache_refill);
+        mag->nr = cache_get(c, mag->obj, XMEM_MAG_BATCH);
+        if ( !mag->nr )
+            return NULL;
+    }
+
+    return mag->obj[--mag->nr];
+}
+
+void *xmem_cache_zalloc(struct xmem_cache *c)
+{
+    void *obj = xmem_cache_alloc(c);
+
+    return obj ? memset(obj, 0, c->size) : NULL;
+}
+
+void xmem_cache_free(struct xmem_cache *c, void *obj)
+{
+    struct xmem_magazine *mag;
+
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( !obj )
+        return;
+
+    mag = cache_magazine(c);
+    if ( !mag ||
+         obj_to_slab(c, obj)->node != cpu_to_node(smp_processor_id()) )
+    {
+        cache_put(c, &obj, 1);
+        return;
+    }
+
+    if ( mag->nr == XMEM_MAG_SIZE )
+    {
+        perfc_incr(xmem_cache_flush);
+        cache_put(c, mag->obj, XMEM_MAG_BATCH);
+        mag->nr -= XMEM_MAG_BATCH;
+        memmove(mag->obj, mag->obj + XMEM_MAG_BATCH,
+                mag->nr * sizeof(*mag->obj));
+    }
+
+    mag->obj[mag->nr++] = obj;
+}
+
+static void cf_check dump_xmem_caches(unsigned char key)
+{
+    const struct xmem_cache *c;
+    unsigned int cpu;
+
+    printk("xmem caches:\n");
+    printk("  %-20s %6s %8s %8s %8s %10s %10s\n", "name", "size",
+           "per slab", "slabs", "pages", "in use", "cached");
+
+    spin_lock(&caches_lock);
+
+    list_for_each_entry ( c, &caches, list )
+    {
+        unsigned int cached = 0;
+
+        if ( c->id <= XMEM_CACHE_MAX )
+            for_each_online_cpu ( cpu )
+                cached += per_cpu(xmem_magazines, cpu)[c->id - 1].nr;
+
+        printk("  %-20s %6u %8u %8u %8u %10u %10u\n", c->name, c->size,
+               c->objs, c->slabs, c->slabs << c->order, c->inuse - cached,
+               cached);
+    }
+
+    spin_unlock(&caches_lock);
+}
+
+static int cf_check cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmem_cache *c;
+
+    switch ( action )
+    {
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        spin_lock(&caches_lock);
+        list_for_each_entry ( c, &caches, list )
+        {
+            struct xmem_magazine *mag;
+
+            if ( c->id > XMEM_CACHE_MAX )
+                continue;
+
+            mag = &per_cpu(xmem_magazines, cpu)[c->id - 1];
+            cache_put(c, mag->obj, mag->nr);
+            mag->nr = 0;
+        }
+        spin_unlock(&caches_lock);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback,
+};
+
+static int __init cf_check xmem_cache_init(void)
+{
+    register_cpu_notifier(&cpu_nfb);
+    register_keyhandler('X', dump_xmem_caches, "dump xmem cache usage", 1);
+
+#ifdef CONFIG_HYPFS
+    hypfs_add_dir(&hypfs_root, &memory_dir, true);
+    hypfs_add_dir(&memory_dir, &caches_dir, true);
+#endif
+
+    return 0;
+}
+presmp_initcall(xmem_cache_init);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
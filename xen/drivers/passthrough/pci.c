@@ -38,6 +38,8 @@
 
 struct pci_seg {
     struct list_head alldevs_list;
+    /* Devices of alldevs_list, indexed by BDF. */
+    struct radix_tree_root pdevs;
     u16 nr;
     unsigned long *ro_map;
     /* bus2bridge_lock protects bus2bridge array */
@@ -92,6 +94,7 @@ static struct pci_seg *alloc_pseg(u16 seg)
 
     pseg->nr = seg;
     INIT_LIST_HEAD(&pseg->alldevs_list);
+    radix_tree_init(&pseg->pdevs);
     spin_lock_init(&pseg->bus2bridge_lock);
 
     if ( radix_tree_insert(&pci_segments, seg, pseg) )
@@ -385,9 +388,9 @@ static struct pci_dev *alloc_pdev(struct pci_seg *pseg, u8 bus, u8 devfn)
     unsigned int pos;
     int rc;
 
-    list_for_each_entry ( pdev, &pseg->alldevs_list, alldevs_list )
-        if ( pdev->bus == bus && pdev->devfn == devfn )
-            return pdev;
+    pdev = radix_tree_lookup(&pseg->pdevs, PCI_BDF(bus, devfn));
+    if ( pdev )
+        return pdev;
 
     pdev = xzalloc(struct pci_dev);
     if ( !pdev )
@@ -407,6 +410,14 @@ static struct pci_dev *alloc_pdev(struct pci_seg *pseg, u8 bus, u8 devfn)
         return NULL;
     }
 
+    rc = radix_tree_insert(&pseg->pdevs, PCI_BDF(bus, devfn), pdev);
+    if ( rc )
+    {
+        pdev_msi_deinit(pdev);
+        xfree(pdev);
+        return NULL;
+    }
+
     list_add(&pdev->alldevs_list, &pseg->alldevs_list);
 
     /* update bus2bridge */
@@ -513,6 +524,7 @@ static void free_pdev(struct pci_seg *pseg, struct pci_dev *pdev)
             break;
     }
 
+    radix_tree_delete(&pseg->pdevs, pdev->sbdf.bdf);
     list_del(&pdev->alldevs_list);
     pdev_msi_deinit(pdev);
     xfree(pdev);
@@ -597,34 +609,24 @@ struct pci_dev *pci_get_real_pdev(pci_sbdf_t sbdf)
 
 struct pci_dev *pci_get_pdev(const struct domain *d, pci_sbdf_t sbdf)
 {
+    struct pci_seg *pseg = get_pseg(sbdf.seg);
     struct pci_dev *pdev;
 
     ASSERT(d || pcidevs_locked());
 
+    if ( !pseg )
+        return NULL;
+
     /*
-     * The hardware domain owns the majority of the devices in the system.
-     * When there are multiple segments, traversing the per-segment list is
-     * likely going to be faster, whereas for a single segment the difference
-     * shouldn't be that large.
+     * Look the device up by BDF rather than walking the device lists, which
+     * can be long with SR-IOV.  d->pdev_list holds exactly the devices with
+     * pdev->domain == d, so checking the owner is equivalent to walking it.
      */
-    if ( !d || is_hardware_domain(d) )
-    {
-        const struct pci_seg *pseg = get_pseg(sbdf.seg);
-
-        if ( !pseg )
-            return NULL;
+    pdev = radix_tree_lookup(&pseg->pdevs, sbdf.bdf);
+    if ( pdev && d && pdev->domain != d )
+        pdev = NULL;
 
-        list_for_each_entry ( pdev, &pseg->alldevs_list, alldevs_list )
-            if ( pdev->sbdf.bdf == sbdf.bdf &&
-                 (!d || pdev->domain == d) )
-                return pdev;
-    }
-    else
-        list_for_each_entry ( pdev, &d->pdev_list, domain_list )
-            if ( pdev->sbdf.bdf == sbdf.bdf )
-                return pdev;
-
-    return NULL;
+    return pdev;
 }
 
 /**
@@ -878,18 +880,17 @@ int pci_remove_device(u16 seg, u8 bus, u8 devfn)
         return -ENODEV;
 
     pcidevs_lock();
-    list_for_each_entry ( pdev, &pseg->alldevs_list, alldevs_list )
-        if ( pdev->bus == bus && pdev->devfn == devfn )
-        {
-            vpci_remove_device(pdev);
-            pci_cleanup_msi(pdev);
-            ret = iommu_remove_device(pdev);
-            if ( pdev->domain )
-                list_del(&pdev->domain_list);
-            printk(XENLOG_DEBUG "PCI remove device %pp\n", &pdev->sbdf);
-            free_pdev(pseg, pdev);
-            break;
-        }
+    pdev = radix_tree_lookup(&pseg->pdevs, PCI_BDF(bus, devfn));
+    if ( pdev )
+    {
+        vpci_remove_device(pdev);
+        pci_cleanup_msi(pdev);
+        ret = iommu_remove_device(pdev);
+        if ( pdev->domain )
+            list_del(&pdev->domain_list);
+        printk(XENLOG_DEBUG "PCI remove device %pp\n", &pdev->sbdf);
+        free_pdev(pseg, pdev);
+    }
 
     pcidevs_unlock();
     return ret;
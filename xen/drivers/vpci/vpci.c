@@ -37,6 +37,8 @@ extern vpci_register_init_t *const __end_vpci_array[];
 
 void vpci_remove_device(struct pci_dev *pdev)
 {
+    unsigned int i;
+
     if ( !has_vpci(pdev->domain) )
         return;
 
@@ -50,6 +52,8 @@ void vpci_remove_device(struct pci_dev *pdev)
         list_del(&r->node);
         xfree(r);
     }
+    for ( i = 0; i < ARRAY_SIZE(pdev->vpci->map); i++ )
+        XFREE(pdev->vpci->map[i]);
     spin_unlock(&pdev->vpci->lock);
     if ( pdev->vpci->msix && pdev->vpci->msix->pba )
         iounmap(pdev->vpci->msix->pba);
@@ -107,6 +111,42 @@ static int vpci_register_cmp(const struct vpci_register *r1,
     return 0;
 }
 
+/* Slot of the handler index covering offset, NULL if not allocated. */
+static struct vpci_register **vpci_map_slot(const struct vpci *vpci,
+                                            unsigned int offset)
+{
+    struct vpci_register **chunk = vpci->map[offset / VPCI_MAP_CHUNK];
+
+    return chunk ? &chunk[(offset % VPCI_MAP_CHUNK) / 4] : NULL;
+}
+
+/*
+ * Find the handler to start walking the list from for an access: the first
+ * one within the dwords covered by the access.  As handlers don't cross dword
+ * boundaries, no handler before it can overlap the access.  Returns the list
+ * head if there's none, so that walking the list from it terminates at once.
+ */
+static struct vpci_register *vpci_first_register(struct vpci *vpci,
+                                                 unsigned int reg,
+                                                 unsigned int size)
+{
+    unsigned int offset;
+
+    for ( offset = reg & ~3; offset < reg + size; offset += 4 )
+    {
+        struct vpci_register **slot;
+
+        if ( offset >= PCI_CFG_SPACE_EXP_SIZE )
+            break;
+
+        slot = vpci_map_slot(vpci, offset);
+        if ( slot && *slot )
+            return *slot;
+    }
+
+    return list_entry(&vpci->handlers, struct vpci_register, node);
+}
+
 /* Dummy hooks, writes are ignored, reads return 1's */
 static uint32_t cf_check vpci_ignored_read(
     const struct pci_dev *pdev, unsigned int reg, void *data)
@@ -136,7 +176,7 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
                       unsigned int size, void *data)
 {
     struct list_head *prev;
-    struct vpci_register *r;
+    struct vpci_register *r, **slot;
 
     /* Some sanity checks. */
     if ( (size != 1 && size != 2 && size != 4) ||
@@ -156,6 +196,18 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
 
     spin_lock(&vpci->lock);
 
+    if ( !vpci->map[offset / VPCI_MAP_CHUNK] )
+    {
+        vpci->map[offset / VPCI_MAP_CHUNK] =
+            xzalloc_array(struct vpci_register *, VPCI_MAP_CHUNK / 4);
+        if ( !vpci->map[offset / VPCI_MAP_CHUNK] )
+        {
+            spin_unlock(&vpci->lock);
+            xfree(r);
+            return -ENOMEM;
+        }
+    }
+
     /* The list of handlers must be kept sorted at all times. */
     list_for_each ( prev, &vpci->handlers )
     {
@@ -174,6 +226,11 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
     }
 
     list_add_tail(&r->node, prev);
+
+    slot = vpci_map_slot(vpci, offset);
+    if ( !*slot || (*slot)->offset > offset )
+        *slot = r;
+
     spin_unlock(&vpci->lock);
 
     return 0;
@@ -196,6 +253,17 @@ int vpci_remove_register(struct vpci *vpci, unsigned int offset,
          */
         if ( !cmp && rm->offset == offset && rm->size == size )
         {
+            struct vpci_register **slot = vpci_map_slot(vpci, offset);
+
+            if ( *slot == rm )
+            {
+                struct vpci_register *next = list_next_entry(rm, node);
+
+                /* Handlers are sorted, the next one may be in this dword. */
+                *slot = !list_is_last(&rm->node, &vpci->handlers) &&
+                        (next->offset & ~3) == (offset & ~3) ? next : NULL;
+            }
+
             list_del(&rm->node);
             spin_unlock(&vpci->lock);
             xfree(rm);
@@ -332,7 +400,8 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
     spin_lock(&pdev->vpci->lock);
 
     /* Read from the hardware or the emulated register handlers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_first_register(pdev->vpci, reg, size);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
@@ -445,7 +514,8 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
     spin_lock(&pdev->vpci->lock);
 
     /* Write the value to the hardware or emulated registers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_first_register(pdev->vpci, reg, size);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
@@ -315,6 +315,8 @@ typedef uint16_t grant_status_t;
 #define GNTTABOP_get_version          10
 #define GNTTABOP_swap_grant_ref	      11
 #define GNTTABOP_cache_flush	      12
+#define GNTTABOP_copy_segs            13
+#define GNTTABOP_unmap_flush          14
 #endif /* __XEN_INTERFACE_VERSION__ */
 /* ` } */
 
@@ -475,6 +477,84 @@ struct gnttab_copy {
 typedef struct gnttab_copy  gnttab_copy_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_copy_t);
 
+#if __XEN_INTERFACE_VERSION__ >= 0x0003020a
+/*
+ * GNTTABOP_copy_segs: Hypervisor based copy of many segments between a
+ * single pair of domains.
+ *
+ * Each gnttab_copy_segs describes up to GNTTAB_COPY_SEGS_MAX copies from
+ * source_domid to dest_domid, with <flags> applying to all of them as for
+ * GNTTABOP_copy.  The domains are looked up once per gnttab_copy_segs, and
+ * a grant (or frame) referenced by several segments is normally acquired
+ * only once.  Segments which are contiguous in both source and destination
+ * are copied as one.
+ *
+ * <status> reports errors affecting all the segments, in which case none of
+ * them was processed.  Otherwise it is GNTST_okay and the status of each
+ * segment is found in the segment.
+ *
+ * If the operation gets restarted (e.g. because a grant changed while it was
+ * being acquired), segments preceding the restart point within the same
+ * gnttab_copy_segs may be copied again.
+ */
+#define GNTTAB_COPY_SEGS_MAX 256
+
+struct gnttab_copy_seg {
+    /* IN parameters. */
+    uint64_t      source;         /* Grant reference or frame number. */
+    uint64_t      dest;           /* Grant reference or frame number. */
+    uint16_t      source_offset;
+    uint16_t      dest_offset;
+    uint16_t      len;
+    /* OUT parameters. */
+    int16_t       status;
+};
+typedef struct gnttab_copy_seg gnttab_copy_seg_t;
+DEFINE_XEN_GUEST_HANDLE(gnttab_copy_seg_t);
+
+struct gnttab_copy_segs {
+    /* IN parameters. */
+    domid_t       source_domid;
+    domid_t       dest_domid;
+    uint16_t      flags;          /* GNTCOPY_* */
+    uint16_t      nr_segs;
+    XEN_GUEST_HANDLE(gnttab_copy_seg_t) segs;
+    /* OUT parameters. */
+    int16_t       status;
+};
+typedef struct gnttab_copy_segs gnttab_copy_segs_t;
+DEFINE_XEN_GUEST_HANDLE(gnttab_copy_segs_t);
+
+/*
+ * GNTTABOP_unmap_flush: Control deferral of the TLB flushes needed when
+ * unmapping grants, and flush pending unmaps.
+ *
+ * Before a grant unmapped by GNTTABOP_unmap_grant_ref or
+ * GNTTABOP_unmap_and_replace can be released to the granting domain, TLBs
+ * need flushing.  Normally this happens once, before these operations return
+ * (Xen may also flush at preemption points, and whenever it runs out of space
+ * to track pending unmaps).  With GNTTAB_UNMAP_FLUSH_defer set, subsequent
+ * unmaps of the calling domain only remove the mappings, leaving the flush
+ * and the release of the grants pending until the next GNTTABOP_unmap_flush
+ * (or until Xen runs out of space to track pending unmaps).  Until then the
+ * granting domains continue to see the grants as in use.  Clearing the flag
+ * ends deferral.
+ *
+ * Each call flushes and releases all pending unmaps.  <count> must be 1.
+ */
+#define _GNTTAB_UNMAP_FLUSH_defer 0
+#define GNTTAB_UNMAP_FLUSH_defer  (1u<<_GNTTAB_UNMAP_FLUSH_defer)
+
+struct gnttab_unmap_flush {
+    /* IN parameters. */
+    uint32_t flags;               /* GNTTAB_UNMAP_FLUSH_* */
+    /* OUT parameters. */
+    uint32_t completed;           /* Number of unmaps released. */
+};
+typedef struct gnttab_unmap_flush gnttab_unmap_flush_t;
+DEFINE_XEN_GUEST_HANDLE(gnttab_unmap_flush_t);
+#endif /* __XEN_INTERFACE_VERSION__ */
+
 /*
  * GNTTABOP_query_size: Query the current and maximum sizes of the shared
  * grant table.
@@ -61,13 +61,25 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If <flags> contains XEN_DMOP_IOREQ_SERVER_BATCH then Xen will post
+ * emulated MMIO writes which don't reference guest memory to the batched
+ * ioreq ring (see struct ioreq_batch_page in ioreq.h) once the emulator has
+ * acquired it, and the vCPU will continue without waiting for them to be
+ * completed.  This requires <handle_bufioreq> not to be
+ * HVM_IOREQSRV_BUFIOREQ_OFF, as the buffered ioreq event channel is used to
+ * notify the emulator.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - XEN_DMOP_IOREQ_SERVER_* */
+    uint8_t flags;
+#define _XEN_DMOP_IOREQ_SERVER_BATCH 0
+#define XEN_DMOP_IOREQ_SERVER_BATCH (1u << _XEN_DMOP_IOREQ_SERVER_BATCH)
+    uint8_t pad[2];
     /* OUT - server id */
     ioservid_t id;
 };
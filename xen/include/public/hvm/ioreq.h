@@ -98,6 +98,31 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Batched ioreq ring, used by IOREQ Servers created with
+ * XEN_DMOP_IOREQ_SERVER_BATCH.  Xen produces requests at <prod>, and the
+ * emulator consumes them at <cons>; both are free running.  Requests posted
+ * here have state STATE_IOREQ_READY and need no response.
+ *
+ * Xen only notifies the buffered ioreq event channel when <prod> moves past
+ * <event>, so that a burst of requests costs a single notification.  Having
+ * consumed all requests, the emulator should set <event> to <cons> + 1 and
+ * then check <prod> again before waiting for the next notification.
+ *
+ * Requests on this ring precede any synchronous request issued later by the
+ * same vCPU, so the emulator must consume the ring before servicing a
+ * synchronous request.
+ */
+#define IOREQ_BATCH_SLOT_NUM      64
+struct ioreq_batch_page {
+    uint32_t prod;   /* Written by Xen. */
+    uint32_t cons;   /* Written by the emulator. */
+    uint32_t event;  /* Written by the emulator. */
+    uint32_t pad[5];
+    ioreq_t ring[IOREQ_BATCH_SLOT_NUM];
+}; /* NB. Size of this structure must be no greater than one page. */
+typedef struct ioreq_batch_page ioreq_batch_page_t;
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
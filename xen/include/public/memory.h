@@ -398,15 +398,32 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+/*
+ * Batched variants of the above, operating on the nr gfns in gfn_list and
+ * reporting the result for each one in errs.  gfn must be 0, and nr must be
+ * below 2^26.
+ */
+#define XENMEM_paging_op_nominate_batch     3
+#define XENMEM_paging_op_evict_batch        4
+#define XENMEM_paging_op_prep_batch         5
 
 struct xen_mem_paging_op {
     uint8_t     op;         /* XENMEM_paging_op_* */
     domid_t     domain;
+    /* IN: (XENMEM_paging_op_*_batch) number of gfns in gfn_list */
+    uint32_t    nr;
 
-    /* IN: (XENMEM_paging_op_prep) buffer to immediately fill page from */
+    /*
+     * IN: (XENMEM_paging_op_prep) buffer to immediately fill page from
+     *     (XENMEM_paging_op_prep_batch) nr pages to fill the gfns from
+     */
     XEN_GUEST_HANDLE_64(const_uint8) buffer;
     /* IN:  gfn of page being operated on */
     uint64_aligned_t    gfn;
+    /* IN: (XENMEM_paging_op_*_batch) gfns of the pages to operate on */
+    XEN_GUEST_HANDLE_64(const_uint64) gfn_list;
+    /* OUT: (XENMEM_paging_op_*_batch) 0 or -errno for each gfn */
+    XEN_GUEST_HANDLE_64(int) errs;
 };
 typedef struct xen_mem_paging_op xen_mem_paging_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_mem_paging_op_t);
@@ -681,6 +698,8 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/* Not covered by the size of the resource reported for nr_frames == 0. */
+#define XENMEM_resource_ioreq_server_frame_batch 0x80000000
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
@@ -466,7 +466,10 @@ struct xen_sysctl_page_offline_op {
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
-#define LOCKPROF_TYPE_N           2   /* number of types */
+#define LOCKPROF_TYPE_RUNQ        2   /* scheduler runqueue lock, idx is a
+                                         serial number, unique across
+                                         cpupools */
+#define LOCKPROF_TYPE_N           3   /* number of types */
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
@@ -559,6 +562,24 @@ struct xen_sysctl_numainfo {
     XEN_GUEST_HANDLE_64(uint32) distance;
 };
 
+/*
+ * XEN_SYSCTL_scrub_status
+ *
+ * Progress of the scrubbing of freed memory done by idle CPUs.
+ *
+ * IN: 'num_nodes' is the number of entries in 'node_dirty_pages', which may
+ * be a null handle if the per-node counts aren't wanted.
+ * OUT: 'num_nodes' is the number of nodes Xen has counts for, which may be
+ * more than the number of entries written.
+ */
+struct xen_sysctl_scrub_status {
+    uint32_t num_nodes;                  /* IN/OUT */
+    uint32_t scrubbers;                  /* OUT: # CPUs currently scrubbing */
+    uint64_aligned_t dirty_pages;        /* OUT: free pages left to scrub */
+    uint64_aligned_t scrubbed_pages;     /* OUT: pages scrubbed since boot */
+    XEN_GUEST_HANDLE_64(uint64) node_dirty_pages; /* OUT: per node */
+};
+
 /* XEN_SYSCTL_cpupool_op */
 #define XEN_SYSCTL_CPUPOOL_OP_CREATE                1  /* C */
 #define XEN_SYSCTL_CPUPOOL_OP_DESTROY               2  /* D */
@@ -1109,6 +1130,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_livepatch_op                  27
 /* #define XEN_SYSCTL_set_parameter              28 */
 #define XEN_SYSCTL_get_cpu_policy                29
+#define XEN_SYSCTL_scrub_status                  30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1117,6 +1139,7 @@ struct xen_sysctl {
         struct xen_sysctl_cputopoinfo       cputopoinfo;
         struct xen_sysctl_pcitopoinfo       pcitopoinfo;
         struct xen_sysctl_numainfo          numainfo;
+        struct xen_sysctl_scrub_status      scrub_status;
         struct xen_sysctl_sched_id          sched_id;
         struct xen_sysctl_perfc_op          perfc_op;
         struct xen_sysctl_getdomaininfolist getdomaininfolist;
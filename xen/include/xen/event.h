@@ -209,6 +209,13 @@ int evtchn_reset(struct domain *d, bool resuming);
  * from changing state. This may be the domain event lock, the per-channel
  * lock, or in the case of sending interdomain events also the other side's
  * per-channel lock. Exceptions apply in certain cases for the PV shim.
+ *
+ * The evtchn_send() fast path calls set_pending() for an interdomain channel
+ * holding only the sending domain's evtchn_send_lock (a percpu rwlock) for
+ * reading. Binding and closing interdomain channels take it for writing, so
+ * neither end can change state, but the receiving channel's per-channel lock
+ * is not held: set_pending() may run concurrently with the hooks called
+ * under it (unmask, set_priority, ...), as it would with another sender.
  */
 struct evtchn_port_ops {
     void (*init)(struct domain *d, struct evtchn *evtchn);
@@ -55,6 +55,10 @@ struct ioreq_server {
     struct rangeset        *range[NR_IO_RANGE_TYPES];
     bool                   enabled;
     uint8_t                bufioreq_handling;
+
+    /* Batched ioreq ring, protected by bufioreq_lock */
+    bool                   batch;
+    struct ioreq_page      batchioreq;
 };
 
 static inline paddr_t ioreq_mmio_first_byte(const ioreq_t *p)
@@ -125,6 +125,8 @@ unsigned long avail_domheap_pages_region(
     unsigned int node, unsigned int min_width, unsigned int max_width);
 unsigned long avail_domheap_pages(void);
 unsigned long avail_node_heap_pages(unsigned int);
+unsigned long node_dirty_pages(unsigned int node);
+void get_scrub_status(unsigned long *scrubbed, unsigned int *scrubbers);
 #define alloc_domheap_page(d,f) (alloc_domheap_pages(d,0,f))
 #define free_domheap_page(p)  (free_domheap_pages(p,0))
 unsigned int online_page(mfn_t mfn, uint32_t *status);
@@ -79,8 +79,26 @@ PERFCOUNTER(credit_reset,           "csched2: credit_reset")
 PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
+PERFCOUNTER(wake_queued,            "csched2: wake_queued")
+PERFCOUNTER(wake_requeued,          "csched2: wake_requeued")
 #endif
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(heap_lock_contended,    "page_alloc: heap_lock contended")
+PERFCOUNTER(pcp_alloc,              "page_alloc: magazine allocations")
+PERFCOUNTER(pcp_free,               "page_alloc: magazine frees")
+PERFCOUNTER(pcp_refill,             "page_alloc: magazine refills")
+PERFCOUNTER(pcp_drain,              "page_alloc: magazine drains")
+
+PERFCOUNTER(xmem_cache_refill,      "xmem cache: magazine refills")
+PERFCOUNTER(xmem_cache_flush,       "xmem cache: magazine flushes")
+
+PERFCOUNTER(evtchn_send_fast,       "evtchn: interdomain sends (fast path)")
+PERFCOUNTER(evtchn_send_slow,       "evtchn: sends (slow path)")
+
+PERFCOUNTER(gnttab_unmap_flush,     "gnttab: unmap TLB flushes")
+PERFCOUNTER(gnttab_unmap_flush_avoided, "gnttab: unmap TLB flushes avoided")
+PERFCOUNTER(gnttab_unmap_deferred,  "gnttab: unmaps deferred")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -430,6 +430,12 @@ struct domain
     /* Port to resume from in evtchn_reset(), when in a continuation. */
     unsigned int     next_evtchn;
     rwlock_t         event_lock;
+    /*
+     * Held for reading by the evtchn_send() fast path, and for writing
+     * (in addition to event_lock) around binding and closing of this
+     * domain's interdomain channels.
+     */
+    percpu_rwlock_t  evtchn_send_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;
 
@@ -594,6 +600,7 @@ struct domain
     struct {
         spinlock_t              lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        struct ioreq_index      *index; /* See ioreq_server_select() */
     } ioreq_server;
 #endif
 
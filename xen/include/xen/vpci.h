@@ -60,6 +60,13 @@ bool __must_check vpci_process_pending(struct vcpu *v);
 struct vpci {
     /* List of vPCI handlers for a device. */
     struct list_head handlers;
+    /*
+     * Index of the handlers by config space dword: each slot points to the
+     * first handler within that dword.  Allocated in chunks of
+     * VPCI_MAP_CHUNK bytes of config space when handlers are added.
+     */
+#define VPCI_MAP_CHUNK 256
+    struct vpci_register **map[PCI_CFG_SPACE_EXP_SIZE / VPCI_MAP_CHUNK];
     spinlock_t lock;
 
 #ifdef __XEN__
@@ -0,0 +1,59 @@
+#ifndef __XEN_XMEM_CACHE_H__
+#define __XEN_XMEM_CACHE_H__
+
+/*
+ * Object caches for small fixed-size objects which are allocated and freed
+ * at a high rate.
+ *
+ * Objects are carved out of slabs of xenheap pages taken from the node of
+ * the allocating CPU, and every CPU keeps a small magazine of free objects
+ * for each cache, so most allocations and frees don't take any lock.  As for
+ * xmalloc(), neither may be used in interrupt context.
+ *
+ * Caches are never destroyed.  They are either defined statically with
+ * XMEM_CACHE(), which makes them usable from early boot onwards, or created
+ * at runtime with xmem_cache_create().
+ *
+ * Allocations of about a page or more (e.g. event channel buckets, grant
+ * maptrack frames), of varying size, or made only at setup time gain nothing
+ * from a cache and should keep using xmalloc() or the page allocator.
+ */
+
+#include <xen/list.h>
+#include <xen/numa.h>
+#include <xen/spinlock.h>
+
+struct xmem_cache {
+    const char *name;
+    unsigned int size;             /* Object size, rounded up to align. */
+    unsigned int align;
+    unsigned int id;               /* Magazine index, 0 until first used. */
+
+    /* Everything below is private to xmem_cache.c. */
+    spinlock_t lock;
+    unsigned int order;            /* Slab size. */
+    unsigned int objs;             /* Objects per slab. */
+    unsigned int offset;           /* Offset of the first object in a slab. */
+    struct list_head list;         /* Entry in the list of all caches. */
+    struct list_head partial[MAX_NUMNODES]; /* Slabs with free objects. */
+
+    /* Statistics, updated under lock. */
+    unsigned int slabs;
+    unsigned int inuse;            /* Objects allocated from slabs. */
+};
+
+#define XMEM_CACHE(var, nam, type)                \
+    struct xmem_cache var = {                     \
+        .name = (nam),                            \
+        .size = sizeof(type),                     \
+        .align = __alignof__(type),               \
+        .lock = SPIN_LOCK_UNLOCKED,               \
+    }
+
+struct xmem_cache *xmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align);
+void *xmem_cache_alloc(struct xmem_cache *c);
+void *xmem_cache_zalloc(struct xmem_cache *c);
+void xmem_cache_free(struct xmem_cache *c, void *obj);
+
+#endif /* __XEN_XMEM_CACHE_H__ */
@@ -75,7 +75,12 @@
 #ifndef __XENXXHASH_H__
 #define __XENXXHASH_H__
 
+#ifdef __XEN__
 #include <xen/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
 
 /*-****************************
  * Simple Hash Functions
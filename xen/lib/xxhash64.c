@@ -44,6 +44,28 @@
 #include <xen/string.h>
 #include <xen/xxhash.h>
 #include <asm/unaligned.h>
+#else
+#include <errno.h>
+#include <string.h>
+#include INCLUDE_ENDIAN_H
+
+#include "../include/xen/xxhash.h"
+
+static inline uint64_t get_unaligned_le64(const void *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t get_unaligned_le32(const void *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
 #endif
 
 /*-*************************************